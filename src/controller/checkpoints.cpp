@@ -0,0 +1,678 @@
+#include "controller/checkpoints.h"
+
+#include "model/controlpoint.h"
+#include "model/document.h"
+#include "model/instance.h"
+#include "model/node.h"
+#include "model/path.h"
+#include "model/sketch.h"
+
+#include <algorithm>
+#include <cassert>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+namespace Controller
+{
+
+// Elements are held by value in flat lists, so that capturing a sketch takes a handful of allocations rather than one
+// for each element
+struct DocumentCheckpoints::SketchState
+{
+  size_t heapUsage() const
+  {
+    size_t usage = Controller::heapUsage(mNodes) + Controller::heapUsage(mControlPoints)
+      + Controller::heapUsage(mPaths) + Controller::heapUsage(mInstances) + Controller::heapUsage(mSharedNodes)
+      + Controller::heapUsage(mSharedControlPoints) + Controller::heapUsage(mDrawOrder)
+      + Controller::heapUsage(mSketches);
+
+    for (auto& [id, node] : mNodes) {
+      usage += Controller::heapUsage(node.controlPoints());
+    }
+
+    for (auto& [id, path] : mPaths) {
+      usage += Controller::heapUsage(path.entries());
+    }
+
+    for (const SketchState& subSketch : mSketches) {
+      usage += subSketch.heapUsage();
+    }
+
+    return usage;
+  }
+
+  ID<Model::Sketch> mID;
+  Point mPosition;
+  std::vector<std::pair<ID<Model::Node>, Model::Node>> mNodes;
+  std::vector<std::pair<ID<Model::ControlPoint>, Model::ControlPoint>> mControlPoints;
+  std::vector<std::pair<ID<Model::Path>, Model::Path>> mPaths;
+  std::vector<std::pair<ID<Model::Instance>, Model::Instance>> mInstances;
+  // Sub-sketches share nodes and control points with the sketch that contains them, so those are only kept once
+  std::vector<ID<Model::Node>> mSharedNodes;
+  std::vector<ID<Model::ControlPoint>> mSharedControlPoints;
+  Model::Sketch::DrawOrder mDrawOrder;
+  std::vector<SketchState> mSketches;
+};
+
+template <class TKey, class TState = TKey>
+using StateList = std::unordered_map<ID<TKey>, std::optional<TState>>;
+
+// Elements as they were at some point, for the ones that a checkpoint covers. An element without a state didn't exist
+// then. Sub-sketches of the document's sketch and definitions are kept along with everything in them.
+struct DocumentCheckpoints::Elements
+{
+  // Finds the state of an element in the latest of a list of elements that has it, or null if it didn't exist
+  template <class TKey, class TState>
+  static const TState* find(const std::vector<const Elements*>& list, StateList<TKey, TState> Elements::*states,
+    const ID<TKey>& id)
+  {
+    for (auto it = list.rbegin(); it != list.rend(); ++it) {
+      auto found = ((*it)->*states).find(id);
+
+      if (found != ((*it)->*states).end()) {
+        return found->second ? &*found->second : nullptr;
+      }
+    }
+
+    return nullptr;
+  }
+
+  static const Model::Sketch::DrawOrder* findDrawOrder(const std::vector<const Elements*>& list)
+  {
+    for (auto it = list.rbegin(); it != list.rend(); ++it) {
+      if ((*it)->mDrawOrder) {
+        return &*(*it)->mDrawOrder;
+      }
+    }
+
+    return nullptr;
+  }
+
+  size_t heapUsage() const
+  {
+    size_t usage = Controller::heapUsage(mNodes) + Controller::heapUsage(mControlPoints)
+      + Controller::heapUsage(mPaths) + Controller::heapUsage(mInstances) + Controller::heapUsage(mSketches)
+      + Controller::heapUsage(mDefinitions) + (mDrawOrder ? Controller::heapUsage(*mDrawOrder) : 0);
+
+    for (auto& [id, node] : mNodes) {
+      usage += node ? Controller::heapUsage(node->controlPoints()) : 0;
+    }
+
+    for (auto& [id, path] : mPaths) {
+      usage += path ? Controller::heapUsage(path->entries()) : 0;
+    }
+
+    for (auto& [id, sketch] : mSketches) {
+      usage += sketch ? sketch->heapUsage() : 0;
+    }
+
+    for (auto& [id, definition] : mDefinitions) {
+      usage += definition ? definition->heapUsage() : 0;
+    }
+
+    return usage;
+  }
+
+  // Reports the elements that these are states of as changes to the sketch
+  void addTo(const Model::Sketch* sketch, Model::ChangeSet* changes) const
+  {
+    auto add = [sketch, changes](auto& states)
+    {
+      for (auto& [id, state] : states) {
+        changes->add(sketch, id);
+      }
+    };
+
+    add(mNodes);
+    add(mControlPoints);
+    add(mPaths);
+    add(mInstances);
+    add(mSketches);
+    add(mDefinitions);
+
+    if (mDrawOrder) {
+      changes->add(sketch, Model::Reference());
+    }
+  }
+
+  // Takes states from later elements, replacing any that these have and dropping the elements that were gone by then
+  void update(Elements&& later)
+  {
+    auto take = [](auto* states, auto& laterStates)
+    {
+      for (auto& [id, state] : laterStates) {
+        if (state) {
+          (*states)[id] = std::move(state);
+        } else {
+          states->erase(id);
+        }
+      }
+    };
+
+    take(&mNodes, later.mNodes);
+    take(&mControlPoints, later.mControlPoints);
+    take(&mPaths, later.mPaths);
+    take(&mInstances, later.mInstances);
+    take(&mSketches, later.mSketches);
+    take(&mDefinitions, later.mDefinitions);
+
+    if (later.mDrawOrder) {
+      mDrawOrder = std::move(later.mDrawOrder);
+    }
+  }
+
+  // Takes states from earlier elements for the ones that these don't have, as they still held later on
+  void inherit(Elements&& earlier)
+  {
+    auto keep = [](auto* states, auto& earlierStates)
+    {
+      for (auto& [id, state] : earlierStates) {
+        states->try_emplace(id, std::move(state));
+      }
+    };
+
+    keep(&mNodes, earlier.mNodes);
+    keep(&mControlPoints, earlier.mControlPoints);
+    keep(&mPaths, earlier.mPaths);
+    keep(&mInstances, earlier.mInstances);
+    keep(&mSketches, earlier.mSketches);
+    keep(&mDefinitions, earlier.mDefinitions);
+
+    if (!mDrawOrder) {
+      mDrawOrder = std::move(earlier.mDrawOrder);
+    }
+  }
+
+  StateList<Model::Node> mNodes;
+  StateList<Model::ControlPoint> mControlPoints;
+  StateList<Model::Path> mPaths;
+  StateList<Model::Instance> mInstances;
+  StateList<Model::Sketch, SketchState> mSketches;
+  StateList<Model::Sketch, SketchState> mDefinitions;
+  std::optional<Model::Sketch::DrawOrder> mDrawOrder;
+};
+
+class DocumentCheckpoints::Checkpoint : public UndoCheckpoint
+{
+public:
+  Checkpoint(DocumentCheckpoints* owner)
+    : mOwner(owner)
+  {
+  }
+
+  ~Checkpoint() override
+  {
+    if (mOwner) {
+      mOwner->removeCheckpoint(this);
+    }
+  }
+
+  size_t memoryUsage() const override
+  {
+    return sizeof(*this) + mElements.heapUsage();
+  }
+
+  // Cleared if the checkpoints outlive their source, or the document that they were captured from
+  DocumentCheckpoints* mOwner;
+  // The elements that changed since the checkpoint before this one
+  Elements mElements;
+};
+
+namespace
+{
+
+// Whether an element of a sub-sketch is the same one as in the sketch that contains it
+template <class TModel>
+bool isShared(const std::unordered_map<ID<TModel>, TModel*>* parentElements, const ID<TModel>& id,
+  const TModel* element)
+{
+  if (!parentElements) {
+    return false;
+  }
+
+  auto it = parentElements->find(id);
+  return it != parentElements->end() && it->second == element;
+}
+
+template <class TModel>
+void captureElement(const std::unordered_map<ID<TModel>, TModel*>& elements, const ID<TModel>& id,
+  StateList<TModel>* states)
+{
+  auto it = elements.find(id);
+  (*states)[id] = it != elements.end() ? std::optional<TModel>(*it->second) : std::nullopt;
+}
+
+// Elements that exist both now and in the state being restored are restored in place, as sub-sketches may share them
+template <class TModel>
+void restoreElement(std::unordered_map<ID<TModel>, TModel*>* elements, const ID<TModel>& id, const TModel* state)
+{
+  auto it = elements->find(id);
+
+  if (state && it != elements->end()) {
+    *it->second = *state;
+  } else if (state) {
+    (*elements)[id] = new TModel(*state);
+  } else if (it != elements->end()) {
+    delete it->second;
+    elements->erase(it);
+  }
+}
+
+}
+
+DocumentCheckpoints::DocumentCheckpoints()
+  : mDocument(nullptr)
+{
+}
+
+DocumentCheckpoints::~DocumentCheckpoints()
+{
+  mConnection.disconnect();
+  mBatchConnection.disconnect();
+
+  detachCheckpoints();
+}
+
+void DocumentCheckpoints::setDocument(Model::Document* document)
+{
+  mConnection.disconnect();
+  mBatchConnection.disconnect();
+
+  detachCheckpoints();
+
+  mDocument = document;
+  mChanges.clear();
+  mConnection = mDocument->journal().signalChanged().connect(sigc::mem_fun(mChanges, &Model::ChangeSet::add));
+  mBatchConnection = mDocument->journal().signalBatchChanged().connect(
+    sigc::mem_fun(mChanges, &Model::ChangeSet::merge));
+
+  // Everything is captured once here, as the state that later checkpoints' changes are made to
+  const Model::Sketch* sketch = mDocument->mSketch;
+  mBase = std::make_unique<Elements>();
+
+  for (auto& [id, node] : sketch->mNodes) {
+    mBase->mNodes.emplace(id, *node);
+  }
+
+  for (auto& [id, controlPoint] : sketch->mControlPoints) {
+    mBase->mControlPoints.emplace(id, *controlPoint);
+  }
+
+  for (auto& [id, path] : sketch->mPaths) {
+    mBase->mPaths.emplace(id, *path);
+  }
+
+  for (auto& [id, instance] : sketch->mInstances) {
+    mBase->mInstances.emplace(id, *instance);
+  }
+
+  for (auto& [id, subSketch] : sketch->mSketches) {
+    SketchState& state = mBase->mSketches[id].emplace();
+    state.mID = id;
+    captureSketch(subSketch, sketch, &state);
+  }
+
+  for (auto& [id, definition] : mDocument->mDefinitions) {
+    SketchState& state = mBase->mDefinitions[id].emplace();
+    state.mID = id;
+    captureSketch(definition, nullptr, &state);
+  }
+
+  mBase->mDrawOrder = sketch->mDrawOrder;
+}
+
+UndoCheckpoint* DocumentCheckpoints::captureCheckpoint()
+{
+  Checkpoint* checkpoint = new Checkpoint(this);
+
+  captureElements(mChanges, &checkpoint->mElements);
+  mChanges.clear();
+
+  mCheckpoints.push_back(checkpoint);
+
+  return checkpoint;
+}
+
+void DocumentCheckpoints::restoreCheckpoint(const UndoCheckpoint* undoCheckpoint)
+{
+  const Checkpoint* checkpoint = static_cast<const Checkpoint*>(undoCheckpoint);
+  Model::Sketch* sketch = mDocument->mSketch;
+  Model::Journal& journal = mDocument->journal();
+
+  auto position = std::find(mCheckpoints.begin(), mCheckpoints.end(), checkpoint);
+  assert(position != mCheckpoints.end());
+
+  // Only the elements that have changed since the checkpoint need restoring. Their states are in the latest of the
+  // checkpoints up to it that has them, or otherwise in the base.
+  Model::ChangeSet changes = mChanges;
+  std::vector<const Elements*> states = { mBase.get() };
+
+  for (auto it = mCheckpoints.begin(); it != mCheckpoints.end(); ++it) {
+    if (it <= position) {
+      states.push_back(&(*it)->mElements);
+    } else {
+      (*it)->mElements.addTo(sketch, &changes);
+    }
+  }
+
+  // Sub-sketches and definitions are replaced as a whole. The old ones go first, while sub-sketches can still tell
+  // which of their elements belong to the document's sketch, and anything keyed on them needs to hear about it.
+  for (const Model::Reference& reference : changes.references()) {
+    if (reference.type() != Model::Type::Sketch) {
+      continue;
+    }
+
+    const ID<Model::Sketch> id = reference.id<Model::Sketch>();
+
+    if (auto it = sketch->mSketches.find(id); it != sketch->mSketches.end()) {
+      recordSketch(journal, sketch, it->second);
+      clearSketch(it->second, sketch);
+      delete it->second;
+      sketch->mSketches.erase(it);
+    }
+
+    if (auto it = mDocument->mDefinitions.find(id); it != mDocument->mDefinitions.end()) {
+      recordSketch(journal, sketch, it->second);
+      clearSketch(it->second, nullptr);
+      delete it->second;
+      mDocument->mDefinitions.erase(it);
+    }
+  }
+
+  for (const Model::Reference& reference : changes.references()) {
+    switch (reference.type()) {
+      case Model::Type::Node:
+        restoreElement(&sketch->mNodes, reference.id<Model::Node>(),
+          Elements::find(states, &Elements::mNodes, reference.id<Model::Node>()));
+        break;
+      case Model::Type::ControlPoint:
+        restoreElement(&sketch->mControlPoints, reference.id<Model::ControlPoint>(),
+          Elements::find(states, &Elements::mControlPoints, reference.id<Model::ControlPoint>()));
+        break;
+      case Model::Type::Path:
+        restoreElement(&sketch->mPaths, reference.id<Model::Path>(),
+          Elements::find(states, &Elements::mPaths, reference.id<Model::Path>()));
+        break;
+      case Model::Type::Instance:
+        restoreElement(&sketch->mInstances, reference.id<Model::Instance>(),
+          Elements::find(states, &Elements::mInstances, reference.id<Model::Instance>()));
+        break;
+      case Model::Type::Sketch:
+      case Model::Type::Null:
+        break;
+    }
+
+    journal.recordChange(sketch, reference);
+  }
+
+  if (changes.drawOrderChanged(sketch)) {
+    sketch->mDrawOrder = *Elements::findDrawOrder(states);
+    journal.recordChange(sketch, Model::Reference());
+  }
+
+  // Sub-sketches share the nodes and control points restored above
+  for (const Model::Reference& reference : changes.references()) {
+    if (reference.type() != Model::Type::Sketch) {
+      continue;
+    }
+
+    const ID<Model::Sketch> id = reference.id<Model::Sketch>();
+
+    if (const SketchState* state = Elements::find(states, &Elements::mSketches, id)) {
+      Model::Sketch* subSketch = new Model::Sketch(mDocument);
+      restoreSketch(subSketch, *state, sketch);
+      sketch->mSketches[id] = subSketch;
+      recordSketch(journal, sketch, subSketch);
+    }
+
+    if (const SketchState* state = Elements::find(states, &Elements::mDefinitions, id)) {
+      Model::Sketch* definition = new Model::Sketch(mDocument);
+      restoreSketch(definition, *state, nullptr);
+      mDocument->mDefinitions[id] = definition;
+      recordSketch(journal, sketch, definition);
+    }
+  }
+}
+
+void DocumentCheckpoints::beginJump()
+{
+  mDocument->journal().beginBatch();
+}
+
+void DocumentCheckpoints::endJump()
+{
+  mDocument->journal().endBatch();
+}
+
+void DocumentCheckpoints::captureSketch(const Model::Sketch* sketch, const Model::Sketch* parent, SketchState* state)
+{
+  state->mPosition = sketch->mPosition;
+  state->mDrawOrder = sketch->mDrawOrder;
+
+  state->mNodes.reserve(sketch->mNodes.size());
+
+  for (auto& [id, node] : sketch->mNodes) {
+    if (isShared(parent ? &parent->mNodes : nullptr, id, node)) {
+      state->mSharedNodes.push_back(id);
+    } else {
+      state->mNodes.emplace_back(id, *node);
+    }
+  }
+
+  state->mControlPoints.reserve(sketch->mControlPoints.size());
+
+  for (auto& [id, controlPoint] : sketch->mControlPoints) {
+    if (isShared(parent ? &parent->mControlPoints : nullptr, id, controlPoint)) {
+      state->mSharedControlPoints.push_back(id);
+    } else {
+      state->mControlPoints.emplace_back(id, *controlPoint);
+    }
+  }
+
+  state->mPaths.reserve(sketch->mPaths.size());
+
+  for (auto& [id, path] : sketch->mPaths) {
+    state->mPaths.emplace_back(id, *path);
+  }
+
+  state->mInstances.reserve(sketch->mInstances.size());
+
+  for (auto& [id, instance] : sketch->mInstances) {
+    state->mInstances.emplace_back(id, *instance);
+  }
+
+  state->mSketches.reserve(sketch->mSketches.size());
+
+  for (auto& [id, subSketch] : sketch->mSketches) {
+    state->mSketches.emplace_back();
+    state->mSketches.back().mID = id;
+    captureSketch(subSketch, sketch, &state->mSketches.back());
+  }
+}
+
+void DocumentCheckpoints::restoreSketch(Model::Sketch* sketch, const SketchState& state, const Model::Sketch* parent)
+{
+  sketch->mPosition = state.mPosition;
+  sketch->mDrawOrder = state.mDrawOrder;
+
+  sketch->mNodes.reserve(state.mNodes.size() + state.mSharedNodes.size());
+
+  for (auto& [id, node] : state.mNodes) {
+    sketch->mNodes[id] = new Model::Node(node);
+  }
+
+  for (auto& id : state.mSharedNodes) {
+    sketch->mNodes[id] = parent->mNodes.at(id);
+  }
+
+  sketch->mControlPoints.reserve(state.mControlPoints.size() + state.mSharedControlPoints.size());
+
+  for (auto& [id, controlPoint] : state.mControlPoints) {
+    sketch->mControlPoints[id] = new Model::ControlPoint(controlPoint);
+  }
+
+  for (auto& id : state.mSharedControlPoints) {
+    sketch->mControlPoints[id] = parent->mControlPoints.at(id);
+  }
+
+  sketch->mPaths.reserve(state.mPaths.size());
+
+  for (auto& [id, path] : state.mPaths) {
+    sketch->mPaths[id] = new Model::Path(path);
+  }
+
+  sketch->mInstances.reserve(state.mInstances.size());
+
+  for (auto& [id, instance] : state.mInstances) {
+    sketch->mInstances[id] = new Model::Instance(instance);
+  }
+
+  for (const SketchState& subState : state.mSketches) {
+    Model::Sketch* subSketch = new Model::Sketch(sketch->mParent);
+    restoreSketch(subSketch, subState, sketch);
+    sketch->mSketches[subState.mID] = subSketch;
+  }
+}
+
+void DocumentCheckpoints::clearSketch(Model::Sketch* sketch, const Model::Sketch* parent)
+{
+  // Sub-sketches go first, while they can still tell which of their elements belong to this sketch
+  for (auto& [id, subSketch] : sketch->mSketches) {
+    clearSketch(subSketch, sketch);
+    delete subSketch;
+  }
+
+  for (auto& [id, node] : sketch->mNodes) {
+    if (!isShared(parent ? &parent->mNodes : nullptr, id, node)) {
+      delete node;
+    }
+  }
+
+  for (auto& [id, controlPoint] : sketch->mControlPoints) {
+    if (!isShared(parent ? &parent->mControlPoints : nullptr, id, controlPoint)) {
+      delete controlPoint;
+    }
+  }
+
+  for (auto& [id, path] : sketch->mPaths) {
+    delete path;
+  }
+
+  for (auto& [id, instance] : sketch->mInstances) {
+    delete instance;
+  }
+
+  sketch->mSketches.clear();
+  sketch->mNodes.clear();
+  sketch->mControlPoints.clear();
+  sketch->mPaths.clear();
+  sketch->mInstances.clear();
+  sketch->mDrawOrder.clear();
+}
+
+void DocumentCheckpoints::captureElements(const Model::ChangeSet& changes, Elements* elements) const
+{
+  const Model::Sketch* sketch = mDocument->mSketch;
+
+  for (const Model::Reference& reference : changes.references()) {
+    switch (reference.type()) {
+      case Model::Type::Node:
+        captureElement(sketch->mNodes, reference.id<Model::Node>(), &elements->mNodes);
+        break;
+      case Model::Type::ControlPoint:
+        captureElement(sketch->mControlPoints, reference.id<Model::ControlPoint>(), &elements->mControlPoints);
+        break;
+      case Model::Type::Path:
+        captureElement(sketch->mPaths, reference.id<Model::Path>(), &elements->mPaths);
+        break;
+      case Model::Type::Instance:
+        captureElement(sketch->mInstances, reference.id<Model::Instance>(), &elements->mInstances);
+        break;
+      case Model::Type::Sketch:
+      {
+        // Either a sub-sketch of the document's sketch or a definition, or one that's gone or is nested in another
+        const ID<Model::Sketch> id = reference.id<Model::Sketch>();
+        std::optional<SketchState>& subSketch = elements->mSketches[id];
+        std::optional<SketchState>& definition = elements->mDefinitions[id];
+
+        if (auto it = sketch->mSketches.find(id); it != sketch->mSketches.end()) {
+          subSketch.emplace().mID = id;
+          captureSketch(it->second, sketch, &*subSketch);
+        } else {
+          subSketch.reset();
+        }
+
+        if (auto it = mDocument->mDefinitions.find(id); it != mDocument->mDefinitions.end()) {
+          definition.emplace().mID = id;
+          captureSketch(it->second, nullptr, &*definition);
+        } else {
+          definition.reset();
+        }
+
+        break;
+      }
+      case Model::Type::Null:
+        break;
+    }
+  }
+
+  if (changes.drawOrderChanged(sketch)) {
+    elements->mDrawOrder = sketch->mDrawOrder;
+  }
+}
+
+void DocumentCheckpoints::removeCheckpoint(Checkpoint* checkpoint)
+{
+  auto position = std::find(mCheckpoints.begin(), mCheckpoints.end(), checkpoint);
+  assert(position != mCheckpoints.end());
+
+  if (position == mCheckpoints.begin()) {
+    // The oldest checkpoint's state becomes the base that the rest are changes to
+    mBase->update(std::move(checkpoint->mElements));
+  } else if (position + 1 == mCheckpoints.end()) {
+    // What changed since the checkpoint before the latest has changed since the one that's now the latest
+    checkpoint->mElements.addTo(mDocument->mSketch, &mChanges);
+  } else {
+    (*(position + 1))->mElements.inherit(std::move(checkpoint->mElements));
+  }
+
+  mCheckpoints.erase(position);
+}
+
+void DocumentCheckpoints::detachCheckpoints()
+{
+  for (Checkpoint* checkpoint : mCheckpoints) {
+    checkpoint->mOwner = nullptr;
+  }
+
+  mCheckpoints.clear();
+}
+
+void DocumentCheckpoints::recordSketch(Model::Journal& journal, const Model::Sketch* root, const Model::Sketch* sketch)
+{
+  // Elements are reported against the root sketch, as the changes that commands report are
+  for (auto& [id, node] : sketch->mNodes) {
+    journal.recordChange(root, id);
+  }
+
+  for (auto& [id, controlPoint] : sketch->mControlPoints) {
+    journal.recordChange(root, id);
+  }
+
+  for (auto& [id, path] : sketch->mPaths) {
+    journal.recordChange(root, id);
+  }
+
+  for (auto& [id, instance] : sketch->mInstances) {
+    journal.recordChange(root, id);
+  }
+
+  // Sub-sketches are restored as new objects, which anything keyed on the old ones needs to hear about
+  for (auto& [id, subSketch] : sketch->mSketches) {
+    journal.recordChange(root, id);
+    recordSketch(journal, root, subSketch);
+  }
+}
+
+}
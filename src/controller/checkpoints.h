@@ -0,0 +1,58 @@
+#pragma once
+
+#include "controller/undo.h"
+#include "model/journal.h"
+
+#include <memory>
+
+namespace Model
+{
+  class Document;
+  class Sketch;
+}
+
+namespace Controller
+{
+
+// Captures documents for the undo history, so that jumping through the history can restore a nearby checkpoint
+// rather than replaying every command in between. The whole document is only copied when it's set. Each checkpoint
+// after that holds just the elements that changed since the one before it, so that capturing one costs about as
+// much as the commands since the last did.
+class DocumentCheckpoints : public UndoManager::CheckpointSource
+{
+public:
+  DocumentCheckpoints();
+  ~DocumentCheckpoints();
+
+  void setDocument(Model::Document* document);
+
+  UndoCheckpoint* captureCheckpoint() override;
+  void restoreCheckpoint(const UndoCheckpoint* checkpoint) override;
+  void beginJump() override;
+  void endJump() override;
+
+private:
+  struct SketchState;
+  struct Elements;
+  class Checkpoint;
+
+  static void captureSketch(const Model::Sketch* sketch, const Model::Sketch* parent, SketchState* state);
+  static void restoreSketch(Model::Sketch* sketch, const SketchState& state, const Model::Sketch* parent);
+  static void clearSketch(Model::Sketch* sketch, const Model::Sketch* parent);
+  static void recordSketch(Model::Journal& journal, const Model::Sketch* root, const Model::Sketch* sketch);
+  void captureElements(const Model::ChangeSet& changes, Elements* elements) const;
+  void removeCheckpoint(Checkpoint* checkpoint);
+  void detachCheckpoints();
+
+  Model::Document* mDocument;
+  // The document as it was when it was set, updated with each checkpoint that's dropped from the oldest end
+  std::unique_ptr<Elements> mBase;
+  // The checkpoints that are still in the history, from the oldest
+  std::vector<Checkpoint*> mCheckpoints;
+  // Elements changed since the latest checkpoint, or since the document was set if there isn't one
+  Model::ChangeSet mChanges;
+  sigc::connection mConnection;
+  sigc::connection mBatchConnection;
+};
+
+}
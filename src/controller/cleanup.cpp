@@ -0,0 +1,254 @@
+#include "controller/cleanup.h"
+
+#include "model/controlpoint.h"
+#include "model/document.h"
+#include "model/instance.h"
+#include "model/node.h"
+#include "model/path.h"
+#include "model/sketch.h"
+
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace Controller
+{
+
+// Copies a document's sketches in draw order, numbering each element when it's first reached. Elements are looked up
+// by their old IDs, which are unique across the document, so that the nodes and control points that sub-sketches
+// share with the sketches that contain them are still shared in the copy.
+class DocumentCleanup::Copier
+{
+public:
+  Copier(const Model::Document* document, Model::Document* copy)
+    : mDocument(document)
+    , mCopy(copy)
+    , mNextID(1)
+    , mCopiedDefinitions(0)
+  {}
+
+  void copy(Result* result)
+  {
+    findUsed(mDocument->mSketch);
+
+    for (auto& [id, definition] : mDocument->mDefinitions) {
+      findUsed(definition);
+    }
+
+    copySketch(mDocument->mSketch, mCopy->mSketch);
+    copyDefinitions();
+
+    // Definitions follow the root sketch in the order that their instances are reached, and any without instances
+    // follow those in the order of their old IDs, so that copying the same document always numbers it the same way
+    std::vector<ID<Model::Sketch>> definitions;
+    definitions.reserve(mDocument->mDefinitions.size());
+
+    for (auto& [id, definition] : mDocument->mDefinitions) {
+      definitions.push_back(id);
+    }
+
+    std::sort(definitions.begin(), definitions.end());
+
+    for (const ID<Model::Sketch>& id : definitions) {
+      definitionID(id);
+    }
+
+    copyDefinitions();
+
+    mCopy->mNextID = mNextID;
+
+    result->mRemovedNodes = mRemovedNodes.size();
+    result->mRemovedControlPoints = mRemovedControlPoints.size();
+    result->mNextIDBefore = mDocument->mNextID;
+    result->mNextIDAfter = mNextID;
+  }
+
+private:
+  template <class TModel>
+  ID<TModel> number(const ID<TModel>& id)
+  {
+    auto [it, inserted] = mIDs.try_emplace(id.value(), mNextID);
+
+    if (inserted) {
+      ++mNextID;
+    }
+
+    return ID<TModel>(it->second);
+  }
+
+  template <class TModel>
+  bool isNumbered(const ID<TModel>& id) const
+  {
+    return mIDs.count(id.value()) > 0;
+  }
+
+  void findUsed(const Model::Sketch* sketch)
+  {
+    for (auto& [id, path] : sketch->mPaths) {
+      for (const Model::Path::Entry& entry : path->entries()) {
+        mUsed.insert(entry.mNode.value());
+        mUsed.insert(entry.mPreControl.value());
+        mUsed.insert(entry.mPostControl.value());
+      }
+    }
+
+    for (auto& [id, subSketch] : sketch->mSketches) {
+      findUsed(subSketch);
+    }
+  }
+
+  // Definitions are numbered when their first instance is reached, and copied once the sketch that holds it has been
+  ID<Model::Sketch> definitionID(const ID<Model::Sketch>& id)
+  {
+    if (!isNumbered(id)) {
+      mDefinitions.push_back(id);
+    }
+
+    return number(id);
+  }
+
+  void copyDefinitions()
+  {
+    // Copying a definition can reach instances of others, which are added to the end of the list
+    for (; mCopiedDefinitions < mDefinitions.size(); ++mCopiedDefinitions) {
+      const ID<Model::Sketch> id = mDefinitions[mCopiedDefinitions];
+      Model::Sketch* definition = new Model::Sketch(mCopy);
+
+      mCopy->mDefinitions[ID<Model::Sketch>(mIDs.at(id.value()))] = definition;
+      copySketch(mDocument->mDefinitions.at(id), definition);
+    }
+  }
+
+  void copyNode(const Model::Sketch* sketch, const ID<Model::Node>& id)
+  {
+    if (isNumbered(id)) {
+      return;
+    }
+
+    const Model::Node* node = sketch->node(id);
+    number(id);
+
+    Model::Node* copy = new Model::Node(node->position(), node->type());
+    mNodes[id.value()] = copy;
+
+    // A node's control points follow it, leaving out any that no path uses
+    for (const ID<Model::ControlPoint>& controlPointID : node->controlPoints()) {
+      if (mUsed.count(controlPointID.value()) > 0) {
+        copyControlPoint(sketch, controlPointID);
+        copy->mControlPoints.push_back(ID<Model::ControlPoint>(mIDs.at(controlPointID.value())));
+      }
+    }
+  }
+
+  void copyControlPoint(const Model::Sketch* sketch, const ID<Model::ControlPoint>& id)
+  {
+    if (isNumbered(id)) {
+      return;
+    }
+
+    const Model::ControlPoint* controlPoint = sketch->controlPoint(id);
+
+    // Copying the node that the control point belongs to copies it too, unless the node doesn't list it
+    copyNode(sketch, controlPoint->node());
+
+    if (isNumbered(id)) {
+      return;
+    }
+
+    number(id);
+    mControlPoints[id.value()] = new Model::ControlPoint(ID<Model::Node>(mIDs.at(controlPoint->node().value())),
+      controlPoint->position());
+  }
+
+  void copySketch(const Model::Sketch* sketch, Model::Sketch* copy)
+  {
+    copy->mPosition = sketch->mPosition;
+    copy->mDrawOrder.reserve(sketch->mDrawOrder.size());
+
+    for (const Model::Reference& reference : sketch->mDrawOrder) {
+      if (reference.type() == Model::Type::Path) {
+        const ID<Model::Path> id = number(reference.id<Model::Path>());
+        const Model::Path* path = sketch->path(reference.id<Model::Path>());
+        Model::Path* pathCopy = new Model::Path(*path);
+
+        for (Model::Path::Entry& entry : pathCopy->mEntries) {
+          copyNode(sketch, entry.mNode);
+          copyControlPoint(sketch, entry.mPreControl);
+          copyControlPoint(sketch, entry.mPostControl);
+
+          entry.mNode = ID<Model::Node>(mIDs.at(entry.mNode.value()));
+          entry.mPreControl = ID<Model::ControlPoint>(mIDs.at(entry.mPreControl.value()));
+          entry.mPostControl = ID<Model::ControlPoint>(mIDs.at(entry.mPostControl.value()));
+        }
+
+        copy->mPaths[id] = pathCopy;
+        copy->mDrawOrder.push_back(id);
+      } else if (reference.type() == Model::Type::Sketch) {
+        const ID<Model::Sketch> id = number(reference.id<Model::Sketch>());
+        Model::Sketch* subSketch = new Model::Sketch(mCopy);
+
+        copySketch(sketch->sketch(reference.id<Model::Sketch>()), subSketch);
+
+        copy->mSketches[id] = subSketch;
+        copy->mDrawOrder.push_back(id);
+      } else if (reference.type() == Model::Type::Instance) {
+        const ID<Model::Instance> id = number(reference.id<Model::Instance>());
+        const Model::Instance* instance = sketch->instance(reference.id<Model::Instance>());
+
+        copy->mInstances[id] = new Model::Instance(definitionID(instance->definition()), instance->position());
+        copy->mDrawOrder.push_back(id);
+      }
+    }
+
+    // The sketch holds the copies of its nodes and control points that survived, which are shared with any
+    // sub-sketches that hold them too
+    for (auto& [id, node] : sketch->mNodes) {
+      auto it = mNodes.find(id.value());
+
+      if (it != mNodes.end()) {
+        copy->mNodes[ID<Model::Node>(mIDs.at(id.value()))] = it->second;
+      } else {
+        mRemovedNodes.insert(id.value());
+      }
+    }
+
+    for (auto& [id, controlPoint] : sketch->mControlPoints) {
+      auto it = mControlPoints.find(id.value());
+
+      if (it != mControlPoints.end()) {
+        copy->mControlPoints[ID<Model::ControlPoint>(mIDs.at(id.value()))] = it->second;
+      } else {
+        mRemovedControlPoints.insert(id.value());
+      }
+    }
+  }
+
+  const Model::Document* mDocument;
+  Model::Document* mCopy;
+  IDValue mNextID;
+  // The old IDs of the nodes and control points that paths use
+  std::unordered_set<IDValue> mUsed;
+  // The new ID of each element by its old ID
+  std::unordered_map<IDValue, IDValue> mIDs;
+  // The copies of nodes and control points by their old IDs
+  std::unordered_map<IDValue, Model::Node*> mNodes;
+  std::unordered_map<IDValue, Model::ControlPoint*> mControlPoints;
+  // Definitions in the order that they were numbered, of which the first few have been copied
+  std::vector<ID<Model::Sketch>> mDefinitions;
+  size_t mCopiedDefinitions;
+  std::unordered_set<IDValue> mRemovedNodes;
+  std::unordered_set<IDValue> mRemovedControlPoints;
+};
+
+Model::Document* DocumentCleanup::cleanUp(const Model::Document* document, Result* result)
+{
+  Model::Document* copy = new Model::Document;
+
+  Copier copier(document, copy);
+  copier.copy(result);
+
+  return copy;
+}
+
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "utilities/id.h"
+
+#include <cstddef>
+
+namespace Model
+{
+  class Document;
+}
+
+namespace Controller
+{
+
+// Copies a document without the nodes and control points that none of its paths use, with every element numbered
+// again from one in the order that it's drawn. Each path is followed by the nodes and control points that it reaches
+// first, so elements that are used together have nearby IDs and are allocated next to each other, as they are in a
+// freshly loaded document. Commands in the undo history refer to elements by their old IDs, so the copy starts a new
+// history.
+class DocumentCleanup
+{
+public:
+  struct Result
+  {
+    size_t mRemovedNodes;
+    size_t mRemovedControlPoints;
+    // The document's next ID before and after numbering its elements again
+    IDValue mNextIDBefore;
+    IDValue mNextIDAfter;
+  };
+
+  static Model::Document* cleanUp(const Model::Document* document, Result* result);
+
+private:
+  class Copier;
+};
+
+}
@@ -68,6 +68,8 @@ public:
 
     ControlPoint::position(models.mPreControl) = mPreControl;
     ControlPoint::position(models.mPostControl) = mPostControl;
+
+    recordChanges(models);
   }
 
   void undo() override
@@ -76,13 +78,20 @@ public:
 
     ControlPoint::position(models.mPreControl) = mOldPreControl;
     ControlPoint::position(models.mPostControl) = mOldPostControl;
+
+    recordChanges(models);
   }
 
-  std::string description() override
+  const char* description() const override
   {
     return "Move control point";
   }
 
+  size_t memoryUsage() const override
+  {
+    return sizeof(*this);
+  }
+
   bool mergeWith(UndoCommand* other) override
   {
     SetControlPointPositionCommand* command = static_cast<SetControlPointPositionCommand*>(other);
@@ -112,6 +121,13 @@ private:
     return { modelA, modelB, node };
   }
 
+  void recordChanges(const Models& models)
+  {
+    for (auto id : models.mNode->controlPoints()) {
+      mAccessor->recordChange(id);
+    }
+  }
+
   ControlPoint::Accessor* mAccessor;
   ID<Model::ControlPoint> mID;
   Point mPreControl;
@@ -122,7 +138,8 @@ private:
 
 void ControlPoint::setPosition(const Point& position)
 {
-  mUndoManager->pushCommand(new SetControlPointPositionCommand(mAccessor, mID, position));
+  mUndoManager->pushCommand(
+    mUndoManager->createCommand<SetControlPointPositionCommand>(mAccessor, mID, position));
 }
 
 Point& ControlPoint::position(Model::ControlPoint* model)
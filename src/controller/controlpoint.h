@@ -1,5 +1,6 @@
 #pragma once
 
+#include "model/reference.h"
 #include "utilities/geometry.h"
 #include "utilities/id.h"
 
@@ -22,6 +23,7 @@ public:
   public:
     virtual Model::ControlPoint* getControlPoint(const ID<Model::ControlPoint>& id) = 0;
     virtual Model::Node* getNode(const ID<Model::Node>& id) = 0;
+    virtual void recordChange(const Model::Reference& reference) = 0;
   };
 
   ControlPoint(UndoManager* undoManager, Accessor* accessor, const ID<Model::ControlPoint>& id);
@@ -29,9 +31,11 @@ public:
   void setPosition(const Point& position);
 
 private:
-  friend class MoveSelectionCommand;
   friend class SetControlPointPositionCommand;
   friend class SetNodePositionCommand;
+  friend class SimplifySelectionCommand;
+  friend class SplitSegmentCommand;
+  friend class Sketch;
 
   static Point& position(Model::ControlPoint* model);
 
@@ -0,0 +1,633 @@
+#include "controller/flattening.h"
+
+#include "controller/selection.h"
+#include "model/controlpoint.h"
+#include "model/document.h"
+#include "model/instance.h"
+#include "model/node.h"
+#include "model/sketch.h"
+
+#include <algorithm>
+
+namespace Controller
+{
+
+// The finest level matches cairo's default tolerance at four times magnification, and each level is four times
+// coarser than the one before
+const double FlattenedPaths::Tolerances[LevelCount] = { 0.025, 0.1, 0.4, 1.6 };
+
+namespace
+{
+
+// Paths are indexed, and their closest points found, with polylines fine enough that their closest points are near
+// the curves' own
+const int IndexLevel = 1;
+const double IndexCellSize = 64;
+
+// The curve of the segment that starts at the entry of the same index
+CubicBezier segmentCurve(const Model::Sketch* sketch, const Model::Path::EntryList& entries, size_t segment)
+{
+  const Model::Path::Entry& from = entries[segment];
+  const Model::Path::Entry& to = entries[segment + 1 < entries.size() ? segment + 1 : 0];
+
+  return {
+    sketch->node(from.mNode)->position(), sketch->controlPoint(from.mPostControl)->position(),
+    sketch->controlPoint(to.mPreControl)->position(), sketch->node(to.mNode)->position() };
+}
+
+}
+
+FlattenedPaths::Index::Index()
+  : mGrid(IndexCellSize)
+{
+}
+
+FlattenedPaths::FlattenedPaths()
+  : mDocument(nullptr)
+{
+}
+
+FlattenedPaths::~FlattenedPaths()
+{
+  mConnection.disconnect();
+  mBatchConnection.disconnect();
+}
+
+void FlattenedPaths::setDocument(Model::Document* document)
+{
+  mConnection.disconnect();
+  mBatchConnection.disconnect();
+
+  mEntries.clear();
+  mUses.clear();
+  mIndices.clear();
+  mSketchBounds.clear();
+  mInstanceSketches.clear();
+
+  mDocument = document;
+
+  if (mDocument) {
+    mConnection = mDocument->journal().signalChanged().connect(sigc::mem_fun(*this, &FlattenedPaths::onChanged));
+    mBatchConnection = mDocument->journal().signalBatchChanged().connect(
+      sigc::mem_fun(*this, &FlattenedPaths::onBatchChanged));
+  }
+}
+
+const std::vector<Point>& FlattenedPaths::flattened(const Model::Sketch* sketch, const ID<Model::Path>& id,
+  double tolerance)
+{
+  double levelTolerance;
+  return level(sketch, id, tolerance, &levelTolerance).mPoints;
+}
+
+bool FlattenedPaths::bounds(const Model::Sketch* sketch, const ID<Model::Path>& id, Rectangle* bounds)
+{
+  Entry& entry = this->entry(sketch, id);
+  CurveBounds& curveBounds = entry.mCurveBounds;
+
+  if (!curveBounds.mBuilt) {
+    const Model::Path::EntryList& entries = entry.mEntries;
+    const size_t segmentCount = entries.size() > 1 ? entries.size() - (entry.mClosed ? 0 : 1) : 0;
+
+    curveBounds.mSegmentBounds.resize(segmentCount);
+    curveBounds.mStale.assign(segmentCount, false);
+
+    mCurves.clear();
+
+    for (size_t segment = 0; segment < segmentCount; ++segment) {
+      mCurves.push_back(segmentCurve(sketch, entries, segment));
+    }
+
+    CubicBezier::bounds(mCurves.data(), mCurves.size(), curveBounds.mSegmentBounds.data());
+
+    gatherBounds(curveBounds.mSegmentBounds, &curveBounds.mBounds);
+    curveBounds.mBuilt = true;
+  } else if (!curveBounds.mStaleSegments.empty()) {
+    for (size_t segment : curveBounds.mStaleSegments) {
+      curveBounds.mSegmentBounds[segment] = segmentCurve(sketch, entry.mEntries, segment).bounds();
+      curveBounds.mStale[segment] = false;
+    }
+
+    curveBounds.mStaleSegments.clear();
+    gatherBounds(curveBounds.mSegmentBounds, &curveBounds.mBounds);
+  }
+
+  if (curveBounds.mSegmentBounds.empty()) {
+    return false;
+  }
+
+  *bounds = curveBounds.mBounds;
+  return true;
+}
+
+bool FlattenedPaths::sketchBounds(const Model::Sketch* sketch, Rectangle* bounds)
+{
+  auto cached = mSketchBounds.find(sketch);
+
+  if (cached == mSketchBounds.end()) {
+    SketchBounds composed = { true, { 0, 0, 0, 0 }, {} };
+
+    // Sub-sketches and definitions keep track of the sketches composed from them, so that a change to one of them
+    // only needs those composing again
+    auto use = [this, sketch](const Model::Sketch* part)
+    {
+      std::vector<const Model::Sketch*>& users = mSketchBounds.at(part).mUsers;
+
+      if (std::find(users.begin(), users.end(), sketch) == users.end()) {
+        users.push_back(sketch);
+      }
+    };
+
+    auto add = [&composed](const Rectangle& bounds)
+    {
+      if (composed.mEmpty) {
+        composed.mBounds = bounds;
+        composed.mEmpty = false;
+      } else {
+        composed.mBounds.grow(bounds);
+      }
+    };
+
+    for (const Model::Reference& reference : sketch->drawOrder()) {
+      Rectangle elementBounds;
+
+      if (reference.type() == Model::Type::Path) {
+        if (this->bounds(sketch, reference.id<Model::Path>(), &elementBounds)) {
+          add(elementBounds);
+        }
+      } else if (reference.type() == Model::Type::Sketch) {
+        const Model::Sketch* subSketch = sketch->sketch(reference.id<Model::Sketch>());
+
+        if (sketchBounds(subSketch, &elementBounds)) {
+          add(elementBounds.translated(subSketch->position() - Point{0, 0}));
+        }
+
+        use(subSketch);
+      } else if (reference.type() == Model::Type::Instance) {
+        const Model::Instance* instance = sketch->instance(reference.id<Model::Instance>());
+        const Model::Sketch* definition = sketch->parent()->definition(instance->definition());
+
+        if (sketchBounds(definition, &elementBounds)) {
+          add(elementBounds.translated(instance->position() - Point{0, 0}));
+        }
+
+        use(definition);
+        mInstanceSketches[reference.id<Model::Instance>()] = sketch;
+      }
+    }
+
+    // The sketches composed along the way might have moved the cache's entries
+    cached = mSketchBounds.insert_or_assign(sketch, composed).first;
+  }
+
+  if (cached->second.mEmpty) {
+    return false;
+  }
+
+  *bounds = cached->second.mBounds;
+  return true;
+}
+
+bool FlattenedPaths::closestPoint(const Model::Sketch* sketch, const Point& point, double maxDistance,
+  CurvePoint* result, const Selection* exclude)
+{
+  double bestDistance = maxDistance;
+  bool found = false;
+
+  const Rectangle area = { point.x - maxDistance, point.y - maxDistance, point.x + maxDistance, point.y + maxDistance };
+
+  const Index& paths = index(sketch);
+
+  paths.mGrid.query(area, [this, sketch, &point, &bestDistance, &found, result, exclude](const ID<Model::Path>& id)
+  {
+    double tolerance;
+    const Level& polyline = level(sketch, id, Tolerances[IndexLevel], &tolerance);
+
+    if (polyline.mBounds.distance(point) > bestDistance) {
+      return;
+    }
+
+    const Model::Path::EntryList& entries = mEntries.at(id).mEntries;
+
+    for (size_t segment = 0; segment < polyline.mEnds.size(); ++segment) {
+      if (polyline.mSegmentBounds[segment].distance(point) > bestDistance) {
+        continue;
+      }
+
+      const Model::Path::Entry& from = entries[segment];
+      const Model::Path::Entry& to = entries[segment + 1 < entries.size() ? segment + 1 : 0];
+
+      if (exclude && (exclude->contains(from.mNode) || exclude->contains(from.mPostControl)
+          || exclude->contains(to.mPreControl) || exclude->contains(to.mNode))) {
+        continue;
+      }
+
+      // The closest point on the segment's polyline, with the curve's parameter there taken to be proportional
+      const size_t start = segment > 0 ? polyline.mEnds[segment - 1] : 1;
+      const size_t steps = polyline.mEnds[segment] - start;
+
+      double polylineDistance = bestDistance + tolerance;
+      double estimate = 0;
+
+      for (size_t i = 0; i < steps; ++i) {
+        const Point& p1 = polyline.mPoints[start + i - 1];
+        const Point& p2 = polyline.mPoints[start + i];
+        const Vector delta = p2 - p1;
+        const double lengthSquared = delta.dot(delta);
+
+        double u = lengthSquared > 0 ? (point - p1).dot(delta) / lengthSquared : 0;
+        u = std::max(0.0, std::min(1.0, u));
+
+        const double distance = (point - (p1 + delta * u)).length();
+
+        if (distance < polylineDistance) {
+          polylineDistance = distance;
+          estimate = (i + u) / steps;
+        }
+      }
+
+      // The curve is within the tolerance of its polyline, so it can only be closer than the best so far if the
+      // polyline is nearly as close
+      if (polylineDistance - tolerance > bestDistance) {
+        continue;
+      }
+
+      const CubicBezier curve = segmentCurve(sketch, entries, segment);
+
+      const double t = curve.closestParameter(point, estimate);
+      const Point position = curve.evaluate(t);
+      const double distance = (position - point).length();
+
+      if (distance <= bestDistance) {
+        bestDistance = distance;
+        found = true;
+        *result = { id, segment, t, position, distance };
+      }
+    }
+  });
+
+  return found;
+}
+
+FlattenedPaths::Entry& FlattenedPaths::entry(const Model::Sketch* sketch, const ID<Model::Path>& id)
+{
+  auto [it, inserted] = mEntries.try_emplace(id);
+  Entry& entry = it->second;
+
+  if (inserted) {
+    const Model::Path* path = sketch->path(id);
+
+    entry.mSketch = sketch;
+    entry.mEntries = path->entries();
+    entry.mClosed = path->isClosed();
+
+    const Model::Path::EntryList& entries = entry.mEntries;
+
+    auto addUses = [this, id](const Model::Path::Entry& from, const Model::Path::Entry& to, size_t segment)
+    {
+      for (IDValue value : { from.mNode.value(), from.mPostControl.value(), to.mPreControl.value(),
+          to.mNode.value() }) {
+        mUses[value].push_back({ id, segment });
+      }
+    };
+
+    for (size_t i = 1; i < entries.size(); ++i) {
+      addUses(entries[i - 1], entries[i], i - 1);
+    }
+
+    if (entry.mClosed && entries.size() > 1) {
+      addUses(entries.back(), entries.front(), entries.size() - 1);
+    }
+  }
+
+  return entry;
+}
+
+FlattenedPaths::Level& FlattenedPaths::level(const Model::Sketch* sketch, const ID<Model::Path>& id,
+  double tolerance, double* levelTolerance)
+{
+  Entry& entry = this->entry(sketch, id);
+
+  int index = 0;
+
+  while (index + 1 < LevelCount && Tolerances[index + 1] <= tolerance) {
+    ++index;
+  }
+
+  Level& level = entry.mLevels[index];
+
+  if (!level.mBuilt || !level.mStaleSegments.empty()) {
+    refresh(sketch, &level, entry, Tolerances[index]);
+  }
+
+  *levelTolerance = Tolerances[index];
+
+  return level;
+}
+
+void FlattenedPaths::onChanged(const Model::Sketch* sketch, const Model::Reference& reference)
+{
+  // Only the bounds of the sketches that hold what changed, and of those composed from them, are composed again.
+  // Elements that are added or removed also change their sketch's draw order, which is reported with the sketch.
+  if (reference.type() == Model::Type::Null) {
+    boundsChanged(sketch);
+  } else if (reference.refersTo(Model::Type::Path)) {
+    if (auto it = mEntries.find(reference.id<Model::Path>()); it != mEntries.end()) {
+      boundsChanged(it->second.mSketch);
+    }
+
+    forget(reference.id<Model::Path>());
+    pathChanged(reference.id<Model::Path>());
+  } else if (reference.refersTo(Model::Type::Sketch)) {
+    // Sketches are only added and removed by grouping and ungrouping, and a removed sketch's index could otherwise be
+    // found again by a new sketch at the same address
+    mIndices.clear();
+    mSketchBounds.clear();
+    mInstanceSketches.clear();
+  } else if (reference.refersTo(Model::Type::Instance)) {
+    if (auto it = mInstanceSketches.find(reference.id<Model::Instance>()); it != mInstanceSketches.end()) {
+      boundsChanged(it->second);
+    }
+  } else if (reference.refersTo(Model::Type::Node) || reference.refersTo(Model::Type::ControlPoint)) {
+    IDValue value = reference.type() == Model::Type::Node ? reference.id<Model::Node>().value()
+      : reference.id<Model::ControlPoint>().value();
+
+    auto uses = mUses.find(value);
+
+    if (uses == mUses.end()) {
+      return;
+    }
+
+    for (const Use& use : uses->second) {
+      auto markStale = [&use](auto& cache)
+      {
+        if (cache.mBuilt && !cache.mStale[use.mSegment]) {
+          cache.mStale[use.mSegment] = true;
+          cache.mStaleSegments.push_back(use.mSegment);
+        }
+      };
+
+      Entry& entry = mEntries.at(use.mPath);
+
+      for (Level& level : entry.mLevels) {
+        markStale(level);
+      }
+
+      markStale(entry.mCurveBounds);
+
+      pathChanged(use.mPath);
+      boundsChanged(entry.mSketch);
+    }
+  }
+}
+
+void FlattenedPaths::onBatchChanged(const Model::ChangeSet& changes)
+{
+  for (const Model::Reference& reference : changes.references()) {
+    onChanged(nullptr, reference);
+  }
+
+  // Reordering is reported apart from the elements, and means that sketches' bounds need composing again
+  for (const Model::Sketch* sketch : changes.drawOrders()) {
+    onChanged(sketch, Model::Reference());
+  }
+}
+
+void FlattenedPaths::forget(const ID<Model::Path>& id)
+{
+  auto it = mEntries.find(id);
+
+  if (it == mEntries.end()) {
+    return;
+  }
+
+  auto removeUses = [this, id](const ID<Model::Node>& node, const ID<Model::ControlPoint>& preControl,
+    const ID<Model::ControlPoint>& postControl)
+  {
+    for (IDValue value : { node.value(), preControl.value(), postControl.value() }) {
+      auto uses = mUses.find(value);
+
+      if (uses != mUses.end()) {
+        std::vector<Use>& list = uses->second;
+        list.erase(std::remove_if(list.begin(), list.end(), [id](const Use& use) { return use.mPath == id; }),
+          list.end());
+
+        if (list.empty()) {
+          mUses.erase(uses);
+        }
+      }
+    }
+  };
+
+  for (const Model::Path::Entry& entry : it->second.mEntries) {
+    removeUses(entry.mNode, entry.mPreControl, entry.mPostControl);
+  }
+
+  mEntries.erase(it);
+}
+
+void FlattenedPaths::pathChanged(const ID<Model::Path>& id)
+{
+  for (auto it = mIndices.begin(); it != mIndices.end();) {
+    std::vector<ID<Model::Path>>& changed = it->second.mChanged;
+    changed.push_back(id);
+
+    // An index that isn't being used is dropped once it's cheaper to build again than to catch up
+    if (changed.size() > it->second.mBounds.size() + 1024) {
+      it = mIndices.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+void FlattenedPaths::boundsChanged(const Model::Sketch* sketch)
+{
+  auto it = mSketchBounds.find(sketch);
+
+  if (it == mSketchBounds.end()) {
+    return;
+  }
+
+  const std::vector<const Model::Sketch*> users = std::move(it->second.mUsers);
+  mSketchBounds.erase(it);
+
+  for (const Model::Sketch* user : users) {
+    boundsChanged(user);
+  }
+}
+
+FlattenedPaths::Index& FlattenedPaths::index(const Model::Sketch* sketch)
+{
+  auto [it, inserted] = mIndices.try_emplace(sketch);
+  Index& index = it->second;
+
+  // The paths are indexed by the exact bounds of their curves, which hold their closest points
+  auto add = [this, sketch, &index](const ID<Model::Path>& id)
+  {
+    Rectangle bounds;
+
+    if (this->bounds(sketch, id, &bounds)) {
+      index.mGrid.insert(id, bounds);
+      index.mBounds[id] = bounds;
+    }
+  };
+
+  if (inserted) {
+    for (auto [id, path] : sketch->paths()) {
+      add(id);
+    }
+  } else if (!index.mChanged.empty()) {
+    std::sort(index.mChanged.begin(), index.mChanged.end());
+    index.mChanged.erase(std::unique(index.mChanged.begin(), index.mChanged.end()), index.mChanged.end());
+
+    for (const ID<Model::Path>& id : index.mChanged) {
+      auto bounds = index.mBounds.find(id);
+
+      if (bounds != index.mBounds.end()) {
+        index.mGrid.remove(id, bounds->second);
+        index.mBounds.erase(bounds);
+      }
+
+      if (sketch->paths().contains(id)) {
+        add(id);
+      }
+    }
+  }
+
+  index.mChanged.clear();
+
+  return index;
+}
+
+void FlattenedPaths::refresh(const Model::Sketch* sketch, Level* level, const Entry& entry, double tolerance)
+{
+  const Model::Path::EntryList& entries = entry.mEntries;
+  const size_t segmentCount = entries.size() > 1 ? entries.size() - (entry.mClosed ? 0 : 1) : 0;
+
+  auto curve = [sketch, &entries](size_t segment) { return segmentCurve(sketch, entries, segment); };
+
+  if (!level->mBuilt) {
+    mCurves.clear();
+
+    for (size_t i = 0; i < segmentCount; ++i) {
+      mCurves.push_back(curve(i));
+    }
+
+    level->mPoints.clear();
+    level->mEnds.clear();
+    level->mStale.assign(segmentCount, false);
+    level->mSegmentBounds.resize(segmentCount);
+
+    CubicBezier::flatten(mCurves.data(), mCurves.size(), tolerance, &level->mPoints, &level->mEnds);
+
+    for (size_t i = 0; i < mCurves.size(); ++i) {
+      updateBounds(level, i, tolerance);
+    }
+
+    gatherBounds(level->mSegmentBounds, &level->mBounds);
+
+    level->mBuilt = true;
+    return;
+  }
+
+  // Only the stale segments' curves are looked up again, and moving a point usually leaves them with as many steps
+  // as before, in which case their points are replaced where they are
+  std::sort(level->mStaleSegments.begin(), level->mStaleSegments.end());
+
+  mCurves.clear();
+
+  for (size_t segment : level->mStaleSegments) {
+    mCurves.push_back(curve(segment));
+  }
+
+  mSteps.resize(mCurves.size());
+  CubicBezier::flatteningSteps(mCurves.data(), mCurves.size(), tolerance, mSteps.data());
+
+  bool sameSteps = true;
+
+  for (size_t i = 0; i < mCurves.size() && sameSteps; ++i) {
+    const size_t segment = level->mStaleSegments[i];
+    const size_t start = segment > 0 ? level->mEnds[segment - 1] : 1;
+
+    sameSteps = size_t(mSteps[i]) == level->mEnds[segment] - start;
+  }
+
+  if (level->mStaleSegments.front() == 0) {
+    level->mPoints.front() = mCurves.front().p0;
+  }
+
+  if (sameSteps) {
+    for (size_t i = 0; i < mCurves.size(); ++i) {
+      const size_t segment = level->mStaleSegments[i];
+      const size_t start = segment > 0 ? level->mEnds[segment - 1] : 1;
+
+      mScratch.clear();
+      mCurves[i].flatten(tolerance, &mScratch);
+      std::copy(mScratch.begin(), mScratch.end(), level->mPoints.begin() + start);
+    }
+  } else {
+    // Otherwise the points are rebuilt, copying the segments that haven't changed
+    mScratch.clear();
+    mScratch.reserve(level->mPoints.size());
+    mScratch.push_back(level->mPoints.front());
+
+    size_t start = 1;
+    size_t next = 0;
+
+    for (size_t segment = 0; segment < segmentCount; ++segment) {
+      const size_t end = level->mEnds[segment];
+
+      if (next < mCurves.size() && level->mStaleSegments[next] == segment) {
+        mCurves[next++].flatten(tolerance, &mScratch);
+      } else {
+        mScratch.insert(mScratch.end(), level->mPoints.begin() + start, level->mPoints.begin() + end);
+      }
+
+      level->mEnds[segment] = mScratch.size();
+      start = end;
+    }
+
+    level->mPoints.swap(mScratch);
+  }
+
+  for (size_t segment : level->mStaleSegments) {
+    level->mStale[segment] = false;
+    updateBounds(level, segment, tolerance);
+  }
+
+  level->mStaleSegments.clear();
+
+  // A segment that's changed might have shrunk, so the path's bounds are gathered again
+  gatherBounds(level->mSegmentBounds, &level->mBounds);
+}
+
+void FlattenedPaths::updateBounds(Level* level, size_t segment, double tolerance)
+{
+  const size_t start = segment > 0 ? level->mEnds[segment - 1] : 1;
+  const Point& first = level->mPoints[start - 1];
+
+  Rectangle bounds = { first.x, first.y, first.x, first.y };
+
+  for (size_t i = start; i < level->mEnds[segment]; ++i) {
+    bounds.grow(level->mPoints[i]);
+  }
+
+  level->mSegmentBounds[segment] = bounds.inflated(tolerance);
+}
+
+void FlattenedPaths::gatherBounds(const std::vector<Rectangle>& segmentBounds, Rectangle* bounds)
+{
+  if (segmentBounds.empty()) {
+    return;
+  }
+
+  *bounds = segmentBounds.front();
+
+  for (const Rectangle& segment : segmentBounds) {
+    bounds->grow(segment);
+  }
+}
+
+
+}
@@ -0,0 +1,163 @@
+#pragma once
+
+#include "model/journal.h"
+#include "model/path.h"
+#include "utilities/geometry.h"
+#include "utilities/id.h"
+#include "utilities/spatialgrid.h"
+
+#include <unordered_map>
+#include <vector>
+
+namespace Model
+{
+  class Document;
+  class Sketch;
+}
+
+namespace Controller
+{
+
+class Selection;
+
+// Polylines that follow a document's paths at a few tolerances, and the exact bounds of the paths' curves, made when
+// they're first asked for. They're kept until the document's journal reports a change to the path, or to one of its
+// nodes or control points, and in the latter case only the segments that use the changed element are made again.
+class FlattenedPaths
+{
+public:
+  FlattenedPaths();
+  ~FlattenedPaths();
+
+  void setDocument(Model::Document* document);
+
+  // The path's curves to within the tolerance, in its sketch's coordinates, using the coarsest level that's fine
+  // enough, or the finest level for finer tolerances. A closed path's polyline ends where it starts, and a path
+  // without any segments has no points.
+  const std::vector<Point>& flattened(const Model::Sketch* sketch, const ID<Model::Path>& id, double tolerance);
+
+  // The bounds of the path's curves in its sketch's coordinates, from the extremes where their derivatives are zero
+  // rather than from their control points. Returns false for a path without any segments.
+  bool bounds(const Model::Sketch* sketch, const ID<Model::Path>& id, Rectangle* bounds);
+  // The bounds of everything that a sketch draws, in its own coordinates, composed from the bounds of its paths and
+  // of its sub-sketches and instances where they're placed. They're kept until something that they were composed from
+  // changes, and composing them again only unites bounds that are kept for each path. Returns false for an empty
+  // sketch.
+  bool sketchBounds(const Model::Sketch* sketch, Rectangle* bounds);
+
+  // A point on one of a sketch's paths, where the segment is the one that starts at the entry of the same index
+  struct CurvePoint
+  {
+    ID<Model::Path> mPath;
+    size_t mSegment;
+    double mParameter;
+    Point mPosition;
+    double mDistance;
+  };
+
+  // Finds the closest point on any of the sketch's own paths that's within the distance of the point. The paths near
+  // the point are found from a grid of their bounds, which is kept for each sketch that's queried and
+  // updated with the paths that have changed since. Segments whose bounds are too far away are passed over, and the
+  // closest points on the remaining polylines are refined on the curves themselves. Segments that use any of the
+  // excluded nodes or control points are passed over too.
+  bool closestPoint(const Model::Sketch* sketch, const Point& point, double maxDistance, CurvePoint* result,
+    const Selection* exclude = nullptr);
+
+  static const int LevelCount = 4;
+  static const double Tolerances[LevelCount];
+
+private:
+  struct Level
+  {
+    Level()
+      : mBuilt(false)
+    {}
+
+    bool mBuilt;
+    std::vector<Point> mPoints;
+    // Where each segment's points end. The first point is the path's start, which belongs to no segment.
+    std::vector<size_t> mEnds;
+    // The bounds of each segment's points, grown by the tolerance so that they hold the curve too
+    std::vector<Rectangle> mSegmentBounds;
+    Rectangle mBounds;
+    std::vector<bool> mStale;
+    std::vector<size_t> mStaleSegments;
+  };
+
+  // The exact bounds of each segment's curve
+  struct CurveBounds
+  {
+    CurveBounds()
+      : mBuilt(false)
+    {}
+
+    bool mBuilt;
+    std::vector<Rectangle> mSegmentBounds;
+    Rectangle mBounds;
+    std::vector<bool> mStale;
+    std::vector<size_t> mStaleSegments;
+  };
+
+  struct Entry
+  {
+    const Model::Sketch* mSketch;
+    Model::Path::EntryList mEntries;
+    bool mClosed;
+    Level mLevels[LevelCount];
+    CurveBounds mCurveBounds;
+  };
+
+  struct SketchBounds
+  {
+    bool mEmpty;
+    Rectangle mBounds;
+    // The sketches whose bounds were composed from these, which need composing again whenever these do
+    std::vector<const Model::Sketch*> mUsers;
+  };
+
+  // The paths of a sketch by the exact bounds of their curves
+  struct Index
+  {
+    Index();
+
+    SpatialGrid<ID<Model::Path>> mGrid;
+    std::unordered_map<ID<Model::Path>, Rectangle> mBounds;
+    // Paths that have changed since the index was last used, which might no longer be in the sketch
+    std::vector<ID<Model::Path>> mChanged;
+  };
+
+  // A segment of a path that uses a node or control point
+  struct Use
+  {
+    ID<Model::Path> mPath;
+    size_t mSegment;
+  };
+
+  void onChanged(const Model::Sketch* sketch, const Model::Reference& reference);
+  void onBatchChanged(const Model::ChangeSet& changes);
+  void forget(const ID<Model::Path>& id);
+  void pathChanged(const ID<Model::Path>& id);
+  void boundsChanged(const Model::Sketch* sketch);
+  Index& index(const Model::Sketch* sketch);
+  Entry& entry(const Model::Sketch* sketch, const ID<Model::Path>& id);
+  Level& level(const Model::Sketch* sketch, const ID<Model::Path>& id, double tolerance, double* levelTolerance);
+  void refresh(const Model::Sketch* sketch, Level* level, const Entry& entry, double tolerance);
+  static void updateBounds(Level* level, size_t segment, double tolerance);
+  static void gatherBounds(const std::vector<Rectangle>& segmentBounds, Rectangle* bounds);
+
+  Model::Document* mDocument;
+  sigc::connection mConnection;
+  sigc::connection mBatchConnection;
+  std::unordered_map<ID<Model::Path>, Entry> mEntries;
+  std::unordered_map<IDValue, std::vector<Use>> mUses;
+  std::unordered_map<const Model::Sketch*, Index> mIndices;
+  std::unordered_map<const Model::Sketch*, SketchBounds> mSketchBounds;
+  // The sketch that holds each instance that a sketch's bounds were composed from
+  std::unordered_map<ID<Model::Instance>, const Model::Sketch*> mInstanceSketches;
+  // Reused while refreshing, so that the curves and their step counts don't need allocating each time
+  std::vector<CubicBezier> mCurves;
+  std::vector<int> mSteps;
+  std::vector<Point> mScratch;
+};
+
+}
@@ -0,0 +1,304 @@
+#include "controller/hashing.h"
+
+#include "model/controlpoint.h"
+#include "model/document.h"
+#include "model/instance.h"
+#include "model/node.h"
+#include "model/path.h"
+#include "model/sketch.h"
+#include "utilities/hasher.h"
+
+#include <algorithm>
+
+namespace Controller
+{
+
+ContentHashes::ContentHashes()
+  : mDocument(nullptr)
+{
+}
+
+ContentHashes::~ContentHashes()
+{
+  mConnection.disconnect();
+  mBatchConnection.disconnect();
+}
+
+void ContentHashes::setDocument(Model::Document* document)
+{
+  mConnection.disconnect();
+  mBatchConnection.disconnect();
+
+  mPaths.clear();
+  mUses.clear();
+  mSketches.clear();
+  mOwners.clear();
+  mSketchIDs.clear();
+
+  mDocument = document;
+
+  if (mDocument) {
+    mConnection = mDocument->journal().signalChanged().connect(sigc::mem_fun(*this, &ContentHashes::onChanged));
+    mBatchConnection = mDocument->journal().signalBatchChanged().connect(
+      sigc::mem_fun(*this, &ContentHashes::onBatchChanged));
+  }
+}
+
+ContentHashes::Hash ContentHashes::pathHash(const Model::Sketch* sketch, const ID<Model::Path>& id)
+{
+  auto [it, inserted] = mPaths.try_emplace(id);
+  PathEntry& entry = it->second;
+
+  if (!inserted) {
+    return entry.mHash;
+  }
+
+  const Model::Path* path = sketch->path(id);
+  Hasher hasher;
+
+  hasher.add(uint64_t(path->isClosed())).add(uint64_t(path->isFilled()));
+  hasher.add(uint64_t(path->strokeColour().rgba())).add(uint64_t(path->fillColour().rgba()));
+
+  entry.mElements.reserve(3 * path->entries().size());
+
+  for (const Model::Path::Entry& pathEntry : path->entries()) {
+    const Model::Node* node = sketch->node(pathEntry.mNode);
+
+    hasher.add(node->position()).add(uint64_t(node->type()));
+    hasher.add(sketch->controlPoint(pathEntry.mPreControl)->position());
+    hasher.add(sketch->controlPoint(pathEntry.mPostControl)->position());
+
+    for (IDValue value : { pathEntry.mNode.value(), pathEntry.mPreControl.value(), pathEntry.mPostControl.value() }) {
+      entry.mElements.push_back(value);
+      mUses[value].push_back(id);
+    }
+  }
+
+  entry.mHash = hasher.hash();
+
+  return entry.mHash;
+}
+
+ContentHashes::Hash ContentHashes::sketchHash(const Model::Sketch* sketch)
+{
+  // Entries stay where they are as others are added, while the sketches below are hashed
+  SketchEntry& entry = mSketches[sketch];
+
+  if (!entry.mBuilt) {
+    const size_t count = sketch->drawOrder().size();
+
+    entry.mTerms.resize(count);
+    entry.mStale.assign(count, false);
+    entry.mStaleTerms.clear();
+    entry.mSum = 0;
+
+    for (size_t index = 0; index < count; ++index) {
+      entry.mTerms[index] = term(sketch, index);
+      entry.mSum += entry.mTerms[index];
+    }
+
+    entry.mBuilt = true;
+  } else if (!entry.mStaleTerms.empty()) {
+    for (size_t index : entry.mStaleTerms) {
+      entry.mSum -= entry.mTerms[index];
+      entry.mTerms[index] = term(sketch, index);
+      entry.mSum += entry.mTerms[index];
+      entry.mStale[index] = false;
+    }
+
+    entry.mStaleTerms.clear();
+  }
+
+  return Hasher().add(entry.mSum).add(uint64_t(entry.mTerms.size())).hash();
+}
+
+void ContentHashes::onChanged(const Model::Sketch* sketch, const Model::Reference& reference)
+{
+  if (reference.type() == Model::Type::Null) {
+    // The sketch's draw order changed
+    if (sketch) {
+      invalidate(sketch);
+    }
+  } else if (reference.refersTo(Model::Type::Path)) {
+    forgetPath(reference.id<Model::Path>());
+    elementChanged(reference.id<Model::Path>().value());
+  } else if (reference.refersTo(Model::Type::Node) || reference.refersTo(Model::Type::ControlPoint)) {
+    IDValue value = reference.type() == Model::Type::Node ? reference.id<Model::Node>().value()
+      : reference.id<Model::ControlPoint>().value();
+
+    auto uses = mUses.find(value);
+
+    if (uses == mUses.end()) {
+      return;
+    }
+
+    // Forgetting the paths removes them from the list
+    const std::vector<ID<Model::Path>> paths = uses->second;
+
+    for (const ID<Model::Path>& id : paths) {
+      forgetPath(id);
+      elementChanged(id.value());
+    }
+  } else if (reference.refersTo(Model::Type::Instance)) {
+    elementChanged(reference.id<Model::Instance>().value());
+  } else if (reference.refersTo(Model::Type::Sketch)) {
+    elementChanged(reference.id<Model::Sketch>().value());
+
+    // Sub-sketches and definitions are reported when they move, and when they're added, removed or restored, and a
+    // removed sketch's hash could otherwise be found again by a new sketch at the same address
+    auto sketchID = mSketchIDs.find(reference.id<Model::Sketch>().value());
+
+    if (sketchID != mSketchIDs.end()) {
+      invalidate(sketchID->second);
+    }
+  }
+}
+
+void ContentHashes::onBatchChanged(const Model::ChangeSet& changes)
+{
+  for (const Model::Reference& reference : changes.references()) {
+    onChanged(nullptr, reference);
+  }
+
+  for (const Model::Sketch* sketch : changes.drawOrders()) {
+    invalidate(sketch);
+  }
+}
+
+void ContentHashes::forgetPath(const ID<Model::Path>& id)
+{
+  auto it = mPaths.find(id);
+
+  if (it == mPaths.end()) {
+    return;
+  }
+
+  for (IDValue value : it->second.mElements) {
+    auto uses = mUses.find(value);
+
+    if (uses != mUses.end()) {
+      std::vector<ID<Model::Path>>& list = uses->second;
+      list.erase(std::remove(list.begin(), list.end(), id), list.end());
+
+      if (list.empty()) {
+        mUses.erase(uses);
+      }
+    }
+  }
+
+  mPaths.erase(it);
+}
+
+void ContentHashes::elementChanged(IDValue id)
+{
+  auto owner = mOwners.find(id);
+
+  if (owner != mOwners.end()) {
+    markStale(owner->second);
+  }
+}
+
+void ContentHashes::markStale(const Use& use)
+{
+  auto it = mSketches.find(use.first);
+
+  if (it == mSketches.end() || !it->second.mBuilt) {
+    return;
+  }
+
+  SketchEntry& entry = it->second;
+
+  // The element was drawn there before the sketch was last hashed again
+  if (use.second >= entry.mTerms.size()) {
+    invalidate(use.first);
+    return;
+  }
+
+  if (entry.mStale[use.second]) {
+    return;
+  }
+
+  const bool wasCurrent = entry.mStaleTerms.empty();
+
+  entry.mStale[use.second] = true;
+  entry.mStaleTerms.push_back(use.second);
+
+  if (wasCurrent) {
+    usesChanged(entry);
+  }
+}
+
+void ContentHashes::invalidate(const Model::Sketch* sketch)
+{
+  auto it = mSketches.find(sketch);
+
+  if (it == mSketches.end() || !it->second.mBuilt) {
+    return;
+  }
+
+  SketchEntry& entry = it->second;
+  const bool wasCurrent = entry.mStaleTerms.empty();
+
+  entry.mBuilt = false;
+
+  if (wasCurrent) {
+    usesChanged(entry);
+  }
+}
+
+// A sketch whose hash is out of date has made the terms for it out of date wherever it's drawn, so this is only
+// needed when it first goes out of date
+void ContentHashes::usesChanged(const SketchEntry& entry)
+{
+  for (const Use& use : entry.mUses) {
+    markStale(use);
+  }
+}
+
+ContentHashes::Hash ContentHashes::term(const Model::Sketch* sketch, size_t index)
+{
+  const Model::Reference& reference = sketch->drawOrder()[index];
+  const Use use(sketch, index);
+
+  Hasher hasher;
+  hasher.add(uint64_t(index)).add(uint64_t(reference.type()));
+
+  // Sketches drawn here are recorded against their IDs, and a sketch that's new to its ID might be at the address of
+  // one that's gone
+  auto drawnSketch = [this, &use](IDValue id, const Model::Sketch* drawn)
+  {
+    auto [it, inserted] = mSketchIDs.try_emplace(id, drawn);
+    SketchEntry& entry = mSketches[drawn];
+
+    if (inserted || it->second != drawn) {
+      it->second = drawn;
+      entry.mBuilt = false;
+    }
+
+    entry.mUses.insert(use);
+  };
+
+  if (reference.type() == Model::Type::Path) {
+    mOwners[reference.id<Model::Path>().value()] = use;
+    hasher.add(pathHash(sketch, reference.id<Model::Path>()));
+  } else if (reference.type() == Model::Type::Sketch) {
+    const Model::Sketch* subSketch = sketch->sketch(reference.id<Model::Sketch>());
+
+    mOwners[reference.id<Model::Sketch>().value()] = use;
+    drawnSketch(reference.id<Model::Sketch>().value(), subSketch);
+
+    hasher.add(subSketch->position()).add(sketchHash(subSketch));
+  } else if (reference.type() == Model::Type::Instance) {
+    const Model::Instance* instance = sketch->instance(reference.id<Model::Instance>());
+    const Model::Sketch* definition = sketch->parent()->definition(instance->definition());
+
+    mOwners[reference.id<Model::Instance>().value()] = use;
+    drawnSketch(instance->definition().value(), definition);
+
+    hasher.add(instance->position()).add(sketchHash(definition));
+  }
+
+  return hasher.hash();
+}
+
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include "model/journal.h"
+#include "utilities/id.h"
+
+#include <cstdint>
+#include <set>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace Model
+{
+  class Document;
+  class Path;
+  class Sketch;
+}
+
+namespace Controller
+{
+
+// Hashes of what a document's paths and sketches draw, which are equal for equal content whatever the elements' IDs.
+// A path's hash covers its flags, colours and the positions and types of its nodes and control points. A sketch's
+// hash covers the hashes of the paths, sub-sketches and instances it draws, along with their places in its draw order
+// and where the latter are placed, so that sketches that draw the same things hash the same wherever they are.
+//
+// Hashes are made when they're first asked for and kept until the document's journal reports a change to them. A
+// sketch's hash is a sum of a term for each element it draws, so a change to an element only makes the hash of its
+// path again and replaces one term in each of the sketches above it, rather than hashing their draw orders again.
+class ContentHashes
+{
+public:
+  typedef uint64_t Hash;
+
+  ContentHashes();
+  ~ContentHashes();
+
+  void setDocument(Model::Document* document);
+
+  Hash pathHash(const Model::Sketch* sketch, const ID<Model::Path>& id);
+  Hash sketchHash(const Model::Sketch* sketch);
+
+private:
+  struct PathEntry
+  {
+    Hash mHash;
+    // The nodes and control points that the hash covers
+    std::vector<IDValue> mElements;
+  };
+
+  // A place in a sketch's draw order
+  typedef std::pair<const Model::Sketch*, size_t> Use;
+
+  struct SketchEntry
+  {
+    SketchEntry()
+      : mBuilt(false)
+    {}
+
+    bool mBuilt;
+    // Each element's term, by its place in the draw order
+    std::vector<Hash> mTerms;
+    Hash mSum;
+    std::vector<bool> mStale;
+    std::vector<size_t> mStaleTerms;
+    // Where the sketch is drawn by others, as a sub-sketch or a definition that they place. Places that no longer
+    // draw it only cost their terms being made again.
+    std::set<Use> mUses;
+  };
+
+  void onChanged(const Model::Sketch* sketch, const Model::Reference& reference);
+  void onBatchChanged(const Model::ChangeSet& changes);
+  void forgetPath(const ID<Model::Path>& id);
+  void elementChanged(IDValue id);
+  void markStale(const Use& use);
+  void invalidate(const Model::Sketch* sketch);
+  void usesChanged(const SketchEntry& entry);
+  Hash term(const Model::Sketch* sketch, size_t index);
+
+  Model::Document* mDocument;
+  sigc::connection mConnection;
+  sigc::connection mBatchConnection;
+  std::unordered_map<ID<Model::Path>, PathEntry> mPaths;
+  // The paths whose hashes cover each node and control point
+  std::unordered_map<IDValue, std::vector<ID<Model::Path>>> mUses;
+  std::unordered_map<const Model::Sketch*, SketchEntry> mSketches;
+  // Where each path, sub-sketch and instance was drawn when its sketch was hashed
+  std::unordered_map<IDValue, Use> mOwners;
+  // The sub-sketches and definitions by their IDs, as they were when hashed
+  std::unordered_map<IDValue, const Model::Sketch*> mSketchIDs;
+};
+
+}
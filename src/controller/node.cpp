@@ -31,18 +31,25 @@ public:
   void redo() override
   { 
     Node::type(mAccessor->getNode(mID)) = mType;
+    mAccessor->recordChange(mID);
   }
 
   void undo() override
   { 
     Node::type(mAccessor->getNode(mID)) = mOldType;
+    mAccessor->recordChange(mID);
   }
 
-  std::string description() override
+  const char* description() const override
   {
     return "Set node type";
   }
 
+  size_t memoryUsage() const override
+  {
+    return sizeof(*this);
+  }
+
 private:
   Node::Accessor* mAccessor;
   ID<Model::Node> mID;
@@ -52,7 +59,7 @@ private:
 
 void Node::setType(Type type)
 {
-  mUndoManager->pushCommand(new SetNodeTypeCommand(mAccessor, mID, type));
+  mUndoManager->pushCommand(mUndoManager->createCommand<SetNodeTypeCommand>(mAccessor, mID, type));
 }
 
 class SetNodePositionCommand : public UndoManager::AutoIDCommand<SetNodePositionCommand>
@@ -84,11 +91,13 @@ public:
     Model::Node* node = mAccessor->getNode(mID);
 
     Node::position(node) = mPosition;
+    mAccessor->recordChange(mID);
 
     const Model::Node::ControlPointList& controlPoints = node->controlPoints();
 
     for (int i = 0; i < controlPoints.size(); ++i) {
       ControlPoint::position(mAccessor->getControlPoint(controlPoints[i])) = mControlPoints[i];
+      mAccessor->recordChange(controlPoints[i]);
     }
   }
 
@@ -97,19 +106,26 @@ public:
     Model::Node* node = mAccessor->getNode(mID);
 
     Node::position(node) = mOldPosition;
+    mAccessor->recordChange(mID);
 
     const Model::Node::ControlPointList& controlPoints = node->controlPoints();
 
     for (int i = 0; i < controlPoints.size(); ++i) {
       ControlPoint::position(mAccessor->getControlPoint(controlPoints[i])) = mOldControlPoints[i];
+      mAccessor->recordChange(controlPoints[i]);
     }
   }
 
-  std::string description() override
+  const char* description() const override
   {
     return "Move node";
   }
 
+  size_t memoryUsage() const override
+  {
+    return sizeof(*this) + heapUsage(mControlPoints) + heapUsage(mOldControlPoints);
+  }
+
   bool mergeWith(UndoCommand* other) override
   {
     SetNodePositionCommand* command = static_cast<SetNodePositionCommand*>(other);
@@ -134,7 +150,7 @@ private:
 
 void Node::setPosition(const Point& position)
 {
-  mUndoManager->pushCommand(new SetNodePositionCommand(mAccessor, mID, position));
+  mUndoManager->pushCommand(mUndoManager->createCommand<SetNodePositionCommand>(mAccessor, mID, position));
 }
 
 Point& Node::position(Model::Node* model)
@@ -3,6 +3,7 @@
 #include "utilities/geometry.h"
 
 #include "model/node.h"
+#include "model/reference.h"
 
 namespace Controller
 {
@@ -18,6 +19,7 @@ public:
   public:
     virtual Model::ControlPoint* getControlPoint(const ID<Model::ControlPoint>& id) = 0;
     virtual Model::Node* getNode(const ID<Model::Node>& id) = 0;
+    virtual void recordChange(const Model::Reference& reference) = 0;
   };
 
   Node(UndoManager* undoManager, Accessor* accessor, const ID<Model::Node>& id);
@@ -29,9 +31,10 @@ public:
   void setType(Type type);
 
 private:
-  friend class MoveSelectionCommand;
   friend class SetNodePositionCommand;
   friend class SetNodeTypeCommand;
+  friend class SimplifySelectionCommand;
+  friend class SplitSegmentCommand;
   friend class Sketch;
 
   static Point& position(Model::Node* model);
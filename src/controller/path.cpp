@@ -1,6 +1,11 @@
 #include "controller/path.h"
 
+#include "controller/controlpoint.h"
+#include "controller/node.h"
 #include "controller/undo.h"
+#include "model/controlpoint.h"
+
+#include <cassert>
 
 namespace Controller
 {
@@ -65,6 +70,8 @@ public:
     } else if (mAddPosition == Position::End) {
       entries.push_back(entry);
     }
+
+    mAccessor->recordChange(mID);
   }
 
   void undo() override
@@ -85,13 +92,20 @@ public:
     mAccessor->destroyNode(mNodeID);
     mAccessor->destroyControlPoint(mPreControlID);
     mAccessor->destroyControlPoint(mPostControlID);
+
+    mAccessor->recordChange(mID);
   }
 
-  std::string description() override
+  const char* description() const override
   {
     return "Add node";
   }
 
+  size_t memoryUsage() const override
+  {
+    return sizeof(*this);
+  }
+
 private:
   Path::Accessor* mAccessor;
   Position mAddPosition;
@@ -109,23 +123,98 @@ void Path::addSymmetricNode(int index, const Point& position, const Point& contr
 {
   Vector offsetA = controlA - position;
 
-  mUndoManager->pushCommand(
-    new AddNodeCommand(mAccessor, mID, index, position, controlA, position - offsetA, NodeType::Symmetric));
+  mUndoManager->pushCommand(mUndoManager->createCommand<AddNodeCommand>(mAccessor, mID, index, position, controlA,
+    position - offsetA, NodeType::Symmetric));
 }
 
 void Path::addSmoothNode(int index, const Point& position, const Point& controlA, double lengthB)
 {
   Vector offsetA = controlA - position;
 
-  mUndoManager->pushCommand(
-      new AddNodeCommand(mAccessor, mID, index, position, controlA, position - offsetA.normalised() * lengthB,
-        NodeType::Smooth));
+  mUndoManager->pushCommand(mUndoManager->createCommand<AddNodeCommand>(mAccessor, mID, index, position, controlA,
+    position - offsetA.normalised() * lengthB, NodeType::Smooth));
 }
 
 void Path::addSharpNode(int index, const Point& position)
 {
-  mUndoManager->pushCommand(new AddNodeCommand(mAccessor, mID, index, position, position, position,
-        NodeType::Sharp));
+  mUndoManager->pushCommand(mUndoManager->createCommand<AddNodeCommand>(mAccessor, mID, index, position, position,
+    position, NodeType::Sharp));
+}
+
+class AddNodesCommand : public UndoCommand
+{
+public:
+  AddNodesCommand(Path::Accessor* accessor, const ID<Model::Path>& id, int entryIndex,
+    const std::vector<Path::NodeData>& nodes)
+    : mAccessor(accessor)
+    , mNodes(nodes)
+    , mID(id)
+    , mEntryIndex(entryIndex)
+    , mFirstID(accessor->reserveIDs(3 * nodes.size()))
+  {
+  }
+
+  void redo() override
+  {
+    mAccessor->createNodes(mFirstID, mNodes);
+
+    Model::Path* model = mAccessor->getPath(mID);
+    Model::Path::EntryList& entries = Path::entries(model);
+
+    // Open a gap for all of the entries at once, rather than shuffling the later ones along for each
+    entries.insert(std::next(entries.begin(), mEntryIndex), mNodes.size(), Model::Path::Entry());
+
+    for (size_t i = 0; i < mNodes.size(); ++i) {
+      IDValue nodeID = mFirstID + 3 * i;
+
+      entries[mEntryIndex + i] = {
+        .mNode = ID<Model::Node>(nodeID),
+        .mPreControl = ID<Model::ControlPoint>(nodeID + 1),
+        .mPostControl = ID<Model::ControlPoint>(nodeID + 2),
+      };
+    }
+
+    mAccessor->recordChange(mID);
+  }
+
+  void undo() override
+  {
+    Model::Path* model = mAccessor->getPath(mID);
+    Model::Path::EntryList& entries = Path::entries(model);
+
+    auto first = std::next(entries.begin(), mEntryIndex);
+    entries.erase(first, std::next(first, mNodes.size()));
+
+    mAccessor->destroyNodes(mFirstID, mNodes.size());
+
+    mAccessor->recordChange(mID);
+  }
+
+  const char* description() const override
+  {
+    return "Add nodes";
+  }
+
+  size_t memoryUsage() const override
+  {
+    return sizeof(*this) + heapUsage(mNodes);
+  }
+
+private:
+  Path::Accessor* mAccessor;
+  std::vector<Path::NodeData> mNodes;
+  ID<Model::Path> mID;
+  int mEntryIndex;
+  IDValue mFirstID;
+};
+
+void Path::addNodes(int index, const std::vector<NodeData>& nodes)
+{
+  if (nodes.empty()) {
+    return;
+  }
+
+  mUndoManager->pushCommand(mUndoManager->createCommand<AddNodesCommand>(mAccessor, mID, index, nodes));
 }
 
 class AddEntryCommand : public UndoCommand
@@ -148,6 +237,8 @@ public:
     } else {
       entries.push_back(mEntry);
     }
+
+    mAccessor->recordChange(mID);
   }
 
   void undo() override
@@ -156,13 +247,20 @@ public:
     Model::Path::EntryList& entries = Path::entries(model);
 
     entries.erase(std::next(entries.begin(), mAddIndex));
+
+    mAccessor->recordChange(mID);
   }
 
-  std::string description() override
+  const char* description() const override
   {
     return "Add node";
   }
 
+  size_t memoryUsage() const override
+  {
+    return sizeof(*this);
+  }
+
 private:
   Path::Accessor* mAccessor;
   Model::Path::Entry mEntry;
@@ -172,7 +270,121 @@ private:
 
 void Path::addEntry(int index, const Model::Path::Entry& entry)
 {
-  mUndoManager->pushCommand(new AddEntryCommand(mAccessor, mID, index, entry));
+  mUndoManager->pushCommand(mUndoManager->createCommand<AddEntryCommand>(mAccessor, mID, index, entry));
+}
+
+class SplitSegmentCommand : public UndoCommand
+{
+public:
+  SplitSegmentCommand(Path::Accessor* accessor, const ID<Model::Path>& id, size_t segment, double t)
+    : mAccessor(accessor)
+    , mID(id)
+    , mEntryIndex(segment + 1)
+  {
+    const Model::Path::EntryList& entries = accessor->getPath(id)->entries();
+
+    assert(entries.size() > 1 && segment < entries.size() && t > 0 && t < 1);
+
+    mFrom = entries[segment];
+    mTo = entries[segment + 1 < entries.size() ? segment + 1 : 0];
+
+    const CubicBezier curve = {
+      accessor->getNode(mFrom.mNode)->position(), accessor->getControlPoint(mFrom.mPostControl)->position(),
+      accessor->getControlPoint(mTo.mPreControl)->position(), accessor->getNode(mTo.mNode)->position() };
+
+    CubicBezier first, second;
+    curve.split(t, &first, &second);
+
+    mOldPostControl = curve.p1;
+    mOldPreControl = curve.p2;
+    mPostControl = first.p1;
+    mPreControl = second.p2;
+    mNode = { first.p3, first.p2, second.p1, NodeType::Smooth };
+
+    // Shortening the neighbouring control points would break a symmetric node's symmetry, so those nodes become
+    // smooth instead, which keeps the shape of their other segments
+    mOldFromType = accessor->getNode(mFrom.mNode)->type();
+    mOldToType = accessor->getNode(mTo.mNode)->type();
+
+    mNewEntry = {
+      .mNode = accessor->nextID<Model::Node>(),
+      .mPreControl = accessor->nextID<Model::ControlPoint>(),
+      .mPostControl = accessor->nextID<Model::ControlPoint>(),
+    };
+  }
+
+  void redo() override
+  {
+    mAccessor->createNode(mNewEntry.mNode, mNode.mPosition, mNode.mType);
+    mAccessor->createControlPoint(mNewEntry.mPreControl, mNewEntry.mNode, mNode.mPreControl);
+    mAccessor->createControlPoint(mNewEntry.mPostControl, mNewEntry.mNode, mNode.mPostControl);
+
+    Model::Path::EntryList& entries = Path::entries(mAccessor->getPath(mID));
+    entries.insert(std::next(entries.begin(), mEntryIndex), mNewEntry);
+
+    update(mPostControl, mPreControl, smoothed(mOldFromType), smoothed(mOldToType));
+  }
+
+  void undo() override
+  {
+    Model::Path::EntryList& entries = Path::entries(mAccessor->getPath(mID));
+    entries.erase(std::next(entries.begin(), mEntryIndex));
+
+    mAccessor->destroyNode(mNewEntry.mNode);
+    mAccessor->destroyControlPoint(mNewEntry.mPreControl);
+    mAccessor->destroyControlPoint(mNewEntry.mPostControl);
+
+    update(mOldPostControl, mOldPreControl, mOldFromType, mOldToType);
+  }
+
+  const char* description() const override
+  {
+    return "Add node";
+  }
+
+  size_t memoryUsage() const override
+  {
+    return sizeof(*this);
+  }
+
+private:
+  static NodeType smoothed(NodeType type)
+  {
+    return type == NodeType::Symmetric ? NodeType::Smooth : type;
+  }
+
+  void update(const Point& postControl, const Point& preControl, NodeType fromType, NodeType toType)
+  {
+    ControlPoint::position(mAccessor->getControlPoint(mFrom.mPostControl)) = postControl;
+    ControlPoint::position(mAccessor->getControlPoint(mTo.mPreControl)) = preControl;
+    Node::type(mAccessor->getNode(mFrom.mNode)) = fromType;
+    Node::type(mAccessor->getNode(mTo.mNode)) = toType;
+
+    mAccessor->recordChange(mFrom.mPostControl);
+    mAccessor->recordChange(mTo.mPreControl);
+    mAccessor->recordChange(mFrom.mNode);
+    mAccessor->recordChange(mTo.mNode);
+    mAccessor->recordChange(mID);
+  }
+
+  Path::Accessor* mAccessor;
+  ID<Model::Path> mID;
+  size_t mEntryIndex;
+  Model::Path::Entry mFrom;
+  Model::Path::Entry mTo;
+  Model::Path::Entry mNewEntry;
+  Path::NodeData mNode;
+  Point mPostControl;
+  Point mPreControl;
+  Point mOldPostControl;
+  Point mOldPreControl;
+  NodeType mOldFromType;
+  NodeType mOldToType;
+};
+
+void Path::splitSegment(size_t segment, double t)
+{
+  mUndoManager->pushCommand(mUndoManager->createCommand<SplitSegmentCommand>(mAccessor, mID, segment, t));
 }
 
 class RemoveEntryCommand : public UndoCommand
@@ -192,6 +404,8 @@ public:
     Model::Path::EntryList& entries = Path::entries(model);
 
     entries.erase(std::next(entries.begin(), mRemoveIndex));
+
+    mAccessor->recordChange(mID);
   }
 
   void undo() override
@@ -200,13 +414,20 @@ public:
     Model::Path::EntryList& entries = Path::entries(model);
 
     entries.insert(std::next(entries.begin(), mRemoveIndex), mEntry);
+
+    mAccessor->recordChange(mID);
   }
 
-  std::string description() override
+  const char* description() const override
   {
     return "Remove path entry";
   }
 
+  size_t memoryUsage() const override
+  {
+    return sizeof(*this);
+  }
+
 private:
   Path::Accessor* mAccessor;
   Model::Path::Entry mEntry;
@@ -216,7 +437,7 @@ private:
 
 void Path::removeEntry(int index)
 {
-  mUndoManager->pushCommand(new RemoveEntryCommand(mAccessor, mID, index));
+  mUndoManager->pushCommand(mUndoManager->createCommand<RemoveEntryCommand>(mAccessor, mID, index));
 }
 
 void Path::setStrokeColour(const Colour& colour)
@@ -226,8 +447,14 @@ void Path::setStrokeColour(const Colour& colour)
   auto oldColour = accessor->getPath(id)->mStrokeColour;
 
   mUndoManager->pushCommand(
-      [=]() { accessor->getPath(id)->mStrokeColour = colour; },
-      [=]() { accessor->getPath(id)->mStrokeColour = oldColour; },
+      [=]() {
+        accessor->getPath(id)->mStrokeColour = colour;
+        accessor->recordChange(id);
+      },
+      [=]() {
+        accessor->getPath(id)->mStrokeColour = oldColour;
+        accessor->recordChange(id);
+      },
       "Set stroke colour");
 }
 
@@ -243,11 +470,13 @@ void Path::setFillColour(const Colour& colour)
         Model::Path* path = accessor->getPath(id);
         path->mFillColour = colour;
         path->mFlags |= Model::Path::Flag_Filled;
+        accessor->recordChange(id);
       },
       [=]() {
         Model::Path* path = accessor->getPath(id);
         path->mFillColour = oldColour;
         path->mFlags = oldFlags;
+        accessor->recordChange(id);
       },
       "Set fill colour");
 }
@@ -264,8 +493,14 @@ void Path::setClosed(bool closed)
   auto id = mID;
 
   mUndoManager->pushCommand(
-      [newFlags, accessor, id]() { accessor->getPath(id)->mFlags = newFlags; },
-      [oldFlags, accessor, id]() { accessor->getPath(id)->mFlags = oldFlags; },
+      [newFlags, accessor, id]() {
+        accessor->getPath(id)->mFlags = newFlags;
+        accessor->recordChange(id);
+      },
+      [oldFlags, accessor, id]() {
+        accessor->getPath(id)->mFlags = oldFlags;
+        accessor->recordChange(id);
+      },
       "Close path");
 }
 
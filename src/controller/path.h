@@ -2,8 +2,11 @@
 
 #include "model/node.h"
 #include "model/path.h"
+#include "model/reference.h"
 #include "utilities/geometry.h"
 
+#include <vector>
+
 namespace Controller
 {
 
@@ -12,6 +15,15 @@ class UndoManager;
 class Path
 {
 public:
+  // A node to be added along with its control points, for building paths in bulk
+  struct NodeData
+  {
+    Point mPosition;
+    Point mPreControl;
+    Point mPostControl;
+    Model::Node::Type mType;
+  };
+
   class Accessor
   {
   public:
@@ -22,12 +34,20 @@ public:
     }
 
     virtual IDValue nextID() = 0;
+    // Reserves a contiguous block of IDs, returning the first of them
+    virtual IDValue reserveIDs(IDValue count) = 0;
     virtual void createNode(const ID<Model::Node>& id, const Point& position, Model::Node::Type type) = 0;
     virtual void destroyNode(const ID<Model::Node>& id) = 0;
+    // Nodes created in bulk take three IDs each from the first, for the node and then its two control points
+    virtual void createNodes(IDValue firstID, const std::vector<NodeData>& nodes) = 0;
+    virtual void destroyNodes(IDValue firstID, size_t count) = 0;
     virtual void createControlPoint(const ID<Model::ControlPoint>& id, const ID<Model::Node>& node,
       const Point& position) = 0;
     virtual void destroyControlPoint(const ID<Model::ControlPoint>& controlPoint) = 0;
     virtual Model::Path* getPath(const ID<Model::Path>& id) = 0;
+    virtual Model::Node* getNode(const ID<Model::Node>& id) = 0;
+    virtual Model::ControlPoint* getControlPoint(const ID<Model::ControlPoint>& id) = 0;
+    virtual void recordChange(const Model::Reference& reference) = 0;
   };
 
   Path(UndoManager* undoManager, Accessor* accessor, const ID<Model::Path>& id);
@@ -35,8 +55,14 @@ public:
   void addSymmetricNode(int index, const Point& position, const Point& controlA);
   void addSmoothNode(int index, const Point& position, const Point& controlA, double lengthB);
   void addSharpNode(int index, const Point& position);
+  // Adds all of the nodes before the given index as one undo step, which is much quicker than adding them one at a
+  // time for importers and generators
+  void addNodes(int index, const std::vector<NodeData>& nodes);
 
   void addEntry(int index, const Model::Path::Entry& entry);
+  // Adds a smooth node at the parameter along the segment that starts at the given entry, moving the segment's
+  // control points so that the path keeps its shape, as one undo step
+  void splitSegment(size_t segment, double t);
   void removeEntry(int index);
   void setStrokeColour(const Colour& colour);
   void setFillColour(const Colour& colour);
@@ -45,8 +71,12 @@ public:
 
 private:
   friend class AddNodeCommand;
+  friend class AddNodesCommand;
   friend class AddEntryCommand;
   friend class RemoveEntryCommand;
+  friend class RemoveSelectionCommand;
+  friend class SimplifySelectionCommand;
+  friend class SplitSegmentCommand;
 
   static Model::Path::EntryList& entries(Model::Path* path);
 
@@ -1,46 +1,76 @@
 #include "controller/selection.h"
 
+#include "model/controlpoint.h"
 #include "model/node.h"
 #include "model/path.h"
 #include "model/sketch.h"
+#include "utilities/colour.h"
+
+#include <algorithm>
+#include <numeric>
 
 namespace Controller
 {
 
 using Reference = Model::Reference;
 
-bool Selection::contains(const Reference& reference) const
+namespace
+{
+
+// Every type of ID has the same kind of value
+IDValue idValue(const Reference& reference)
 {
-  return mReferences.count(reference) > 0;
+  return reference.id<Model::Node>().value();
+}
+
 }
 
-bool Selection::contains(Model::Type type) const
+void Selection::clear()
 {
-  for (auto& reference : mReferences) {
-    if (reference.type() == type) {
-      return true;
-    }
+  for (auto& ids : mSets) {
+    ids.reset();
   }
+}
 
-  return false;
+bool Selection::isEmpty() const
+{
+  return size() == 0;
 }
 
-int Selection::count(Model::Type type) const
+int Selection::size() const
 {
   int result = 0;
 
-  for (auto& reference : mReferences) {
-    if (reference.type() == type) {
-      ++result;
-    }
+  for (auto& ids : mSets) {
+    result += ids ? ids->mCount : 0;
   }
 
   return result;
 }
 
+bool Selection::contains(const Reference& reference) const
+{
+  if (reference.type() == Model::Type::Null) {
+    return false;
+  }
+
+  const IDSet* ids = mSets[static_cast<int>(reference.type())].get();
+  return ids && ids->contains(idValue(reference));
+}
+
+int Selection::count(Model::Type type) const
+{
+  if (type == Model::Type::Null) {
+    return 0;
+  }
+
+  const IDSet* ids = mSets[static_cast<int>(type)].get();
+  return ids ? ids->mCount : 0;
+}
+
 void Selection::add(const Reference& reference, const Model::Sketch* sketch)
 {
-  mReferences.insert(reference);
+  insert(reference);
 
   switch (reference.type()) {
     case Model::Type::Path:
@@ -58,12 +88,14 @@ void Selection::add(const Reference& reference, const Model::Sketch* sketch)
         const Model::Node* node = sketch->node(reference.id<Model::Node>());
 
         for (auto id : node->controlPoints()) {
-          add(id, sketch);
+          insert(id);
         }
 
         break;
       }
     case Model::Type::ControlPoint:
+    case Model::Type::Sketch:
+    case Model::Type::Instance:
     case Model::Type::Null:
       break;
   }
@@ -71,7 +103,7 @@ void Selection::add(const Reference& reference, const Model::Sketch* sketch)
 
 void Selection::remove(const Reference& reference, const Model::Sketch* sketch)
 {
-  mReferences.erase(reference);
+  erase(reference);
 
   switch (reference.type()) {
     case Model::Type::Path:
@@ -89,15 +121,349 @@ void Selection::remove(const Reference& reference, const Model::Sketch* sketch)
         const Model::Node* node = sketch->node(reference.id<Model::Node>());
 
         for (auto id : node->controlPoints()) {
-          remove(id, sketch);
+          erase(id);
         }
 
         break;
       }
     case Model::Type::ControlPoint:
+    case Model::Type::Sketch:
+    case Model::Type::Instance:
     case Model::Type::Null:
       break;
   }
 }
 
+void Selection::insert(const Reference& reference)
+{
+  if (reference.type() == Model::Type::Null) {
+    return;
+  }
+
+  // Checking first means that selecting something twice doesn't copy a shared set
+  if (contains(reference)) {
+    return;
+  }
+
+  IDSet* ids = mutableSet(reference.type());
+  IDValue value = idValue(reference);
+
+  if (value / WordBits >= ids->mWords.size()) {
+    ids->mWords.resize(std::max<size_t>(value / WordBits + 1, ids->mWords.size() * 2));
+  }
+
+  ids->mWords[value / WordBits] |= uint64_t(1) << (value % WordBits);
+  ++ids->mCount;
+}
+
+void Selection::erase(const Reference& reference)
+{
+  if (!contains(reference)) {
+    return;
+  }
+
+  IDSet* ids = mutableSet(reference.type());
+  IDValue value = idValue(reference);
+
+  ids->mWords[value / WordBits] &= ~(uint64_t(1) << (value % WordBits));
+  --ids->mCount;
+}
+
+void Selection::unite(const Selection& other)
+{
+  for (int type = 0; type < TypeCount; ++type) {
+    const IDSet* otherIDs = other.mSets[type].get();
+
+    if (!otherIDs || otherIDs->mCount == 0 || mSets[type] == other.mSets[type]) {
+      continue;
+    }
+
+    if (!mSets[type] || mSets[type]->mCount == 0) {
+      mSets[type] = other.mSets[type];
+      continue;
+    }
+
+    IDSet* ids = mutableSet(static_cast<Model::Type>(type));
+    ids->mWords.resize(std::max(ids->mWords.size(), otherIDs->mWords.size()));
+
+    for (size_t i = 0; i < otherIDs->mWords.size(); ++i) {
+      ids->mWords[i] |= otherIDs->mWords[i];
+    }
+
+    ids->updateCount();
+  }
+}
+
+void Selection::intersect(const Selection& other)
+{
+  for (int type = 0; type < TypeCount; ++type) {
+    if (!mSets[type] || mSets[type] == other.mSets[type]) {
+      continue;
+    }
+
+    const IDSet* otherIDs = other.mSets[type].get();
+
+    if (!otherIDs) {
+      mSets[type].reset();
+      continue;
+    }
+
+    IDSet* ids = mutableSet(static_cast<Model::Type>(type));
+    ids->mWords.resize(std::min(ids->mWords.size(), otherIDs->mWords.size()));
+
+    for (size_t i = 0; i < ids->mWords.size(); ++i) {
+      ids->mWords[i] &= otherIDs->mWords[i];
+    }
+
+    ids->updateCount();
+  }
+}
+
+void Selection::subtract(const Selection& other)
+{
+  for (int type = 0; type < TypeCount; ++type) {
+    const IDSet* otherIDs = other.mSets[type].get();
+
+    if (!mSets[type] || !otherIDs || otherIDs->mCount == 0) {
+      continue;
+    }
+
+    if (mSets[type] == other.mSets[type]) {
+      mSets[type].reset();
+      continue;
+    }
+
+    IDSet* ids = mutableSet(static_cast<Model::Type>(type));
+    size_t size = std::min(ids->mWords.size(), otherIDs->mWords.size());
+
+    for (size_t i = 0; i < size; ++i) {
+      ids->mWords[i] &= ~otherIDs->mWords[i];
+    }
+
+    ids->updateCount();
+  }
+}
+
+template <class TModel, class T_Predicate>
+void Selection::insertWhere(Model::Type type, const Model::Sketch::Accessor<TModel>& elements,
+  T_Predicate predicate)
+{
+  IDSet* ids = nullptr;
+
+  for (auto& [id, element] : elements) {
+    if (!predicate(id, element)) {
+      continue;
+    }
+
+    // The set is only made unshared once there's something to add to it
+    if (!ids) {
+      ids = mutableSet(type);
+    }
+
+    IDValue value = id.value();
+
+    if (value / WordBits >= ids->mWords.size()) {
+      ids->mWords.resize(std::max<size_t>(value / WordBits + 1, ids->mWords.size() * 2));
+    }
+
+    ids->mWords[value / WordBits] |= uint64_t(1) << (value % WordBits);
+  }
+
+  if (ids) {
+    ids->updateCount();
+  }
+}
+
+void Selection::selectAll(const Model::Sketch* sketch)
+{
+  auto all = [](const auto&, const auto*) { return true; };
+
+  insertWhere(Model::Type::Path, sketch->paths(), all);
+  insertWhere(Model::Type::Node, sketch->nodes(), all);
+  insertWhere(Model::Type::ControlPoint, sketch->controlPoints(), all);
+  insertWhere(Model::Type::Sketch, sketch->sketches(), all);
+  insertWhere(Model::Type::Instance, sketch->instances(), all);
+}
+
+void Selection::invert(const Model::Sketch* sketch)
+{
+  // The elements that aren't selected become the new selection, so nothing else carries over
+  Selection inverted;
+
+  auto unselected = [this](Model::Type type)
+  {
+    const IDSet* ids = mSets[static_cast<int>(type)].get();
+
+    return [ids](const auto& id, const auto*) { return !ids || !ids->contains(id.value()); };
+  };
+
+  inverted.insertWhere(Model::Type::Path, sketch->paths(), unselected(Model::Type::Path));
+  inverted.insertWhere(Model::Type::Node, sketch->nodes(), unselected(Model::Type::Node));
+  inverted.insertWhere(Model::Type::ControlPoint, sketch->controlPoints(), unselected(Model::Type::ControlPoint));
+  inverted.insertWhere(Model::Type::Sketch, sketch->sketches(), unselected(Model::Type::Sketch));
+  inverted.insertWhere(Model::Type::Instance, sketch->instances(), unselected(Model::Type::Instance));
+
+  *this = std::move(inverted);
+}
+
+void Selection::selectByStrokeColour(const Model::Sketch* sketch, const Colour& colour)
+{
+  for (auto& [id, path] : sketch->paths()) {
+    if (path->strokeColour() == colour) {
+      add(id, sketch);
+    }
+  }
+}
+
+void Selection::selectByFillColour(const Model::Sketch* sketch, const Colour& colour)
+{
+  for (auto& [id, path] : sketch->paths()) {
+    if (path->isFilled() && path->fillColour() == colour) {
+      add(id, sketch);
+    }
+  }
+}
+
+void Selection::selectConnected(const Model::Sketch* sketch)
+{
+  // Paths that share nodes are joined into groups, with a representative node for each group, indexed by ID value
+  IDValue maxNodeValue = 0;
+
+  for (auto& [id, node] : sketch->nodes()) {
+    maxNodeValue = std::max(maxNodeValue, id.value());
+  }
+
+  std::vector<IDValue> representatives(maxNodeValue + 1);
+  std::iota(representatives.begin(), representatives.end(), 0);
+
+  auto find = [&representatives](IDValue value)
+  {
+    while (representatives[value] != value) {
+      representatives[value] = representatives[representatives[value]];
+      value = representatives[value];
+    }
+
+    return value;
+  };
+
+  for (auto& [id, path] : sketch->paths()) {
+    const Model::Path::EntryList& entries = path->entries();
+
+    for (size_t i = 1; i < entries.size(); ++i) {
+      representatives[find(entries[i].mNode.value())] = find(entries[0].mNode.value());
+    }
+  }
+
+  // Selected paths and control points count through their nodes
+  std::vector<bool> selectedGroups(representatives.size());
+
+  forEach(Model::Type::Node,
+    [&](const Reference& reference)
+    {
+      if (idValue(reference) <= maxNodeValue) {
+        selectedGroups[find(idValue(reference))] = true;
+      }
+    });
+
+  forEach(Model::Type::ControlPoint,
+    [&](const Reference& reference)
+    {
+      const Model::ControlPoint* controlPoint = sketch->controlPoint(reference.id<Model::ControlPoint>());
+      selectedGroups[find(controlPoint->node().value())] = true;
+    });
+
+  forEachPathID(
+    [&](const ID<Model::Path>& id)
+    {
+      const Model::Path::EntryList& entries = sketch->path(id)->entries();
+
+      if (!entries.empty()) {
+        selectedGroups[find(entries[0].mNode.value())] = true;
+      }
+    });
+
+  for (auto& [id, path] : sketch->paths()) {
+    const Model::Path::EntryList& entries = path->entries();
+
+    if (!entries.empty() && selectedGroups[find(entries[0].mNode.value())]) {
+      add(id, sketch);
+    }
+  }
+}
+
+bool Selection::operator==(const Selection& other) const
+{
+  for (int type = 0; type < TypeCount; ++type) {
+    const IDSet* ids = mSets[type].get();
+    const IDSet* otherIDs = other.mSets[type].get();
+
+    if (ids == otherIDs) {
+      continue;
+    }
+
+    int count = ids ? ids->mCount : 0;
+
+    if (count != (otherIDs ? otherIDs->mCount : 0)) {
+      return false;
+    }
+
+    if (count == 0) {
+      continue;
+    }
+
+    // Either set may have trailing words that are empty
+    size_t size = std::min(ids->mWords.size(), otherIDs->mWords.size());
+
+    if (!std::equal(ids->mWords.begin(), ids->mWords.begin() + size, otherIDs->mWords.begin())) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+void Selection::IDSet::updateCount()
+{
+  mCount = 0;
+
+  for (uint64_t word : mWords) {
+    mCount += countBits(word);
+  }
+}
+
+int Selection::lowestBit(uint64_t word)
+{
+  // Isolating the lowest bit and multiplying by a de Bruijn sequence gives a unique index for each bit
+  static const int Positions[WordBits] = {
+    0, 1, 48, 2, 57, 49, 28, 3, 61, 58, 50, 42, 38, 29, 17, 4,
+    62, 55, 59, 36, 53, 51, 43, 22, 45, 39, 33, 30, 24, 18, 12, 5,
+    63, 47, 56, 27, 60, 41, 37, 16, 54, 35, 52, 21, 44, 32, 23, 11,
+    46, 26, 40, 15, 34, 20, 31, 10, 25, 14, 19, 9, 13, 8, 7, 6,
+  };
+
+  return Positions[((word & (~word + 1)) * 0x03f79d71b4cb0a89) >> 58];
+}
+
+int Selection::countBits(uint64_t word)
+{
+  word = word - ((word >> 1) & 0x5555555555555555);
+  word = (word & 0x3333333333333333) + ((word >> 2) & 0x3333333333333333);
+  word = (word + (word >> 4)) & 0x0f0f0f0f0f0f0f0f;
+
+  return static_cast<int>((word * 0x0101010101010101) >> 56);
+}
+
+Selection::IDSet* Selection::mutableSet(Model::Type type)
+{
+  std::shared_ptr<IDSet>& ids = mSets[static_cast<int>(type)];
+
+  if (!ids) {
+    ids = std::make_shared<IDSet>();
+  } else if (ids.use_count() > 1) {
+    ids = std::make_shared<IDSet>(*ids);
+  }
+
+  return ids.get();
+}
+
 }
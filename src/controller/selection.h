@@ -3,76 +3,157 @@
 #include "model/reference.h"
 #include "model/sketch.h"
 
-#include <set>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+class Colour;
 
 namespace Controller
 {
 
-struct Selection
+// The selected elements of a sketch, held as a bit for each ID value of each type of element. The bits are shared
+// between copies of a selection until one of them changes, so selections are cheap to copy.
+class Selection
 {
-  void clear()
-  {
-    mReferences.clear();
-  }
+public:
+  void clear();
+  bool isEmpty() const;
+  int size() const;
 
   bool contains(const Model::Reference& reference) const;
-  bool contains(Model::Type type) const;
+  bool contains(Model::Type type) const { return count(type) > 0; }
   int count(Model::Type type) const;
 
+  // Adding or removing a path does the same to its nodes, and a node to its control points
   void add(const Model::Reference& reference, const Model::Sketch* sketch);
   void remove(const Model::Reference& reference, const Model::Sketch* sketch);
+  // Adds or removes just the element itself
+  void insert(const Model::Reference& reference);
+  void erase(const Model::Reference& reference);
+
+  void unite(const Selection& other);
+  void intersect(const Selection& other);
+  void subtract(const Selection& other);
+
+  // Each of these is a single pass over the sketch's elements
+  void selectAll(const Model::Sketch* sketch);
+  // Selects exactly the elements that weren't selected
+  void invert(const Model::Sketch* sketch);
+  // Adds the paths with the given colour, along with their nodes. Only filled paths have a fill colour.
+  void selectByStrokeColour(const Model::Sketch* sketch, const Colour& colour);
+  void selectByFillColour(const Model::Sketch* sketch, const Colour& colour);
+  // Adds every path that shares a node with the selection, directly or through other paths
+  void selectConnected(const Model::Sketch* sketch);
 
+  // Visits the selected elements by type, and then in ID order
   template <class T_Callback>
-  void forEachPathID(T_Callback callback) const
+  void forEach(T_Callback callback) const
   {
-    for (const Model::Reference& reference : mReferences) {
-      if (reference.type() == Model::Type::Path) {
-        callback(reference.id<Model::Path>());
+    for (int type = 0; type < TypeCount; ++type) {
+      forEach(static_cast<Model::Type>(type), callback);
+    }
+  }
+
+  template <class T_Callback>
+  void forEach(Model::Type type, T_Callback callback) const
+  {
+    const IDSet* ids = mSets[static_cast<int>(type)].get();
+
+    if (!ids) {
+      return;
+    }
+
+    for (size_t i = 0; i < ids->mWords.size(); ++i) {
+      for (uint64_t word = ids->mWords[i]; word != 0; word &= word - 1) {
+        callback(Model::Reference(type, i * WordBits + lowestBit(word)));
       }
     }
   }
 
+  template <class T_Callback>
+  void forEachPathID(T_Callback callback) const
+  {
+    forEach(Model::Type::Path,
+      [&callback](const Model::Reference& reference)
+      {
+        callback(reference.id<Model::Path>());
+      });
+  }
+
   template <class T_Callback>
   void forEachNode(const Model::Sketch* sketch, T_Callback callback) const
   {
-    for (const Model::Reference& reference : mReferences) {
-      if (reference.type() == Model::Type::Node) {
+    forEach(Model::Type::Node,
+      [sketch, &callback](const Model::Reference& reference)
+      {
         callback(sketch->node(reference.id<Model::Node>()));
-      }
-    }
+      });
   }
 
   template <class T_Callback>
   void forEachControlPoint(const Model::Sketch* sketch, T_Callback callback) const
   {
-    for (const Model::Reference& reference : mReferences) {
-      if (reference.type() == Model::Type::ControlPoint) {
+    forEach(Model::Type::ControlPoint,
+      [sketch, &callback](const Model::Reference& reference)
+      {
         callback(sketch->controlPoint(reference.id<Model::ControlPoint>()));
-      }
-    }
+      });
   }
 
   template <class T_Callback>
   void forEachSubSketch(const Model::Sketch* sketch, T_Callback callback) const
   {
-    for (const Model::Reference& reference : mReferences) {
-      if (reference.type() == Model::Type::Sketch) {
+    forEach(Model::Type::Sketch,
+      [sketch, &callback](const Model::Reference& reference)
+      {
         callback(sketch->sketch(reference.id<Model::Sketch>()));
-      }
-    }
+      });
   }
 
-  bool operator==(const Selection& other) const
+  template <class T_Callback>
+  void forEachInstance(const Model::Sketch* sketch, T_Callback callback) const
   {
-    return mReferences == other.mReferences;
+    forEach(Model::Type::Instance,
+      [sketch, &callback](const Model::Reference& reference)
+      {
+        callback(sketch->instance(reference.id<Model::Instance>()));
+      });
   }
 
-  bool isEmpty() const
+  bool operator==(const Selection& other) const;
+
+private:
+  static const int TypeCount = static_cast<int>(Model::Type::Null);
+  static const int WordBits = 64;
+
+  struct IDSet
   {
-    return mReferences.empty();
-  }
+    IDSet()
+      : mCount(0)
+    {}
+
+    bool contains(IDValue value) const
+    {
+      return value / WordBits < mWords.size() && (mWords[value / WordBits] & (uint64_t(1) << (value % WordBits)));
+    }
+
+    void updateCount();
+
+    std::vector<uint64_t> mWords;
+    int mCount;
+  };
+
+  static int lowestBit(uint64_t word);
+  static int countBits(uint64_t word);
+
+  // Returns a set that isn't shared with any other selection, so that it can be changed
+  IDSet* mutableSet(Model::Type type);
+
+  template <class TModel, class T_Predicate>
+  void insertWhere(Model::Type type, const Model::Sketch::Accessor<TModel>& elements, T_Predicate predicate);
 
-  std::set<Model::Reference> mReferences;
+  std::shared_ptr<IDSet> mSets[TypeCount];
 };
 
 }
@@ -5,9 +5,15 @@
 #include "controller/undo.h"
 #include "model/controlpoint.h"
 #include "model/document.h"
+#include "model/instance.h"
+#include "utilities/curvefitting.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cstring>
 #include <map>
+#include <memory>
+#include <set>
 
 namespace Controller
 {
@@ -18,6 +24,24 @@ Sketch::Sketch(UndoManager *undoManager, Model::Sketch* model)
 {
 }
 
+void Sketch::beginTransaction()
+{
+  journal().beginBatch();
+  mUndoManager->beginTransaction();
+}
+
+void Sketch::commitTransaction()
+{
+  mUndoManager->commitTransaction();
+  journal().endBatch();
+}
+
+void Sketch::rollbackTransaction()
+{
+  mUndoManager->rollbackTransaction();
+  journal().endBatch();
+}
+
 ID<Model::Path> Sketch::addPath()
 {
   ID<Model::Path> id = Path::Accessor::nextID<Model::Path>();
@@ -26,11 +50,15 @@ ID<Model::Path> Sketch::addPath()
     [this, id]() {
       mModel->mPaths[id] = new Model::Path;
       mModel->mDrawOrder.push_back(id);
+      recordChange(id);
+      recordChange(Model::Reference());
     },
     [this, id]() {
       delete mModel->mPaths.at(id);
       mModel->mPaths.erase(id);
       mModel->mDrawOrder.pop_back();
+      recordChange(id);
+      recordChange(Model::Reference());
     },
     "Add path");
 
@@ -52,104 +80,53 @@ ControlPoint Sketch::controllerForControlPoint(const ID<Model::ControlPoint>& id
   return ControlPoint(mUndoManager, this, id);
 }
 
-class MoveSelectionCommand : public UndoManager::AutoIDCommand<MoveSelectionCommand>
+class TransformSelectionCommand : public UndoManager::AutoIDCommand<TransformSelectionCommand>
 {
 public:
-  MoveSelectionCommand(Sketch* sketch, const Selection& selection, const Vector& offset)
+  TransformSelectionCommand(Sketch* sketch, const std::shared_ptr<const Selection>& selection,
+    const Transform& transform, const char* description)
     : mSketch(sketch)
     , mSelection(selection)
+    , mTransform(transform)
+    , mDescription(description)
   {
-    const int PointCount = mSelection.count(Model::Type::Node)
-      + mSelection.count(Model::Type::ControlPoint);
-
-    mOrigins.reserve(PointCount);
-    mDestinations.reserve(PointCount);
-
-    mSelection.forEachNode(mSketch->mModel,
-      [this, &offset](Model::Node* node)
-      {
-        mOrigins.push_back(node->position());
-        mDestinations.push_back(node->position() + offset);
-      });
-
-    mSelection.forEachControlPoint(mSketch->mModel,
-      [this, &offset](Model::ControlPoint* point)
-      {
-        mOrigins.push_back(point->position());
-        mDestinations.push_back(point->position() + offset);
-      });
-
-    mSelection.forEachSubSketch(mSketch->mModel,
-      [this, &offset](Model::Sketch* sketch)
-      {
-        mOrigins.push_back(sketch->position());
-        mDestinations.push_back(sketch->position() + offset);
-      });
   }
 
   void redo() override
   {
-    auto pointIterator = mDestinations.begin();
-
-    mSelection.forEachNode(mSketch->mModel,
-      [this, &pointIterator](Model::Node* node)
-      {
-        Node::position(node) = *pointIterator;
-        ++pointIterator;
-      });
-
-    mSelection.forEachControlPoint(mSketch->mModel,
-      [this, &pointIterator](Model::ControlPoint* point)
-      {
-        ControlPoint::position(point) = *pointIterator;
-        ++pointIterator;
-      });
-
-    mSelection.forEachSubSketch(mSketch->mModel,
-      [this, &pointIterator](Model::Sketch* sketch)
-      {
-        Sketch::position(sketch) = *pointIterator;
-        ++pointIterator;
-      });
+    // Positions are put back exactly as they were rather than transformed back, which would leave them slightly
+    // off and couldn't undo a transform that isn't invertible
+    if (mNewPositions.empty()) {
+      mSketch->applyTransform(*mSelection, mTransform, &mOldPositions);
+    } else {
+      mSketch->setPositions(*mSelection, mNewPositions, nullptr);
+    }
   }
 
   void undo() override
   {
-    auto pointIterator = mOrigins.begin();
-
-    mSelection.forEachNode(mSketch->mModel,
-      [this, &pointIterator](Model::Node* node)
-      {
-        Node::position(node) = *pointIterator;
-        ++pointIterator;
-      });
-
-    mSelection.forEachControlPoint(mSketch->mModel,
-      [this, &pointIterator](Model::ControlPoint* point)
-      {
-        ControlPoint::position(point) = *pointIterator;
-        ++pointIterator;
-      });
+    mSketch->setPositions(*mSelection, mOldPositions, &mNewPositions);
+  }
 
-    mSelection.forEachSubSketch(mSketch->mModel,
-      [this, &pointIterator](Model::Sketch* sketch)
-      {
-        Sketch::position(sketch) = *pointIterator;
-        ++pointIterator;
-      });
+  const char* description() const override
+  {
+    return mDescription;
   }
 
-  std::string description() override
+  // The selection is shared with the other steps of the same drag, so it isn't counted here
+  size_t memoryUsage() const override
   {
-    return "Move selection";
+    return sizeof(*this) + (mOldPositions.capacity() + mNewPositions.capacity()) * sizeof(Point);
   }
 
   bool mergeWith(UndoCommand* other) override
   {
-    MoveSelectionCommand* command = static_cast<MoveSelectionCommand*>(other);
+    TransformSelectionCommand* command = static_cast<TransformSelectionCommand*>(other);
 
-    if (command->mSketch == mSketch && command->mSelection == mSelection) {
-      mDestinations = std::move(command->mDestinations);
+    // The merged command's positions are already in the model, and this one's from before the drag are kept
+    if (command->mSketch == mSketch && command->mSelection == mSelection
+      && std::strcmp(command->mDescription, mDescription) == 0) {
+      mTransform = command->mTransform * mTransform;
       return true;
     } else {
       return false;
@@ -158,14 +135,163 @@ public:
 
 private:
   Sketch* mSketch;
-  Selection mSelection;
-  std::vector<Point> mOrigins;
-  std::vector<Point> mDestinations;
+  std::shared_ptr<const Selection> mSelection;
+  Transform mTransform;
+  const char* mDescription;
+  // The selection's positions in the order that they're resolved in, from before the transform and, once it's been
+  // undone, from after it
+  std::vector<Point> mOldPositions;
+  std::vector<Point> mNewPositions;
 };
 
 void Sketch::moveSelection(const Selection& selection, const Vector& offset)
 {
-  mUndoManager->pushCommand(new MoveSelectionCommand(this, selection, offset));
+  transformSelection(selection, Transform::translation(offset), "Move selection");
+}
+
+void Sketch::scaleSelection(const Selection& selection, const Point& centre, double scaleX, double scaleY)
+{
+  transformSelection(selection, Transform::scale(centre, scaleX, scaleY), "Scale selection");
+}
+
+void Sketch::rotateSelection(const Selection& selection, const Point& centre, double angle)
+{
+  transformSelection(selection, Transform::rotation(centre, angle), "Rotate selection");
+}
+
+void Sketch::transformSelection(const Selection& selection, const Transform& transform, const char* description)
+{
+  // Successive steps of a drag move the same selection, so they share one copy of it
+  if (!mTransformSelection || !(*mTransformSelection == selection)) {
+    mTransformSelection = std::make_shared<const Selection>(selection);
+  }
+
+  mUndoManager->pushCommand(
+    mUndoManager->createCommand<TransformSelectionCommand>(this, mTransformSelection, transform, description));
+}
+
+Rectangle Sketch::selectionBounds(const Selection& selection)
+{
+  std::vector<Point*> targets;
+  resolvePositions(selection, &targets, nullptr);
+
+  if (targets.empty()) {
+    return { 0, 0, 0, 0 };
+  }
+
+  Rectangle bounds = { targets[0]->x, targets[0]->y, targets[0]->x, targets[0]->y };
+
+  for (Point* target : targets) {
+    bounds.grow({ target->x, target->y, target->x, target->y });
+  }
+
+  return bounds;
+}
+
+void Sketch::resolvePositions(const Selection& selection, std::vector<Point*>* targets,
+  std::vector<Model::Reference>* references)
+{
+  // Selected paths stand for all of their nodes and control points, which may also be selected themselves
+  std::vector<Model::Reference> resolved;
+  resolved.reserve(selection.size());
+
+  selection.forEach(
+    [this, &resolved](const Model::Reference& reference)
+    {
+      if (reference.type() == Model::Type::Path) {
+        for (const Model::Path::Entry& entry : mModel->path(reference.id<Model::Path>())->entries()) {
+          resolved.push_back(entry.mNode);
+          resolved.push_back(entry.mPreControl);
+          resolved.push_back(entry.mPostControl);
+        }
+      } else {
+        resolved.push_back(reference);
+      }
+    });
+
+  if (selection.contains(Model::Type::Path)) {
+    std::sort(resolved.begin(), resolved.end());
+    resolved.erase(std::unique(resolved.begin(), resolved.end()), resolved.end());
+  }
+
+  targets->reserve(resolved.size());
+
+  for (const Model::Reference& reference : resolved) {
+    switch (reference.type()) {
+      case Model::Type::Node:
+        targets->push_back(&Node::position(mModel->node(reference.id<Model::Node>())));
+        break;
+      case Model::Type::ControlPoint:
+        targets->push_back(&ControlPoint::position(mModel->controlPoint(reference.id<Model::ControlPoint>())));
+        break;
+      case Model::Type::Sketch:
+        targets->push_back(&position(mModel->sketch(reference.id<Model::Sketch>())));
+        break;
+      case Model::Type::Instance:
+        targets->push_back(&position(mModel->instance(reference.id<Model::Instance>())));
+        break;
+      case Model::Type::Path:
+      case Model::Type::Null:
+        break;
+    }
+  }
+
+  if (references) {
+    *references = std::move(resolved);
+  }
+}
+
+void Sketch::applyTransform(const Selection& selection, const Transform& transform, std::vector<Point>* previous)
+{
+  // Gather the positions once, so that they can all be transformed in a single batch
+  std::vector<Point*> targets;
+  std::vector<Model::Reference> references;
+  resolvePositions(selection, &targets, &references);
+
+  for (const Model::Reference& reference : references) {
+    recordChange(reference);
+  }
+
+  std::vector<Point> points(targets.size());
+
+  for (size_t i = 0; i < targets.size(); ++i) {
+    points[i] = *targets[i];
+  }
+
+  if (previous) {
+    *previous = points;
+  }
+
+  transform.apply(points.data(), points.size());
+
+  for (size_t i = 0; i < targets.size(); ++i) {
+    *targets[i] = points[i];
+  }
+}
+
+void Sketch::setPositions(const Selection& selection, const std::vector<Point>& positions,
+  std::vector<Point>* previous)
+{
+  std::vector<Point*> targets;
+  std::vector<Model::Reference> references;
+  resolvePositions(selection, &targets, &references);
+  assert(targets.size() == positions.size());
+
+  for (const Model::Reference& reference : references) {
+    recordChange(reference);
+  }
+
+  if (previous) {
+    previous->resize(targets.size());
+  }
+
+  for (size_t i = 0; i < targets.size(); ++i) {
+    if (previous) {
+      (*previous)[i] = *targets[i];
+    }
+
+    *targets[i] = positions[i];
+  }
 }
 
 Model::Sketch::DrawOrder::iterator findDrawEntry(Model::Sketch::DrawOrder& drawOrder,
@@ -180,7 +306,7 @@ Model::Sketch::DrawOrder::const_iterator findDrawEntry(const Model::Sketch::Draw
   return std::find(drawOrder.begin(), drawOrder.end(), id);
 }
 
-Model::Sketch::DrawOrder::iterator findDrawEntry(Model::Sketch::DrawOrder& drawOrder,
+Model::Sketch::DrawOrder::const_iterator findDrawEntry(const Model::Sketch::DrawOrder& drawOrder,
   const ID<Model::Sketch>& id)
 {
   return std::find(drawOrder.begin(), drawOrder.end(), id);
@@ -199,8 +325,14 @@ void Sketch::bringPathForward(const ID<Model::Path>& id)
   }
 
   mUndoManager->pushCommand(
-    [=]() { std::swap(mModel->mDrawOrder[index], mModel->mDrawOrder[index + 1]); },
-    [=]() { std::swap(mModel->mDrawOrder[index], mModel->mDrawOrder[index + 1]); },
+    [=]() {
+      std::swap(mModel->mDrawOrder[index], mModel->mDrawOrder[index + 1]);
+      recordChange(Model::Reference());
+    },
+    [=]() {
+      std::swap(mModel->mDrawOrder[index], mModel->mDrawOrder[index + 1]);
+      recordChange(Model::Reference());
+    },
     "Bring path forward");
 }
 
@@ -218,229 +350,1344 @@ void Sketch::sendPathBackward(const ID<Model::Path>& id)
   }
 
   mUndoManager->pushCommand(
-    [=]() { std::swap(mModel->mDrawOrder[index], mModel->mDrawOrder[index - 1]); },
-    [=]() { std::swap(mModel->mDrawOrder[index], mModel->mDrawOrder[index - 1]); },
+    [=]() {
+      std::swap(mModel->mDrawOrder[index], mModel->mDrawOrder[index - 1]);
+      recordChange(Model::Reference());
+    },
+    [=]() {
+      std::swap(mModel->mDrawOrder[index], mModel->mDrawOrder[index - 1]);
+      recordChange(Model::Reference());
+    },
     "Send path backward");
 }
 
-void Sketch::removeNode(const ID<Model::Node>& nodeID)
+namespace
 {
-  const Model::Node* node = mModel->node(nodeID);
-
-  mUndoManager->beginGroup();
 
-  // Destroy path entries
-  for (auto current : mModel->paths()) {
-    const Model::Path::EntryList& entries = current.second->entries();
+// Removes the items at the given ascending indices in a single pass
+template <class T>
+void eraseIndices(std::vector<T>* items, const std::vector<std::pair<size_t, T>>& removed)
+{
+  auto next = removed.begin();
+  size_t kept = 0;
 
-    for (int i = 0; i < entries.size(); ) {
-      if (entries[i].mNode == nodeID) {
-        controllerForPath(current.first).removeEntry(i);
-      } else {
-        ++i;
-      }
+  for (size_t i = 0; i < items->size(); ++i) {
+    if (next != removed.end() && next->first == i) {
+      ++next;
+    } else {
+      (*items)[kept++] = (*items)[i];
     }
   }
 
-  // Destroy control points
-  for (auto controlPointID : node->controlPoints()) {
-    Point position = mModel->controlPoint(controlPointID)->position();
+  items->resize(kept);
+}
 
-    mUndoManager->pushCommand(
-      [=]() { destroyControlPoint(controlPointID); },
-      [=]() { createControlPoint(controlPointID, nodeID, position); },
-      "Destroy control point");
+// Puts back the items removed by eraseIndices, again in a single pass
+template <class T>
+void restoreIndices(std::vector<T>* items, const std::vector<std::pair<size_t, T>>& removed)
+{
+  if (removed.empty()) {
+    return;
   }
 
-  // Destroy node
-  {
-    Point position = node->position();
-    Model::Node::Type type = node->type();
+  std::vector<T> merged;
+  merged.reserve(items->size() + removed.size());
 
-    mUndoManager->pushCommand(
-      [=]() { destroyNode(nodeID); },
-      [=]() { createNode(nodeID, position, type); },
-      "Destroy node");
+  auto next = removed.begin();
+  auto kept = items->begin();
+
+  while (next != removed.end() || kept != items->end()) {
+    if (next != removed.end() && next->first == merged.size()) {
+      merged.push_back(next->second);
+      ++next;
+    } else {
+      merged.push_back(*kept);
+      ++kept;
+    }
   }
 
-  mUndoManager->endGroup();
+  *items = std::move(merged);
 }
 
-class CreateSubSketchCommand : public UndoCommand
+// Marks an ID in flags indexed by ID value, which avoids hashing, and returns whether it wasn't already marked
+bool flagID(std::vector<bool>* flags, IDValue value)
+{
+  if (value >= flags->size()) {
+    flags->resize(std::max<size_t>(value + 1, flags->size() * 2));
+  }
+
+  bool added = !(*flags)[value];
+  (*flags)[value] = true;
+
+  return added;
+}
+
+bool isFlagged(const std::vector<bool>& flags, IDValue value)
+{
+  return value < flags.size() && flags[value];
+}
+
+}
+
+class RemoveSelectionCommand : public UndoCommand
 {
 public:
-  CreateSubSketchCommand(Sketch* sketch, const Selection& selection, const ID<Model::Sketch>& id)
+  RemoveSelectionCommand(Sketch* sketch, const Selection& selection)
     : mSketch(sketch)
-    , mSelection(selection)
-    , mID(id)
   {
-    const Model::Sketch::DrawOrder& drawOrder = mSketch->mModel->drawOrder();
+    const Model::Sketch* model = mSketch->mModel;
+
+    // Paths take their nodes with them, and nodes take their control points. Control points can't be removed on
+    // their own, as the path entries that use them need both.
+    std::vector<bool> removedPaths;
+    std::vector<bool> removedNodes;
+    std::vector<ID<Model::Node>> nodeIDs;
 
-    mSelection.forEachPathID(
-      [this, &drawOrder](const ID<Model::Path>& id)
+    selection.forEach(
+      [model, &removedPaths, &removedNodes, &nodeIDs](const Model::Reference& reference)
       {
-        auto it = findDrawEntry(drawOrder, id);
-        int index = std::distance(drawOrder.begin(), it);
-        mOldDrawOrder[index] = id;
+        if (reference.type() == Model::Type::Path) {
+          flagID(&removedPaths, reference.id<Model::Path>().value());
+
+          for (const Model::Path::Entry& entry : model->path(reference.id<Model::Path>())->entries()) {
+            if (flagID(&removedNodes, entry.mNode.value())) {
+              nodeIDs.push_back(entry.mNode);
+            }
+          }
+        } else if (reference.type() == Model::Type::Node) {
+          if (flagID(&removedNodes, reference.id<Model::Node>().value())) {
+            nodeIDs.push_back(reference.id<Model::Node>());
+          }
+        }
       });
-  }
-
-  void redo() override
-  {
-    Model::Sketch* subSketch = new Model::Sketch(mSketch->mModel->parent());
-    Sketch::sketches(mSketch->mModel)[mID] = subSketch;
-
-    Model::Sketch::DrawOrder& drawOrder = Sketch::drawOrder(mSketch->mModel);
-    int drawIndex = !mOldDrawOrder.empty() ? (mOldDrawOrder.rbegin()->first + 1) : drawOrder.size();
-    drawOrder.insert(drawOrder.begin() + drawIndex, mID);
 
-    auto addControlPoint = [this, subSketch](const ID<Model::ControlPoint>& id)
-    {
-      if (Sketch::controlPoints(subSketch).count(id) == 0) {
-        Model::ControlPoint* controlPoint = mSketch->getControlPoint(id);
-        Sketch::controlPoints(subSketch)[id] = controlPoint;
+    for (auto& [id, path] : model->paths()) {
+      if (isFlagged(removedPaths, id.value())) {
+        mPaths.emplace_back(id, *path);
+        continue;
       }
-    };
 
-    auto addNode = [this, subSketch, &addControlPoint](const ID<Model::Node>& id)
-    {
-      if (Sketch::nodes(subSketch).count(id) == 0) {
-        Model::Node* node = mSketch->getNode(id);
-        Sketch::nodes(subSketch)[id] = node;
+      const Model::Path::EntryList& entries = path->entries();
+      PathEdit edit = { id, {} };
 
-        for (auto controlPointID : node->controlPoints()) {
-          addControlPoint(controlPointID);
+      for (size_t i = 0; i < entries.size(); ++i) {
+        if (isFlagged(removedNodes, entries[i].mNode.value())) {
+          edit.mRemovedEntries.emplace_back(i, entries[i]);
         }
       }
-    };
 
-    auto movePath = [this, subSketch, &addNode](const ID<Model::Path>& id)
-    {
-      Model::Path* path = mSketch->mModel->path(id);
+      if (!edit.mRemovedEntries.empty()) {
+        mPathEdits.push_back(std::move(edit));
+      }
+    }
+
+    const Model::Sketch::DrawOrder& drawOrder = model->drawOrder();
+
+    for (size_t i = 0; i < drawOrder.size(); ++i) {
+      if (drawOrder[i].type() == Model::Type::Path && isFlagged(removedPaths, drawOrder[i].id<Model::Path>().value())) {
+        mDrawEntries.emplace_back(i, drawOrder[i]);
+      }
+    }
 
-      Sketch::paths(subSketch)[id] = path;
-      Sketch::paths(mSketch->mModel).erase(id);
+    mNodes.reserve(nodeIDs.size());
 
-      Sketch::drawOrder(subSketch).push_back(id);
-      Model::Sketch::DrawOrder& drawOrder = Sketch::drawOrder(mSketch->mModel);
-      drawOrder.erase(findDrawEntry(drawOrder, id));
+    for (const ID<Model::Node>& id : nodeIDs) {
+      const Model::Node* node = model->node(id);
+      mNodes.emplace_back(id, *node);
 
-      for (auto entry: path->entries()) {
-        addNode(entry.mNode);
+      for (const ID<Model::ControlPoint>& controlPointID : node->controlPoints()) {
+        mControlPoints.emplace_back(controlPointID, *model->controlPoint(controlPointID));
       }
-    };
+    }
+  }
 
-    for (auto& [index, id] : mOldDrawOrder) {
-      movePath(id);
+  void redo() override
+  {
+    Model::Sketch* model = mSketch->mModel;
+
+    for (PathEdit& edit : mPathEdits) {
+      eraseIndices(&Path::entries(model->path(edit.mID)), edit.mRemovedEntries);
+      mSketch->recordChange(edit.mID);
     }
 
-    for (auto& reference : mSelection.mReferences) {
-      if (reference.type() == Model::Type::Node) {
-        addNode(reference.id<Model::Node>());
-      } else if (reference.type() == Model::Type::ControlPoint) {
-        addControlPoint(reference.id<Model::ControlPoint>());
-      }
+    for (auto& [id, path] : mPaths) {
+      auto& paths = Sketch::paths(model);
+      auto it = paths.find(id);
+
+      delete it->second;
+      paths.erase(it);
+
+      mSketch->recordChange(id);
+    }
+
+    if (!mDrawEntries.empty()) {
+      eraseIndices(&Sketch::drawOrder(model), mDrawEntries);
+      mSketch->recordChange(Model::Reference());
+    }
+
+    for (auto& [id, controlPoint] : mControlPoints) {
+      mSketch->destroyControlPoint(id);
+    }
+
+    for (auto& [id, node] : mNodes) {
+      mSketch->destroyNode(id);
     }
   }
 
   void undo() override
   {
-    Model::Sketch* subSketch = mSketch->mModel->sketch(mID);
+    Model::Sketch* model = mSketch->mModel;
 
-    Model::Sketch::DrawOrder& drawOrder = Sketch::drawOrder(mSketch->mModel);
-    drawOrder.erase(findDrawEntry(drawOrder, mID));
+    for (auto& [id, node] : mNodes) {
+      Sketch::nodes(model)[id] = new Model::Node(node);
+      mSketch->recordChange(id);
+    }
 
-    mSelection.forEachPathID(
-      [this, subSketch](const ID<Model::Path>& id)
-      {
-        Sketch::paths(mSketch->mModel)[id] = subSketch->path(id);
-      });
+    for (auto& [id, controlPoint] : mControlPoints) {
+      Sketch::controlPoints(model)[id] = new Model::ControlPoint(controlPoint);
+      mSketch->recordChange(id);
+    }
 
-    for (auto [index, id] : mOldDrawOrder) {
-      drawOrder.insert(drawOrder.begin() + index, id);
+    for (auto& [id, path] : mPaths) {
+      Sketch::paths(model)[id] = new Model::Path(path);
+      mSketch->recordChange(id);
     }
 
-    delete subSketch;
-    Sketch::sketches(mSketch->mModel).erase(mID);
+    if (!mDrawEntries.empty()) {
+      restoreIndices(&Sketch::drawOrder(model), mDrawEntries);
+      mSketch->recordChange(Model::Reference());
+    }
+
+    for (PathEdit& edit : mPathEdits) {
+      restoreIndices(&Path::entries(model->path(edit.mID)), edit.mRemovedEntries);
+      mSketch->recordChange(edit.mID);
+    }
   }
 
-  std::string description() override
+  const char* description() const override
   {
-    return "Create sub-sketch";
+    return "Delete selection";
+  }
+
+  size_t memoryUsage() const override
+  {
+    size_t usage = sizeof(*this) + heapUsage(mPathEdits) + heapUsage(mPaths) + heapUsage(mDrawEntries)
+      + heapUsage(mNodes) + heapUsage(mControlPoints);
+
+    for (const PathEdit& edit : mPathEdits) {
+      usage += heapUsage(edit.mRemovedEntries);
+    }
+
+    for (auto& [id, path] : mPaths) {
+      usage += heapUsage(path.entries());
+    }
+
+    for (auto& [id, node] : mNodes) {
+      usage += heapUsage(node.controlPoints());
+    }
+
+    return usage;
+  }
+
+  bool isEmpty() const
+  {
+    return mPathEdits.empty() && mPaths.empty() && mNodes.empty();
   }
 
 private:
+  struct PathEdit
+  {
+    ID<Model::Path> mID;
+    std::vector<std::pair<size_t, Model::Path::Entry>> mRemovedEntries;
+  };
+
   Sketch* mSketch;
-  Selection mSelection;
-  std::map<int, ID<Model::Path>> mOldDrawOrder;
-  ID<Model::Sketch> mID;
+  std::vector<PathEdit> mPathEdits;
+  std::vector<std::pair<ID<Model::Path>, Model::Path>> mPaths;
+  std::vector<std::pair<size_t, Model::Reference>> mDrawEntries;
+  std::vector<std::pair<ID<Model::Node>, Model::Node>> mNodes;
+  std::vector<std::pair<ID<Model::ControlPoint>, Model::ControlPoint>> mControlPoints;
 };
 
-ID<Model::Sketch> Sketch::createSubSketch(const Selection& selection)
+void Sketch::removeSelection(const Selection& selection)
 {
-  ID<Model::Sketch> id(nextID());
+  RemoveSelectionCommand* command = mUndoManager->createCommand<RemoveSelectionCommand>(this, selection);
 
-  mUndoManager->pushCommand(new CreateSubSketchCommand(this, selection, id));
+  if (command->isEmpty()) {
+    mUndoManager->destroyCommand(command);
+    return;
+  }
 
-  return id;
+  mUndoManager->pushCommand(command);
 }
 
-Model::Node* Sketch::getNode(const ID<Model::Node>& id)
+void Sketch::removeNode(const ID<Model::Node>& nodeID)
 {
-  return mModel->node(id);
-}
+  Selection selection;
+  selection.insert(nodeID);
 
-Model::ControlPoint* Sketch::getControlPoint(const ID<Model::ControlPoint>& id)
-{
-  return mModel->controlPoint(id);
+  removeSelection(selection);
 }
 
-IDValue Sketch::nextID()
+class SimplifySelectionCommand : public UndoCommand
 {
-  IDValue value = mModel->mParent->mNextID;
-  ++mModel->mParent->mNextID;
+public:
+  SimplifySelectionCommand(Sketch* sketch, const Selection& selection, double tolerance,
+    Sketch::SimplifyResult* result)
+    : mSketch(sketch)
+  {
+    const Model::Sketch* model = mSketch->mModel;
 
-  return value;
-}
+    // Nodes used more than once, whether by this sketch's paths or by its sub-sketches', have to stay where they are
+    std::vector<bool> used;
+    std::vector<bool> shared;
 
-void Sketch::createNode(const ID<Model::Node>& id, const Point& position, Model::Node::Type type)
-{
-  assert(mModel->mNodes.find(id) == mModel->mNodes.end());
+    auto findShared = [&used, &shared](const Model::Sketch* sketch, auto& findShared) -> void
+    {
+      for (auto& [id, path] : sketch->paths()) {
+        for (const Model::Path::Entry& entry : path->entries()) {
+          if (!flagID(&used, entry.mNode.value())) {
+            flagID(&shared, entry.mNode.value());
+          }
+        }
+      }
 
-  Model::Node* node = new Model::Node(position, type);
-  mModel->mNodes[id] = node;
-}
+      for (auto& [id, subSketch] : sketch->sketches()) {
+        findShared(subSketch, findShared);
+      }
+    };
 
-void Sketch::destroyNode(const ID<Model::Node>& id)
-{
-  delete mModel->node(id);
-  mModel->mNodes.erase(id);
-}
+    findShared(model, findShared);
 
-void Sketch::createControlPoint(const ID<Model::ControlPoint>& id, const ID<Model::Node>& nodeID, const Point& position)
-{
-  assert(mModel->mControlPoints.find(id) == mModel->mControlPoints.end());
+    *result = { 0, 0, 0 };
+    Workspace workspace;
 
-  Model::ControlPoint* controlPoint = new Model::ControlPoint(nodeID, position);
+    selection.forEachPathID(
+      [this, model, tolerance, &shared, result, &workspace](const ID<Model::Path>& id)
+      {
+        planPath(model, id, tolerance, shared, result, &workspace);
+      });
+  }
 
-  Node::controlPoints(mModel->node(nodeID)).push_back(id);
-  mModel->mControlPoints[id] = controlPoint;
-}
+  void redo() override
+  {
+    Model::Sketch* model = mSketch->mModel;
 
-void Sketch::destroyControlPoint(const ID<Model::ControlPoint>& id)
-{
-  delete mModel->controlPoint(id);
-  mModel->mControlPoints.erase(id);
-}
+    for (PathEdit& edit : mPathEdits) {
+      Path::entries(model->path(edit.mID)) = edit.mNewEntries;
+      mSketch->recordChange(edit.mID);
+    }
 
-Model::Path* Sketch::getPath(const ID<Model::Path>& id)
-{
-  return mModel->path(id);
-}
+    for (ControlPointEdit& edit : mControlPointEdits) {
+      ControlPoint::position(model->controlPoint(edit.mID)) = edit.mNewPosition;
+      mSketch->recordChange(edit.mID);
+    }
 
-Model::Sketch::ControlPointList& Sketch::controlPoints(Model::Sketch* sketch)
-{
-  return sketch->mControlPoints;
+    for (NodeTypeEdit& edit : mNodeTypeEdits) {
+      Node::type(model->node(edit.mID)) = Model::Node::Type::Smooth;
+      mSketch->recordChange(edit.mID);
+    }
+
+    for (auto& [id, controlPoint] : mControlPoints) {
+      mSketch->destroyControlPoint(id);
+    }
+
+    for (auto& [id, node] : mNodes) {
+      mSketch->destroyNode(id);
+    }
+  }
+
+  void undo() override
+  {
+    Model::Sketch* model = mSketch->mModel;
+
+    for (auto& [id, node] : mNodes) {
+      Sketch::nodes(model)[id] = new Model::Node(node);
+      mSketch->recordChange(id);
+    }
+
+    for (auto& [id, controlPoint] : mControlPoints) {
+      Sketch::controlPoints(model)[id] = new Model::ControlPoint(controlPoint);
+      mSketch->recordChange(id);
+    }
+
+    for (NodeTypeEdit& edit : mNodeTypeEdits) {
+      Node::type(model->node(edit.mID)) = edit.mOldType;
+      mSketch->recordChange(edit.mID);
+    }
+
+    for (ControlPointEdit& edit : mControlPointEdits) {
+      ControlPoint::position(model->controlPoint(edit.mID)) = edit.mOldPosition;
+      mSketch->recordChange(edit.mID);
+    }
+
+    for (PathEdit& edit : mPathEdits) {
+      Path::entries(model->path(edit.mID)) = edit.mOldEntries;
+      mSketch->recordChange(edit.mID);
+    }
+  }
+
+  const char* description() const override
+  {
+    return "Simplify selection";
+  }
+
+  size_t memoryUsage() const override
+  {
+    size_t usage = sizeof(*this) + heapUsage(mPathEdits) + heapUsage(mControlPointEdits) + heapUsage(mNodeTypeEdits)
+      + heapUsage(mNodes) + heapUsage(mControlPoints);
+
+    for (const PathEdit& edit : mPathEdits) {
+      usage += heapUsage(edit.mOldEntries) + heapUsage(edit.mNewEntries);
+    }
+
+    for (auto& [id, node] : mNodes) {
+      usage += heapUsage(node.controlPoints());
+    }
+
+    return usage;
+  }
+
+  bool isEmpty() const
+  {
+    return mPathEdits.empty();
+  }
+
+private:
+  // Space that's reused between paths while planning
+  struct Workspace
+  {
+    CurveFitter mFitter;
+    std::vector<CubicBezier> mCurves;
+    std::vector<Point> mSamples;
+    std::vector<bool> mSmoothed;
+  };
+
+  // Fits as few curves as it can to the path's segments, and records the edits that would replace them
+  void planPath(const Model::Sketch* model, const ID<Model::Path>& id, double tolerance,
+    const std::vector<bool>& shared, Sketch::SimplifyResult* result, Workspace* workspace)
+  {
+    // Each segment is represented by points at even parameters along it, and a run of segments is fitted to the
+    // points of all of them. Runs are capped so that the cost of a fit stays bounded.
+    const size_t SamplesPerSegment = 8;
+    const size_t MaxRun = 64;
+
+    const Model::Path* path = model->path(id);
+    const Model::Path::EntryList& entries = path->entries();
+    const size_t entryCount = entries.size();
+    const size_t segmentCount = path->isClosed() ? entryCount : entryCount - 1;
+
+    result->mNodesBefore += entryCount;
+
+    if (entryCount < 3) {
+      result->mNodesAfter += entryCount;
+      return;
+    }
+
+    auto entry = [&entries, entryCount](size_t position) -> const Model::Path::Entry&
+    {
+      return entries[position % entryCount];
+    };
+
+    auto curve = [model, &entry](size_t segment) -> CubicBezier
+    {
+      const Model::Path::Entry& from = entry(segment);
+      const Model::Path::Entry& to = entry(segment + 1);
+
+      return { model->node(from.mNode)->position(), model->controlPoint(from.mPostControl)->position(),
+        model->controlPoint(to.mPreControl)->position(), model->node(to.mNode)->position() };
+    };
+
+    // Sharp nodes, shared nodes and the ends of the path are never removed, so runs stop at them
+    auto isAnchor = [model, &shared, &entry, segmentCount](size_t position)
+    {
+      const Model::Path::Entry& anchor = entry(position);
+
+      return position == 0 || position == segmentCount || isFlagged(shared, anchor.mNode.value())
+        || model->node(anchor.mNode)->type() == Model::Node::Type::Sharp;
+    };
+
+    // The direction a curve leaves its first point in, from the first of the other points that's apart from it
+    auto direction = [](const Point& from, const Point& a, const Point& b, const Point& c)
+    {
+      for (const Point* point : { &a, &b, &c }) {
+        const Vector offset = *point - from;
+
+        if (offset.length() > 1e-9) {
+          return offset.normalised();
+        }
+      }
+
+      return Vector::zero;
+    };
+
+    double parameters[SamplesPerSegment];
+
+    for (size_t i = 0; i < SamplesPerSegment; ++i) {
+      parameters[i] = double(i + 1) / SamplesPerSegment;
+    }
+
+    std::vector<CubicBezier>& curves = workspace->mCurves;
+    std::vector<Point>& samples = workspace->mSamples;
+    curves.resize(segmentCount);
+    samples.resize(segmentCount * SamplesPerSegment + 1);
+
+    for (size_t segment = 0; segment < segmentCount; ++segment) {
+      curves[segment] = curve(segment);
+      curves[segment].evaluate(parameters, SamplesPerSegment, &samples[segment * SamplesPerSegment + 1]);
+    }
+
+    samples[0] = curves[0].p0;
+
+    std::vector<size_t> kept = { 0 };
+    std::vector<CubicBezier> fits;
+    double pathError = 0;
+
+    for (size_t start = 0; start < segmentCount; ) {
+      size_t limit = start + 1;
+
+      while (limit < segmentCount && limit - start < MaxRun && !isAnchor(limit)) {
+        ++limit;
+      }
+
+      const CubicBezier& first = curves[start];
+      const Vector startTangent = direction(first.p0, first.p1, first.p2, first.p3);
+
+      auto tryRun = [workspace, start, tolerance, &startTangent, &direction](size_t end, CubicBezier* fitted,
+        double* error)
+      {
+        const CubicBezier& last = workspace->mCurves[end - 1];
+        const Vector endTangent = direction(last.p3, last.p2, last.p1, last.p0);
+
+        *error = workspace->mFitter.fit(&workspace->mSamples[start * SamplesPerSegment],
+          (end - start) * SamplesPerSegment + 1, startTangent, endTangent, tolerance, fitted);
+
+        return *error <= tolerance;
+      };
+
+      // Runs that are known to fit and not to fit, which galloping and then bisection bring together
+      size_t good = start + 1;
+      size_t bad = limit + 1;
+      CubicBezier best = first;
+      double bestError = 0;
+
+      for (size_t step = 2; good < limit; step *= 2) {
+        const size_t end = std::min(start + step, limit);
+        CubicBezier fitted;
+        double error;
+
+        if (!tryRun(end, &fitted, &error)) {
+          bad = end;
+          break;
+        }
+
+        good = end;
+        best = fitted;
+        bestError = error;
+      }
+
+      while (bad - good > 1) {
+        const size_t end = (good + bad) / 2;
+        CubicBezier fitted;
+        double error;
+
+        if (tryRun(end, &fitted, &error)) {
+          good = end;
+          best = fitted;
+          bestError = error;
+        } else {
+          bad = end;
+        }
+      }
+
+      kept.push_back(good);
+      fits.push_back(best);
+      pathError = std::max(pathError, bestError);
+      start = good;
+    }
+
+    const size_t keptCount = path->isClosed() ? kept.size() - 1 : kept.size();
+    result->mNodesAfter += keptCount;
+
+    if (keptCount == entryCount) {
+      return;
+    }
+
+    result->mError = std::max(result->mError, pathError);
+
+    PathEdit edit = { id, entries, {} };
+    edit.mNewEntries.reserve(keptCount);
+
+    for (size_t i = 0; i < keptCount; ++i) {
+      edit.mNewEntries.push_back(entries[kept[i]]);
+    }
+
+    auto moveControlPoint = [this, model](const ID<Model::ControlPoint>& controlPointID, const Point& position)
+    {
+      mControlPointEdits.push_back({ controlPointID, model->controlPoint(controlPointID)->position(), position });
+    };
+
+    for (size_t i = 0; i < fits.size(); ++i) {
+      if (kept[i + 1] - kept[i] == 1) {
+        continue;
+      }
+
+      const Model::Path::Entry& from = entry(kept[i]);
+      const Model::Path::Entry& to = entry(kept[i + 1]);
+
+      moveControlPoint(from.mPostControl, fits[i].p1);
+      moveControlPoint(to.mPreControl, fits[i].p2);
+
+      // Refitted control points don't keep a symmetric node's symmetry, although they do keep its tangent
+      for (const ID<Model::Node>& nodeID : { from.mNode, to.mNode }) {
+        const Model::Node::Type type = model->node(nodeID)->type();
+
+        if (type == Model::Node::Type::Symmetric && flagID(&workspace->mSmoothed, nodeID.value())) {
+          mNodeTypeEdits.push_back({ nodeID, type });
+        }
+      }
+    }
+
+    for (size_t i = 0; i + 1 < kept.size(); ++i) {
+      for (size_t position = kept[i] + 1; position < kept[i + 1]; ++position) {
+        const ID<Model::Node>& nodeID = entries[position].mNode;
+        const Model::Node* node = model->node(nodeID);
+        mNodes.emplace_back(nodeID, *node);
+
+        for (const ID<Model::ControlPoint>& controlPointID : node->controlPoints()) {
+          mControlPoints.emplace_back(controlPointID, *model->controlPoint(controlPointID));
+        }
+      }
+    }
+
+    mPathEdits.push_back(std::move(edit));
+  }
+
+  struct PathEdit
+  {
+    ID<Model::Path> mID;
+    Model::Path::EntryList mOldEntries;
+    Model::Path::EntryList mNewEntries;
+  };
+
+  struct ControlPointEdit
+  {
+    ID<Model::ControlPoint> mID;
+    Point mOldPosition;
+    Point mNewPosition;
+  };
+
+  struct NodeTypeEdit
+  {
+    ID<Model::Node> mID;
+    Model::Node::Type mOldType;
+  };
+
+  Sketch* mSketch;
+  std::vector<PathEdit> mPathEdits;
+  std::vector<ControlPointEdit> mControlPointEdits;
+  std::vector<NodeTypeEdit> mNodeTypeEdits;
+  std::vector<std::pair<ID<Model::Node>, Model::Node>> mNodes;
+  std::vector<std::pair<ID<Model::ControlPoint>, Model::ControlPoint>> mControlPoints;
+};
+
+Sketch::SimplifyResult Sketch::simplifySelection(const Selection& selection, double tolerance)
+{
+  SimplifyResult result;
+  SimplifySelectionCommand* command =
+    mUndoManager->createCommand<SimplifySelectionCommand>(this, selection, tolerance, &result);
+
+  if (command->isEmpty()) {
+    mUndoManager->destroyCommand(command);
+  } else {
+    mUndoManager->pushCommand(command);
+  }
+
+  return result;
+}
+
+Sketch::SimplifyResult Sketch::simplifyPath(const ID<Model::Path>& id, double tolerance)
+{
+  Selection selection;
+  selection.insert(id);
+
+  return simplifySelection(selection, tolerance);
+}
+
+template <class TModel>
+void moveElement(std::unordered_map<ID<TModel>, TModel*>* from, std::unordered_map<ID<TModel>, TModel*>* to,
+  const ID<TModel>& id)
+{
+  auto it = from->find(id);
+  assert(it != from->end());
+
+  (*to)[id] = it->second;
+  from->erase(it);
+}
+
+class CreateSubSketchCommand : public UndoCommand
+{
+public:
+  CreateSubSketchCommand(Sketch* sketch, const Selection& selection, const ID<Model::Sketch>& id)
+    : mSketch(sketch)
+    , mID(id)
+  {
+    const Model::Sketch* model = mSketch->mModel;
+
+    // Selected paths bring their nodes, and nodes bring their control points. These stay in the sketch as well, as
+    // sub-sketches share them with the sketch that contains them.
+    std::vector<bool> groupedPaths;
+    std::vector<bool> groupedNodes;
+    std::vector<bool> groupedControlPoints;
+
+    auto addNode = [&](const ID<Model::Node>& id)
+    {
+      if (flagID(&groupedNodes, id.value())) {
+        mNodes.push_back(id);
+
+        for (const ID<Model::ControlPoint>& controlPointID : model->node(id)->controlPoints()) {
+          if (flagID(&groupedControlPoints, controlPointID.value())) {
+            mControlPoints.push_back(controlPointID);
+          }
+        }
+      }
+    };
+
+    selection.forEach(
+      [this, model, &groupedPaths, &groupedControlPoints, &addNode](const Model::Reference& reference)
+      {
+        if (reference.type() == Model::Type::Path) {
+          flagID(&groupedPaths, reference.id<Model::Path>().value());
+
+          for (const Model::Path::Entry& entry : model->path(reference.id<Model::Path>())->entries()) {
+            addNode(entry.mNode);
+          }
+        } else if (reference.type() == Model::Type::Node) {
+          addNode(reference.id<Model::Node>());
+        } else if (reference.type() == Model::Type::ControlPoint) {
+          if (flagID(&groupedControlPoints, reference.id<Model::ControlPoint>().value())) {
+            mControlPoints.push_back(reference.id<Model::ControlPoint>());
+          }
+        }
+      });
+
+    // The paths keep their relative order, and the sub-sketch takes the place of the frontmost one
+    const Model::Sketch::DrawOrder& drawOrder = model->drawOrder();
+
+    for (size_t i = 0; i < drawOrder.size(); ++i) {
+      if (drawOrder[i].type() == Model::Type::Path && isFlagged(groupedPaths, drawOrder[i].id<Model::Path>().value())) {
+        mDrawEntries.emplace_back(i, drawOrder[i]);
+      }
+    }
+
+    // Once the paths are removed, the sub-sketch goes where the frontmost of them was
+    mDrawIndex = !mDrawEntries.empty() ? mDrawEntries.back().first - (mDrawEntries.size() - 1) : drawOrder.size();
+  }
+
+  void redo() override
+  {
+    Model::Sketch* model = mSketch->mModel;
+    Model::Sketch* subSketch = new Model::Sketch(model->parent());
+    Sketch::position(subSketch) = { 0, 0 };
+    Sketch::sketches(model)[mID] = subSketch;
+
+    auto& paths = Sketch::paths(subSketch);
+    Model::Sketch::DrawOrder& subDrawOrder = Sketch::drawOrder(subSketch);
+    paths.reserve(mDrawEntries.size());
+    subDrawOrder.reserve(mDrawEntries.size());
+
+    for (auto& [index, reference] : mDrawEntries) {
+      moveElement(&Sketch::paths(model), &paths, reference.id<Model::Path>());
+      subDrawOrder.push_back(reference);
+      mSketch->recordChange(reference);
+    }
+
+    auto& nodes = Sketch::nodes(subSketch);
+    nodes.reserve(mNodes.size());
+
+    for (const ID<Model::Node>& id : mNodes) {
+      nodes.emplace(id, model->node(id));
+    }
+
+    auto& controlPoints = Sketch::controlPoints(subSketch);
+    controlPoints.reserve(mControlPoints.size());
+
+    for (const ID<Model::ControlPoint>& id : mControlPoints) {
+      controlPoints.emplace(id, model->controlPoint(id));
+    }
+
+    Model::Sketch::DrawOrder& drawOrder = Sketch::drawOrder(model);
+
+    eraseIndices(&drawOrder, mDrawEntries);
+    drawOrder.insert(drawOrder.begin() + mDrawIndex, mID);
+
+    mSketch->recordChange(mID);
+    mSketch->recordChange(Model::Reference());
+    mSketch->journal().recordChange(subSketch, Model::Reference());
+  }
+
+  void undo() override
+  {
+    Model::Sketch* model = mSketch->mModel;
+    Model::Sketch* subSketch = model->sketch(mID);
+    Model::Sketch::DrawOrder& drawOrder = Sketch::drawOrder(model);
+
+    drawOrder.erase(drawOrder.begin() + mDrawIndex);
+    restoreIndices(&drawOrder, mDrawEntries);
+
+    auto& paths = Sketch::paths(model);
+    paths.reserve(paths.size() + mDrawEntries.size());
+
+    for (auto& [index, reference] : mDrawEntries) {
+      moveElement(&Sketch::paths(subSketch), &paths, reference.id<Model::Path>());
+      mSketch->recordChange(reference);
+    }
+
+    // Only the sub-sketch's lists go with it, as the nodes and control points also belong to the sketch
+    delete subSketch;
+    Sketch::sketches(model).erase(mID);
+
+    mSketch->recordChange(mID);
+    mSketch->recordChange(Model::Reference());
+  }
+
+  const char* description() const override
+  {
+    return "Create sub-sketch";
+  }
+
+  size_t memoryUsage() const override
+  {
+    return sizeof(*this) + heapUsage(mDrawEntries) + heapUsage(mNodes) + heapUsage(mControlPoints);
+  }
+
+private:
+  Sketch* mSketch;
+  ID<Model::Sketch> mID;
+  size_t mDrawIndex;
+  // The draw order entries of the grouped paths, in order, with their indices in the sketch
+  std::vector<std::pair<size_t, Model::Reference>> mDrawEntries;
+  std::vector<ID<Model::Node>> mNodes;
+  std::vector<ID<Model::ControlPoint>> mControlPoints;
+};
+
+ID<Model::Sketch> Sketch::createSubSketch(const Selection& selection)
+{
+  ID<Model::Sketch> id(nextID());
+
+  mUndoManager->pushCommand(mUndoManager->createCommand<CreateSubSketchCommand>(this, selection, id));
+
+  return id;
+}
+
+class UngroupSubSketchCommand : public UndoCommand
+{
+public:
+  UngroupSubSketchCommand(Sketch* sketch, const ID<Model::Sketch>& id)
+    : mSketch(sketch)
+    , mID(id)
+  {
+    const Model::Sketch::DrawOrder& drawOrder = mSketch->mModel->drawOrder();
+    auto it = findDrawEntry(drawOrder, mID);
+    assert(it != drawOrder.end());
+
+    mDrawIndex = std::distance(drawOrder.begin(), it);
+
+    Model::Sketch* subSketch = mSketch->mModel->sketch(mID);
+    mPosition = subSketch->position();
+    mDrawOrder = subSketch->drawOrder();
+
+    mNodes.reserve(Sketch::nodes(subSketch).size());
+
+    for (auto& [id, node] : Sketch::nodes(subSketch)) {
+      mNodes.push_back(id);
+    }
+
+    mControlPoints.reserve(Sketch::controlPoints(subSketch).size());
+
+    for (auto& [id, controlPoint] : Sketch::controlPoints(subSketch)) {
+      mControlPoints.push_back(id);
+    }
+  }
+
+  void redo() override
+  {
+    Model::Sketch* model = mSketch->mModel;
+    Model::Sketch* subSketch = model->sketch(mID);
+
+    moveElements(subSketch, model);
+
+    // The sub-sketch's offset is applied to what it contained, so that everything stays where it was drawn
+    offsetElements({ mPosition.x, mPosition.y });
+
+    Model::Sketch::DrawOrder& drawOrder = Sketch::drawOrder(model);
+
+    if (mDrawOrder.empty()) {
+      drawOrder.erase(drawOrder.begin() + mDrawIndex);
+    } else {
+      // The sub-sketch's entry is reused for its backmost element, and the rest are spliced in after it
+      drawOrder[mDrawIndex] = mDrawOrder.front();
+      drawOrder.insert(drawOrder.begin() + mDrawIndex + 1, mDrawOrder.begin() + 1, mDrawOrder.end());
+    }
+
+    // Only the sub-sketch's lists go with it, as the nodes and control points also belong to the sketch
+    delete subSketch;
+    Sketch::sketches(model).erase(mID);
+
+    mSketch->recordChange(mID);
+    mSketch->recordChange(Model::Reference());
+  }
+
+  void undo() override
+  {
+    Model::Sketch* model = mSketch->mModel;
+    Model::Sketch* subSketch = new Model::Sketch(model->parent());
+    Sketch::position(subSketch) = mPosition;
+    Sketch::sketches(model)[mID] = subSketch;
+
+    Model::Sketch::DrawOrder& drawOrder = Sketch::drawOrder(model);
+
+    if (mDrawOrder.empty()) {
+      drawOrder.insert(drawOrder.begin() + mDrawIndex, mID);
+    } else {
+      drawOrder[mDrawIndex] = mID;
+      drawOrder.erase(drawOrder.begin() + mDrawIndex + 1, drawOrder.begin() + mDrawIndex + mDrawOrder.size());
+    }
+
+    offsetElements({ -mPosition.x, -mPosition.y });
+
+    Sketch::drawOrder(subSketch) = mDrawOrder;
+    moveElements(model, subSketch);
+
+    auto& nodes = Sketch::nodes(subSketch);
+    nodes.reserve(mNodes.size());
+
+    for (const ID<Model::Node>& id : mNodes) {
+      nodes.emplace(id, model->node(id));
+    }
+
+    auto& controlPoints = Sketch::controlPoints(subSketch);
+    controlPoints.reserve(mControlPoints.size());
+
+    for (const ID<Model::ControlPoint>& id : mControlPoints) {
+      controlPoints.emplace(id, model->controlPoint(id));
+    }
+
+    mSketch->recordChange(mID);
+    mSketch->recordChange(Model::Reference());
+    mSketch->journal().recordChange(subSketch, Model::Reference());
+  }
+
+  const char* description() const override
+  {
+    return "Ungroup sub-sketch";
+  }
+
+  size_t memoryUsage() const override
+  {
+    return sizeof(*this) + heapUsage(mDrawOrder) + heapUsage(mNodes) + heapUsage(mControlPoints);
+  }
+
+private:
+  // Moves the elements in the sub-sketch's draw order between it and the sketch
+  void moveElements(Model::Sketch* from, Model::Sketch* to)
+  {
+    Sketch::paths(to).reserve(Sketch::paths(to).size() + mDrawOrder.size());
+
+    for (const Model::Reference& reference : mDrawOrder) {
+      switch (reference.type()) {
+        case Model::Type::Path:
+          moveElement(&Sketch::paths(from), &Sketch::paths(to), reference.id<Model::Path>());
+          break;
+        case Model::Type::Sketch:
+          moveElement(&Sketch::sketches(from), &Sketch::sketches(to), reference.id<Model::Sketch>());
+          break;
+        case Model::Type::Instance:
+          moveElement(&Sketch::instances(from), &Sketch::instances(to), reference.id<Model::Instance>());
+          break;
+        case Model::Type::Node:
+        case Model::Type::ControlPoint:
+        case Model::Type::Null:
+          break;
+      }
+
+      mSketch->recordChange(reference);
+    }
+  }
+
+  // Offsets the sub-sketch's nodes and control points, which nested sub-sketches share, and its instances while
+  // they're in the sketch
+  void offsetElements(const Vector& offset)
+  {
+    if (offset == Vector::zero) {
+      return;
+    }
+
+    Selection selection;
+
+    for (const ID<Model::Node>& id : mNodes) {
+      selection.insert(id);
+    }
+
+    for (const ID<Model::ControlPoint>& id : mControlPoints) {
+      selection.insert(id);
+    }
+
+    for (const Model::Reference& reference : mDrawOrder) {
+      if (reference.type() == Model::Type::Instance) {
+        selection.insert(reference);
+      }
+    }
+
+    mSketch->applyTransform(selection, Transform::translation(offset));
+  }
+
+  Sketch* mSketch;
+  ID<Model::Sketch> mID;
+  int mDrawIndex;
+  Point mPosition;
+  Model::Sketch::DrawOrder mDrawOrder;
+  std::vector<ID<Model::Node>> mNodes;
+  std::vector<ID<Model::ControlPoint>> mControlPoints;
+};
+
+void Sketch::ungroupSubSketch(const ID<Model::Sketch>& id)
+{
+  mUndoManager->pushCommand(mUndoManager->createCommand<UngroupSubSketchCommand>(this, id));
+}
+
+class CreateDefinitionCommand : public UndoCommand
+{
+public:
+  CreateDefinitionCommand(Sketch* sketch, const Selection& selection, const ID<Model::Sketch>& definitionID,
+    const ID<Model::Instance>& instanceID)
+    : mSketch(sketch)
+    , mDefinitionID(definitionID)
+    , mInstanceID(instanceID)
+  {
+    const Model::Sketch* model = mSketch->mModel;
+
+    // Paths can share nodes, so a path can only be moved if it doesn't share any with the paths that stay behind
+    std::set<ID<Model::Node>> sharedNodes;
+
+    auto addSharedNodes = [&sharedNodes](const Model::Path* path)
+    {
+      for (const Model::Path::Entry& entry : path->entries()) {
+        sharedNodes.insert(entry.mNode);
+      }
+    };
+
+    for (auto [id, path] : model->paths()) {
+      if (!selection.contains(id)) {
+        addSharedNodes(path);
+      }
+    }
+
+    for (auto [id, subSketch] : model->sketches()) {
+      for (auto [pathID, path] : subSketch->paths()) {
+        addSharedNodes(path);
+      }
+    }
+
+    const Model::Sketch::DrawOrder& drawOrder = model->drawOrder();
+
+    for (size_t index = 0; index < drawOrder.size(); ++index) {
+      const Model::Reference& reference = drawOrder[index];
+
+      if (!selection.contains(reference)) {
+        continue;
+      }
+
+      if (reference.type() == Model::Type::Path) {
+        const Model::Path::EntryList& entries = model->path(reference.id<Model::Path>())->entries();
+
+        bool shared = std::any_of(entries.begin(), entries.end(),
+          [&sharedNodes](const Model::Path::Entry& entry) { return sharedNodes.count(entry.mNode) > 0; });
+
+        if (shared) {
+          continue;
+        }
+
+        for (const Model::Path::Entry& entry : entries) {
+          mNodes.insert(entry.mNode);
+        }
+      } else if (reference.type() != Model::Type::Instance) {
+        continue;
+      }
+
+      mOldDrawOrder.emplace_back(index, reference);
+    }
+
+    for (auto id : mNodes) {
+      for (auto controlPointID : model->node(id)->controlPoints()) {
+        mControlPoints.push_back(controlPointID);
+      }
+    }
+  }
+
+  bool isEmpty() const { return mOldDrawOrder.empty(); }
+
+  void redo() override
+  {
+    Model::Sketch* model = mSketch->mModel;
+    Model::Sketch* definition = new Model::Sketch(model->parent());
+    Sketch::definitions(model->parent())[mDefinitionID] = definition;
+
+    // The instance is drawn where the topmost of the elements that it replaces was
+    Model::Sketch::DrawOrder& drawOrder = Sketch::drawOrder(model);
+    eraseIndices(&drawOrder, mOldDrawOrder);
+    drawOrder.insert(drawOrder.begin() + instanceIndex(), mInstanceID);
+
+    for (auto& [index, reference] : mOldDrawOrder) {
+      if (reference.type() == Model::Type::Path) {
+        moveElement(&Sketch::paths(model), &Sketch::paths(definition), reference.id<Model::Path>());
+      } else {
+        moveElement(&Sketch::instances(model), &Sketch::instances(definition), reference.id<Model::Instance>());
+      }
+
+      Sketch::drawOrder(definition).push_back(reference);
+
+      mSketch->recordChange(reference);
+    }
+
+    for (auto id : mNodes) {
+      moveElement(&Sketch::nodes(model), &Sketch::nodes(definition), id);
+      mSketch->recordChange(id);
+    }
+
+    for (auto id : mControlPoints) {
+      moveElement(&Sketch::controlPoints(model), &Sketch::controlPoints(definition), id);
+      mSketch->recordChange(id);
+    }
+
+    Sketch::instances(model)[mInstanceID] = new Model::Instance(mDefinitionID, {0, 0});
+
+    mSketch->recordChange(mDefinitionID);
+    mSketch->recordChange(mInstanceID);
+    mSketch->recordChange(Model::Reference());
+  }
+
+  void undo() override
+  {
+    Model::Sketch* model = mSketch->mModel;
+    Model::Sketch* definition = model->parent()->definition(mDefinitionID);
+
+    Model::Sketch::DrawOrder& drawOrder = Sketch::drawOrder(model);
+    drawOrder.erase(drawOrder.begin() + instanceIndex());
+
+    delete model->instance(mInstanceID);
+    Sketch::instances(model).erase(mInstanceID);
+
+    for (auto& [index, reference] : mOldDrawOrder) {
+      if (reference.type() == Model::Type::Path) {
+        moveElement(&Sketch::paths(definition), &Sketch::paths(model), reference.id<Model::Path>());
+      } else {
+        moveElement(&Sketch::instances(definition), &Sketch::instances(model), reference.id<Model::Instance>());
+      }
+
+      mSketch->recordChange(reference);
+    }
+
+    restoreIndices(&drawOrder, mOldDrawOrder);
+
+    for (auto id : mNodes) {
+      moveElement(&Sketch::nodes(definition), &Sketch::nodes(model), id);
+      mSketch->recordChange(id);
+    }
+
+    for (auto id : mControlPoints) {
+      moveElement(&Sketch::controlPoints(definition), &Sketch::controlPoints(model), id);
+      mSketch->recordChange(id);
+    }
+
+    delete definition;
+    Sketch::definitions(model->parent()).erase(mDefinitionID);
+
+    mSketch->recordChange(mDefinitionID);
+    mSketch->recordChange(mInstanceID);
+    mSketch->recordChange(Model::Reference());
+  }
+
+  const char* description() const override
+  {
+    return "Create definition";
+  }
+
+  size_t memoryUsage() const override
+  {
+    return sizeof(*this) + heapUsage(mOldDrawOrder) + heapUsage(mNodes) + heapUsage(mControlPoints);
+  }
+
+private:
+  // The instance's index once the elements that it replaces are removed
+  size_t instanceIndex() const { return mOldDrawOrder.back().first - (mOldDrawOrder.size() - 1); }
+
+  Sketch* mSketch;
+  // The draw order entries of the elements that the definition takes, in order, with their indices in the sketch
+  std::vector<std::pair<size_t, Model::Reference>> mOldDrawOrder;
+  std::set<ID<Model::Node>> mNodes;
+  std::vector<ID<Model::ControlPoint>> mControlPoints;
+  ID<Model::Sketch> mDefinitionID;
+  ID<Model::Instance> mInstanceID;
+};
+
+ID<Model::Instance> Sketch::createDefinition(const Selection& selection)
+{
+  ID<Model::Sketch> definitionID(nextID());
+  ID<Model::Instance> instanceID(nextID());
+
+  CreateDefinitionCommand* command =
+    mUndoManager->createCommand<CreateDefinitionCommand>(this, selection, definitionID, instanceID);
+
+  if (command->isEmpty()) {
+    mUndoManager->destroyCommand(command);
+    return ID<Model::Instance>();
+  }
+
+  mUndoManager->pushCommand(command);
+
+  return instanceID;
+}
+
+ID<Model::Instance> Sketch::placeInstance(const ID<Model::Sketch>& definition, const Point& position)
+{
+  ID<Model::Instance> id(nextID());
+
+  mUndoManager->pushCommand(
+    [this, id, definition, position]() {
+      mModel->mInstances[id] = new Model::Instance(definition, position);
+      mModel->mDrawOrder.push_back(id);
+      recordChange(id);
+      recordChange(Model::Reference());
+    },
+    [this, id]() {
+      delete mModel->mInstances.at(id);
+      mModel->mInstances.erase(id);
+      mModel->mDrawOrder.pop_back();
+      recordChange(id);
+      recordChange(Model::Reference());
+    },
+    "Place instance");
+
+  return id;
+}
+
+Model::Node* Sketch::getNode(const ID<Model::Node>& id)
+{
+  return mModel->node(id);
+}
+
+Model::ControlPoint* Sketch::getControlPoint(const ID<Model::ControlPoint>& id)
+{
+  return mModel->controlPoint(id);
+}
+
+void Sketch::recordChange(const Model::Reference& reference)
+{
+  journal().recordChange(mModel, reference);
+}
+
+IDValue Sketch::nextID()
+{
+  IDValue value = mModel->mParent->mNextID;
+  ++mModel->mParent->mNextID;
+
+  return value;
+}
+
+IDValue Sketch::reserveIDs(IDValue count)
+{
+  IDValue value = mModel->mParent->mNextID;
+  mModel->mParent->mNextID += count;
+
+  return value;
+}
+
+void Sketch::createNode(const ID<Model::Node>& id, const Point& position, Model::Node::Type type)
+{
+  assert(mModel->mNodes.find(id) == mModel->mNodes.end());
+
+  Model::Node* node = new Model::Node(position, type);
+  mModel->mNodes[id] = node;
+
+  recordChange(id);
+}
+
+void Sketch::destroyNode(const ID<Model::Node>& id)
+{
+  delete mModel->node(id);
+  mModel->mNodes.erase(id);
+
+  recordChange(id);
+}
+
+void Sketch::createNodes(IDValue firstID, const std::vector<Path::NodeData>& nodes)
+{
+  // Make room for everything first, so that the maps don't rehash part way through
+  mModel->mNodes.reserve(mModel->mNodes.size() + nodes.size());
+  mModel->mControlPoints.reserve(mModel->mControlPoints.size() + 2 * nodes.size());
+
+  for (size_t i = 0; i < nodes.size(); ++i) {
+    const Path::NodeData& data = nodes[i];
+
+    ID<Model::Node> nodeID(firstID + 3 * i);
+    ID<Model::ControlPoint> preControlID(firstID + 3 * i + 1);
+    ID<Model::ControlPoint> postControlID(firstID + 3 * i + 2);
+
+    Model::Node* node = new Model::Node(data.mPosition, data.mType);
+    Node::controlPoints(node) = { preControlID, postControlID };
+
+    bool added = mModel->mNodes.emplace(nodeID, node).second;
+    added &= mModel->mControlPoints.emplace(preControlID, new Model::ControlPoint(nodeID, data.mPreControl)).second;
+    added &= mModel->mControlPoints.emplace(postControlID, new Model::ControlPoint(nodeID, data.mPostControl)).second;
+    assert(added);
+
+    recordChange(nodeID);
+    recordChange(preControlID);
+    recordChange(postControlID);
+  }
+}
+
+void Sketch::destroyNodes(IDValue firstID, size_t count)
+{
+  for (size_t i = 0; i < count; ++i) {
+    IDValue nodeID = firstID + 3 * i;
+
+    destroyControlPoint(ID<Model::ControlPoint>(nodeID + 1));
+    destroyControlPoint(ID<Model::ControlPoint>(nodeID + 2));
+    destroyNode(ID<Model::Node>(nodeID));
+  }
+}
+
+void Sketch::createControlPoint(const ID<Model::ControlPoint>& id, const ID<Model::Node>& nodeID, const Point& position)
+{
+  assert(mModel->mControlPoints.find(id) == mModel->mControlPoints.end());
+
+  Model::ControlPoint* controlPoint = new Model::ControlPoint(nodeID, position);
+
+  Node::controlPoints(mModel->node(nodeID)).push_back(id);
+  mModel->mControlPoints[id] = controlPoint;
+
+  recordChange(id);
+  recordChange(nodeID);
+}
+
+void Sketch::destroyControlPoint(const ID<Model::ControlPoint>& id)
+{
+  delete mModel->controlPoint(id);
+  mModel->mControlPoints.erase(id);
+
+  recordChange(id);
+}
+
+Model::Path* Sketch::getPath(const ID<Model::Path>& id)
+{
+  return mModel->path(id);
+}
+
+Model::Sketch::ControlPointList& Sketch::controlPoints(Model::Sketch* sketch)
+{
+  return sketch->mControlPoints;
 }
 
 Model::Sketch::DrawOrder& Sketch::drawOrder(Model::Sketch* sketch)
@@ -463,9 +1710,29 @@ Model::Sketch::SketchList& Sketch::sketches(Model::Sketch* sketch)
   return sketch->mSketches;
 }
 
+Model::Sketch::InstanceList& Sketch::instances(Model::Sketch* sketch)
+{
+  return sketch->mInstances;
+}
+
+Model::Document::DefinitionList& Sketch::definitions(Model::Document* document)
+{
+  return document->mDefinitions;
+}
+
 Point& Sketch::position(Model::Sketch* sketch)
 {
   return sketch->mPosition;
 }
 
+Point& Sketch::position(Model::Instance* instance)
+{
+  return instance->mPosition;
+}
+
+Model::Journal& Sketch::journal()
+{
+  return mModel->mParent->mJournal;
+}
+
 }
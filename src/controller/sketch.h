@@ -5,10 +5,15 @@
 #include "controller/path.h"
 #include "controller/selection.h"
 
+#include "model/document.h"
+#include "model/journal.h"
 #include "model/sketch.h"
 
+#include "utilities/geometry.h"
 #include "utilities/id.h"
 
+#include <memory>
+
 namespace Controller
 {
 
@@ -20,6 +25,12 @@ public:
   Sketch(UndoManager* undoManager, Model::Sketch* model);
   virtual ~Sketch() { }
 
+  // Edits made between beginning and committing a transaction become one undo step, and are reported to the
+  // document's journal as a single change set. Rolling back undoes them instead.
+  void beginTransaction();
+  void commitTransaction();
+  void rollbackTransaction();
+
   ID<Model::Path> addPath();
 
   Path controllerForPath(const ID<Model::Path>& id);
@@ -27,25 +38,60 @@ public:
   ControlPoint controllerForControlPoint(const ID<Model::ControlPoint>& id);
 
   void moveSelection(const Selection& selection, const Vector& offset);
+  void scaleSelection(const Selection& selection, const Point& centre, double scaleX, double scaleY);
+  void rotateSelection(const Selection& selection, const Point& centre, double angle);
+  // Selected paths are transformed along with all of their nodes and control points. Successive transforms of the
+  // same selection with the same description merge into one undo step.
+  void transformSelection(const Selection& selection, const Transform& transform, const char* description);
+  Rectangle selectionBounds(const Selection& selection);
   void bringPathForward(const ID<Model::Path>& id);
   void sendPathBackward(const ID<Model::Path>& id);
   void removeNode(const ID<Model::Node>& id);
+  // Removes the selected paths and nodes, along with the path entries that use those nodes, as a single undo step
+  void removeSelection(const Selection& selection);
+
+  struct SimplifyResult
+  {
+    size_t mNodesBefore;
+    size_t mNodesAfter;
+    // The greatest distance found between a replaced run of segments and the curve that replaced it
+    double mError;
+  };
+
+  // Replaces runs of the selected paths' segments with fewer curves that stay within the tolerance of them, as a
+  // single undo step. Sharp nodes, the ends of open paths and nodes that other paths share are always kept.
+  SimplifyResult simplifySelection(const Selection& selection, double tolerance);
+  SimplifyResult simplifyPath(const ID<Model::Path>& id, double tolerance);
+  // Moves the selected paths into a new sub-sketch, which shares their nodes and control points with this sketch
   ID<Model::Sketch> createSubSketch(const Selection& selection);
+  // Moves a sub-sketch's contents back into this sketch in its place, keeping them where they're drawn
+  void ungroupSubSketch(const ID<Model::Sketch>& id);
+  // Moves the selected paths and instances into a new definition, and puts an instance of it in their place
+  ID<Model::Instance> createDefinition(const Selection& selection);
+  ID<Model::Instance> placeInstance(const ID<Model::Sketch>& definition, const Point& position);
 
 private:
   friend class AddNodeCommand;
   friend class RemoveNodeCommand;
-  friend class MoveSelectionCommand;
+  friend class RemoveSelectionCommand;
+  friend class SimplifySelectionCommand;
+  friend class TransformSelectionCommand;
   friend class CreateSubSketchCommand;
+  friend class UngroupSubSketchCommand;
+  friend class CreateDefinitionCommand;
 
-  // Node::Accessor and ControlPoint::Accessor
+  // Node::Accessor, ControlPoint::Accessor and Path::Accessor
   Model::ControlPoint* getControlPoint(const ID<Model::ControlPoint>& id) override;
   Model::Node* getNode(const ID<Model::Node>& id) override;
+  void recordChange(const Model::Reference& reference) override;
 
   // Path::Accessor
   IDValue nextID() override;
+  IDValue reserveIDs(IDValue count) override;
   void createNode(const ID<Model::Node>& id, const Point& position, Model::Node::Type type) override;
   void destroyNode(const ID<Model::Node>& id) override;
+  void createNodes(IDValue firstID, const std::vector<Path::NodeData>& nodes) override;
+  void destroyNodes(IDValue firstID, size_t count) override;
   void createControlPoint(const ID<Model::ControlPoint>& id, const ID<Model::Node>& node,
     const Point& position) override;
   void destroyControlPoint(const ID<Model::ControlPoint>& id) override;
@@ -56,10 +102,22 @@ private:
   static Model::Sketch::NodeList& nodes(Model::Sketch* sketch);
   static Model::Sketch::PathList& paths(Model::Sketch* sketch);
   static Model::Sketch::SketchList& sketches(Model::Sketch* sketch);
+  static Model::Sketch::InstanceList& instances(Model::Sketch* sketch);
+  static Model::Document::DefinitionList& definitions(Model::Document* document);
   static Point& position(Model::Sketch* sketch);
+  static Point& position(Model::Instance* instance);
+
+  Model::Journal& journal();
+
+  void resolvePositions(const Selection& selection, std::vector<Point*>* targets,
+    std::vector<Model::Reference>* references);
+  // Transforms the selection's positions, and gives the ones from before in the order that setPositions takes them
+  void applyTransform(const Selection& selection, const Transform& transform, std::vector<Point>* previous = nullptr);
+  void setPositions(const Selection& selection, const std::vector<Point>& positions, std::vector<Point>* previous);
 
   UndoManager* mUndoManager;
   Model::Sketch* mModel;
+  std::shared_ptr<const Selection> mTransformSelection;
 };
 
 }
@@ -0,0 +1,306 @@
+#include "controller/snapping.h"
+
+#include "controller/selection.h"
+#include "model/controlpoint.h"
+#include "model/document.h"
+#include "model/node.h"
+#include "model/sketch.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace Controller
+{
+
+namespace
+{
+
+const double IndexCellSize = 64;
+
+IDValue elementID(const Model::Reference& reference)
+{
+  return reference.type() == Model::Type::Node ? reference.id<Model::Node>().value()
+    : reference.id<Model::ControlPoint>().value();
+}
+
+}
+
+Snapping::Index::Index()
+  : mGrid(IndexCellSize)
+{
+}
+
+Snapping::Snapping(FlattenedPaths* flattenedPaths)
+  : mFlattenedPaths(flattenedPaths)
+  , mDocument(nullptr)
+  , mGridSpacing(0)
+{
+}
+
+Snapping::~Snapping()
+{
+  mConnection.disconnect();
+  mBatchConnection.disconnect();
+}
+
+void Snapping::setDocument(Model::Document* document)
+{
+  mConnection.disconnect();
+  mBatchConnection.disconnect();
+
+  mIndices.clear();
+
+  mDocument = document;
+
+  if (mDocument) {
+    mConnection = mDocument->journal().signalChanged().connect(sigc::mem_fun(*this, &Snapping::onChanged));
+    mBatchConnection = mDocument->journal().signalBatchChanged().connect(
+      sigc::mem_fun(*this, &Snapping::onBatchChanged));
+  }
+}
+
+void Snapping::setGridSpacing(double spacing)
+{
+  mGridSpacing = spacing;
+}
+
+bool Snapping::snap(const Model::Sketch* sketch, const Point& point, double distance, const Selection& exclude,
+  Result* result)
+{
+  result->mPosition = point;
+  result->mTarget = Target::None;
+  result->mReference = Model::Reference();
+  result->mGuides.clear();
+
+  Index& index = this->index(sketch);
+
+  if (snapToPoint(index, point, distance, exclude, result)) {
+    return true;
+  }
+
+  FlattenedPaths::CurvePoint curvePoint;
+
+  if (mFlattenedPaths->closestPoint(sketch, point, distance, &curvePoint, &exclude)) {
+    result->mPosition = curvePoint.mPosition;
+    result->mTarget = Target::Curve;
+    result->mReference = curvePoint.mPath;
+    return true;
+  }
+
+  return snapToAxes(index, point, distance, exclude, result);
+}
+
+bool Snapping::snapToPoint(Index& index, const Point& point, double distance, const Selection& exclude,
+  Result* result)
+{
+  const Rectangle area = { point.x - distance, point.y - distance, point.x + distance, point.y + distance };
+
+  const Index::Entry* best = nullptr;
+  double bestDistance = 0;
+
+  // A node anywhere in reach beats a closer control point
+  auto rank = [](const Model::Reference& reference) { return reference.type() == Model::Type::Node ? 0 : 1; };
+
+  index.mGrid.query(area,
+    [&index, &point, distance, &exclude, &best, &bestDistance, &rank](const Model::Reference& reference)
+    {
+      if (exclude.contains(reference)) {
+        return;
+      }
+
+      const Index::Entry& entry = index.mEntries.at(elementID(reference));
+      const double entryDistance = (entry.mPosition - point).length();
+
+      if (entryDistance > distance) {
+        return;
+      }
+
+      if (best && (rank(reference) > rank(best->mReference)
+          || (rank(reference) == rank(best->mReference) && entryDistance >= bestDistance))) {
+        return;
+      }
+
+      best = &entry;
+      bestDistance = entryDistance;
+    });
+
+  if (!best) {
+    return false;
+  }
+
+  result->mPosition = best->mPosition;
+  result->mTarget = best->mReference.type() == Model::Type::Node ? Target::Node : Target::ControlPoint;
+  result->mReference = best->mReference;
+
+  return true;
+}
+
+bool Snapping::snapToAxes(Index& index, const Point& point, double distance, const Selection& exclude,
+  Result* result)
+{
+  // Nodes further away than this along an axis aren't looked for, which keeps the areas searched small
+  const double AlignmentReach = 512;
+
+  // The nearest node in line with the point on each axis, preferring the one that's closest across the axis, and
+  // then along it
+  struct Alignment
+  {
+    const Index::Entry* mEntry;
+    double mAcross;
+    double mAlong;
+  };
+
+  auto align = [&index, &exclude, distance](const Rectangle& area, double Point::* across, const Point& point)
+  {
+    double Point::* along = across == &Point::x ? &Point::y : &Point::x;
+    Alignment alignment = { nullptr, distance, 0 };
+
+    index.mGrid.query(area, [&index, &exclude, &point, across, along, &alignment](const Model::Reference& reference)
+    {
+      if (reference.type() != Model::Type::Node || exclude.contains(reference)) {
+        return;
+      }
+
+      const Index::Entry& entry = index.mEntries.at(elementID(reference));
+      const double acrossDistance = std::abs(entry.mPosition.*across - point.*across);
+      const double alongDistance = std::abs(entry.mPosition.*along - point.*along);
+
+      if (acrossDistance < alignment.mAcross || (acrossDistance == alignment.mAcross
+          && (!alignment.mEntry || alongDistance < alignment.mAlong))) {
+        alignment = { &entry, acrossDistance, alongDistance };
+      }
+    });
+
+    return alignment;
+  };
+
+  const Alignment vertical = align(
+    { point.x - distance, point.y - AlignmentReach, point.x + distance, point.y + AlignmentReach }, &Point::x, point);
+  const Alignment horizontal = align(
+    { point.x - AlignmentReach, point.y - distance, point.x + AlignmentReach, point.y + distance }, &Point::y, point);
+
+  auto snapToGrid = [this, distance](double* coordinate)
+  {
+    if (mGridSpacing <= 0) {
+      return false;
+    }
+
+    const double snapped = std::round(*coordinate / mGridSpacing) * mGridSpacing;
+
+    if (std::abs(snapped - *coordinate) > distance) {
+      return false;
+    }
+
+    *coordinate = snapped;
+    return true;
+  };
+
+  Point& position = result->mPosition;
+  bool aligned = false;
+  bool gridded = false;
+
+  if (vertical.mEntry) {
+    position.x = vertical.mEntry->mPosition.x;
+    aligned = true;
+  } else {
+    gridded = snapToGrid(&position.x);
+  }
+
+  if (horizontal.mEntry) {
+    position.y = horizontal.mEntry->mPosition.y;
+    aligned = true;
+  } else {
+    gridded = snapToGrid(&position.y) || gridded;
+  }
+
+  // The guides are drawn once both axes have snapped, so that they meet the final position
+  for (const Alignment* alignment : { &vertical, &horizontal }) {
+    if (alignment->mEntry) {
+      result->mGuides.push_back({ alignment->mEntry->mPosition, position });
+    }
+  }
+
+  if (aligned) {
+    result->mTarget = Target::Alignment;
+  } else if (gridded) {
+    result->mTarget = Target::Grid;
+  }
+
+  return aligned || gridded;
+}
+
+void Snapping::onChanged(const Model::Sketch*, const Model::Reference& reference)
+{
+  if (reference.refersTo(Model::Type::Sketch)) {
+    // As with the flattened paths, a removed sketch's index could otherwise be found again by a new sketch at the
+    // same address
+    mIndices.clear();
+  } else if (reference.refersTo(Model::Type::Node) || reference.refersTo(Model::Type::ControlPoint)) {
+    for (auto it = mIndices.begin(); it != mIndices.end();) {
+      std::vector<Model::Reference>& changed = it->second.mChanged;
+      changed.push_back(reference);
+
+      // An index that isn't being used is dropped once it's cheaper to build again than to catch up
+      if (changed.size() > it->second.mEntries.size() + 1024) {
+        it = mIndices.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+}
+
+void Snapping::onBatchChanged(const Model::ChangeSet& changes)
+{
+  for (const Model::Reference& reference : changes.references()) {
+    onChanged(nullptr, reference);
+  }
+}
+
+Snapping::Index& Snapping::index(const Model::Sketch* sketch)
+{
+  auto [it, inserted] = mIndices.try_emplace(sketch);
+  Index& index = it->second;
+
+  auto add = [&index](const Model::Reference& reference, const Point& position)
+  {
+    index.mGrid.insert(reference, { position.x, position.y, position.x, position.y });
+    index.mEntries[elementID(reference)] = { reference, position };
+  };
+
+  if (inserted) {
+    for (auto [id, node] : sketch->nodes()) {
+      add(id, node->position());
+    }
+
+    for (auto [id, controlPoint] : sketch->controlPoints()) {
+      add(id, controlPoint->position());
+    }
+  } else if (!index.mChanged.empty()) {
+    std::sort(index.mChanged.begin(), index.mChanged.end());
+    index.mChanged.erase(std::unique(index.mChanged.begin(), index.mChanged.end()), index.mChanged.end());
+
+    for (const Model::Reference& reference : index.mChanged) {
+      auto entry = index.mEntries.find(elementID(reference));
+
+      if (entry != index.mEntries.end()) {
+        const Point& position = entry->second.mPosition;
+        index.mGrid.remove(reference, { position.x, position.y, position.x, position.y });
+        index.mEntries.erase(entry);
+      }
+
+      if (reference.type() == Model::Type::Node && sketch->nodes().contains(reference.id<Model::Node>())) {
+        add(reference, sketch->node(reference.id<Model::Node>())->position());
+      } else if (reference.type() == Model::Type::ControlPoint
+        && sketch->controlPoints().contains(reference.id<Model::ControlPoint>())) {
+        add(reference, sketch->controlPoint(reference.id<Model::ControlPoint>())->position());
+      }
+    }
+  }
+
+  index.mChanged.clear();
+
+  return index;
+}
+
+}
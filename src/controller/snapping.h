@@ -0,0 +1,105 @@
+#pragma once
+
+#include "controller/flattening.h"
+#include "model/journal.h"
+#include "model/reference.h"
+#include "utilities/geometry.h"
+#include "utilities/id.h"
+#include "utilities/spatialgrid.h"
+
+#include <unordered_map>
+#include <vector>
+
+namespace Model
+{
+  class Document;
+  class Sketch;
+}
+
+namespace Controller
+{
+
+class Selection;
+
+// Finds where a point that's being placed should snap to: a node or control point, one of the paths' curves, a line
+// through a node horizontally or vertically, or a grid. Nodes and control points are found from a grid of their
+// positions, which is kept for each sketch that's snapped in and updated with the elements that the journal reports
+// have changed since, and curves are found from the flattened paths' own index. The cost of a snap depends on how
+// many elements are near the point rather than on the size of the document.
+class Snapping
+{
+public:
+  explicit Snapping(FlattenedPaths* flattenedPaths);
+  ~Snapping();
+
+  void setDocument(Model::Document* document);
+  // Points only snap to the grid while its spacing is more than zero
+  void setGridSpacing(double spacing);
+
+  enum class Target
+  {
+    None,
+    Node,
+    ControlPoint,
+    Curve,
+    Alignment,
+    Grid,
+  };
+
+  // A line that shows what a point snapped to
+  struct Guide
+  {
+    Point mFrom;
+    Point mTo;
+  };
+
+  struct Result
+  {
+    Point mPosition;
+    Target mTarget;
+    // The node, control point or path that the point snapped to
+    Model::Reference mReference;
+    std::vector<Guide> mGuides;
+  };
+
+  // Snaps a point in the sketch's coordinates to the best target within the distance of it, passing over the
+  // excluded elements and the curves that use them, which are usually the ones being moved. Nodes come before control
+  // points, and those before curves. Failing those, each axis snaps on its own to the nearest node that's in line
+  // with the point, or to the grid. Returns whether the point snapped, and leaves the result's position at the point
+  // when it didn't.
+  bool snap(const Model::Sketch* sketch, const Point& point, double distance, const Selection& exclude,
+    Result* result);
+
+private:
+  // The positions of a sketch's own nodes and control points
+  struct Index
+  {
+    Index();
+
+    struct Entry
+    {
+      Model::Reference mReference;
+      Point mPosition;
+    };
+
+    SpatialGrid<Model::Reference> mGrid;
+    std::unordered_map<IDValue, Entry> mEntries;
+    // Elements that have changed since the index was last used, which might no longer be in the sketch
+    std::vector<Model::Reference> mChanged;
+  };
+
+  void onChanged(const Model::Sketch* sketch, const Model::Reference& reference);
+  void onBatchChanged(const Model::ChangeSet& changes);
+  Index& index(const Model::Sketch* sketch);
+  bool snapToPoint(Index& index, const Point& point, double distance, const Selection& exclude, Result* result);
+  bool snapToAxes(Index& index, const Point& point, double distance, const Selection& exclude, Result* result);
+
+  FlattenedPaths* mFlattenedPaths;
+  Model::Document* mDocument;
+  sigc::connection mConnection;
+  sigc::connection mBatchConnection;
+  std::unordered_map<const Model::Sketch*, Index> mIndices;
+  double mGridSpacing;
+};
+
+}
@@ -1,6 +1,7 @@
 #include "undo.h"
 
-#include <list>
+#include <algorithm>
+#include <cassert>
 
 namespace Controller
 {
@@ -13,9 +14,77 @@ AutoID::AutoID()
   ++sNextID;
 }
 
+UndoPool::UndoPool()
+  : mFreeLists()
+  , mChunkPosition(nullptr)
+  , mChunkEnd(nullptr)
+{
+}
+
+UndoPool::~UndoPool()
+{
+  for (char* chunk : mChunks) {
+    ::operator delete(chunk);
+  }
+}
+
+void* UndoPool::allocate(size_t size)
+{
+  if (size > MaxPooledSize) {
+    return ::operator new(size);
+  }
+
+  const size_t sizeClass = (size + Granularity - 1) / Granularity - 1;
+
+  if (FreeBlock* block = mFreeLists[sizeClass]) {
+    mFreeLists[sizeClass] = block->mNext;
+    return block;
+  }
+
+  const size_t blockSize = (sizeClass + 1) * Granularity;
+
+  if (mChunkEnd - mChunkPosition < static_cast<std::ptrdiff_t>(blockSize)) {
+    // Whatever is left of the current chunk is too small for this block, and is abandoned
+    mChunks.push_back(static_cast<char*>(::operator new(ChunkSize)));
+    mChunkPosition = mChunks.back();
+    mChunkEnd = mChunkPosition + ChunkSize;
+  }
+
+  void* result = mChunkPosition;
+  mChunkPosition += blockSize;
+
+  return result;
+}
+
+void UndoPool::deallocate(void* pointer, size_t size)
+{
+  if (size > MaxPooledSize) {
+    ::operator delete(pointer);
+    return;
+  }
+
+  const size_t sizeClass = (size + Granularity - 1) / Granularity - 1;
+
+  FreeBlock* block = static_cast<FreeBlock*>(pointer);
+  block->mNext = mFreeLists[sizeClass];
+  mFreeLists[sizeClass] = block;
+}
+
 class UndoGroup : public UndoCommand
 {
 public:
+  UndoGroup(UndoManager* manager)
+    : mManager(manager)
+  {
+  }
+
+  ~UndoGroup() override
+  {
+    for (UndoCommand* child : mChildren) {
+      mManager->destroyCommand(child);
+    }
+  }
+
   void undo() override
   {
     for (auto it = mChildren.crbegin(); it != mChildren.crend(); ++it) {
@@ -30,66 +99,157 @@ public:
     }
   }
 
-  std::string description() override
+  const char* description() const override
   {
-    return "Group";
+    // Groups are named after the edit that they start with, which is what the rest of it builds on
+    return !mChildren.empty() ? mChildren.front()->description() : "Group";
   }
 
-  std::list<UndoCommand*> mChildren;
+  size_t memoryUsage() const override
+  {
+    size_t result = sizeof(*this) + heapUsage(mChildren);
+
+    for (const UndoCommand* child : mChildren) {
+      result += child->memoryUsage();
+    }
+
+    return result;
+  }
+
+  UndoManager* mManager;
+  std::vector<UndoCommand*> mChildren;
 };
 
 UndoManager::UndoManager()
   : mEnableMerge(false)
+  , mMemoryUsage(0)
+  , mMemoryLimit(0)
+  , mCountLimit(0)
+  , mTransactionDepth(0)
+  , mCheckpointSource(nullptr)
+  , mCheckpointInterval(0)
+  , mStepsSinceCheckpoint(0)
+  , mRecorder(nullptr)
+  , mNextSerial(0)
+{
+}
+
+UndoManager::~UndoManager()
 {
+  for (Entry& entry : mUndoCommands) {
+    destroyEntry(entry);
+  }
+
+  for (Entry& entry : mRedoCommands) {
+    destroyEntry(entry);
+  }
 }
 
-void clearStack(std::stack<UndoCommand*>& stack)
+void UndoManager::destroyCommand(UndoCommand* command)
 {
-  while (!stack.empty()) {
-    delete stack.top();
-    stack.pop();
+  size_t poolSize = command->mPoolSize;
+
+  if (poolSize == 0) {
+    delete command;
+    return;
   }
+
+  command->~UndoCommand();
+  mPool.deallocate(command, poolSize);
 }
 
 void UndoManager::pushCommand(UndoCommand* command)
 {
+  UndoGroup* currentGroup = !mGroups.empty() ? mGroups.top() : nullptr;
+
+  UndoCommand* latest = currentGroup
+    ? (!currentGroup->mChildren.empty() ? currentGroup->mChildren.back() : nullptr)
+    : (!mUndoCommands.empty() ? mUndoCommands.back().mCommand : nullptr);
+  const bool mayMerge = mEnableMerge && command->id() != UndoCommand::InvalidID && latest
+    && latest->id() == command->id();
+
+  if (!currentGroup) {
+    captureCheckpoint(command);
+
+    // A command that merges adds to the latest step's changes, so they're only recorded once it's known not to
+    if (mRecorder && !mayMerge) {
+      mRecorder->recordChanges();
+    }
+  }
+
   command->redo();
 
-  UndoGroup* currentGroup = !mGroups.empty() ? mGroups.top() : nullptr;
+  if (mayMerge) {
+    size_t oldUsage = latest->memoryUsage();
+
+    if (latest->mergeWith(command)) {
+      destroyCommand(command);
+
+      addMemoryUsage(&mUndoCommands.back(), oldUsage, latest->memoryUsage());
 
-  if (mEnableMerge && command->id() != UndoCommand::InvalidID) {
-    UndoCommand* latest = currentGroup
-      ? (!currentGroup->mChildren.empty() ? currentGroup->mChildren.back() : nullptr)
-      : (!mUndoCommands.empty() ? mUndoCommands.top() : nullptr);
+      if (!currentGroup) {
+        mSignalHistoryChanged.emit();
+      }
 
-    if (latest && latest->id() == command->id() && latest->mergeWith(command)) {
-      delete command;
       return;
     }
+
+    if (mRecorder && !currentGroup) {
+      // Take the command's changes back out while the latest step's are recorded, which is rare enough that
+      // applying it twice is cheaper than having every command say whether it will merge up front
+      command->undo();
+      mRecorder->recordChanges();
+      command->redo();
+    }
   }
 
   if (currentGroup) {
     currentGroup->mChildren.push_back(command);
+
+    // The outermost open group is always the latest undo command
+    addMemoryUsage(&mUndoCommands.back(), 0, command->memoryUsage());
   } else {
-    mUndoCommands.push(command);
+    size_t usage = command->memoryUsage();
+    mUndoCommands.push_back({ command, usage, mNextSerial++ });
+    mMemoryUsage += usage;
+
+    ++mStepsSinceCheckpoint;
   }
 
   mEnableMerge = true;
 
-  clearStack(mRedoCommands);
+  clearRedoCommands();
+
+  if (!currentGroup) {
+    if (mRecorder) {
+      mRecorder->stepAdded();
+    }
+
+    trim();
+    mSignalHistoryChanged.emit();
+  }
 }
 
 void UndoManager::undo()
 {
   if (!mUndoCommands.empty()) {
-    UndoCommand* command = mUndoCommands.top();
-    mUndoCommands.pop();
+    if (mRecorder) {
+      mRecorder->recordChanges();
+    }
 
-    command->undo();
+    Entry entry = mUndoCommands.back();
+    mUndoCommands.pop_back();
 
-    mRedoCommands.push(command);
+    entry.mCommand->undo();
+
+    mRedoCommands.push_front(entry);
+
+    if (mRecorder) {
+      mRecorder->moved();
+    }
 
     mSignalChanged.emit();
+    mSignalHistoryChanged.emit();
   }
 
   mEnableMerge = false;
@@ -98,14 +258,23 @@ void UndoManager::undo()
 void UndoManager::redo()
 {
   if (!mRedoCommands.empty()) {
-    UndoCommand* command = mRedoCommands.top();
-    mRedoCommands.pop();
+    if (mRecorder) {
+      mRecorder->recordChanges();
+    }
 
-    command->redo();
+    Entry entry = mRedoCommands.front();
+    mRedoCommands.pop_front();
 
-    mUndoCommands.push(command);
+    entry.mCommand->redo();
+
+    mUndoCommands.push_back(entry);
+
+    if (mRecorder) {
+      mRecorder->moved();
+    }
 
     mSignalChanged.emit();
+    mSignalHistoryChanged.emit();
   }
 
   mEnableMerge = false;
@@ -113,7 +282,7 @@ void UndoManager::redo()
 
 void UndoManager::beginGroup()
 {
-  UndoGroup *group = new UndoGroup;
+  UndoGroup* group = createCommand<UndoGroup>(this);
   pushCommand(group);
 
   mGroups.push(group);
@@ -122,9 +291,31 @@ void UndoManager::beginGroup()
 void UndoManager::cancelGroup()
 {
   if (!mGroups.empty()) {
-    mGroups.top()->undo();
+    UndoGroup* group = mGroups.top();
     mGroups.pop();
-    mUndoCommands.pop();
+
+    group->undo();
+
+    if (!mGroups.empty()) {
+      // A nested group is the latest child of the group that encloses it
+      mGroups.top()->mChildren.pop_back();
+      addMemoryUsage(&mUndoCommands.back(), group->memoryUsage(), 0);
+    } else {
+      if (mRecorder) {
+        mRecorder->recordChanges();
+      }
+
+      mMemoryUsage -= mUndoCommands.back().mMemoryUsage;
+      mUndoCommands.pop_back();
+
+      if (mRecorder) {
+        mRecorder->stepCancelled();
+      }
+    }
+
+    destroyCommand(group);
+
+    mSignalHistoryChanged.emit();
   }
 }
 
@@ -132,6 +323,43 @@ void UndoManager::endGroup()
 {
   if (!mGroups.empty()) {
     mGroups.pop();
+
+    if (mGroups.empty()) {
+      if (mRecorder) {
+        mRecorder->recordChanges();
+      }
+
+      trim();
+      mSignalHistoryChanged.emit();
+    }
+  }
+}
+
+void UndoManager::beginTransaction()
+{
+  beginGroup();
+  ++mTransactionDepth;
+}
+
+void UndoManager::commitTransaction()
+{
+  assert(mTransactionDepth > 0);
+
+  endGroup();
+
+  if (--mTransactionDepth == 0) {
+    mSignalChanged.emit();
+  }
+}
+
+void UndoManager::rollbackTransaction()
+{
+  assert(mTransactionDepth > 0);
+
+  cancelGroup();
+
+  if (--mTransactionDepth == 0) {
+    mSignalChanged.emit();
   }
 }
 
@@ -139,8 +367,230 @@ void UndoManager::clear()
 {
   cancelGroup();
 
-  clearStack(mUndoCommands);
-  clearStack(mRedoCommands);
+  if (mRecorder) {
+    mRecorder->recordChanges();
+  }
+
+  for (Entry& entry : mUndoCommands) {
+    destroyEntry(entry);
+  }
+
+  mUndoCommands.clear();
+  clearRedoCommands();
+
+  mMemoryUsage = 0;
+
+  if (mRecorder) {
+    mRecorder->cleared();
+  }
+
+  mSignalHistoryChanged.emit();
+}
+
+void UndoManager::setHistory(const std::vector<UndoCommand*>& commands, size_t position)
+{
+  assert(mGroups.empty() && position <= commands.size());
+
+  for (Entry& entry : mUndoCommands) {
+    destroyEntry(entry);
+  }
+
+  mUndoCommands.clear();
+  clearRedoCommands();
+
+  mMemoryUsage = 0;
+
+  for (size_t i = 0; i < commands.size(); ++i) {
+    size_t usage = commands[i]->memoryUsage();
+    (i < position ? mUndoCommands : mRedoCommands).push_back({ commands[i], usage, mNextSerial++ });
+    mMemoryUsage += usage;
+  }
+
+  mEnableMerge = false;
+  mStepsSinceCheckpoint = position;
+
+  trim();
+  mSignalHistoryChanged.emit();
+}
+
+void UndoManager::setLimits(size_t memoryLimit, size_t countLimit)
+{
+  mMemoryLimit = memoryLimit;
+  mCountLimit = countLimit;
+
+  if (mGroups.empty()) {
+    trim();
+    mSignalHistoryChanged.emit();
+  }
+}
+
+void UndoManager::setCheckpointSource(CheckpointSource* source, size_t interval)
+{
+  mCheckpointSource = source;
+  mCheckpointInterval = interval;
+  mStepsSinceCheckpoint = 0;
+}
+
+const char* UndoManager::description(size_t step) const
+{
+  return entry(step).mCommand->description();
+}
+
+size_t UndoManager::serial(size_t step) const
+{
+  return entry(step).mSerial;
+}
+
+void UndoManager::jumpTo(size_t target)
+{
+  assert(target <= count());
+
+  const size_t current = position();
+
+  if (target == current || !mGroups.empty()) {
+    return;
+  }
+
+  auto distance = [](size_t a, size_t b) { return a > b ? a - b : b - a; };
+
+  // Restoring a checkpoint rewrites whatever changed since it, which is reckoned to cost about half an interval of
+  // commands
+  const size_t restoreCost = std::max<size_t>(mCheckpointInterval / 2, 1);
+
+  size_t start = current;
+  size_t cost = distance(current, target);
+  const UndoCheckpoint* checkpoint = nullptr;
+
+  for (size_t step = 1; step <= count(); ++step) {
+    const UndoCheckpoint* candidate = entry(step).mCheckpoint;
+
+    if (candidate && restoreCost + distance(step, target) < cost) {
+      start = step;
+      cost = restoreCost + distance(step, target);
+      checkpoint = candidate;
+    }
+  }
+
+  if (mRecorder) {
+    mRecorder->recordChanges();
+  }
+
+  if (mCheckpointSource) {
+    mCheckpointSource->beginJump();
+  }
+
+  if (checkpoint) {
+    mCheckpointSource->restoreCheckpoint(checkpoint);
+  }
+
+  for (size_t step = start; step < target; ++step) {
+    entry(step + 1).mCommand->redo();
+  }
+
+  for (size_t step = start; step > target; --step) {
+    entry(step).mCommand->undo();
+  }
+
+  while (mUndoCommands.size() > target) {
+    mRedoCommands.push_front(mUndoCommands.back());
+    mUndoCommands.pop_back();
+  }
+
+  while (mUndoCommands.size() < target) {
+    mUndoCommands.push_back(mRedoCommands.front());
+    mRedoCommands.pop_front();
+  }
+
+  if (mCheckpointSource) {
+    mCheckpointSource->endJump();
+  }
+
+  if (mRecorder) {
+    mRecorder->moved();
+  }
+
+  mEnableMerge = false;
+
+  mSignalChanged.emit();
+  mSignalHistoryChanged.emit();
+}
+
+void UndoManager::addMemoryUsage(Entry* entry, size_t oldUsage, size_t newUsage)
+{
+  entry->mMemoryUsage = entry->mMemoryUsage - oldUsage + newUsage;
+  mMemoryUsage = mMemoryUsage - oldUsage + newUsage;
+}
+
+void UndoManager::captureCheckpoint(const UndoCommand* next)
+{
+  if (!mCheckpointSource || mUndoCommands.empty() || mStepsSinceCheckpoint < mCheckpointInterval) {
+    return;
+  }
+
+  // The latest step can still change if the next command merges into it, so leave it until one that won't
+  Entry& latest = mUndoCommands.back();
+
+  if (latest.mCheckpoint || (mEnableMerge && next->id() != UndoCommand::InvalidID
+    && next->id() == latest.mCommand->id())) {
+    return;
+  }
+
+  latest.mCheckpoint = mCheckpointSource->captureCheckpoint();
+  addMemoryUsage(&latest, 0, latest.mCheckpoint->memoryUsage());
+
+  mStepsSinceCheckpoint = 0;
+}
+
+UndoManager::Entry& UndoManager::entry(size_t step)
+{
+  assert(step > 0 && step <= count());
+
+  return step <= mUndoCommands.size() ? mUndoCommands[step - 1] : mRedoCommands[step - mUndoCommands.size() - 1];
+}
+
+const UndoManager::Entry& UndoManager::entry(size_t step) const
+{
+  return const_cast<UndoManager*>(this)->entry(step);
+}
+
+void UndoManager::destroyEntry(const Entry& entry)
+{
+  destroyCommand(entry.mCommand);
+  delete entry.mCheckpoint;
+}
+
+void UndoManager::trim()
+{
+  auto overLimit = [this]() {
+    return (mMemoryLimit > 0 && mMemoryUsage > mMemoryLimit) || (mCountLimit > 0 && count() > mCountLimit);
+  };
+
+  size_t trimmed = 0;
+
+  // The latest command is always kept, so that even an oversized edit can be undone
+  while (mUndoCommands.size() > 1 && overLimit()) {
+    Entry& entry = mUndoCommands.front();
+
+    mMemoryUsage -= entry.mMemoryUsage;
+    destroyEntry(entry);
+
+    mUndoCommands.pop_front();
+    ++trimmed;
+  }
+
+  if (mRecorder && trimmed > 0) {
+    mRecorder->stepsTrimmed(trimmed);
+  }
+}
+
+void UndoManager::clearRedoCommands()
+{
+  for (Entry& entry : mRedoCommands) {
+    mMemoryUsage -= entry.mMemoryUsage;
+    destroyEntry(entry);
+  }
+
+  mRedoCommands.clear();
 }
 
 }
@@ -1,8 +1,16 @@
 #pragma once
 
 #include <sigc++/sigc++.h>
+#include <cstddef>
+#include <deque>
+#include <map>
+#include <new>
+#include <set>
 #include <stack>
 #include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 namespace Controller
 {
@@ -16,11 +24,84 @@ public:
 
   virtual void undo() = 0;
   virtual void redo() = 0;
-  virtual std::string description() = 0;
+  // Descriptions are string literals, so commands don't need to copy them
+  virtual const char* description() const = 0;
   virtual int id() const { return InvalidID; }
   virtual bool mergeWith(UndoCommand* other) { return false; }
+
+  // Approximate number of bytes held by the command, including anything that it allocated
+  virtual size_t memoryUsage() const = 0;
+
+private:
+  friend class UndoManager;
+
+  // Size of the pool allocation holding the command, or zero if it was allocated with new
+  size_t mPoolSize = 0;
 };
 
+// State captured alongside the undo history, which can be restored instead of replaying the commands before it
+class UndoCheckpoint
+{
+public:
+  virtual ~UndoCheckpoint() { }
+
+  virtual size_t memoryUsage() const = 0;
+};
+
+// Recycles the memory of discarded commands, so that edits which push many small commands don't go through the
+// general purpose allocator for each of them. Blocks are grouped into size classes, each with its own free list.
+class UndoPool
+{
+public:
+  UndoPool();
+  ~UndoPool();
+
+  void* allocate(size_t size);
+  void deallocate(void* pointer, size_t size);
+
+private:
+  static const size_t Granularity = alignof(std::max_align_t);
+  static const size_t MaxPooledSize = 512;
+  static const size_t ChunkSize = 64 * 1024;
+
+  struct FreeBlock
+  {
+    FreeBlock* mNext;
+  };
+
+  FreeBlock* mFreeLists[MaxPooledSize / Granularity];
+  std::vector<char*> mChunks;
+  char* mChunkPosition;
+  char* mChunkEnd;
+};
+
+// Estimates of the memory allocated by the containers that commands hold
+template <class T>
+size_t heapUsage(const std::vector<T>& vector)
+{
+  return vector.capacity() * sizeof(T);
+}
+
+template <class T>
+size_t heapUsage(const std::set<T>& set)
+{
+  // Red-black tree nodes hold three pointers and a colour alongside the value
+  return set.size() * (sizeof(T) + 4 * sizeof(void*));
+}
+
+template <class TKey, class TValue>
+size_t heapUsage(const std::map<TKey, TValue>& map)
+{
+  return map.size() * (sizeof(TKey) + sizeof(TValue) + 4 * sizeof(void*));
+}
+
+template <class TKey, class TValue>
+size_t heapUsage(const std::unordered_map<TKey, TValue>& map)
+{
+  // Each node holds the next pointer and the cached hash alongside the entry, and each bucket a pointer
+  return map.size() * (sizeof(TKey) + sizeof(TValue) + 2 * sizeof(void*)) + map.bucket_count() * sizeof(void*);
+}
+
 class AutoID
 {
 public:
@@ -39,6 +120,7 @@ class UndoManager
 {
 public:
   UndoManager();
+  ~UndoManager();
 
   template <class T_Derived>
   class AutoIDCommand : public UndoCommand
@@ -50,11 +132,39 @@ public:
     static AutoID sID;
   };
 
+  // Captures and restores the state that commands act on
+  class CheckpointSource
+  {
+  public:
+    virtual UndoCheckpoint* captureCheckpoint() = 0;
+    virtual void restoreCheckpoint(const UndoCheckpoint* checkpoint) = 0;
+
+    // Called around a jump through the history, so that the changes it makes can be reported together
+    virtual void beginJump() { }
+    virtual void endJump() { }
+  };
+
+  // Keeps a record of the history outside the manager, such as on disk. The changes made to the document between
+  // calls to recordChanges() belong to the latest step if it was just added, or otherwise to the undo, redo or jump
+  // that was just made.
+  class Recorder
+  {
+  public:
+    virtual void recordChanges() = 0;
+    virtual void stepAdded() = 0;
+    virtual void moved() = 0;
+    // The latest step was a group that has been cancelled, and it's been removed
+    virtual void stepCancelled() = 0;
+    // The oldest steps have been discarded
+    virtual void stepsTrimmed(size_t count) = 0;
+    virtual void cleared() = 0;
+  };
+
   template <class T_Redo, class T_Undo>
   class LambdaCommand : public UndoCommand
   {
   public:
-    LambdaCommand(const T_Redo& redo, const T_Undo& undo, const std::string& description)
+    LambdaCommand(const T_Redo& redo, const T_Undo& undo, const char* description)
       : mRedo(redo)
       , mUndo(undo)
       , mDescription(description)
@@ -71,27 +181,39 @@ public:
       mRedo();
     }
 
-    std::string description() override
+    const char* description() const override
     {
       return mDescription;
     }
 
+    size_t memoryUsage() const override
+    {
+      return sizeof(*this);
+    }
+
   private:
     T_Redo mRedo;
     T_Undo mUndo;
-    std::string mDescription;
+    const char* mDescription;
   };
 
-  template <class T_Redo, class T_Undo>
-  static UndoCommand* createCommand(const T_Redo& redo, const T_Undo& undo, const std::string& description)
+  // Allocates a command from the manager's pool. The manager owns it once it's pushed, and it can be given back with
+  // destroyCommand() if it isn't.
+  template <class T_Command, class... T_Args>
+  T_Command* createCommand(T_Args&&... args)
   {
-    return new LambdaCommand<T_Redo, T_Undo>(redo, undo, description);
+    T_Command* command = new (mPool.allocate(sizeof(T_Command))) T_Command(std::forward<T_Args>(args)...);
+    static_cast<UndoCommand*>(command)->mPoolSize = sizeof(T_Command);
+
+    return command;
   }
 
+  void destroyCommand(UndoCommand* command);
+
   template <class T_Redo, class T_Undo>
-  void pushCommand(const T_Redo& redo, const T_Undo& undo, const std::string& description)
+  void pushCommand(const T_Redo& redo, const T_Undo& undo, const char* description)
   {
-    pushCommand(createCommand(redo, undo, description));
+    pushCommand(createCommand<LambdaCommand<T_Redo, T_Undo>>(redo, undo, description));
   }
 
   void pushCommand(UndoCommand* command);
@@ -104,18 +226,88 @@ public:
   void cancelGroup();
   void endGroup();
 
+  // A transaction is a group that also holds back signalChanged() until the outermost one is committed or rolled
+  // back, so that edits to many elements notify once
+  void beginTransaction();
+  void commitTransaction();
+  void rollbackTransaction();
+  bool inTransaction() const { return mTransactionDepth > 0; }
+
   void clear();
 
+  void setRecorder(Recorder* recorder) { mRecorder = recorder; }
+  // Replaces the history with commands that have been applied up to the given position, such as a history that was
+  // recorded in a previous session. The recorder is only told about any steps that are trimmed to fit the limits.
+  void setHistory(const std::vector<UndoCommand*>& commands, size_t position);
+
+  // Once the history holds more than either limit, its oldest steps are discarded. Zero means no limit.
+  void setLimits(size_t memoryLimit, size_t countLimit);
+  size_t memoryLimit() const { return mMemoryLimit; }
+  size_t countLimit() const { return mCountLimit; }
+
+  // Totals over both the undo and redo history
+  size_t memoryUsage() const { return mMemoryUsage; }
+  size_t count() const { return mUndoCommands.size() + mRedoCommands.size(); }
+
+  // A checkpoint is captured every interval steps, which bounds the number of commands that a jump replays
+  void setCheckpointSource(CheckpointSource* source, size_t interval);
+
+  // Steps are numbered from one, starting with the oldest in the history, and the position is the number of steps
+  // that are currently applied
+  size_t position() const { return mUndoCommands.size(); }
+  const char* description(size_t step) const;
+  // Identifies a step for as long as it stays in the history, however the steps around it change
+  size_t serial(size_t step) const;
+  // Moves to any position in the history, starting from the checkpoint nearest to it when that's quicker than
+  // undoing or redoing every step in between. Change signals are only emitted once the jump is complete. Nothing
+  // happens while a group is open.
+  void jumpTo(size_t position);
+
   using Signal = sigc::signal<void()>;
 
   Signal signalChanged() { return mSignalChanged; }
+  Signal signalHistoryChanged() { return mSignalHistoryChanged; }
 
 private:
-  std::stack<UndoCommand*> mUndoCommands;
-  std::stack<UndoCommand*> mRedoCommands;
+  // Commands are accounted for at the size that they had when added to the history, so that later changes to the
+  // size of a merged command or an open group can be applied as a difference
+  struct Entry
+  {
+    UndoCommand* mCommand;
+    size_t mMemoryUsage;
+    size_t mSerial;
+    // The state once the command has been applied, if it was captured
+    UndoCheckpoint* mCheckpoint = nullptr;
+  };
+
+  friend class UndoGroup;
+
+  void addMemoryUsage(Entry* entry, size_t oldUsage, size_t newUsage);
+  void captureCheckpoint(const UndoCommand* next);
+  Entry& entry(size_t step);
+  const Entry& entry(size_t step) const;
+  void destroyEntry(const Entry& entry);
+  void trim();
+  void clearRedoCommands();
+
+  // Declared first, so that it outlives the commands allocated from it
+  UndoPool mPool;
+  std::deque<Entry> mUndoCommands;
+  // The next command to redo is at the front
+  std::deque<Entry> mRedoCommands;
   Signal mSignalChanged;
+  Signal mSignalHistoryChanged;
   std::stack<UndoGroup*> mGroups;
   bool mEnableMerge;
+  size_t mMemoryUsage;
+  size_t mMemoryLimit;
+  size_t mCountLimit;
+  int mTransactionDepth;
+  CheckpointSource* mCheckpointSource;
+  size_t mCheckpointInterval;
+  size_t mStepsSinceCheckpoint;
+  Recorder* mRecorder;
+  size_t mNextSerial;
 };
 
 template <class T_Derived>
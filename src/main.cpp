@@ -1,13 +1,20 @@
 #include "mainwindow.h"
+#include "controller/checkpoints.h"
+#include "controller/cleanup.h"
 #include "controller/sketch.h"
 #include "controller/undo.h"
 #include "model/document.h"
+#include "serialisation/autosave.h"
+#include "serialisation/incrementalfile.h"
 #include "serialisation/layout.h"
 #include "serialisation/reader.h"
-#include "serialisation/writer.h"
+#include "serialisation/undojournal.h"
 #include "view/context.h"
 
 #include <fstream>
+#include <wx/config.h>
+#include <wx/filename.h>
+#include <wx/stdpaths.h>
 #include <wx/wx.h>
 
 #include <iostream>
@@ -16,29 +23,64 @@ class Application : public wxApp
 {
 public:
   bool OnInit() override;
+  int OnExit() override;
 
 private:
   enum ID {
     Open,
     Save,
+    SaveAs,
+    SaveCompressed,
+    CleanUp,
+    Autosave,
     Undo,
     Redo,
     Add,
     Delete,
+    Freehand,
+    DeleteSelection,
+    Simplify,
     Group,
+    Ungroup,
+    Define,
+    PlaceInstance,
     Move,
+    Scale,
+    Rotate,
     Cancel,
     View,
     BringForward,
     SendBackward,
+    SelectAll,
+    InvertSelection,
+    SelectConnected,
+    SelectSameStroke,
+    SelectSameFill,
+    AutosaveTimer,
+    JournalTimer,
   };
 
   void onUndo(wxCommandEvent& event);
   void onRedo(wxCommandEvent& event);
   void onOpen(wxCommandEvent& event);
   void onSave(wxCommandEvent& event);
+  void onSaveAs(wxCommandEvent& event);
+  void onSaveCompressed(wxCommandEvent& event);
+  void saveAs(bool compress);
+  void onCleanUp(wxCommandEvent& event);
+  void onAutosave(wxCommandEvent& event);
+  void onAutosaveTimer(wxTimerEvent& event);
+  void updateAutosaveTimer();
+  bool recover();
+  void setDocument(Model::Document* document);
 
   Controller::UndoManager mUndoManager;
+  Controller::DocumentCheckpoints mCheckpoints;
+  Serialisation::IncrementalFile mFile;
+  Serialisation::Autosave mAutosave;
+  Serialisation::UndoJournal mUndoJournal;
+  wxTimer mAutosaveTimer;
+  wxTimer mJournalTimer;
   View::Context mViewContext;
   wxMenuBar* mMenuBar;
   Model::Document* mDocument;
@@ -50,16 +92,35 @@ bool Application::OnInit()
   Bind(wxEVT_MENU, &Application::onUndo, this, ID::Undo);
   Bind(wxEVT_MENU, &Application::onRedo, this, ID::Redo);
   Bind(wxEVT_MENU, &Application::onSave, this, ID::Save);
+  Bind(wxEVT_MENU, &Application::onSaveAs, this, ID::SaveAs);
+  Bind(wxEVT_MENU, &Application::onSaveCompressed, this, ID::SaveCompressed);
   Bind(wxEVT_MENU, &Application::onOpen, this, ID::Open);
+  Bind(wxEVT_MENU, &Application::onCleanUp, this, ID::CleanUp);
+  Bind(wxEVT_MENU, &Application::onAutosave, this, ID::Autosave);
+  Bind(wxEVT_TIMER, &Application::onAutosaveTimer, this, ID::AutosaveTimer);
+  Bind(wxEVT_TIMER, [this](wxTimerEvent&) { mUndoJournal.flush(); }, ID::JournalTimer);
 
   Bind(wxEVT_MENU, [this](wxCommandEvent&) { mViewContext.mAddSignal.emit(); }, ID::Add);
   Bind(wxEVT_MENU, [this](wxCommandEvent&) { mViewContext.mDeleteSignal.emit(); }, ID::Delete);
+  Bind(wxEVT_MENU, [this](wxCommandEvent&) { mViewContext.mFreehandSignal.emit(); }, ID::Freehand);
+  Bind(wxEVT_MENU, [this](wxCommandEvent&) { mViewContext.mDeleteSelectionSignal.emit(); }, ID::DeleteSelection);
+  Bind(wxEVT_MENU, [this](wxCommandEvent&) { mViewContext.mSimplifySignal.emit(); }, ID::Simplify);
   Bind(wxEVT_MENU, [this](wxCommandEvent&) { mViewContext.mGroupSignal.emit(); }, ID::Group);
+  Bind(wxEVT_MENU, [this](wxCommandEvent&) { mViewContext.mUngroupSignal.emit(); }, ID::Ungroup);
+  Bind(wxEVT_MENU, [this](wxCommandEvent&) { mViewContext.mDefineSignal.emit(); }, ID::Define);
+  Bind(wxEVT_MENU, [this](wxCommandEvent&) { mViewContext.mPlaceInstanceSignal.emit(); }, ID::PlaceInstance);
   Bind(wxEVT_MENU, [this](wxCommandEvent&) { mViewContext.mMoveSignal.emit(); }, ID::Move);
+  Bind(wxEVT_MENU, [this](wxCommandEvent&) { mViewContext.mScaleSignal.emit(); }, ID::Scale);
+  Bind(wxEVT_MENU, [this](wxCommandEvent&) { mViewContext.mRotateSignal.emit(); }, ID::Rotate);
   Bind(wxEVT_MENU, [this](wxCommandEvent&) { mViewContext.mCancelSignal.emit(); }, ID::Cancel);
   Bind(wxEVT_MENU, [this](wxCommandEvent&) { mViewContext.mViewSignal.emit(); }, ID::View);
   Bind(wxEVT_MENU, [this](wxCommandEvent&) { mViewContext.mBringForwardSignal.emit(); }, ID::BringForward);
   Bind(wxEVT_MENU, [this](wxCommandEvent&) { mViewContext.mSendBackwardSignal.emit(); }, ID::SendBackward);
+  Bind(wxEVT_MENU, [this](wxCommandEvent&) { mViewContext.mSelectAllSignal.emit(); }, ID::SelectAll);
+  Bind(wxEVT_MENU, [this](wxCommandEvent&) { mViewContext.mInvertSelectionSignal.emit(); }, ID::InvertSelection);
+  Bind(wxEVT_MENU, [this](wxCommandEvent&) { mViewContext.mSelectConnectedSignal.emit(); }, ID::SelectConnected);
+  Bind(wxEVT_MENU, [this](wxCommandEvent&) { mViewContext.mSelectSameStrokeSignal.emit(); }, ID::SelectSameStroke);
+  Bind(wxEVT_MENU, [this](wxCommandEvent&) { mViewContext.mSelectSameFillSignal.emit(); }, ID::SelectSameFill);
 
   mMenuBar = new wxMenuBar;
 
@@ -68,6 +129,17 @@ bool Application::OnInit()
 
   fileMenu->Append(ID::Open, "&Open\tCtrl-O");
   fileMenu->Append(ID::Save, "&Save\tCtrl-S");
+  fileMenu->Append(ID::SaveAs, "Save &As\tCtrl-Shift-S");
+  fileMenu->Append(ID::SaveCompressed, "Save &Compressed");
+
+  fileMenu->AppendSeparator();
+
+  fileMenu->Append(ID::CleanUp, "Clean &Up...");
+
+  fileMenu->AppendSeparator();
+
+  fileMenu->AppendCheckItem(ID::Autosave, "Auto&save");
+  fileMenu->Check(ID::Autosave, wxConfigBase::Get()->ReadBool("Autosave", true));
 
   wxMenu* editMenu = new wxMenu;
   mMenuBar->Append(editMenu, "&Edit");
@@ -79,8 +151,16 @@ bool Application::OnInit()
 
   editMenu->Append(ID::Add, "&Add\tA");
   editMenu->Append(ID::Delete, "&Delete\tD");
+  editMenu->Append(ID::Freehand, "Free&hand\tF");
+  editMenu->Append(ID::DeleteSelection, "Delete Se&lection\tDel");
+  editMenu->Append(ID::Simplify, "Sim&plify...");
   editMenu->Append(ID::Group, "&Group\tG");
+  editMenu->Append(ID::Ungroup, "U&ngroup\tShift-G");
+  editMenu->Append(ID::Define, "Make S&ymbol\tY");
+  editMenu->Append(ID::PlaceInstance, "Place &Instance\tI");
   editMenu->Append(ID::Move, "&Move\tM");
+  editMenu->Append(ID::Scale, "&Scale\tS");
+  editMenu->Append(ID::Rotate, "&Rotate\tR");
   editMenu->Append(ID::Cancel, "&Cancel\tEscape");
   editMenu->Append(ID::View, "&View\tSpace");
 
@@ -89,16 +169,70 @@ bool Application::OnInit()
   editMenu->Append(ID::BringForward, "Bring &Forward\tPageUp");
   editMenu->Append(ID::SendBackward, "Send &Backward\tPageDown");
 
+  wxMenu* selectMenu = new wxMenu;
+  mMenuBar->Append(selectMenu, "&Select");
+
+  selectMenu->Append(ID::SelectAll, "&All\tCtrl-A");
+  selectMenu->Append(ID::InvertSelection, "&Invert\tCtrl-I");
+  selectMenu->Append(ID::SelectConnected, "&Connected\tCtrl-L");
+  selectMenu->Append(ID::SelectSameStroke, "Same &Stroke Colour");
+  selectMenu->Append(ID::SelectSameFill, "Same &Fill Colour");
+
+  // Undo history limits, in megabytes and steps, where zero means no limit
+  wxConfigBase* config = wxConfigBase::Get();
+  mUndoManager.setLimits(config->ReadLong("UndoMemoryLimit", 256) * 1024 * 1024, config->ReadLong("UndoLimit", 0));
+
   mDocument = new Model::Document;
+  mFile.setDocument(mDocument, "", false, false);
+
+  // Jumps through the history replay at most about this many steps, between checkpoints of the whole document
+  mCheckpoints.setDocument(mDocument);
+  mUndoManager.setCheckpointSource(&mCheckpoints, config->ReadLong("UndoCheckpointInterval", 64));
+
+  wxFileName recoveryPath(wxStandardPaths::Get().GetUserDataDir(), "recovery.spln");
+  recoveryPath.Mkdir(wxS_DIR_DEFAULT, wxPATH_MKDIR_FULL);
+
+  mAutosave.setPath(recoveryPath.GetFullPath().ToStdString());
+  mAutosave.setDocument(mDocument);
+
+  // The undo history is journaled next to the autosave, so that it can be recovered along with the document
+  recoveryPath.SetExt("undo");
+  mUndoJournal.setPath(recoveryPath.GetFullPath().ToStdString());
+  mUndoJournal.setUndoManager(&mUndoManager);
 
   mMainWindow = new MainWindow(mDocument->sketch(), &mUndoManager, mViewContext);
   mMainWindow->SetMenuBar(mMenuBar);
   mMainWindow->Maximize(true);
   mMainWindow->Show();
 
+  // The journal is only started once any recovery has read the previous session's
+  if (!recover()) {
+    mUndoJournal.setDocument(mDocument);
+  }
+
+  mAutosaveTimer.SetOwner(this, ID::AutosaveTimer);
+  updateAutosaveTimer();
+
+  // Changes to the latest step are held back while they can still merge into it, such as during a drag, so write
+  // them out regularly
+  mJournalTimer.SetOwner(this, ID::JournalTimer);
+  mJournalTimer.Start(config->ReadLong("UndoJournalInterval", 1000));
+
   return true;
 }
 
+int Application::OnExit()
+{
+  // Exiting normally, so there's nothing to recover
+  mAutosaveTimer.Stop();
+  mAutosave.discard();
+
+  mJournalTimer.Stop();
+  mUndoJournal.discard();
+
+  return wxApp::OnExit();
+}
+
 void Application::onUndo(wxCommandEvent& event)
 {
   mUndoManager.undo();
@@ -110,6 +244,28 @@ void Application::onRedo(wxCommandEvent& event)
 }
 
 void Application::onSave(wxCommandEvent& event)
+{
+  if (mFile.path().empty()) {
+    saveAs(false);
+    return;
+  }
+
+  std::cout << "Saving changes to " << mFile.path() << std::endl;
+
+  mFile.save();
+}
+
+void Application::onSaveAs(wxCommandEvent& event)
+{
+  saveAs(false);
+}
+
+void Application::onSaveCompressed(wxCommandEvent& event)
+{
+  saveAs(true);
+}
+
+void Application::saveAs(bool compress)
 {
   wxFileDialog dialog(mMainWindow, "Open", "", "", "", wxFD_SAVE | wxFD_OVERWRITE_PROMPT);
 
@@ -118,10 +274,108 @@ void Application::onSave(wxCommandEvent& event)
   }
 
   std::cout << "Saving to " << dialog.GetPath() << std::endl;
-  std::ofstream stream(dialog.GetPath(), std::ios_base::binary);
 
-  Serialisation::Writer writer(stream);
-  Serialisation::Layout::process(writer, mDocument);
+  mFile.saveAs(dialog.GetPath().ToStdString(), compress);
+}
+
+void Application::onCleanUp(wxCommandEvent& event)
+{
+  int answer = wxMessageBox("Cleaning up removes unused nodes and control points, and numbers the document's elements "
+    "again. The undo history will be cleared. Continue?", "Clean Up", wxYES_NO | wxICON_QUESTION, mMainWindow);
+
+  if (answer != wxYES) {
+    return;
+  }
+
+  Controller::DocumentCleanup::Result result;
+  Model::Document* document = Controller::DocumentCleanup::cleanUp(mDocument, &result);
+
+  // The file's elements have their old IDs, so it's written again in full when it's next saved
+  mFile.setDocument(document, mFile.path(), false, mFile.compressed());
+  setDocument(document);
+
+  wxLogStatus("Removed %zu nodes and %zu control points, and reduced the highest ID from %u to %u",
+    result.mRemovedNodes, result.mRemovedControlPoints, result.mNextIDBefore - 1, result.mNextIDAfter - 1);
+}
+
+void Application::onAutosave(wxCommandEvent& event)
+{
+  wxConfigBase::Get()->Write("Autosave", event.IsChecked());
+  updateAutosaveTimer();
+}
+
+void Application::onAutosaveTimer(wxTimerEvent& event)
+{
+  // Only the elements changed since the last autosave are copied here, and the file is written on another thread
+  mAutosave.update();
+}
+
+void Application::updateAutosaveTimer()
+{
+  wxConfigBase* config = wxConfigBase::Get();
+  long interval = config->ReadLong("AutosaveInterval", 60);
+
+  if (config->ReadBool("Autosave", true) && interval > 0) {
+    mAutosaveTimer.Start(1000 * interval);
+  } else {
+    mAutosaveTimer.Stop();
+  }
+}
+
+bool Application::recover()
+{
+  if (!mAutosave.hasRecovery() && !mUndoJournal.hasRecovery()) {
+    return false;
+  }
+
+  int answer = wxMessageBox("The last session didn't exit normally. Recover its autosaved changes?", "Recover",
+    wxYES_NO | wxICON_QUESTION, mMainWindow);
+
+  if (answer != wxYES) {
+    mAutosave.discard();
+    mUndoJournal.discard();
+    return false;
+  }
+
+  // The journal is written as each step is made, so it's more recent than the autosave, and it has the history too
+  Model::Document* document = nullptr;
+
+  if (mUndoJournal.hasRecovery()) {
+    std::cout << "Recovering " << mUndoJournal.path() << std::endl;
+
+    document = mUndoJournal.recover();
+  }
+
+  if (!document && mAutosave.hasRecovery()) {
+    std::cout << "Recovering " << mAutosave.path() << std::endl;
+
+    document = mAutosave.recover();
+  }
+
+  if (!document) {
+    return false;
+  }
+
+  mFile.setDocument(document, "", false, false);
+  setDocument(document);
+
+  mUndoJournal.restoreHistory();
+
+  return true;
+}
+
+void Application::setDocument(Model::Document* document)
+{
+  mAutosave.setDocument(document);
+
+  mUndoManager.clear();
+  mCheckpoints.setDocument(document);
+  mUndoJournal.setDocument(document);
+
+  delete mDocument;
+  mDocument = document;
+
+  mViewContext.mModelChangedSignal.emit(mDocument->sketch());
 }
 
 void Application::onOpen(wxCommandEvent& event)
@@ -138,12 +392,10 @@ void Application::onOpen(wxCommandEvent& event)
   Serialisation::Reader reader(stream);
   Model::Document* newDocument = Serialisation::Layout::process(reader, nullptr);
 
-  mUndoManager.clear();
+  mFile.setDocument(newDocument, dialog.GetPath().ToStdString(), Serialisation::Layout::acceptsUpdates(reader),
+    reader.packed());
 
-  delete mDocument;
-  mDocument = newDocument;
-
-  mViewContext.mModelChangedSignal.emit(mDocument->sketch());
+  setDocument(newDocument);
 }
 
 wxIMPLEMENT_APP(Application);
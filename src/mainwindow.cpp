@@ -6,6 +6,8 @@
 
 #include <wx/clrpicker.h>
 
+#include <algorithm>
+
 MainWindow::MainWindow(Model::Sketch* model, Controller::UndoManager* undoManager, View::Context& viewContext)
   : wxFrame(nullptr, wxID_ANY, "Dendrite")
   , mUndoManager(undoManager)
@@ -26,6 +28,14 @@ MainWindow::MainWindow(Model::Sketch* model, Controller::UndoManager* undoManage
   toolSizer->Add(new wxStaticText(this, wxID_ANY, "Fill"), wxSizerFlags().CentreVertical().Right());
   toolSizer->Add(fillColourPicker);
 
+  // The first row is the state before the oldest step in the history, and each step follows it
+  mHistoryList = new wxListBox(this, wxID_ANY, wxDefaultPosition, wxSize(200, 300));
+  toolSizer->Add(new wxStaticText(this, wxID_ANY, "History"), wxSizerFlags().Top().Right());
+  toolSizer->Add(mHistoryList, wxSizerFlags(1).Expand());
+
+  mHistoryList->Bind(wxEVT_LISTBOX,
+    [this](wxCommandEvent& event) { mUndoManager->jumpTo(event.GetSelection()); });
+
   strokeColourPicker->Bind(wxEVT_COLOURPICKER_CHANGED,
     [sketchView](wxColourPickerEvent& event) { sketchView->setStrokeColour(event.GetColour()); });
   fillColourPicker->Bind(wxEVT_COLOURPICKER_CHANGED,
@@ -34,8 +44,65 @@ MainWindow::MainWindow(Model::Sketch* model, Controller::UndoManager* undoManage
   SetSizerAndFit(mainBox);
 
   CreateStatusBar();
+
+  undoManager->signalHistoryChanged().connect(sigc::mem_fun(*this, &MainWindow::showUndoHistory));
 }
 
 MainWindow::~MainWindow()
 {
 }
+
+void MainWindow::showUndoHistory()
+{
+  SetStatusText(wxString::Format("Undo history: %zu steps, %.1f MB", mUndoManager->count(),
+    mUndoManager->memoryUsage() / (1024.0 * 1024.0)));
+
+  const size_t count = mUndoManager->count();
+  const size_t position = mUndoManager->position();
+
+  mHistoryList->Freeze();
+
+  if (mHistoryList->IsEmpty()) {
+    mHistoryList->Append("Start");
+  }
+
+  // Steps only leave the history from its ends, trimmed from the oldest or replaced from the newest, so the rows
+  // for the steps in between stay as they are
+  while (!mHistorySerials.empty() && (count == 0 || mHistorySerials.front() < mUndoManager->serial(1))) {
+    mHistoryList->Delete(1);
+    mHistorySerials.pop_front();
+  }
+
+  size_t kept = std::min(mHistorySerials.size(), count);
+
+  while (kept > 0 && mHistorySerials[kept - 1] != mUndoManager->serial(kept)) {
+    --kept;
+  }
+
+  while (mHistorySerials.size() > kept) {
+    mHistoryList->Delete(mHistorySerials.size());
+    mHistorySerials.pop_back();
+  }
+
+  wxArrayString steps;
+  steps.Alloc(count - kept);
+
+  for (size_t step = kept + 1; step <= count; ++step) {
+    steps.Add(mUndoManager->description(step));
+    mHistorySerials.push_back(mUndoManager->serial(step));
+  }
+
+  if (!steps.IsEmpty()) {
+    mHistoryList->Append(steps);
+  }
+
+  // The latest step that's applied may have taken in another command, by merging or as a group, which can change
+  // what it's called
+  if (position > 0 && position <= kept) {
+    mHistoryList->SetString(position, mUndoManager->description(position));
+  }
+
+  mHistoryList->SetSelection(position);
+  mHistoryList->EnsureVisible(mUndoManager->position());
+  mHistoryList->Thaw();
+}
@@ -2,6 +2,8 @@
 
 #include <wx/wx.h>
 
+#include <deque>
+
 namespace Model
 {
   class Sketch;
@@ -24,5 +26,10 @@ public:
   ~MainWindow() override;
 
 private:
+  void showUndoHistory();
+
   Controller::UndoManager* mUndoManager;
+  wxListBox* mHistoryList;
+  // The steps that the rows after the first are showing, so that only the rows for steps that changed are updated
+  std::deque<size_t> mHistorySerials;
 };
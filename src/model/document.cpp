@@ -15,4 +15,9 @@ Document::~Document()
 {
 }
 
+Sketch* Document::definition(const ID<Sketch>& id) const
+{
+  return mDefinitions.at(id);
+}
+
 }
@@ -1,14 +1,20 @@
 #pragma once
 
+#include "model/journal.h"
 #include "utilities/id.h"
 
+#include <unordered_map>
+
 namespace Controller
 {
+  class DocumentCheckpoints;
+  class DocumentCleanup;
   class Sketch;
 }
 
 namespace Serialisation
 {
+  class Layout;
   class Reader;
 }
 
@@ -24,12 +30,23 @@ public:
   ~Document();
 
   Sketch* sketch() const { return mSketch; }
+  Journal& journal() { return mJournal; }
+
+  // Definitions are sketches shared by the whole document, which are drawn wherever they have instances
+  typedef std::unordered_map<ID<Sketch>, Sketch*> DefinitionList;
+  const DefinitionList& definitions() const { return mDefinitions; }
+  Sketch* definition(const ID<Sketch>& id) const;
 
 private:
+  friend class Controller::DocumentCheckpoints;
+  friend class Controller::DocumentCleanup;
   friend class Controller::Sketch;
+  friend class Serialisation::Layout;
   friend class Serialisation::Reader;
 
+  Journal mJournal;
   Sketch* mSketch;
+  DefinitionList mDefinitions;
   IDValue mNextID;
 };
 
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "utilities/geometry.h"
+#include "utilities/id.h"
+
+namespace Controller
+{
+  class Sketch;
+}
+
+namespace Serialisation
+{
+  class Layout;
+}
+
+namespace Model
+{
+
+class Sketch;
+
+// A placement of one of the document's definitions, which draws the definition's elements offset by its position
+class Instance
+{
+public:
+  Instance()
+    : Instance(ID<Sketch>(), {0, 0})
+  {}
+
+  Instance(const ID<Sketch>& definition, const Point& position)
+    : mDefinition(definition)
+    , mPosition(position)
+  {}
+
+  const ID<Sketch>& definition() const { return mDefinition; }
+  const Point& position() const { return mPosition; }
+
+private:
+  friend class Controller::Sketch;
+  friend class Serialisation::Layout;
+
+  ID<Sketch> mDefinition;
+  Point mPosition;
+};
+
+}
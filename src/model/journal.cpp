@@ -0,0 +1,44 @@
+#include "model/journal.h"
+
+#include <cassert>
+
+namespace Model
+{
+
+void ChangeSet::add(const Sketch* sketch, const Reference& reference)
+{
+  if (reference.type() == Type::Null) {
+    mDrawOrders.insert(sketch);
+  } else {
+    mReferences.insert(reference);
+  }
+}
+
+void ChangeSet::merge(const ChangeSet& other)
+{
+  mReferences.insert(other.mReferences.begin(), other.mReferences.end());
+  mDrawOrders.insert(other.mDrawOrders.begin(), other.mDrawOrders.end());
+}
+
+void ChangeSet::clear()
+{
+  mReferences.clear();
+  mDrawOrders.clear();
+}
+
+void Journal::beginBatch()
+{
+  ++mBatchDepth;
+}
+
+void Journal::endBatch()
+{
+  assert(mBatchDepth > 0);
+
+  if (--mBatchDepth == 0 && !mBatch.isEmpty()) {
+    mSignalBatchChanged.emit(mBatch);
+    mBatch.clear();
+  }
+}
+
+}
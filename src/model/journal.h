@@ -0,0 +1,67 @@
+#pragma once
+
+#include "model/reference.h"
+
+#include <set>
+#include <sigc++/sigc++.h>
+
+namespace Model
+{
+
+class Sketch;
+
+// Accumulates the elements reported by a journal, so that they can be dealt with together later
+class ChangeSet
+{
+public:
+  void add(const Sketch* sketch, const Reference& reference);
+  void merge(const ChangeSet& other);
+  void clear();
+
+  bool isEmpty() const { return mReferences.empty() && mDrawOrders.empty(); }
+  bool drawOrderChanged(const Sketch* sketch) const { return mDrawOrders.count(sketch) > 0; }
+
+  const std::set<Reference>& references() const { return mReferences; }
+  // The sketches whose draw orders changed
+  const std::set<const Sketch*>& drawOrders() const { return mDrawOrders; }
+
+private:
+  std::set<Reference> mReferences;
+  std::set<const Sketch*> mDrawOrders;
+};
+
+// Reports every change made to a document's elements. A null reference means that the sketch's draw order changed.
+// Changes made during a batch are collected instead, and reported together once the outermost batch ends.
+class Journal
+{
+public:
+  using Signal = sigc::signal<void(const Sketch*, const Reference&)>;
+  using BatchSignal = sigc::signal<void(const ChangeSet&)>;
+
+  Journal()
+    : mBatchDepth(0)
+  {}
+
+  void recordChange(const Sketch* sketch, const Reference& reference)
+  {
+    if (mBatchDepth > 0) {
+      mBatch.add(sketch, reference);
+    } else {
+      mSignalChanged.emit(sketch, reference);
+    }
+  }
+
+  void beginBatch();
+  void endBatch();
+
+  Signal signalChanged() { return mSignalChanged; }
+  BatchSignal signalBatchChanged() { return mSignalBatchChanged; }
+
+private:
+  Signal mSignalChanged;
+  BatchSignal mSignalBatchChanged;
+  ChangeSet mBatch;
+  int mBatchDepth;
+};
+
+}
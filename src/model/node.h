@@ -7,6 +7,7 @@
 
 namespace Controller
 {
+  class DocumentCleanup;
   class Node;
 }
 
@@ -46,6 +47,7 @@ public:
   const ControlPointList& controlPoints() const { return mControlPoints; }
 
 private:
+  friend class Controller::DocumentCleanup;
   friend class Controller::Node;
   friend class Serialisation::Layout;
 
@@ -7,6 +7,7 @@
 
 namespace Controller
 {
+  class DocumentCleanup;
   class Path;
 }
 
@@ -46,6 +47,7 @@ public:
   const Colour& fillColour() const { return mFillColour; }
 
 private:
+  friend class Controller::DocumentCleanup;
   friend class Controller::Path;
   friend class Serialisation::Layout;
 
@@ -12,6 +12,7 @@ namespace Model
 {
 
 class ControlPoint;
+class Instance;
 class Node;
 class Path;
 class Sketch;
@@ -44,6 +45,10 @@ public:
     : Reference(Type::Sketch, id.value())
   {}
 
+  Reference(const ID<Instance>& id)
+    : Reference(Type::Instance, id.value())
+  {}
+
   Type type() const { return mType; }
 
   template<class TModel>
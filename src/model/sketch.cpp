@@ -27,4 +27,9 @@ Sketch* Sketch::sketch(const ID<Sketch>& id) const
   return mSketches.at(id);
 }
 
+Instance* Sketch::instance(const ID<Instance>& id) const
+{
+  return mInstances.at(id);
+}
+
 }
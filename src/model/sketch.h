@@ -9,6 +9,8 @@
 
 namespace Controller
 {
+  class DocumentCheckpoints;
+  class DocumentCleanup;
   class Sketch;
 }
 
@@ -23,6 +25,7 @@ namespace Model
 
 class ControlPoint;
 class Document;
+class Instance;
 class Node;
 class Path;
 
@@ -37,6 +40,7 @@ public:
   public:
     auto begin() const { return mCollection.begin(); }
     auto end() const { return mCollection.end(); }
+    bool contains(const ID<TModel>& id) const { return mCollection.count(id) > 0; }
 
   private:
     friend class Sketch;
@@ -52,6 +56,7 @@ public:
   Accessor<ControlPoint> controlPoints() const { return Accessor(mControlPoints); }
   Accessor<Path> paths() const { return Accessor(mPaths); }
   Accessor<Sketch> sketches() const { return Accessor(mSketches); }
+  Accessor<Instance> instances() const { return Accessor(mInstances); }
 
   Document* parent() const { return mParent; }
 
@@ -59,6 +64,7 @@ public:
   Node* node(const ID<Node>& id) const;
   Path* path(const ID<Path>& id) const;
   Sketch* sketch(const ID<Sketch>& id) const;
+  Instance* instance(const ID<Instance>& id) const;
 
   typedef std::vector<Reference> DrawOrder;
   const DrawOrder& drawOrder() const { return mDrawOrder; }
@@ -66,6 +72,8 @@ public:
   const Point& position() const { return mPosition; }
 
 private:
+  friend class Controller::DocumentCheckpoints;
+  friend class Controller::DocumentCleanup;
   friend class Controller::Sketch;
   friend class Serialisation::Layout;
   friend class Serialisation::Reader;
@@ -74,11 +82,13 @@ private:
   typedef std::unordered_map<ID<Node>, Node*> NodeList;
   typedef std::unordered_map<ID<Path>, Path*> PathList;
   typedef std::unordered_map<ID<Sketch>, Sketch*> SketchList;
+  typedef std::unordered_map<ID<Instance>, Instance*> InstanceList;
 
   ControlPointList mControlPoints;
   NodeList mNodes;
   PathList mPaths;
   SketchList mSketches;
+  InstanceList mInstances;
   DrawOrder mDrawOrder;
   Document* mParent;
   Point mPosition;
@@ -9,6 +9,7 @@ enum class Type
   Node,
   ControlPoint,
   Sketch,
+  Instance,
   Null,
 };
 
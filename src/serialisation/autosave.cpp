@@ -0,0 +1,112 @@
+#include "serialisation/autosave.h"
+
+#include "model/document.h"
+#include "serialisation/layout.h"
+#include "serialisation/reader.h"
+#include "serialisation/writer.h"
+
+#include <filesystem>
+#include <fstream>
+
+namespace Serialisation
+{
+
+Autosave::Autosave()
+  : mDocument(nullptr)
+  , mSnapshot(nullptr)
+  , mWriting(false)
+{
+}
+
+Autosave::~Autosave()
+{
+  mConnection.disconnect();
+  mBatchConnection.disconnect();
+  wait();
+
+  delete mSnapshot;
+}
+
+void Autosave::setDocument(Model::Document* document)
+{
+  mConnection.disconnect();
+  mBatchConnection.disconnect();
+
+  mDocument = document;
+  mChanges.clear();
+  mConnection = mDocument->journal().signalChanged().connect(sigc::mem_fun(mChanges, &Model::ChangeSet::add));
+  mBatchConnection = mDocument->journal().signalBatchChanged().connect(
+    sigc::mem_fun(mChanges, &Model::ChangeSet::merge));
+
+  // Copy the whole document now, as it's just been created or loaded, so that updates only need to copy changes
+  wait();
+
+  delete mSnapshot;
+  mSnapshot = new Model::Document;
+
+  Layout::updateSnapshot(mSnapshot, mDocument, nullptr);
+}
+
+void Autosave::update()
+{
+  if (mWriting || mPath.empty() || mChanges.isEmpty()) {
+    return;
+  }
+
+  wait();
+
+  Layout::updateSnapshot(mSnapshot, mDocument, &mChanges);
+  mChanges.clear();
+
+  mWriting = true;
+  mThread = std::thread(&Autosave::write, this);
+}
+
+void Autosave::write()
+{
+  // Write to a temporary file first, so that the previous autosave survives a crash part way through
+  const std::string temporaryPath = mPath + ".tmp";
+
+  {
+    std::ofstream stream(temporaryPath, std::ios_base::binary);
+
+    Writer writer(stream);
+    Layout::process(writer, mSnapshot);
+  }
+
+  std::error_code error;
+  std::filesystem::rename(temporaryPath, mPath, error);
+
+  mWriting = false;
+}
+
+void Autosave::wait()
+{
+  if (mThread.joinable()) {
+    mThread.join();
+  }
+}
+
+bool Autosave::hasRecovery() const
+{
+  std::error_code error;
+  return !mPath.empty() && std::filesystem::exists(mPath, error);
+}
+
+Model::Document* Autosave::recover() const
+{
+  std::ifstream stream(mPath, std::ios_base::binary);
+
+  Reader reader(stream);
+  return Layout::process(reader, nullptr);
+}
+
+void Autosave::discard()
+{
+  wait();
+
+  std::error_code error;
+  std::filesystem::remove(mPath, error);
+}
+
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include "model/journal.h"
+
+#include <atomic>
+#include <string>
+#include <thread>
+
+namespace Model
+{
+  class Document;
+}
+
+namespace Serialisation
+{
+
+// Writes a copy of a document to a recovery file on a background thread. The copy is taken when the document is set,
+// and then brought up to date on the calling thread by copying only the elements that changed since the last autosave,
+// so that editing can carry on while the copy is written.
+class Autosave
+{
+public:
+  Autosave();
+  ~Autosave();
+
+  void setPath(const std::string& path) { mPath = path; }
+  const std::string& path() const { return mPath; }
+
+  void setDocument(Model::Document* document);
+
+  // Brings the snapshot up to date and starts writing it, unless the previous autosave is still being written
+  void update();
+
+  // Whether a previous session left a recovery file behind
+  bool hasRecovery() const;
+  Model::Document* recover() const;
+  // Waits for any autosave in progress and removes the recovery file
+  void discard();
+
+private:
+  void write();
+  void wait();
+
+  std::string mPath;
+  Model::Document* mDocument;
+  Model::ChangeSet mChanges;
+  sigc::connection mConnection;
+  sigc::connection mBatchConnection;
+
+  // Only touched by the writing thread while it runs
+  Model::Document* mSnapshot;
+
+  std::thread mThread;
+  std::atomic<bool> mWriting;
+};
+
+}
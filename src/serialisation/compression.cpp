@@ -0,0 +1,187 @@
+#include "serialisation/compression.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace Serialisation
+{
+
+namespace
+{
+
+const size_t MinMatch = 4;
+const size_t MaxOffset = 65535;
+const size_t LastLiterals = 5;
+const size_t MatchSearchLimit = 12;
+const int HashBits = 14;
+const int SkipShift = 6;
+
+uint32_t read32(const unsigned char* bytes)
+{
+  uint32_t value;
+  memcpy(&value, bytes, sizeof(value));
+  return value;
+}
+
+uint32_t hash(uint32_t sequence)
+{
+  return (sequence * 2654435761u) >> (32 - HashBits);
+}
+
+void writeLength(std::string* output, size_t length)
+{
+  while (length >= 255) {
+    output->push_back(static_cast<char>(255));
+    length -= 255;
+  }
+
+  output->push_back(static_cast<char>(length));
+}
+
+void writeSequence(std::string* output, const unsigned char* literals, size_t literalCount, size_t offset,
+  size_t matchLength)
+{
+  const size_t matchCode = matchLength > 0 ? matchLength - MinMatch : 0;
+
+  output->push_back(static_cast<char>((std::min<size_t>(literalCount, 15) << 4) | std::min<size_t>(matchCode, 15)));
+
+  if (literalCount >= 15) {
+    writeLength(output, literalCount - 15);
+  }
+
+  output->append(reinterpret_cast<const char*>(literals), literalCount);
+
+  if (matchLength > 0) {
+    output->push_back(static_cast<char>(offset & 0xFF));
+    output->push_back(static_cast<char>(offset >> 8));
+
+    if (matchCode >= 15) {
+      writeLength(output, matchCode - 15);
+    }
+  }
+}
+
+bool readLength(const unsigned char** input, const unsigned char* end, size_t* length)
+{
+  unsigned char byte;
+
+  do {
+    if (*input >= end) {
+      return false;
+    }
+
+    byte = **input;
+    ++*input;
+    *length += byte;
+  } while (byte == 255);
+
+  return true;
+}
+
+}
+
+std::string compressBlock(const char* data, size_t size)
+{
+  const unsigned char* input = reinterpret_cast<const unsigned char*>(data);
+
+  std::string output;
+  output.reserve(size / 2 + 16);
+
+  std::vector<uint32_t> table(size_t(1) << HashBits, 0);
+
+  const size_t matchLimit = size > MatchSearchLimit ? size - MatchSearchLimit : 0;
+  size_t anchor = 0;
+  size_t position = 0;
+
+  while (position < matchLimit) {
+    const uint32_t sequence = read32(input + position);
+    uint32_t& entry = table[hash(sequence)];
+    const size_t candidate = entry;
+    entry = static_cast<uint32_t>(position);
+
+    if (candidate < position && position - candidate <= MaxOffset && read32(input + candidate) == sequence) {
+      size_t length = MinMatch;
+
+      while (position + length < size - LastLiterals && input[candidate + length] == input[position + length]) {
+        ++length;
+      }
+
+      writeSequence(&output, input + anchor, position - anchor, position - candidate, length);
+
+      position += length;
+      anchor = position;
+    } else {
+      // Step faster through data that isn't matching
+      position += 1 + ((position - anchor) >> SkipShift);
+    }
+  }
+
+  writeSequence(&output, input + anchor, size - anchor, 0, 0);
+
+  return output;
+}
+
+bool decompressBlock(const char* data, size_t size, char* output, size_t outputSize)
+{
+  const unsigned char* input = reinterpret_cast<const unsigned char*>(data);
+  const unsigned char* inputEnd = input + size;
+  size_t position = 0;
+
+  while (input < inputEnd) {
+    const unsigned char token = *input;
+    ++input;
+
+    size_t literalCount = token >> 4;
+
+    if (literalCount == 15 && !readLength(&input, inputEnd, &literalCount)) {
+      return false;
+    }
+
+    if (literalCount > static_cast<size_t>(inputEnd - input) || literalCount > outputSize - position) {
+      return false;
+    }
+
+    memcpy(output + position, input, literalCount);
+    input += literalCount;
+    position += literalCount;
+
+    // The last sequence has no match. Stopping once the output is full also ignores any chunk padding.
+    if (position == outputSize) {
+      break;
+    }
+
+    if (inputEnd - input < 2) {
+      return false;
+    }
+
+    const size_t offset = input[0] | (input[1] << 8);
+    input += 2;
+
+    size_t matchLength = token & 0x0F;
+
+    if (matchLength == 15 && !readLength(&input, inputEnd, &matchLength)) {
+      return false;
+    }
+
+    matchLength += MinMatch;
+
+    if (offset == 0 || offset > position || matchLength > outputSize - position) {
+      return false;
+    }
+
+    // Matches may overlap their own output, so copy forwards one byte at a time
+    const char* source = output + position - offset;
+
+    for (size_t i = 0; i < matchLength; ++i) {
+      output[position + i] = source[i];
+    }
+
+    position += matchLength;
+  }
+
+  return position == outputSize;
+}
+
+}
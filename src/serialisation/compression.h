@@ -0,0 +1,14 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+namespace Serialisation
+{
+
+// LZ77 block compressor using the LZ4 block layout: each sequence is a token byte holding the literal and match
+// lengths, the literals themselves, then a 16-bit match offset.
+std::string compressBlock(const char* data, size_t size);
+bool decompressBlock(const char* data, size_t size, char* output, size_t outputSize);
+
+}
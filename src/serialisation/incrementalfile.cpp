@@ -0,0 +1,242 @@
+#include "serialisation/incrementalfile.h"
+
+#include "model/document.h"
+#include "serialisation/layout.h"
+#include "serialisation/reader.h"
+#include "serialisation/writer.h"
+
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+
+namespace Serialisation
+{
+
+namespace
+{
+
+// Compact once a file holds this many updates, or once they take up more space than the rest of the file
+const int CompactionUpdateCount = 64;
+
+std::streamoff fileSize(const std::string& path)
+{
+  std::ifstream stream(path, std::ios_base::binary | std::ios_base::ate);
+  return stream ? std::streamoff(stream.tellg()) : 0;
+}
+
+}
+
+IncrementalFile::IncrementalFile()
+  : mDocument(nullptr)
+  , mAcceptsUpdates(false)
+  , mCompress(false)
+  , mGeneration(0)
+  , mBaseSize(0)
+  , mUpdateSize(0)
+  , mUpdateCount(0)
+  , mCompacting(false)
+{
+}
+
+IncrementalFile::~IncrementalFile()
+{
+  mConnection.disconnect();
+  mBatchConnection.disconnect();
+
+  if (mCompactionThread.joinable()) {
+    mCompactionThread.join();
+  }
+}
+
+void IncrementalFile::setDocument(Model::Document* document, const std::string& path, bool acceptsUpdates,
+  bool compress)
+{
+  mConnection.disconnect();
+  mBatchConnection.disconnect();
+
+  mDocument = document;
+  mChanges.clear();
+  mConnection = mDocument->journal().signalChanged().connect(sigc::mem_fun(mChanges, &Model::ChangeSet::add));
+  mBatchConnection = mDocument->journal().signalBatchChanged().connect(
+    sigc::mem_fun(mChanges, &Model::ChangeSet::merge));
+
+  std::lock_guard<std::mutex> lock(mMutex);
+
+  mPath = path;
+  mAcceptsUpdates = acceptsUpdates;
+  mCompress = compress;
+
+  ++mGeneration;
+  mBaseSize = fileSize(path);
+  mUpdateSize = 0;
+  mUpdateCount = 0;
+}
+
+void IncrementalFile::saveAs(const std::string& path, bool compress)
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+
+  std::ofstream stream(path, std::ios_base::binary);
+
+  Writer writer(stream, compress);
+  writer.setKeyed(true);
+  Layout::process(writer, mDocument);
+
+  mPath = path;
+  mAcceptsUpdates = true;
+  mCompress = compress;
+
+  ++mGeneration;
+  mBaseSize = stream.tellp();
+  mUpdateSize = 0;
+  mUpdateCount = 0;
+
+  mChanges.clear();
+}
+
+void IncrementalFile::save()
+{
+  if (!mAcceptsUpdates) {
+    // The file was written before incremental saving, or by a different version, so replace it
+    saveAs(mPath, mCompress);
+    return;
+  }
+
+  if (mChanges.isEmpty()) {
+    return;
+  }
+
+  bool missing = false;
+  bool compact = false;
+
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    std::fstream stream(mPath, std::ios_base::in | std::ios_base::out | std::ios_base::binary);
+
+    if (stream) {
+      stream.seekp(0, std::ios_base::end);
+
+      std::streamoff start = stream.tellp();
+
+      Writer writer(stream, mCompress);
+      Layout::appendUpdate(writer, mDocument, mChanges);
+
+      mUpdateSize += std::streamoff(stream.tellp()) - start;
+      ++mUpdateCount;
+
+      compact = mUpdateCount >= CompactionUpdateCount || mUpdateSize > mBaseSize;
+    } else {
+      missing = true;
+    }
+  }
+
+  if (missing) {
+    // The file has gone away since it was last saved, so write it again from scratch
+    saveAs(mPath, mCompress);
+    return;
+  }
+
+  mChanges.clear();
+
+  if (compact) {
+    startCompaction();
+  }
+}
+
+void IncrementalFile::startCompaction()
+{
+  if (mCompacting) {
+    return;
+  }
+
+  if (mCompactionThread.joinable()) {
+    mCompactionThread.join();
+  }
+
+  std::lock_guard<std::mutex> lock(mMutex);
+
+  mCompacting = true;
+  mCompactionThread = std::thread(&IncrementalFile::compact, this, mPath, fileSize(mPath), mCompress, mGeneration);
+}
+
+void IncrementalFile::compact(std::string path, std::streamoff length, bool compress, unsigned int generation)
+{
+  // Saving again to the same path truncates the file, so it's read under the lock, and only if it's still the file
+  // that compaction started on. The RIFF size is fixed up afterwards in case it already covers later updates.
+  std::string contents(length, '\0');
+
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    std::ifstream input(path, std::ios_base::binary);
+
+    if (generation != mGeneration || !input.read(contents.data(), length)) {
+      mCompacting = false;
+      return;
+    }
+  }
+
+  std::stringstream memory(contents, std::ios_base::in | std::ios_base::out | std::ios_base::binary);
+
+  {
+    memory.seekp(0, std::ios_base::end);
+
+    Writer writer(memory);
+    Layout::extendFile(writer);
+  }
+
+  Reader reader(memory);
+  Model::Document* document = Layout::process(reader, nullptr);
+
+  const std::string compactPath = path + ".compact";
+
+  std::streamoff compactSize;
+
+  {
+    std::ofstream output(compactPath, std::ios_base::binary);
+
+    Writer writer(output, compress);
+    writer.setKeyed(true);
+    Layout::process(writer, document);
+
+    compactSize = output.tellp();
+  }
+
+  delete document;
+
+  std::lock_guard<std::mutex> lock(mMutex);
+
+  if (generation == mGeneration) {
+    // Carry over the updates that were appended while compacting, which still apply as elements keep their IDs
+    std::streamoff updateSize = fileSize(path) - length;
+
+    if (updateSize > 0) {
+      std::ifstream input(path, std::ios_base::binary);
+      input.seekg(length);
+
+      std::fstream output(compactPath, std::ios_base::in | std::ios_base::out | std::ios_base::binary);
+      output.seekp(0, std::ios_base::end);
+      output << input.rdbuf();
+
+      Writer writer(output);
+      Layout::extendFile(writer);
+    }
+
+    std::error_code error;
+    std::filesystem::rename(compactPath, path, error);
+
+    if (!error) {
+      mBaseSize = compactSize;
+      mUpdateSize = updateSize;
+      mUpdateCount = 0;
+    }
+  } else {
+    std::error_code error;
+    std::filesystem::remove(compactPath, error);
+  }
+
+  mCompacting = false;
+}
+
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "model/journal.h"
+
+#include <atomic>
+#include <ios>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace Model
+{
+  class Document;
+}
+
+namespace Serialisation
+{
+
+// Saves a document by appending the elements that changed since the last save to its file, so that saving takes time
+// in proportion to the size of the edit. Once the appended updates grow too large, the file is compacted on a
+// background thread.
+class IncrementalFile
+{
+public:
+  IncrementalFile();
+  ~IncrementalFile();
+
+  // Starts tracking changes to a document, which was loaded from path unless it's empty
+  void setDocument(Model::Document* document, const std::string& path, bool acceptsUpdates, bool compress);
+
+  const std::string& path() const { return mPath; }
+  bool compressed() const { return mCompress; }
+
+  // Writes the whole document to a new file
+  void saveAs(const std::string& path, bool compress);
+  // Appends the changes since the last save to the current file
+  void save();
+
+private:
+  void startCompaction();
+  void compact(std::string path, std::streamoff length, bool compress, unsigned int generation);
+
+  Model::Document* mDocument;
+  Model::ChangeSet mChanges;
+  sigc::connection mConnection;
+  sigc::connection mBatchConnection;
+  std::string mPath;
+  bool mAcceptsUpdates;
+  bool mCompress;
+
+  // Guards the file, and the members below, against the compaction thread
+  std::mutex mMutex;
+  unsigned int mGeneration;
+  std::streamoff mBaseSize;
+  std::streamoff mUpdateSize;
+  int mUpdateCount;
+
+  std::thread mCompactionThread;
+  std::atomic<bool> mCompacting;
+};
+
+}
@@ -2,12 +2,15 @@
 
 #include "model/controlpoint.h"
 #include "model/document.h"
+#include "model/instance.h"
+#include "model/journal.h"
 #include "model/node.h"
 #include "model/path.h"
 #include "model/sketch.h"
 #include "serialisation/reader.h"
 #include "serialisation/writer.h"
 
+#include <algorithm>
 #include <cassert>
 
 namespace Serialisation
@@ -29,7 +32,16 @@ public:
   uint32_t mValue;
 };
 
-void checkValid(bool valid, std::string message)
+// Data that's read stops being read once it doesn't match the layout, as though the file had ended there, while
+// anything written must always match it
+void checkValid(Reader& reader, bool valid)
+{
+  if (!valid) {
+    reader.fail();
+  }
+}
+
+void checkValid(Writer&, bool valid)
 {
   assert(valid);
 }
@@ -53,12 +65,29 @@ void simpleValue(TEndpoint& endpoint, Point* value)
   endpoint.asDouble(&value->y);
 }
 
+template <class TEndpoint>
+void point(TEndpoint& endpoint, Point* value, const Point& origin)
+{
+  if (endpoint.packed()) {
+    endpoint.asCoordinate(&value->x, origin.x);
+    endpoint.asCoordinate(&value->y, origin.y);
+  } else {
+    simpleValue(endpoint, value);
+  }
+}
+
 template <class TEndpoint>
 auto beginChunk(TEndpoint& endpoint, ChunkID id)
 {
   return endpoint.beginChunk(id.mValue);
 }
 
+template <class TEndpoint>
+auto beginCompressedChunk(TEndpoint& endpoint, ChunkID id)
+{
+  return endpoint.beginCompressedChunk(id.mValue);
+}
+
 template <class TEndpoint>
 auto beginListChunk(TEndpoint& endpoint, ChunkID id, ChunkID listID)
 {
@@ -67,7 +96,7 @@ auto beginListChunk(TEndpoint& endpoint, ChunkID id, ChunkID listID)
   ChunkID listIDActual = listID;
   simpleValue(endpoint, &listIDActual);
 
-  checkValid(listIDActual == listID, "Unexpected list ID");
+  checkValid(endpoint, listIDActual == listID);
 
   return result;
 }
@@ -159,8 +188,87 @@ static const unsigned int Initial = 1;
 static const unsigned int PathChunks = 2;
 static const unsigned int DrawOrder = 3;
 static const unsigned int SubSketches = 4;
-static const unsigned int Current = 4;
+static const unsigned int FormatFlags = 5;
+static const unsigned int Instances = 6;
+static const unsigned int Current = 6;
+
+}
+
+enum FormatFlag
+{
+  FormatFlag_Compressed = 0x00000001,
+  FormatFlag_Incremental = 0x00000002,
+};
+
+enum UpdateFlag
+{
+  UpdateFlag_DrawOrder = 0x00000001,
+};
+
+// Offset of the RIFF chunk's body, after its ID and size
+const std::streamoff RiffBodyStart = 8;
+
+unsigned int formatFlags(const Writer& writer)
+{
+  return (writer.compress() ? FormatFlag_Compressed : 0) | (writer.keyed() ? FormatFlag_Incremental : 0);
+}
+
+unsigned int formatFlags(const Reader& reader)
+{
+  return 0;
+}
+
+template <class TModel>
+bool copyElement(const std::unordered_map<ID<TModel>, TModel*>& source, const ID<TModel>& id,
+  std::unordered_map<ID<TModel>, TModel*>* destination)
+{
+  auto it = source.find(id);
+
+  if (it == source.end()) {
+    return false;
+  }
+
+  destination->emplace(id, it->second);
+  return true;
+}
+
+template <class TModel>
+void removeElement(std::unordered_map<ID<TModel>, TModel*>* map, const ID<TModel>& id)
+{
+  auto it = map->find(id);
 
+  if (it != map->end()) {
+    delete it->second;
+    map->erase(it);
+  }
+}
+
+template <class TModel>
+void replaceElements(std::unordered_map<ID<TModel>, TModel*>* map,
+  const std::unordered_map<ID<TModel>, TModel*>& replacements)
+{
+  for (auto [id, model] : replacements) {
+    TModel*& current = (*map)[id];
+    delete current;
+    current = model;
+  }
+}
+
+template <class TModel>
+void copyElements(std::unordered_map<ID<TModel>, TModel*>* map)
+{
+  for (auto& [id, model] : *map) {
+    model = new TModel(*model);
+  }
+}
+
+// Manifests only count instances and definitions from the version that added them
+template <class TEndpoint>
+void manifestCount(TEndpoint& endpoint, size_t* count)
+{
+  if (endpoint.version() >= Version::Instances) {
+    endpoint.asUint32(count);
+  }
 }
 
 template <class TEndpoint>
@@ -177,29 +285,76 @@ Model::Document* Layout::process(TEndpoint& endpoint, Model::Document* document)
   endpoint.asUint32(&version);
   endpoint.setVersion(version);
 
+  unsigned int flags = formatFlags(endpoint);
+
+  if (endpoint.version() >= Version::FormatFlags) {
+    endpoint.asUint32(&flags);
+  }
+
   endpoint.endChunk(formatInfoChunk);
 
+  endpoint.setPacked((flags & FormatFlag_Compressed) != 0);
+  endpoint.setKeyed((flags & FormatFlag_Incremental) != 0);
+
   // Sketch
   auto sketchChunk = beginListChunk(endpoint, "LIST", "SKCH");
 
   endpoint.beginObject(&sketch);
 
+  processSketch(endpoint, sketch);
+
+  endpoint.endObject(sketch);
+
+  endpoint.endChunk(sketchChunk);
+
+  // Definitions
+  if (endpoint.version() >= Version::Instances) {
+    processDefinitions(endpoint, sketch->mParent, &sketch->mParent->mDefinitions);
+  }
+
+  // Updates appended to an incremental file, each superseding the elements that it contains
+  while (endpoint.keyed() && endpoint.moreInChunk(riffChunk)) {
+    processUpdate(endpoint, sketch, nullptr, nullptr);
+  }
+
+  endpoint.endChunk(riffChunk);
+
+  return sketch->mParent;
+}
+
+template <class TEndpoint>
+void Layout::processSketch(TEndpoint& endpoint, Model::Sketch* sketch)
+{
   // Nodes
-  auto nodesChunk = beginChunk(endpoint, "NODS");
+  auto nodesChunk = beginCompressedChunk(endpoint, "NODS");
 
-  variableElements(endpoint, &sketch->mNodes, processNode<TEndpoint>);
+  Point previousNode{0, 0};
 
-  endpoint.endChunk(nodesChunk);
+  variableElements(endpoint, &sketch->mNodes,
+    [&previousNode](TEndpoint& endpoint, Model::Node* node) {
+      processNode(endpoint, node, &previousNode);
+    });
+
+  endpoint.endCompressedChunk(nodesChunk);
 
   // Control points
-  auto controlPointsChunk = beginChunk(endpoint, "CPTS");
+  auto controlPointsChunk = beginCompressedChunk(endpoint, "CPTS");
 
-  fixedElements(endpoint, &sketch->mControlPoints, processControlPoint<TEndpoint>);
+  fixedElements(endpoint, &sketch->mControlPoints,
+    [sketch](TEndpoint& endpoint, Model::ControlPoint* controlPoint) {
+      processControlPoint(endpoint, controlPoint, sketch);
+    });
 
-  endpoint.endChunk(controlPointsChunk);
+  endpoint.endCompressedChunk(controlPointsChunk);
 
   // Paths
-  if (endpoint.version() >= Version::PathChunks) {
+  if (endpoint.packed()) {
+    auto pathsChunk = beginCompressedChunk(endpoint, "PTHS");
+
+    variableElements(endpoint, &sketch->mPaths, processPathChunk<TEndpoint>);
+
+    endpoint.endCompressedChunk(pathsChunk);
+  } else if (endpoint.version() >= Version::PathChunks) {
     chunks(endpoint, &sketch->mPaths, "PTHS", processPathChunk<TEndpoint>);
   } else {
     auto pathsChunk = beginChunk(endpoint, "PTHS");
@@ -209,9 +364,22 @@ Model::Document* Layout::process(TEndpoint& endpoint, Model::Document* document)
     endpoint.endChunk(pathsChunk);
   }
 
+  // Instances
+  if (endpoint.version() >= Version::Instances) {
+    auto instancesChunk = beginCompressedChunk(endpoint, "INST");
+
+    fixedElements(endpoint, &sketch->mInstances,
+      [](TEndpoint& endpoint, Model::Instance* instance) {
+        endpoint.id(&instance->mDefinition);
+        point(endpoint, &instance->mPosition, {0, 0});
+      });
+
+    endpoint.endCompressedChunk(instancesChunk);
+  }
+
   // Draw order
   if (endpoint.version() >= Version::SubSketches) {
-    auto drawOrderChunk = beginChunk(endpoint, "ORDR");
+    auto drawOrderChunk = beginCompressedChunk(endpoint, "ORDR");
 
     fixedElements(endpoint, &sketch->mDrawOrder,
       [](TEndpoint& endpoint, Model::Reference* reference) {
@@ -225,10 +393,14 @@ Model::Document* Layout::process(TEndpoint& endpoint, Model::Document* document)
           ID<Model::Sketch> id(reference->mID);
           endpoint.id(&id);
           reference->mID = id.value();
+        } else if (reference->mType == Model::Type::Instance) {
+          ID<Model::Instance> id(reference->mID);
+          endpoint.id(&id);
+          reference->mID = id.value();
         }
       });
 
-    endpoint.endChunk(drawOrderChunk);
+    endpoint.endCompressedChunk(drawOrderChunk);
   } else if (endpoint.version() >= Version::DrawOrder) {
     auto drawOrderChunk = beginChunk(endpoint, "ORDR");
 
@@ -252,20 +424,355 @@ Model::Document* Layout::process(TEndpoint& endpoint, Model::Document* document)
 
     endpoint.endChunk(drawOrderChunk);
   }
+}
 
-  endpoint.endObject(sketch);
+template <class TEndpoint>
+void Layout::processDefinitions(TEndpoint& endpoint, Model::Document* document,
+  Model::Document::DefinitionList* definitions)
+{
+  auto definitionsChunk = beginListChunk(endpoint, "LIST", "DEFS");
 
-  endpoint.endChunk(sketchChunk);
+  // Instances refer to definitions by their document IDs, so those are kept in every format
+  std::vector<ID<Model::Sketch>> ids;
 
-  endpoint.endChunk(riffChunk);
+  for (auto& [id, definition] : *definitions) {
+    ids.push_back(id);
+  }
 
-  return sketch->mParent;
+  std::sort(ids.begin(), ids.end());
+
+  auto idsChunk = beginCompressedChunk(endpoint, "HEAD");
+
+  fixedElements(endpoint, &ids,
+    [](TEndpoint& endpoint, ID<Model::Sketch>* id) {
+      endpoint.id(id);
+    });
+
+  endpoint.endCompressedChunk(idsChunk);
+
+  for (auto& id : ids) {
+    Model::Sketch*& definition = (*definitions)[id];
+
+    if (!definition) {
+      definition = new Model::Sketch(document);
+    }
+
+    auto sketchChunk = beginListChunk(endpoint, "LIST", "SKCH");
+
+    endpoint.beginObject(&definition);
+
+    processSketch(endpoint, definition);
+
+    endpoint.endObject(definition);
+
+    endpoint.endChunk(sketchChunk);
+
+    document->mNextID = std::max(document->mNextID, id.value() + 1);
+  }
+
+  endpoint.endChunk(definitionsChunk);
+}
+
+template <class TEndpoint>
+void Layout::processUpdate(TEndpoint& endpoint, Model::Sketch* sketch, const Model::ChangeSet* changes,
+  std::vector<Model::Reference>* applied)
+{
+  // The update's elements are gathered in a separate sketch, which only owns them once they have been read
+  Model::Sketch update(sketch->mParent);
+  Model::Document::DefinitionList definitions;
+  std::vector<Model::Reference> removed;
+  unsigned int updateFlags = 0;
+
+  if (changes) {
+    collectUpdate(sketch, *changes, &update, &definitions, &removed, &updateFlags);
+  }
+
+  auto updateChunk = beginListChunk(endpoint, "LIST", "UPDT");
+
+  // Removed elements
+  auto removedChunk = beginCompressedChunk(endpoint, "REMV");
+
+  fixedElements(endpoint, &removed,
+    [](TEndpoint& endpoint, Model::Reference* reference) {
+      endpoint.asUint32(&reference->mType);
+      endpoint.asUint32(&reference->mID);
+    });
+
+  endpoint.endCompressedChunk(removedChunk);
+
+  // Added and changed elements
+  Model::Sketch* updateSketch = &update;
+  endpoint.beginObject(&updateSketch);
+
+  processSketch(endpoint, &update);
+
+  if (endpoint.version() >= Version::Instances) {
+    processDefinitions(endpoint, sketch->mParent, &definitions);
+  }
+
+  // Manifest, describing the whole document once the update has been applied
+  auto manifestChunk = beginChunk(endpoint, "MNFT");
+
+  IDValue nextID = sketch->mParent->mNextID;
+  size_t nodeCount = sketch->mNodes.size();
+  size_t controlPointCount = sketch->mControlPoints.size();
+  size_t pathCount = sketch->mPaths.size();
+  size_t instanceCount = sketch->mInstances.size();
+  size_t definitionCount = sketch->mParent->mDefinitions.size();
+
+  endpoint.asUint32(&updateFlags);
+  endpoint.asUint32(&nextID);
+  endpoint.asUint32(&nodeCount);
+  endpoint.asUint32(&controlPointCount);
+  endpoint.asUint32(&pathCount);
+  manifestCount(endpoint, &instanceCount);
+  manifestCount(endpoint, &definitionCount);
+
+  endpoint.endChunk(manifestChunk);
+
+  endpoint.endChunk(updateChunk);
+
+  if (!changes) {
+    // This is an update being read, so apply it
+    if (applied) {
+      reportUpdate(update, definitions, removed, updateFlags, applied);
+    }
+
+    applyUpdate(sketch, &update, &definitions, removed, updateFlags);
+
+    Model::Document* document = sketch->mParent;
+    document->mNextID = std::max(document->mNextID, nextID);
+
+    // Standalone updates are applied out of sequence with the file that they came from, so can't be checked
+    if (applied) {
+      return;
+    }
+
+    // The update must leave the document as its manifest describes
+    checkValid(endpoint, sketch->mNodes.size() == nodeCount && sketch->mControlPoints.size() == controlPointCount
+      && sketch->mPaths.size() == pathCount);
+    checkValid(endpoint, endpoint.version() < Version::Instances || (sketch->mInstances.size() == instanceCount
+      && document->mDefinitions.size() == definitionCount));
+  }
+}
+
+void Layout::collectUpdate(const Model::Sketch* sketch, const Model::ChangeSet& changes, Model::Sketch* update,
+  Model::Document::DefinitionList* definitions, std::vector<Model::Reference>* removed, unsigned int* flags)
+{
+  for (const Model::Reference& reference : changes.references()) {
+    switch (reference.type()) {
+      case Model::Type::Node:
+        if (!copyElement(sketch->mNodes, reference.id<Model::Node>(), &update->mNodes)) {
+          removed->push_back(reference);
+        }
+        break;
+      case Model::Type::ControlPoint:
+        if (copyElement(sketch->mControlPoints, reference.id<Model::ControlPoint>(), &update->mControlPoints)) {
+          // Packed control points are stored relative to their node, so it must be in the same update
+          const Model::ControlPoint* controlPoint = sketch->controlPoint(reference.id<Model::ControlPoint>());
+          copyElement(sketch->mNodes, controlPoint->node(), &update->mNodes);
+        } else {
+          removed->push_back(reference);
+        }
+        break;
+      case Model::Type::Path:
+        if (!copyElement(sketch->mPaths, reference.id<Model::Path>(), &update->mPaths)) {
+          removed->push_back(reference);
+        }
+        break;
+      case Model::Type::Sketch:
+        // Definitions never change once they're created, so they're only ever added or removed
+        if (!copyElement(sketch->mParent->mDefinitions, reference.id<Model::Sketch>(), definitions)) {
+          removed->push_back(reference);
+        }
+        break;
+      case Model::Type::Instance:
+        if (!copyElement(sketch->mInstances, reference.id<Model::Instance>(), &update->mInstances)) {
+          removed->push_back(reference);
+        }
+        break;
+      case Model::Type::Null:
+        break;
+    }
+  }
+
+  if (changes.drawOrderChanged(sketch)) {
+    update->mDrawOrder = sketch->mDrawOrder;
+    *flags |= UpdateFlag_DrawOrder;
+  }
+}
+
+void Layout::applyUpdate(Model::Sketch* sketch, Model::Sketch* update, Model::Document::DefinitionList* definitions,
+  const std::vector<Model::Reference>& removed, unsigned int flags)
+{
+  for (const Model::Reference& reference : removed) {
+    switch (reference.type()) {
+      case Model::Type::Node:
+        removeElement(&sketch->mNodes, reference.id<Model::Node>());
+        break;
+      case Model::Type::ControlPoint:
+        removeElement(&sketch->mControlPoints, reference.id<Model::ControlPoint>());
+        break;
+      case Model::Type::Path:
+        removeElement(&sketch->mPaths, reference.id<Model::Path>());
+        break;
+      case Model::Type::Sketch:
+        removeElement(&sketch->mParent->mDefinitions, reference.id<Model::Sketch>());
+        break;
+      case Model::Type::Instance:
+        removeElement(&sketch->mInstances, reference.id<Model::Instance>());
+        break;
+      case Model::Type::Null:
+        break;
+    }
+  }
+
+  replaceElements(&sketch->mNodes, update->mNodes);
+  replaceElements(&sketch->mControlPoints, update->mControlPoints);
+  replaceElements(&sketch->mPaths, update->mPaths);
+  replaceElements(&sketch->mInstances, update->mInstances);
+  replaceElements(&sketch->mParent->mDefinitions, *definitions);
+
+  if (flags & UpdateFlag_DrawOrder) {
+    sketch->mDrawOrder = std::move(update->mDrawOrder);
+  }
+}
+
+void Layout::reportUpdate(const Model::Sketch& update, const Model::Document::DefinitionList& definitions,
+  const std::vector<Model::Reference>& removed, unsigned int flags, std::vector<Model::Reference>* applied)
+{
+  applied->insert(applied->end(), removed.begin(), removed.end());
+
+  for (auto& [id, node] : update.mNodes) {
+    applied->push_back(id);
+  }
+
+  for (auto& [id, controlPoint] : update.mControlPoints) {
+    applied->push_back(id);
+  }
+
+  for (auto& [id, path] : update.mPaths) {
+    applied->push_back(id);
+  }
+
+  for (auto& [id, instance] : update.mInstances) {
+    applied->push_back(id);
+  }
+
+  for (auto& [id, definition] : definitions) {
+    applied->push_back(id);
+  }
+
+  if (flags & UpdateFlag_DrawOrder) {
+    applied->push_back(Model::Reference());
+  }
+}
+
+bool Layout::acceptsUpdates(const Reader& reader)
+{
+  return reader.keyed() && reader.version() == Version::Current;
+}
+
+void Layout::appendUpdate(Writer& writer, Model::Document* document, const Model::ChangeSet& changes)
+{
+  writer.setVersion(Version::Current);
+  writer.setPacked(writer.compress());
+  writer.setKeyed(true);
+
+  processUpdate(writer, document->sketch(), &changes, nullptr);
+
+  // Only extend the RIFF chunk over the update once it's been written, so that an interrupted append is ignored
+  writer.flush();
+  extendFile(writer);
+}
+
+void Layout::extendFile(Writer& writer)
+{
+  writer.endChunk(RiffBodyStart);
+  writer.flush();
+}
+
+void Layout::writeElements(Writer& writer, Model::Document* document, const Model::ChangeSet& changes)
+{
+  // Always packed, as these are usually kept in memory as well as written out
+  writer.setVersion(Version::Current);
+  writer.setPacked(true);
+  writer.setKeyed(true);
+
+  processUpdate(writer, document->sketch(), &changes, nullptr);
+}
+
+void Layout::readElements(Reader& reader, Model::Document* document, std::vector<Model::Reference>* applied)
+{
+  reader.setVersion(Version::Current);
+  reader.setPacked(true);
+  reader.setKeyed(true);
+
+  processUpdate(reader, document->sketch(), nullptr, applied);
+}
+
+void Layout::updateSnapshot(Model::Document* snapshot, const Model::Document* document,
+  const Model::ChangeSet* changes)
+{
+  const Model::Sketch* sketch = document->sketch();
+
+  Model::Sketch update(snapshot);
+  Model::Document::DefinitionList definitions;
+  std::vector<Model::Reference> removed;
+  unsigned int updateFlags = 0;
+
+  if (changes) {
+    collectUpdate(sketch, *changes, &update, &definitions, &removed, &updateFlags);
+  } else {
+    update.mNodes = sketch->mNodes;
+    update.mControlPoints = sketch->mControlPoints;
+    update.mPaths = sketch->mPaths;
+    update.mInstances = sketch->mInstances;
+    update.mDrawOrder = sketch->mDrawOrder;
+    definitions = document->mDefinitions;
+    updateFlags |= UpdateFlag_DrawOrder;
+  }
+
+  // The update refers to the document's elements, so give the snapshot its own copies
+  copyElements(&update.mNodes);
+  copyElements(&update.mControlPoints);
+  copyElements(&update.mPaths);
+  copyElements(&update.mInstances);
+
+  for (auto& [id, definition] : definitions) {
+    definition = copySketch(definition, snapshot);
+  }
+
+  applyUpdate(snapshot->sketch(), &update, &definitions, removed, updateFlags);
+
+  snapshot->mNextID = document->mNextID;
+}
+
+Model::Sketch* Layout::copySketch(const Model::Sketch* sketch, Model::Document* document)
+{
+  Model::Sketch* copy = new Model::Sketch(document);
+
+  copy->mNodes = sketch->mNodes;
+  copy->mControlPoints = sketch->mControlPoints;
+  copy->mPaths = sketch->mPaths;
+  copy->mInstances = sketch->mInstances;
+  copy->mDrawOrder = sketch->mDrawOrder;
+
+  copyElements(&copy->mNodes);
+  copyElements(&copy->mControlPoints);
+  copyElements(&copy->mPaths);
+  copyElements(&copy->mInstances);
+
+  return copy;
 }
 
 template <class TEndpoint>
-void Layout::processNode(TEndpoint& endpoint, Model::Node* node)
+void Layout::processNode(TEndpoint& endpoint, Model::Node* node, Point* previous)
 {
-  simpleValue(endpoint, &node->mPosition);
+  // Packed node positions are relative to the previous node, which is usually its neighbour along a path
+  point(endpoint, &node->mPosition, *previous);
+  *previous = node->mPosition;
+
   endpoint.asUint32(&node->mType);
 
   fixedElements(endpoint, &node->mControlPoints,
@@ -275,10 +782,20 @@ void Layout::processNode(TEndpoint& endpoint, Model::Node* node)
 }
 
 template <class TEndpoint>
-void Layout::processControlPoint(TEndpoint& endpoint, Model::ControlPoint* controlPoint)
+void Layout::processControlPoint(TEndpoint& endpoint, Model::ControlPoint* controlPoint, const Model::Sketch* sketch)
 {
-  simpleValue(endpoint, &controlPoint->mPosition);
-  endpoint.id(&controlPoint->mNode);
+  if (endpoint.packed()) {
+    // Packed control point positions are relative to their node, which has to have been read already
+    endpoint.id(&controlPoint->mNode);
+
+    auto node = sketch->mNodes.find(controlPoint->mNode);
+    checkValid(endpoint, node != sketch->mNodes.end());
+
+    point(endpoint, &controlPoint->mPosition, node != sketch->mNodes.end() ? node->second->position() : Point{0, 0});
+  } else {
+    simpleValue(endpoint, &controlPoint->mPosition);
+    endpoint.id(&controlPoint->mNode);
+  }
 }
 
 template <class TEndpoint>
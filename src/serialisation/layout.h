@@ -1,27 +1,68 @@
 #pragma once
 
+#include "model/document.h"
+#include "model/reference.h"
+#include "utilities/geometry.h"
+
+#include <vector>
+
 namespace Model
 {
+  class ChangeSet;
   class ControlPoint;
-  class Document;
   class Node;
   class Path;
+  class Sketch;
 }
 
 namespace Serialisation
 {
 
+class Reader;
+class Writer;
+
 class Layout
 {
 public:
   template <class TEndpoint>
   static Model::Document* process(TEndpoint& endpoint, Model::Document* document);
 
+  // Incremental files store elements under their document IDs, so changed elements can be appended to them later
+  static bool acceptsUpdates(const Reader& reader);
+  static void appendUpdate(Writer& writer, Model::Document* document, const Model::ChangeSet& changes);
+  // Extends the file's RIFF chunk over anything appended to it, with the writer positioned at the end of the file
+  static void extendFile(Writer& writer);
+
+  // Element updates that stand alone rather than following the rest of a file, so that they can be applied to a
+  // document in any state, as when stepping back through a recorded history. Reading reports what was applied.
+  static void writeElements(Writer& writer, Model::Document* document, const Model::ChangeSet& changes);
+  static void readElements(Reader& reader, Model::Document* document, std::vector<Model::Reference>* applied);
+
+  // Brings a copy of a document up to date with the changes made to it, or copies all of it into an empty snapshot
+  static void updateSnapshot(Model::Document* snapshot, const Model::Document* document,
+    const Model::ChangeSet* changes);
+
 private:
   template <class TEndpoint>
-  static void processNode(TEndpoint& endpoint, Model::Node* node);
+  static void processSketch(TEndpoint& endpoint, Model::Sketch* sketch);
+  template <class TEndpoint>
+  static void processDefinitions(TEndpoint& endpoint, Model::Document* document,
+    Model::Document::DefinitionList* definitions);
+  template <class TEndpoint>
+  static void processUpdate(TEndpoint& endpoint, Model::Sketch* sketch, const Model::ChangeSet* changes,
+    std::vector<Model::Reference>* applied);
+  static void collectUpdate(const Model::Sketch* sketch, const Model::ChangeSet& changes, Model::Sketch* update,
+    Model::Document::DefinitionList* definitions, std::vector<Model::Reference>* removed, unsigned int* flags);
+  static void applyUpdate(Model::Sketch* sketch, Model::Sketch* update, Model::Document::DefinitionList* definitions,
+    const std::vector<Model::Reference>& removed, unsigned int flags);
+  static void reportUpdate(const Model::Sketch& update, const Model::Document::DefinitionList& definitions,
+    const std::vector<Model::Reference>& removed, unsigned int flags, std::vector<Model::Reference>* applied);
+  static Model::Sketch* copySketch(const Model::Sketch* sketch, Model::Document* document);
+  template <class TEndpoint>
+  static void processNode(TEndpoint& endpoint, Model::Node* node, Point* previous);
   template <class TEndpoint>
-  static void processControlPoint(TEndpoint& endpoint, Model::ControlPoint* controlPoint);
+  static void processControlPoint(TEndpoint& endpoint, Model::ControlPoint* controlPoint,
+    const Model::Sketch* sketch);
   template <class TEndpoint>
   static void processPathChunk(TEndpoint& endpoint, Model::Path* path);
   template <class TEndpoint>
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+
+namespace Serialisation
+{
+
+// Variable length integers: seven bits per byte, least significant group first, high bit set on all but the last byte
+enum { VarintShift = 7, VarintMask = 0x7F, VarintContinue = 0x80, VarintMaxBytes = 10 };
+
+// Packed coordinates are stored as a zigzag-encoded fixed point delta shifted up by one bit. Values that can't be
+// represented exactly in fixed point are written as the escape value followed by the raw double.
+enum { CoordinateEscape = 1 };
+
+const double FixedPointScale = 256;
+const double FixedPointLimit = 4503599627370496.0; // 2^52
+
+inline uint64_t zigzag(int64_t value)
+{
+  return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+}
+
+inline int64_t unzigzag(uint64_t value)
+{
+  return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+inline bool toFixedPoint(double value, int64_t* fixed)
+{
+  const double scaled = value * FixedPointScale;
+
+  if (std::nearbyint(scaled) != scaled || std::fabs(scaled) >= FixedPointLimit
+    || (std::signbit(scaled) && scaled == 0)) {
+    return false;
+  }
+
+  *fixed = static_cast<int64_t>(scaled);
+  return true;
+}
+
+inline int64_t toFixedPoint(double value)
+{
+  const double scaled = value * FixedPointScale;
+
+  if (std::isnan(scaled)) {
+    return 0;
+  }
+
+  return static_cast<int64_t>(std::nearbyint(std::fmax(-FixedPointLimit, std::fmin(FixedPointLimit, scaled))));
+}
+
+inline double fromFixedPoint(int64_t fixed)
+{
+  return static_cast<double>(fixed) / FixedPointScale;
+}
+
+}
@@ -4,17 +4,25 @@
 #include "model/controlpoint.h"
 #include "model/document.h"
 #include "model/sketch.h"
+#include "serialisation/compression.h"
+#include "serialisation/packing.h"
 #include "utilities/geometry.h"
 #include "utilities/id.h"
 
 #include <cassert>
+#include <cstring>
 
 namespace Serialisation
 {
 
 Reader::Reader(Stream& stream)
   : mStream(stream)
+  , mPosition(0)
+  , mBlockPosition(0)
   , mVersion(0)
+  , mPacked(false)
+  , mKeyed(false)
+  , mInBlock(false)
 {
 }
 
@@ -23,36 +31,129 @@ Reader::Element Reader::beginChunk(uint32_t expectedID)
   uint32_t actualID = 0;
   read(&actualID);
 
-  assert(actualID == expectedID);
+  // Any other chunk means that the data is corrupt, or isn't a document at all
+  if (actualID != expectedID) {
+    fail();
+    return { mPosition, 0 };
+  }
 
-  return beginElement();
+  return readElementHeader();
 }
 
 void Reader::endChunk(const Element& element)
 {
-  Stream::pos_type bodyEnd = element.mBodyStart + element.mBodySize;
-  Stream::pos_type position = mStream.tellg();
+  skipTo(element.mBodyStart + element.mBodySize);
+}
+
+Reader::Element Reader::beginCompressedChunk(uint32_t expectedID)
+{
+  Element element = beginChunk(expectedID);
+
+  if (mPacked) {
+    assert(!mInBlock);
+
+    uint32_t size = 0;
+
+    // Checked before reading the size, so that a failed chunk is never read past its end
+    if (element.mBodySize < static_cast<std::streamoff>(sizeof(size))) {
+      fail();
+      return element;
+    }
+
+    read(&size);
+
+    // The body's size is only allocated once it's known to fit in what's left of the stream, so that a corrupt size
+    // can't ask for more memory than the file could hold
+    const std::streamoff compressedSize = element.mBodySize - sizeof(size);
+    const std::streamoff available = this->available();
+
+    if (!mStream || (available >= 0 && compressedSize > available)) {
+      fail();
+      return element;
+    }
+
+    std::string compressed;
+
+    if (available >= 0) {
+      compressed.resize(compressedSize);
+      data(compressed.data(), compressed.size());
+    } else {
+      // Streams that can't tell how much is left are read in pieces, which only grow the buffer as far as the
+      // stream goes
+      const std::streamoff PieceSize = 1 << 16;
+
+      while (mStream && static_cast<std::streamoff>(compressed.size()) < compressedSize) {
+        const size_t start = compressed.size();
+        compressed.resize(start + std::min(PieceSize, compressedSize - static_cast<std::streamoff>(start)));
+        data(compressed.data() + start, compressed.size() - start);
+      }
+    }
+
+    // Each input byte can add at most one length byte's worth of output, so larger sizes can only be corrupt
+    if (!mStream || size > (compressed.size() + 1) * 255) {
+      fail();
+      return element;
+    }
+
+    mBlock.resize(size);
+
+    if (!decompressBlock(compressed.data(), compressed.size(), mBlock.data(), mBlock.size())) {
+      fail();
+      return element;
+    }
+
+    mBlockPosition = 0;
+    mInBlock = true;
+  }
+
+  return element;
+}
+
+void Reader::endCompressedChunk(const Element& element)
+{
+  mInBlock = false;
+
+  endChunk(element);
+}
+
+bool Reader::moreInChunk(const Element& element)
+{
+  // A failed stream doesn't move on, so there's never more to read from it
+  return mStream && mPosition < element.mBodyStart + element.mBodySize;
+}
+
+template <class TMap>
+IDValue maxKey(const TMap& map)
+{
+  IDValue result = 0;
 
-  assert(position <= bodyEnd);
+  for (auto& current : map) {
+    result = std::max(result, current.first.value());
+  }
 
-  mStream.seekg(bodyEnd);
+  return result;
 }
 
 void Reader::beginObject(Model::Sketch** sketch)
 {
-  Model::Document* document = new Model::Document;
-  *sketch = document->mSketch;
+  // Updates are read into a sketch provided by the layout
+  if (!*sketch) {
+    Model::Document* document = new Model::Document;
+    *sketch = document->mSketch;
+  }
 }
 
 void Reader::endObject(Model::Sketch* sketch)
 {
-  size_t maxID = 0;
-  maxID = std::max(maxID, sketch->mControlPoints.size());
-  maxID = std::max(maxID, sketch->mNodes.size());
-  maxID = std::max(maxID, sketch->mPaths.size());
-  maxID = std::max(maxID, sketch->mSketches.size());
+  IDValue maxID = 0;
+  maxID = std::max(maxID, maxKey(sketch->mControlPoints));
+  maxID = std::max(maxID, maxKey(sketch->mNodes));
+  maxID = std::max(maxID, maxKey(sketch->mPaths));
+  maxID = std::max(maxID, maxKey(sketch->mSketches));
+  maxID = std::max(maxID, maxKey(sketch->mInstances));
 
-  sketch->mParent->mNextID = maxID + 1;
+  // Definitions are read after the document's sketch, and mustn't lower the next ID that it needs
+  sketch->mParent->mNextID = std::max(sketch->mParent->mNextID, maxID + 1);
 
   if (sketch->mDrawOrder.empty()) {
     sketch->mDrawOrder.reserve(sketch->mPaths.size());
@@ -65,29 +166,32 @@ void Reader::endObject(Model::Sketch* sketch)
 
 Reader::Element Reader::beginElement()
 {
-  Element element;
-  readAs<uint32_t>(&element.mBodySize);
-  element.mBodyStart = mStream.tellg();
+  if (mPacked) {
+    return Element();
+  }
 
-  return element;
+  return readElementHeader();
 }
 
 Reader::Element Reader::beginFixedElement(const Element& definition)
 {
+  if (mPacked) {
+    return definition;
+  }
+
   Element element = definition;
-  element.mBodyStart = mStream.tellg();
+  element.mBodyStart = mPosition;
 
   return element;
 }
 
 Reader::Element Reader::endElement(const Element& element)
 {
-  Stream::pos_type bodyEnd = element.mBodyStart + element.mBodySize;
-  Stream::pos_type position = mStream.tellg();
-
-  assert(position <= bodyEnd);
+  if (mPacked) {
+    return element;
+  }
 
-  mStream.seekg(bodyEnd);
+  skipTo(element.mBodyStart + element.mBodySize);
 
   return element;
 }
@@ -97,9 +201,110 @@ void Reader::endFixedElement(const Element& element)
   endElement(element);
 }
 
+void Reader::asCoordinate(double* value, double origin)
+{
+  uint64_t encoded = varint();
+
+  if (encoded == CoordinateEscape) {
+    readAs<double>(value);
+  } else {
+    *value = fromFixedPoint(toFixedPoint(origin) + unzigzag(encoded >> 1));
+  }
+}
+
 void Reader::data(char* bytes, std::streamsize count)
 {
-  mStream.read(bytes, count);
+  if (mInBlock) {
+    if (count > static_cast<std::streamsize>(mBlock.size() - mBlockPosition)) {
+      // Reading past the end of a block is treated like reading past the end of the file
+      fail();
+      return;
+    }
+
+    memcpy(bytes, mBlock.data() + mBlockPosition, count);
+    mBlockPosition += count;
+  } else {
+    mStream.read(bytes, count);
+    mPosition += mStream.gcount();
+  }
+}
+
+void Reader::fail()
+{
+  mStream.setstate(std::ios_base::failbit);
+  mInBlock = false;
+  mBlock.clear();
+}
+
+void Reader::skipTo(std::streamoff position)
+{
+  // More was read from the element than it said it held
+  if (mPosition > position) {
+    fail();
+    return;
+  }
+
+  // Padding and unknown data are consumed rather than seeked over, so that streams which can't seek can be read
+  mStream.ignore(position - mPosition);
+  mPosition += mStream.gcount();
+
+  // Ignoring stops quietly at the end of the stream, which an element can only run past if the data was cut short
+  if (mPosition < position) {
+    fail();
+  }
+}
+
+std::streamoff Reader::available()
+{
+  // Streams that can't seek can't say how much is left in them
+  const std::streampos current = mStream.tellg();
+
+  if (current == std::streampos(-1)) {
+    return -1;
+  }
+
+  mStream.seekg(0, std::ios_base::end);
+  const std::streampos end = mStream.tellg();
+
+  if (end == std::streampos(-1)) {
+    mStream.clear();
+    mStream.seekg(current);
+    return -1;
+  }
+
+  mStream.seekg(current);
+
+  return end - current;
+}
+
+Reader::Element Reader::readElementHeader()
+{
+  Element element;
+  readAs<uint32_t>(&element.mBodySize);
+  element.mBodyStart = mPosition;
+
+  return element;
+}
+
+uint64_t Reader::varint()
+{
+  uint64_t value = 0;
+  int shift = 0;
+  unsigned char byte = 0;
+
+  do {
+    read(&byte);
+
+    // A failed read leaves the byte as it was, so the value stops where the data did
+    if (!mStream) {
+      break;
+    }
+
+    value |= static_cast<uint64_t>(byte & VarintMask) << shift;
+    shift += VarintShift;
+  } while ((byte & VarintContinue) && shift < VarintMaxBytes * VarintShift);
+
+  return value;
 }
 
 }
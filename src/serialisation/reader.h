@@ -2,7 +2,9 @@
 
 #include "utilities/id.h"
 
+#include <algorithm>
 #include <istream>
+#include <string>
 #include <unordered_map>
 
 namespace Model
@@ -22,15 +24,29 @@ public:
 
   int version() const { return mVersion; }
   void setVersion(int version) { mVersion = version; }
+  bool packed() const { return mPacked; }
+  void setPacked(bool packed) { mPacked = packed; }
+  bool keyed() const { return mKeyed; }
+  void setKeyed(bool keyed) { mKeyed = keyed; }
 
+  // Positions are counted from where the reader started, as the stream itself may not be able to report them
   struct Element
   {
-    Stream::pos_type mBodyStart;
-    Stream::off_type mBodySize;
+    std::streamoff mBodyStart;
+    std::streamoff mBodySize;
   };
 
+  // Whether anything couldn't be read, because the stream ended early or the data didn't match the layout. Reading
+  // stops once it fails, so the elements read after that are left empty.
+  bool failed() const { return !mStream; }
+  // Stops reading, as though the stream had ended, once the data is found not to match the layout
+  void fail();
+
   Element beginChunk(uint32_t expectedID);
   void endChunk(const Element& element);
+  Element beginCompressedChunk(uint32_t expectedID);
+  void endCompressedChunk(const Element& element);
+  bool moreInChunk(const Element& element);
   void beginObject(Model::Sketch** sketch);
   void endObject(Model::Sketch* sketch);
 
@@ -38,13 +54,13 @@ public:
   void modelMap(std::unordered_map<ID<TModel>, TModel*>* map, TCallback callback)
   {
     uint32_t size = 0;
-    read(&size);
+    asUint32(&size);
 
-    map->reserve(size);
+    reserve(map, size);
 
-    for (uint32_t i = 0; i < size; ++i) {
+    for (uint32_t i = 0; i < size && mStream; ++i) {
       TModel* model = new TModel;
-      (*map)[ID<TModel>(i + 1)] = model;
+      (*map)[key<TModel>(i)] = model;
 
       callback(model);
     }
@@ -61,13 +77,13 @@ public:
 
     endChunk(headerChunk);
 
-    map->reserve(size);
+    reserve(map, size);
 
-    for (uint32_t i = 0; i < size; ++i) {
+    for (uint32_t i = 0; i < size && mStream; ++i) {
       auto elementChunk = beginChunk(elementChunkID);
 
       TModel* model = new TModel;
-      (*map)[ID<TModel>(i + 1)] = model;
+      (*map)[key<TModel>(i)] = model;
 
       callback(model);
 
@@ -79,11 +95,11 @@ public:
   void collection(TCollection* collection, TCallback callback)
   {
     uint32_t size = 0;
-    read(&size);
+    asUint32(&size);
 
-    collection->reserve(size);
+    reserve(collection, size);
 
-    for (uint32_t i = 0; i < size; ++i) {
+    for (uint32_t i = 0; i < size && mStream; ++i) {
       auto& value = collection->emplace_back();
       callback(&value);
     }
@@ -98,13 +114,30 @@ public:
   void id(ID<TModel>* id)
   {
     IDValue value = 0;
-    read(&value);
+
+    if (mPacked) {
+      value = static_cast<IDValue>(varint());
+    } else {
+      read(&value);
+    }
+
     *id = ID<TModel>(value);
   }
 
-  template <class TValue> void asUint32(TValue* value) { readAs<uint32_t>(value); }
+  template <class TValue>
+  void asUint32(TValue* value)
+  {
+    if (mPacked) {
+      *value = static_cast<TValue>(static_cast<uint32_t>(varint()));
+    } else {
+      readAs<uint32_t>(value);
+    }
+  }
+
   template <class TValue> void asDouble(TValue* value) { readAs<double>(value); }
 
+  void asCoordinate(double* value, double origin);
+
   template <class TValue>
   void read(TValue* value)
   {
@@ -114,7 +147,7 @@ public:
   template <class TSerialized, class TValue>
   void readAs(TValue* value)
   {
-    TSerialized serialized;
+    TSerialized serialized{};
     read(&serialized);
     *value = static_cast<TValue>(serialized);
   }
@@ -122,8 +155,43 @@ public:
   void data(char* bytes, std::streamsize count);
 
 private:
+  // Elements reserved for at most outside a block, where how much is left to read isn't known
+  static const uint32_t ReserveLimit = 4096;
+
+  // A corrupt count can be far larger than the data that follows it, so room is only reserved for as many elements
+  // as there are bytes left in the block, as each takes at least one
+  template <class TContainer>
+  void reserve(TContainer* container, uint32_t size)
+  {
+    container->reserve(std::min<size_t>(size, mInBlock ? mBlock.size() - mBlockPosition : ReserveLimit));
+  }
+
+  template <class TModel>
+  ID<TModel> key(uint32_t index)
+  {
+    ID<TModel> result(index + 1);
+
+    if (mKeyed) {
+      id(&result);
+    }
+
+    return result;
+  }
+
+  // The number of bytes left in the stream, or -1 if it can't tell
+  std::streamoff available();
+  Element readElementHeader();
+  void skipTo(std::streamoff position);
+  uint64_t varint();
+
   Stream& mStream;
+  std::streamoff mPosition;
+  std::string mBlock;
+  size_t mBlockPosition;
   int mVersion;
+  bool mPacked;
+  bool mKeyed;
+  bool mInBlock;
 };
 
 }
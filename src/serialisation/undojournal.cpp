@@ -0,0 +1,562 @@
+#include "serialisation/undojournal.h"
+
+#include "model/document.h"
+#include "model/sketch.h"
+#include "serialisation/layout.h"
+#include "serialisation/reader.h"
+#include "serialisation/writer.h"
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+
+namespace Serialisation
+{
+
+// Each record is a four character ID and the size of its body, followed by the body. A record that was only partly
+// written when a session ended is ignored, along with anything after it.
+//
+// BASE  The document that the journal starts from, as a whole incremental file
+// HIST  A history restored from a previous session: the step count, position, and each step's description and parts
+// STEP  A step added after the current position, which discards any steps after it, and its description
+// PART  The latest step's description, and the elements that it changed since its last part, after and before
+// MOVE  The new position after an undo, redo or jump
+// CNCL  The latest step was cancelled, once its changes were undone in a final part
+// TRIM  The number of oldest steps discarded
+// CLER  The history was cleared
+namespace
+{
+
+const size_t RecordHeaderSize = 8;
+
+void appendUint32(std::string* body, uint32_t value)
+{
+  body->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void appendString(std::string* body, const std::string& value)
+{
+  appendUint32(body, value.size());
+  body->append(value);
+}
+
+class RecordReader
+{
+public:
+  RecordReader(const std::string& body)
+    : mBody(body)
+    , mPosition(0)
+  {}
+
+  uint32_t readUint32()
+  {
+    uint32_t value = 0;
+
+    if (mPosition + sizeof(value) <= mBody.size()) {
+      memcpy(&value, mBody.data() + mPosition, sizeof(value));
+      mPosition += sizeof(value);
+    }
+
+    return value;
+  }
+
+  std::string readString()
+  {
+    size_t size = std::min<size_t>(readUint32(), mBody.size() - mPosition);
+    size_t start = mPosition;
+    mPosition += size;
+
+    return mBody.substr(start, size);
+  }
+
+private:
+  const std::string& mBody;
+  size_t mPosition;
+};
+
+std::string writeElements(Model::Document* document, const Model::ChangeSet& changes)
+{
+  std::ostringstream stream(std::ios_base::binary);
+
+  Writer writer(stream, true);
+  Layout::writeElements(writer, document, changes);
+
+  return stream.str();
+}
+
+void readElements(Model::Document* document, const std::string& elements, std::vector<Model::Reference>* applied)
+{
+  std::istringstream stream(elements, std::ios_base::binary);
+
+  Reader reader(stream);
+  Layout::readElements(reader, document, applied);
+}
+
+}
+
+// A step restored from a journal, which applies the elements recorded for it
+class UndoJournal::StepCommand : public Controller::UndoCommand
+{
+public:
+  StepCommand(Model::Document* document, Step&& step)
+    : mDocument(document)
+    , mStep(std::move(step))
+  {
+  }
+
+  void undo() override
+  {
+    for (auto it = mStep.mParts.crbegin(); it != mStep.mParts.crend(); ++it) {
+      apply(it->mReverse);
+    }
+  }
+
+  void redo() override
+  {
+    for (const Part& part : mStep.mParts) {
+      apply(part.mForward);
+    }
+  }
+
+  const char* description() const override
+  {
+    return mStep.mDescription.c_str();
+  }
+
+  size_t memoryUsage() const override
+  {
+    size_t usage = sizeof(*this) + mStep.mDescription.capacity() + Controller::heapUsage(mStep.mParts);
+
+    for (const Part& part : mStep.mParts) {
+      usage += part.mForward.capacity() + part.mReverse.capacity();
+    }
+
+    return usage;
+  }
+
+private:
+  void apply(const std::string& elements)
+  {
+    std::vector<Model::Reference> applied;
+    readElements(mDocument, elements, &applied);
+
+    for (const Model::Reference& reference : applied) {
+      mDocument->journal().recordChange(mDocument->sketch(), reference);
+    }
+  }
+
+  Model::Document* mDocument;
+  Step mStep;
+};
+
+UndoJournal::UndoJournal()
+  : mManager(nullptr)
+  , mDocument(nullptr)
+  , mSnapshot(nullptr)
+  , mStepOpen(false)
+  , mRecoveredPosition(0)
+  , mTruncate(false)
+  , mWriting(false)
+  , mStopping(false)
+{
+}
+
+UndoJournal::~UndoJournal()
+{
+  if (mManager) {
+    mManager->setRecorder(nullptr);
+  }
+
+  mConnection.disconnect();
+  mBatchConnection.disconnect();
+
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mStopping = true;
+  }
+
+  // The writing thread finishes what's pending before it stops
+  mCondition.notify_all();
+
+  if (mThread.joinable()) {
+    mThread.join();
+  }
+
+  delete mSnapshot;
+}
+
+void UndoJournal::setUndoManager(Controller::UndoManager* manager)
+{
+  mManager = manager;
+  mManager->setRecorder(this);
+}
+
+void UndoJournal::setDocument(Model::Document* document)
+{
+  mConnection.disconnect();
+  mBatchConnection.disconnect();
+
+  mDocument = nullptr;
+  mChanges.clear();
+  mStepOpen = false;
+
+  delete mSnapshot;
+  mSnapshot = nullptr;
+
+  if (mPath.empty()) {
+    return;
+  }
+
+  mDocument = document;
+  mConnection = mDocument->journal().signalChanged().connect(sigc::mem_fun(mChanges, &Model::ChangeSet::add));
+  mBatchConnection = mDocument->journal().signalBatchChanged().connect(
+    sigc::mem_fun(mChanges, &Model::ChangeSet::merge));
+
+  mSnapshot = new Model::Document;
+  Layout::updateSnapshot(mSnapshot, mDocument, nullptr);
+
+  std::ostringstream stream(std::ios_base::binary);
+
+  {
+    Writer writer(stream, true);
+    writer.setKeyed(true);
+    Layout::process(writer, mDocument);
+  }
+
+  {
+    // Anything still waiting from the previous journal is no longer needed
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    mPending.clear();
+    mTruncate = true;
+  }
+
+  writeRecord("BASE", stream.str());
+}
+
+void UndoJournal::flush()
+{
+  if (mStepOpen) {
+    recordChanges();
+  }
+}
+
+void UndoJournal::recordChanges()
+{
+  if (!mDocument || mChanges.isEmpty()) {
+    return;
+  }
+
+  if (mStepOpen) {
+    // The snapshot's draw order is reported against its own sketch
+    Model::ChangeSet snapshotChanges;
+
+    for (const Model::Reference& reference : mChanges.references()) {
+      snapshotChanges.add(mSnapshot->sketch(), reference);
+    }
+
+    if (mChanges.drawOrderChanged(mDocument->sketch())) {
+      snapshotChanges.add(mSnapshot->sketch(), Model::Reference());
+    }
+
+    std::string body;
+    appendString(&body, mManager->description(mManager->position()));
+    appendString(&body, writeElements(mDocument, mChanges));
+    appendString(&body, writeElements(mSnapshot, snapshotChanges));
+
+    writeRecord("PART", body);
+  }
+
+  Layout::updateSnapshot(mSnapshot, mDocument, &mChanges);
+  mChanges.clear();
+}
+
+void UndoJournal::stepAdded()
+{
+  if (!mDocument) {
+    return;
+  }
+
+  std::string body;
+  appendString(&body, mManager->description(mManager->position()));
+
+  writeRecord("STEP", body);
+
+  mStepOpen = true;
+
+  // Most steps are complete once they've been added, so record them straight away rather than waiting for a flush
+  recordChanges();
+}
+
+void UndoJournal::moved()
+{
+  if (!mDocument) {
+    return;
+  }
+
+  std::string body;
+  appendUint32(&body, mManager->position());
+
+  writeRecord("MOVE", body);
+
+  mStepOpen = false;
+
+  // The changes that moving made are already recorded by the steps that it went through
+  recordChanges();
+}
+
+void UndoJournal::stepCancelled()
+{
+  if (!mDocument) {
+    return;
+  }
+
+  writeRecord("CNCL", std::string());
+
+  // Commands can still merge into the step before the cancelled one
+  mStepOpen = mManager->position() > 0;
+}
+
+void UndoJournal::stepsTrimmed(size_t count)
+{
+  if (!mDocument) {
+    return;
+  }
+
+  std::string body;
+  appendUint32(&body, count);
+
+  writeRecord("TRIM", body);
+}
+
+void UndoJournal::cleared()
+{
+  if (!mDocument) {
+    return;
+  }
+
+  writeRecord("CLER", std::string());
+
+  mStepOpen = false;
+}
+
+bool UndoJournal::hasRecovery() const
+{
+  std::error_code error;
+  return !mPath.empty() && std::filesystem::file_size(mPath, error) > 0 && !error;
+}
+
+Model::Document* UndoJournal::recover()
+{
+  std::ifstream stream(mPath, std::ios_base::binary);
+
+  Model::Document* document = nullptr;
+  std::vector<Step> steps;
+  size_t position = 0;
+
+  auto applyStep = [&document](const Step& step, bool forward) {
+    std::vector<Model::Reference> applied;
+
+    if (forward) {
+      for (const Part& part : step.mParts) {
+        readElements(document, part.mForward, &applied);
+      }
+    } else {
+      for (auto it = step.mParts.crbegin(); it != step.mParts.crend(); ++it) {
+        readElements(document, it->mReverse, &applied);
+      }
+    }
+  };
+
+  char header[RecordHeaderSize];
+
+  while (stream.read(header, RecordHeaderSize)) {
+    const std::string id(header, 4);
+
+    uint32_t size = 0;
+    memcpy(&size, header + 4, sizeof(size));
+
+    std::string body(size, '\0');
+
+    if (!stream.read(body.data(), size)) {
+      // The session ended while this record was being written
+      break;
+    }
+
+    RecordReader record(body);
+
+    if (!document) {
+      if (id != "BASE") {
+        break;
+      }
+
+      std::istringstream base(body, std::ios_base::binary);
+
+      Reader reader(base);
+      document = Layout::process(reader, nullptr);
+    } else if (id == "HIST") {
+      steps.resize(record.readUint32());
+      position = std::min<size_t>(record.readUint32(), steps.size());
+
+      for (Step& step : steps) {
+        step.mDescription = record.readString();
+        step.mParts.resize(record.readUint32());
+
+        for (Part& part : step.mParts) {
+          part.mForward = record.readString();
+          part.mReverse = record.readString();
+        }
+      }
+    } else if (id == "STEP") {
+      steps.resize(position);
+
+      Step& step = steps.emplace_back();
+      step.mDescription = record.readString();
+      ++position;
+    } else if (id == "PART" && position > 0) {
+      Step& step = steps[position - 1];
+      step.mDescription = record.readString();
+
+      Part& part = step.mParts.emplace_back();
+      part.mForward = record.readString();
+      part.mReverse = record.readString();
+
+      std::vector<Model::Reference> applied;
+      readElements(document, part.mForward, &applied);
+    } else if (id == "MOVE") {
+      size_t target = std::min<size_t>(record.readUint32(), steps.size());
+
+      for (; position > target; --position) {
+        applyStep(steps[position - 1], false);
+      }
+
+      for (; position < target; ++position) {
+        applyStep(steps[position], true);
+      }
+    } else if (id == "CNCL" && position == steps.size() && position > 0) {
+      steps.pop_back();
+      --position;
+    } else if (id == "TRIM") {
+      size_t count = std::min<size_t>(record.readUint32(), position);
+
+      steps.erase(steps.begin(), steps.begin() + count);
+      position -= count;
+    } else if (id == "CLER") {
+      steps.clear();
+      position = 0;
+    }
+  }
+
+  mRecoveredSteps = std::move(steps);
+  mRecoveredPosition = position;
+
+  return document;
+}
+
+void UndoJournal::restoreHistory()
+{
+  if (!mDocument || mRecoveredSteps.empty()) {
+    return;
+  }
+
+  // The new journal starts from the recovered document, so the history that led to it is written out again
+  std::string body;
+  appendUint32(&body, mRecoveredSteps.size());
+  appendUint32(&body, mRecoveredPosition);
+
+  for (const Step& step : mRecoveredSteps) {
+    appendString(&body, step.mDescription);
+    appendUint32(&body, step.mParts.size());
+
+    for (const Part& part : step.mParts) {
+      appendString(&body, part.mForward);
+      appendString(&body, part.mReverse);
+    }
+  }
+
+  writeRecord("HIST", body);
+
+  std::vector<Controller::UndoCommand*> commands;
+  commands.reserve(mRecoveredSteps.size());
+
+  for (Step& step : mRecoveredSteps) {
+    commands.push_back(mManager->createCommand<StepCommand>(mDocument, std::move(step)));
+  }
+
+  mManager->setHistory(commands, mRecoveredPosition);
+
+  mRecoveredSteps.clear();
+  mRecoveredPosition = 0;
+}
+
+void UndoJournal::discard()
+{
+  wait();
+
+  std::error_code error;
+  std::filesystem::remove(mPath, error);
+}
+
+void UndoJournal::writeRecord(const char* id, const std::string& body)
+{
+  std::string record(id, 4);
+  appendUint32(&record, body.size());
+  record.append(body);
+
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    mPending.append(record);
+
+    // The writing thread is started with the first record, and then waits for more until the journal is destroyed
+    if (!mThread.joinable()) {
+      mThread = std::thread(&UndoJournal::write, this);
+    }
+  }
+
+  mCondition.notify_all();
+}
+
+void UndoJournal::write()
+{
+  std::unique_lock<std::mutex> lock(mMutex);
+
+  while (true) {
+    mCondition.wait(lock, [this]() { return !mPending.empty() || mStopping; });
+
+    if (mPending.empty()) {
+      return;
+    }
+
+    std::string records;
+    records.swap(mPending);
+
+    const bool truncate = mTruncate;
+    mTruncate = false;
+    mWriting = true;
+
+    lock.unlock();
+
+    {
+      // Each batch is closed once it's written, so that it reaches the file even if the application crashes later
+      std::ofstream stream(mPath, std::ios_base::binary | (truncate ? std::ios_base::trunc : std::ios_base::app));
+      stream.write(records.data(), records.size());
+    }
+
+    lock.lock();
+
+    mWriting = false;
+    mCondition.notify_all();
+  }
+}
+
+void UndoJournal::wait()
+{
+  // Records can't be added while waiting, as they come from the calling thread
+  std::unique_lock<std::mutex> lock(mMutex);
+  mCondition.wait(lock, [this]() { return mPending.empty() && !mWriting; });
+}
+
+}
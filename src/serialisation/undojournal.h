@@ -0,0 +1,101 @@
+#pragma once
+
+#include "controller/undo.h"
+#include "model/journal.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace Model
+{
+  class Document;
+}
+
+namespace Serialisation
+{
+
+// Records the undo history in an append-only file, so that a session that doesn't exit normally can be recovered
+// along with its history. Each step is recorded as the elements that it changed, as they were before and after, and
+// undos, redos and jumps only record the new position. Records are written on a background thread.
+class UndoJournal : public Controller::UndoManager::Recorder
+{
+public:
+  UndoJournal();
+  ~UndoJournal();
+
+  void setPath(const std::string& path) { mPath = path; }
+  const std::string& path() const { return mPath; }
+
+  void setUndoManager(Controller::UndoManager* manager);
+  // Starts a new journal, which begins with the document as it is now
+  void setDocument(Model::Document* document);
+
+  // Records the latest step's changes so far, which are otherwise held back while more commands can merge into it
+  void flush();
+
+  // Whether a previous session left a journal behind
+  bool hasRecovery() const;
+  // Replays the journal, returning the document as it was last recorded, or null if the journal can't be read. The
+  // history is kept until restoreHistory() is called, once the document has been set.
+  Model::Document* recover();
+  void restoreHistory();
+  // Waits for any writing in progress and removes the journal
+  void discard();
+
+  void recordChanges() override;
+  void stepAdded() override;
+  void moved() override;
+  void stepCancelled() override;
+  void stepsTrimmed(size_t count) override;
+  void cleared() override;
+
+private:
+  struct Part
+  {
+    std::string mForward;
+    std::string mReverse;
+  };
+
+  struct Step
+  {
+    std::string mDescription;
+    std::vector<Part> mParts;
+  };
+
+  class StepCommand;
+
+  void writeRecord(const char* id, const std::string& body);
+  void write();
+  void wait();
+
+  std::string mPath;
+  Controller::UndoManager* mManager;
+  Model::Document* mDocument;
+  Model::ChangeSet mChanges;
+  sigc::connection mConnection;
+  sigc::connection mBatchConnection;
+  // A copy of the document as of the last recorded changes, which is where elements are recorded from before a step
+  // changes them
+  Model::Document* mSnapshot;
+  // Whether changes belong to the latest step, rather than to an undo, redo or jump
+  bool mStepOpen;
+
+  std::vector<Step> mRecoveredSteps;
+  size_t mRecoveredPosition;
+
+  // Guards the records waiting to be written, which the writing thread takes as they arrive. The condition is
+  // notified when records are added and when a batch has been written.
+  std::mutex mMutex;
+  std::condition_variable mCondition;
+  std::string mPending;
+  bool mTruncate;
+  bool mWriting;
+  bool mStopping;
+  std::thread mThread;
+};
+
+}
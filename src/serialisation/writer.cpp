@@ -2,24 +2,33 @@
 
 #include "model/node.h"
 #include "model/controlpoint.h"
+#include "model/instance.h"
+#include "model/path.h"
 #include "model/sketch.h"
+#include "serialisation/compression.h"
+#include "serialisation/packing.h"
 #include "utilities/geometry.h"
 #include "utilities/id.h"
 
+#include <algorithm>
 #include <cassert>
 
 namespace Serialisation
 {
 
-Writer::Writer(Stream& stream)
+Writer::Writer(Stream& stream, bool compress)
   : mStream(stream)
   , mVersion(0)
+  , mCompress(compress)
+  , mPacked(false)
+  , mKeyed(false)
+  , mInBlock(false)
 {
 }
 
 Writer::Stream::pos_type Writer::beginChunk(uint32_t id)
 {
-  asUint32(&id);
+  writeAs<uint32_t>(id);
   mStream.write("size", 4);
 
   return mStream.tellp();
@@ -42,24 +51,103 @@ void Writer::endChunk(const Stream::pos_type& bodyStart)
   mStream.seekp(position);
 }
 
-template <class TRange, class TModel>
-void buildIDMap(const TRange& range, std::unordered_map<ID<TModel>, IDValue>* map)
+Writer::Stream::pos_type Writer::beginCompressedChunk(uint32_t id)
+{
+  Stream::pos_type bodyStart = beginChunk(id);
+
+  if (mPacked) {
+    assert(!mInBlock);
+
+    mBlock.clear();
+    mInBlock = true;
+  }
+
+  return bodyStart;
+}
+
+void Writer::endCompressedChunk(const Stream::pos_type& bodyStart)
+{
+  if (mInBlock) {
+    mInBlock = false;
+
+    std::string compressed = compressBlock(mBlock.data(), mBlock.size());
+
+    writeAs<uint32_t>(mBlock.size());
+    data(compressed.data(), compressed.size());
+  }
+
+  endChunk(bodyStart);
+}
+
+template <class TModel>
+void addToIDMap(const ID<TModel>& id, std::unordered_map<ID<TModel>, IDValue>* map, std::vector<ID<TModel>>* order)
 {
-  map->clear();
+  if (map->emplace(id, order->size() + 1).second) {
+    order->push_back(id);
+  }
+}
 
-  IDValue nextIndex = 1;
+template <class TRange, class TModel>
+void buildIDMap(const TRange& range, std::unordered_map<ID<TModel>, IDValue>* map, std::vector<ID<TModel>>* order)
+{
+  for (auto current : range) {
+    addToIDMap(current.first, map, order);
+  }
+}
 
+template <class TRange, class TModel>
+void buildSortedIDs(const TRange& range, std::vector<ID<TModel>>* order)
+{
   for (auto current : range) {
-    (*map)[current.first] = nextIndex;
-    ++nextIndex;
+    order->push_back(current.first);
   }
+
+  std::sort(order->begin(), order->end());
 }
 
 void Writer::beginObject(Model::Sketch** sketch)
 {
-  buildIDMap((*sketch)->paths(), &mPathIndices);
-  buildIDMap((*sketch)->nodes(), &mNodeIndices);
-  buildIDMap((*sketch)->controlPoints(), &mControlPointIndices);
+  mPathIndices.clear();
+  mNodeIndices.clear();
+  mControlPointIndices.clear();
+  mInstanceIndices.clear();
+  mPathOrder.clear();
+  mNodeOrder.clear();
+  mControlPointOrder.clear();
+  mInstanceOrder.clear();
+
+  if (mKeyed) {
+    // Keyed elements keep their IDs, which are allocated as elements are added, so writing them in ID order also
+    // keeps neighbouring nodes together. The sketch may be a partial update, so don't rely on its draw order.
+    buildSortedIDs((*sketch)->paths(), &mPathOrder);
+    buildSortedIDs((*sketch)->nodes(), &mNodeOrder);
+    buildSortedIDs((*sketch)->controlPoints(), &mControlPointOrder);
+    buildSortedIDs((*sketch)->instances(), &mInstanceOrder);
+
+    return;
+  }
+
+  // Number elements in draw order, so that neighbouring nodes and control points along a path are written next to
+  // each other and their delta-encoded positions stay small
+  for (const Model::Reference& reference : (*sketch)->drawOrder()) {
+    if (reference.type() == Model::Type::Path) {
+      ID<Model::Path> pathID = reference.id<Model::Path>();
+      addToIDMap(pathID, &mPathIndices, &mPathOrder);
+
+      for (const Model::Path::Entry& entry : (*sketch)->path(pathID)->entries()) {
+        addToIDMap(entry.mNode, &mNodeIndices, &mNodeOrder);
+        addToIDMap(entry.mPreControl, &mControlPointIndices, &mControlPointOrder);
+        addToIDMap(entry.mPostControl, &mControlPointIndices, &mControlPointOrder);
+      }
+    } else if (reference.type() == Model::Type::Instance) {
+      addToIDMap(reference.id<Model::Instance>(), &mInstanceIndices, &mInstanceOrder);
+    }
+  }
+
+  buildIDMap((*sketch)->paths(), &mPathIndices, &mPathOrder);
+  buildIDMap((*sketch)->nodes(), &mNodeIndices, &mNodeOrder);
+  buildIDMap((*sketch)->controlPoints(), &mControlPointIndices, &mControlPointOrder);
+  buildIDMap((*sketch)->instances(), &mInstanceIndices, &mInstanceOrder);
 }
 
 void Writer::endObject(Model::Sketch* sketch)
@@ -68,6 +156,10 @@ void Writer::endObject(Model::Sketch* sketch)
 
 Writer::Element Writer::beginElement()
 {
+  if (mPacked) {
+    return Element();
+  }
+
   mStream.write("size", 4);
   return { .mBodyStart = mStream.tellp() };
 }
@@ -82,6 +174,10 @@ Writer::Element Writer::beginFixedElement(const Element& definition)
 
 Writer::Element Writer::endElement(const Element& element)
 {
+  if (mPacked) {
+    return element;
+  }
+
   Stream::pos_type position = mStream.tellp();
 
   Element result = element;
@@ -97,13 +193,62 @@ Writer::Element Writer::endElement(const Element& element)
 
 void Writer::endFixedElement(const Element& element)
 {
+  if (mPacked) {
+    return;
+  }
+
   Stream::pos_type size = mStream.tellp() - element.mBodyStart;
   assert(size == element.mBodySize);
 }
 
-void Writer::data(char* bytes, std::streamsize count)
+void Writer::asCoordinate(double* value, double origin)
 {
-  mStream.write(bytes, count);
+  int64_t fixed;
+
+  if (toFixedPoint(*value, &fixed)) {
+    varint(zigzag(fixed - toFixedPoint(origin)) << 1);
+  } else {
+    varint(CoordinateEscape);
+    writeAs<double>(*value);
+  }
+}
+
+void Writer::data(const char* bytes, std::streamsize count)
+{
+  if (mInBlock) {
+    mBlock.append(bytes, count);
+  } else {
+    mStream.write(bytes, count);
+  }
+}
+
+void Writer::flush()
+{
+  mStream.flush();
+}
+
+void Writer::count(size_t size)
+{
+  if (mPacked) {
+    varint(size);
+  } else {
+    writeAs<uint32_t>(size);
+  }
+}
+
+void Writer::varint(uint64_t value)
+{
+  char bytes[VarintMaxBytes];
+  int count = 0;
+
+  while (value >= VarintContinue) {
+    bytes[count++] = static_cast<char>((value & VarintMask) | VarintContinue);
+    value >>= VarintShift;
+  }
+
+  bytes[count++] = static_cast<char>(value);
+
+  data(bytes, count);
 }
 
 }
@@ -3,12 +3,15 @@
 #include "utilities/id.h"
 
 #include <ostream>
+#include <string>
 #include <unordered_map>
+#include <vector>
 
 namespace Model
 {
   class Node;
   class ControlPoint;
+  class Instance;
   class Path;
   class Sketch;
 }
@@ -21,20 +24,50 @@ class Writer
 public:
   typedef std::basic_ostream<char> Stream;
 
-  Writer(Stream& stream);
+  Writer(Stream& stream, bool compress = false);
 
   int version() const { return mVersion; }
   void setVersion(int version) { mVersion = version; }
+  bool compress() const { return mCompress; }
+  bool packed() const { return mPacked; }
+  void setPacked(bool packed) { mPacked = packed; }
+  bool keyed() const { return mKeyed; }
+  void setKeyed(bool keyed) { mKeyed = keyed; }
 
   Stream::pos_type beginChunk(uint32_t id);
   void endChunk(const Stream::pos_type& bodyStart);
+  Stream::pos_type beginCompressedChunk(uint32_t id);
+  void endCompressedChunk(const Stream::pos_type& bodyStart);
+  bool moreInChunk(const Stream::pos_type&) const { return false; }
   void beginObject(Model::Sketch** sketch);
   void endObject(Model::Sketch* sketch);
 
   template<class TModel, class TCallback>
   void modelMap(std::unordered_map<ID<TModel>, TModel*>* map, TCallback callback)
   {
-    collection(map, [callback](const auto& current) { callback(current->second); });
+    auto element = [this, callback](ID<TModel> id, TModel* model) {
+      if (mKeyed) {
+        this->id(&id);
+      }
+
+      callback(model);
+    };
+
+    const std::vector<ID<TModel>>* order = elementOrder(static_cast<ID<TModel>*>(nullptr));
+
+    if (order) {
+      count(order->size());
+
+      for (auto& id : *order) {
+        element(id, map->at(id));
+      }
+    } else {
+      count(map->size());
+
+      for (auto& current : *map) {
+        element(current.first, current.second);
+      }
+    }
   }
 
   template<class TModel, class TCallback>
@@ -47,19 +80,35 @@ public:
 
     endChunk(headerChunk);
 
-    for (auto& current : *map) {
+    auto element = [this, elementChunkID, callback](ID<TModel> id, TModel* model) {
       auto elementChunk = beginChunk(elementChunkID);
 
-      callback(current.second);
+      if (mKeyed) {
+        this->id(&id);
+      }
+
+      callback(model);
 
       endChunk(elementChunk);
+    };
+
+    const std::vector<ID<TModel>>* order = elementOrder(static_cast<ID<TModel>*>(nullptr));
+
+    if (order) {
+      for (auto& id : *order) {
+        element(id, map->at(id));
+      }
+    } else {
+      for (auto& current : *map) {
+        element(current.first, current.second);
+      }
     }
   }
 
   template<class TCollection, class TCallback>
   void collection(TCollection* collection, TCallback callback)
   {
-    writeAs<uint32_t>(collection->size());
+    count(collection->size());
 
     for (auto& current : *collection) {
       callback(&current);
@@ -81,7 +130,12 @@ public:
   void id(ID<TModel>* id)
   {
     IDValue value = remap(id);
-    data(reinterpret_cast<char*>(&value), sizeof(value));
+
+    if (mPacked) {
+      varint(value);
+    } else {
+      data(reinterpret_cast<char*>(&value), sizeof(value));
+    }
   }
 
   template <class TModel>
@@ -92,22 +146,38 @@ public:
 
   IDValue remap(ID<Model::Path>* id)
   {
-    return mPathIndices.at(*id);
+    return mKeyed ? id->value() : mPathIndices.at(*id);
   }
 
   IDValue remap(ID<Model::Node>* id)
   {
-    return mNodeIndices.at(*id);
+    return mKeyed ? id->value() : mNodeIndices.at(*id);
   }
 
   IDValue remap(ID<Model::ControlPoint>* id)
   {
-    return mControlPointIndices.at(*id);
+    return mKeyed ? id->value() : mControlPointIndices.at(*id);
+  }
+
+  IDValue remap(ID<Model::Instance>* id)
+  {
+    return mKeyed ? id->value() : mInstanceIndices.at(*id);
+  }
+
+  template <class TValue>
+  void asUint32(TValue* value)
+  {
+    if (mPacked) {
+      varint(static_cast<uint32_t>(*value));
+    } else {
+      writeAs<uint32_t>(*value);
+    }
   }
 
-  template <class TValue> void asUint32(TValue* value) { writeAs<uint32_t>(*value); }
   template <class TValue> void asDouble(TValue* value) { writeAs<double>(*value); }
 
+  void asCoordinate(double* value, double origin);
+
   template <class TSerialized, class TValue>
   void writeAs(const TValue& value)
   {
@@ -115,14 +185,38 @@ public:
     data(reinterpret_cast<char*>(&serialized), sizeof(serialized));
   }
 
-  void data(char* bytes, std::streamsize count);
+  void data(const char* bytes, std::streamsize count);
+  void flush();
 
 private:
+  void count(size_t size);
+  void varint(uint64_t value);
+
+  template <class TModel>
+  const std::vector<ID<TModel>>* elementOrder(const ID<TModel>*) const { return nullptr; }
+  const std::vector<ID<Model::Path>>* elementOrder(const ID<Model::Path>*) const { return &mPathOrder; }
+  const std::vector<ID<Model::Node>>* elementOrder(const ID<Model::Node>*) const { return &mNodeOrder; }
+  const std::vector<ID<Model::ControlPoint>>* elementOrder(const ID<Model::ControlPoint>*) const
+  {
+    return &mControlPointOrder;
+  }
+  const std::vector<ID<Model::Instance>>* elementOrder(const ID<Model::Instance>*) const { return &mInstanceOrder; }
+
   Stream& mStream;
   std::unordered_map<ID<Model::Path>, IDValue> mPathIndices;
   std::unordered_map<ID<Model::Node>, IDValue> mNodeIndices;
   std::unordered_map<ID<Model::ControlPoint>, IDValue> mControlPointIndices;
+  std::unordered_map<ID<Model::Instance>, IDValue> mInstanceIndices;
+  std::vector<ID<Model::Path>> mPathOrder;
+  std::vector<ID<Model::Node>> mNodeOrder;
+  std::vector<ID<Model::ControlPoint>> mControlPointOrder;
+  std::vector<ID<Model::Instance>> mInstanceOrder;
+  std::string mBlock;
   int mVersion;
+  bool mCompress;
+  bool mPacked;
+  bool mKeyed;
+  bool mInBlock;
 };
 
 }
@@ -0,0 +1,251 @@
+#include "controller/hashing.h"
+#include "model/document.h"
+#include "model/instance.h"
+#include "model/path.h"
+#include "model/sketch.h"
+#include "serialisation/layout.h"
+#include "serialisation/reader.h"
+#include "utilities/hasher.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <vector>
+
+// Compares two documents by the content hashes of their paths, instances and definitions, which are matched up by
+// their IDs. Paths that were removed from one ID and added at another with the same content are reported as
+// renumbered rather than as changes. Exits with 0 when the documents draw the same things, 1 when they differ, and 2
+// when one of them can't be read, as diff does.
+
+namespace
+{
+
+// Whether everything that the sketch's elements refer to is there, and none of the definitions that it draws end up
+// drawing themselves. A file can be read without error and still get these wrong, and hashing the sketch would then
+// look up elements that don't exist or never finish.
+bool isComplete(const Model::Document* document, const Model::Sketch* sketch,
+  std::set<const Model::Sketch*>* complete, std::vector<const Model::Sketch*>* open)
+{
+  if (complete->count(sketch) > 0) {
+    return true;
+  }
+
+  if (std::find(open->begin(), open->end(), sketch) != open->end()) {
+    return false;
+  }
+
+  for (auto& [id, path] : sketch->paths()) {
+    for (const Model::Path::Entry& entry : path->entries()) {
+      if (!sketch->nodes().contains(entry.mNode) || !sketch->controlPoints().contains(entry.mPreControl)
+        || !sketch->controlPoints().contains(entry.mPostControl)) {
+        return false;
+      }
+    }
+  }
+
+  for (const Model::Reference& reference : sketch->drawOrder()) {
+    bool found = true;
+
+    if (reference.type() == Model::Type::Path) {
+      found = sketch->paths().contains(reference.id<Model::Path>());
+    } else if (reference.type() == Model::Type::Sketch) {
+      found = sketch->sketches().contains(reference.id<Model::Sketch>());
+    } else if (reference.type() == Model::Type::Instance) {
+      found = sketch->instances().contains(reference.id<Model::Instance>());
+    }
+
+    if (!found) {
+      return false;
+    }
+  }
+
+  open->push_back(sketch);
+  bool result = true;
+
+  for (auto& [id, subSketch] : sketch->sketches()) {
+    result = result && isComplete(document, subSketch, complete, open);
+  }
+
+  for (auto& [id, instance] : sketch->instances()) {
+    auto definition = document->definitions().find(instance->definition());
+    result = result && definition != document->definitions().end()
+      && isComplete(document, definition->second, complete, open);
+  }
+
+  open->pop_back();
+
+  if (result) {
+    complete->insert(sketch);
+  }
+
+  return result;
+}
+
+Model::Document* load(const char* path)
+{
+  std::ifstream stream(path, std::ios_base::binary);
+
+  if (!stream) {
+    std::cerr << "Can't open " << path << std::endl;
+    return nullptr;
+  }
+
+  Serialisation::Reader reader(stream);
+  Model::Document* document = Serialisation::Layout::process(reader, nullptr);
+
+  std::set<const Model::Sketch*> complete;
+  std::vector<const Model::Sketch*> open;
+  bool valid = !reader.failed() && isComplete(document, document->sketch(), &complete, &open);
+
+  for (auto& [id, definition] : document->definitions()) {
+    valid = valid && isComplete(document, definition, &complete, &open);
+  }
+
+  if (!valid) {
+    std::cerr << "Can't read " << path << std::endl;
+    delete document;
+    return nullptr;
+  }
+
+  return document;
+}
+
+typedef Controller::ContentHashes::Hash Hash;
+
+// Reports the elements that are only in one of the sketches or that differ between them, given each one's hash, and
+// returns whether there were any
+template <class TModel, class T_Hash>
+bool compare(const char* name, const Model::Sketch::Accessor<TModel>& before,
+  const Model::Sketch::Accessor<TModel>& after, T_Hash hash)
+{
+  std::map<ID<TModel>, Hash> removed;
+  std::map<ID<TModel>, Hash> added;
+  bool different = false;
+
+  for (auto& [id, element] : before) {
+    if (!after.contains(id)) {
+      removed[id] = hash(true, id);
+    } else if (hash(true, id) != hash(false, id)) {
+      std::cout << "~ " << name << " " << id.value() << std::endl;
+      different = true;
+    }
+  }
+
+  for (auto& [id, element] : after) {
+    if (!before.contains(id)) {
+      added[id] = hash(false, id);
+    }
+  }
+
+  std::unordered_multimap<Hash, ID<TModel>> removedByHash;
+
+  for (auto& [id, elementHash] : removed) {
+    removedByHash.emplace(elementHash, id);
+  }
+
+  for (auto& [id, elementHash] : added) {
+    auto match = removedByHash.find(elementHash);
+
+    if (match != removedByHash.end()) {
+      std::cout << "= " << name << " " << match->second.value() << " -> " << id.value() << std::endl;
+      removed.erase(match->second);
+      removedByHash.erase(match);
+    } else {
+      std::cout << "+ " << name << " " << id.value() << std::endl;
+      different = true;
+    }
+  }
+
+  for (auto& [id, elementHash] : removed) {
+    std::cout << "- " << name << " " << id.value() << std::endl;
+    different = true;
+  }
+
+  return different;
+}
+
+}
+
+int main(int argc, char** argv)
+{
+  if (argc != 3) {
+    std::cerr << "Usage: " << argv[0] << " <before.spln> <after.spln>" << std::endl;
+    return 2;
+  }
+
+  Model::Document* before = load(argv[1]);
+  Model::Document* after = load(argv[2]);
+
+  if (!before || !after) {
+    return 2;
+  }
+
+  Controller::ContentHashes beforeHashes;
+  Controller::ContentHashes afterHashes;
+  beforeHashes.setDocument(before);
+  afterHashes.setDocument(after);
+
+  std::map<ID<Model::Sketch>, Hash> beforeDefinitions;
+  std::map<ID<Model::Sketch>, Hash> afterDefinitions;
+
+  for (auto& [id, definition] : before->definitions()) {
+    beforeDefinitions[id] = beforeHashes.sketchHash(definition);
+  }
+
+  for (auto& [id, definition] : after->definitions()) {
+    afterDefinitions[id] = afterHashes.sketchHash(definition);
+  }
+
+  // Documents that draw the same things in the same order need no more comparing. Definitions that aren't instanced
+  // don't contribute to the root sketch's hash, so they're compared too.
+  if (beforeHashes.sketchHash(before->sketch()) == afterHashes.sketchHash(after->sketch())
+    && beforeDefinitions == afterDefinitions) {
+    return 0;
+  }
+
+  bool different = compare("path", before->sketch()->paths(), after->sketch()->paths(),
+    [before, after, &beforeHashes, &afterHashes](bool isBefore, const ID<Model::Path>& id)
+    {
+      return isBefore ? beforeHashes.pathHash(before->sketch(), id) : afterHashes.pathHash(after->sketch(), id);
+    });
+
+  different |= compare("instance", before->sketch()->instances(), after->sketch()->instances(),
+    [before, after, &beforeHashes, &afterHashes](bool isBefore, const ID<Model::Instance>& id)
+    {
+      Model::Document* document = isBefore ? before : after;
+      Controller::ContentHashes& hashes = isBefore ? beforeHashes : afterHashes;
+      const Model::Instance* instance = document->sketch()->instance(id);
+
+      return Hasher().add(instance->position()).add(hashes.sketchHash(document->definition(instance->definition())))
+        .hash();
+    });
+
+  for (auto& [id, hash] : beforeDefinitions) {
+    auto match = afterDefinitions.find(id);
+
+    if (match == afterDefinitions.end()) {
+      std::cout << "- definition " << id.value() << std::endl;
+      different = true;
+    } else if (match->second != hash) {
+      std::cout << "~ definition " << id.value() << std::endl;
+      different = true;
+    }
+  }
+
+  for (auto& [id, hash] : afterDefinitions) {
+    if (beforeDefinitions.count(id) == 0) {
+      std::cout << "+ definition " << id.value() << std::endl;
+      different = true;
+    }
+  }
+
+  // The same elements drawn in a different order
+  if (!different) {
+    std::cout << "~ draw order" << std::endl;
+  }
+
+  return 1;
+}
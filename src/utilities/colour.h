@@ -26,6 +26,10 @@ public:
   float green() const { return static_cast<float>((mValue >> GreenShift) & ComponentMask) / ComponentMask; }
   float blue() const { return static_cast<float>((mValue >> BlueShift) & ComponentMask) / ComponentMask; }
   float alpha() const { return static_cast<float>((mValue >> AlphaShift) & ComponentMask) / ComponentMask; }
+  uint32_t rgba() const { return mValue; }
+
+  bool operator==(const Colour& other) const { return mValue == other.mValue; }
+  bool operator!=(const Colour& other) const { return !(*this == other); }
 
 private:
   friend class Serialisation::Layout;
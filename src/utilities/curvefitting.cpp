@@ -0,0 +1,233 @@
+#include "utilities/curvefitting.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+double CurveFitter::fit(const Point* points, size_t count, const Vector& startTangent, const Vector& endTangent,
+  double target, CubicBezier* curve)
+{
+  // Each pass moves the points' parameters to their closest points on the last pass's curve, which converges quickly
+  // when the first guess is near. Schneider only refines fits that are within four times the target.
+  const int MaxPasses = 4;
+  const double RefinableError = 4 * target;
+
+  assert(count >= 2);
+
+  const Point& start = points[0];
+  const Point& end = points[count - 1];
+
+  chordLengthParameters(points, count);
+
+  if (count == 2 || mParameters.back() == 0) {
+    const double length = (end - start).length() / 3;
+    *curve = { start, start + startTangent * length, end + endTangent * length, end };
+
+    return maxError(points, count, *curve);
+  }
+
+  double bestError = 0;
+
+  for (int pass = 0; pass < MaxPasses; ++pass) {
+    CubicBezier candidate;
+    leastSquares(points, count, startTangent, endTangent, &candidate);
+
+    const double error = maxError(points, count, candidate);
+
+    if (pass == 0 || error < bestError) {
+      *curve = candidate;
+      bestError = error;
+    }
+
+    if (bestError <= target || bestError > RefinableError) {
+      break;
+    }
+
+    if (pass + 1 < MaxPasses) {
+      reparameterise(points, count, candidate);
+    }
+  }
+
+  return bestError;
+}
+
+void CurveFitter::chordLengthParameters(const Point* points, size_t count)
+{
+  mParameters.resize(count);
+  mParameters[0] = 0;
+
+  for (size_t i = 1; i < count; ++i) {
+    mParameters[i] = mParameters[i - 1] + (points[i] - points[i - 1]).length();
+  }
+
+  const double total = mParameters.back();
+
+  if (total > 0) {
+    for (size_t i = 1; i < count; ++i) {
+      mParameters[i] /= total;
+    }
+  }
+}
+
+void CurveFitter::leastSquares(const Point* points, size_t count, const Vector& startTangent,
+  const Vector& endTangent, CubicBezier* curve) const
+{
+  const Point& start = points[0];
+  const Point& end = points[count - 1];
+
+  // The normal equations for the distances of the control points along their tangents
+  double c00 = 0, c01 = 0, c11 = 0;
+  double x0 = 0, x1 = 0;
+
+  for (size_t i = 0; i < count; ++i) {
+    const double t = mParameters[i];
+    const double s = 1 - t;
+    const double b1 = 3 * s * s * t;
+    const double b2 = 3 * s * t * t;
+    const double b3 = t * t * t;
+
+    const Vector a1 = startTangent * b1;
+    const Vector a2 = endTangent * b2;
+
+    c00 += a1.dot(a1);
+    c01 += a1.dot(a2);
+    c11 += a2.dot(a2);
+
+    // The point's offset from the curve with both control points on their end points, since the weights sum to one
+    const Vector offset = (points[i] - start) - (end - start) * (b2 + b3);
+
+    x0 += a1.dot(offset);
+    x1 += a2.dot(offset);
+  }
+
+  const double determinant = c00 * c11 - c01 * c01;
+  const double length = (end - start).length();
+  const double epsilon = 1e-6 * length;
+
+  double alpha1 = 0;
+  double alpha2 = 0;
+
+  if (std::abs(determinant) > 1e-12) {
+    alpha1 = (x0 * c11 - x1 * c01) / determinant;
+    alpha2 = (c00 * x1 - c01 * x0) / determinant;
+  }
+
+  // A degenerate or backwards solution falls back to Wu and Barsky's heuristic of a third of the chord
+  if (alpha1 < epsilon || alpha2 < epsilon) {
+    alpha1 = length / 3;
+    alpha2 = length / 3;
+  }
+
+  *curve = { start, start + startTangent * alpha1, end + endTangent * alpha2, end };
+}
+
+double CurveFitter::maxError(const Point* points, size_t count, const CubicBezier& curve) const
+{
+  double error = 0;
+
+  for (size_t i = 1; i + 1 < count; ++i) {
+    error = std::max(error, (curve.evaluate(mParameters[i]) - points[i]).length());
+  }
+
+  return error;
+}
+
+void CurveFitter::reparameterise(const Point* points, size_t count, const CubicBezier& curve)
+{
+  for (size_t i = 1; i + 1 < count; ++i) {
+    mParameters[i] = curve.closestParameter(points[i], mParameters[i]);
+  }
+}
+
+namespace
+{
+
+// The direction from one of the points to another a few points along, or to its neighbour if they coincide
+Vector direction(const Point* points, size_t count, int step)
+{
+  const int Reach = 3;
+
+  const Point& from = points[0];
+  const Vector far = points[step * std::min<int>(Reach, count - 1)] - from;
+
+  if (far.length() > 0) {
+    return far.normalised();
+  }
+
+  return (points[step] - from).normalised();
+}
+
+}
+
+StrokeFitter::StrokeFitter()
+  : mTolerance(0)
+  , mStartTangent(Vector::zero)
+  , mEndTangent(Vector::zero)
+{
+}
+
+void StrokeFitter::begin(const Point& point, double tolerance)
+{
+  mTolerance = tolerance;
+  mPoints.assign(1, point);
+  mCurves.clear();
+}
+
+void StrokeFitter::addPoint(const Point& point)
+{
+  // Points closer together than this add noise rather than shape
+  const double MinSpacing = 1;
+  // The most points that the curve at the end can hold, which bounds the cost of refitting it
+  const size_t MaxPoints = 64;
+
+  if ((point - mPoints.back()).length() < MinSpacing) {
+    return;
+  }
+
+  mPoints.push_back(point);
+
+  if (mPoints.size() == 2) {
+    mCurves.emplace_back();
+    fitTail();
+    return;
+  }
+
+  const Vector previousEndTangent = mEndTangent;
+  const CubicBezier previous = mCurves.back();
+
+  if (mPoints.size() <= MaxPoints && fitTail() <= mTolerance) {
+    return;
+  }
+
+  // The curve as it was before this point is fixed, and a new one starts at its end, leaving in the direction that
+  // it arrives in
+  mCurves.back() = previous;
+  mStartTangent = -previousEndTangent;
+  mPoints.erase(mPoints.begin(), mPoints.end() - 2);
+
+  mCurves.emplace_back();
+  fitTail();
+}
+
+Vector StrokeFitter::startTangent() const
+{
+  return direction(mPoints.data(), mPoints.size(), 1);
+}
+
+Vector StrokeFitter::endTangent() const
+{
+  return direction(&mPoints.back(), mPoints.size(), -1);
+}
+
+double StrokeFitter::fitTail()
+{
+  // The first curve's start tangent follows the stroke until the curve is fixed, and later curves' are fixed by the
+  // curves before them
+  if (mCurves.size() == 1) {
+    mStartTangent = startTangent();
+  }
+
+  mEndTangent = endTangent();
+
+  return mFitter.fit(mPoints.data(), mPoints.size(), mStartTangent, mEndTangent, mTolerance, &mCurves.back());
+}
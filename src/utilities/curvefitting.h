@@ -0,0 +1,59 @@
+#pragma once
+
+#include "utilities/geometry.h"
+
+#include <cstddef>
+#include <vector>
+
+// Fits cubic Bezier curves to runs of points by least squares, as in Schneider's "An Algorithm for Automatically
+// Fitting Digitized Curves" from Graphics Gems. A fitter keeps its working space between fits, so that it can be
+// reused without allocating.
+class CurveFitter
+{
+public:
+  // Fits one curve from the first point to the last, leaving the first along the start tangent and arriving at the
+  // last against the end tangent, so that the curve's control points are start + startTangent * a and
+  // end + endTangent * b. The tangents must be unit vectors. Returns the greatest distance from a point to the curve,
+  // measured at the point's parameter, which is never less than the true distance. Refining stops once the error is
+  // within the target, or when it's far enough outside it that refining is unlikely to bring it within.
+  double fit(const Point* points, size_t count, const Vector& startTangent, const Vector& endTangent, double target,
+    CubicBezier* curve);
+
+private:
+  void chordLengthParameters(const Point* points, size_t count);
+  void leastSquares(const Point* points, size_t count, const Vector& startTangent, const Vector& endTangent,
+    CubicBezier* curve) const;
+  double maxError(const Point* points, size_t count, const CubicBezier& curve) const;
+  void reparameterise(const Point* points, size_t count, const CubicBezier& curve);
+
+  std::vector<double> mParameters;
+};
+
+// Fits a chain of curves to a stroke while it's being drawn. Only the curve at the end of the stroke is refitted as
+// points arrive, and it's fixed in place once it can't take another point within the tolerance or it holds as many
+// points as it may, so the cost of a point is bounded however long the stroke gets. Each curve leaves its start in
+// the direction that the one before it arrives in, so the chain is smooth where they join.
+class StrokeFitter
+{
+public:
+  StrokeFitter();
+
+  void begin(const Point& point, double tolerance);
+  void addPoint(const Point& point);
+
+  // The fixed curves followed by the one at the end of the stroke, which are empty until the stroke has moved
+  const std::vector<CubicBezier>& curves() const { return mCurves; }
+
+private:
+  Vector startTangent() const;
+  Vector endTangent() const;
+  double fitTail();
+
+  CurveFitter mFitter;
+  double mTolerance;
+  // The points of the curve at the end of the stroke
+  std::vector<Point> mPoints;
+  std::vector<CubicBezier> mCurves;
+  Vector mStartTangent;
+  Vector mEndTangent;
+};
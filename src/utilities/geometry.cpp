@@ -1,7 +1,12 @@
 #include "utilities/geometry.h"
 
+#include <algorithm>
 #include <cmath>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 double Vector::length() const
 {
   return std::sqrt(x * x + y * y);
@@ -33,6 +38,16 @@ Vector Vector::operator-() const
   return { -x, -y };
 }
 
+Vector Vector::operator+(const Vector& other) const
+{
+  return { x + other.x, y + other.y };
+}
+
+Vector Vector::operator-(const Vector& other) const
+{
+  return { x - other.x, y - other.y };
+}
+
 Vector Vector::operator*(double scale) const
 {
   return { x * scale, y * scale };
@@ -70,6 +85,81 @@ Vector Point::operator-(const Point& p) const
   return { x - p.x, y - p.y };
 }
 
+Transform Transform::translation(const Vector& offset)
+{
+  return { 1, 0, 0, 1, offset.x, offset.y };
+}
+
+Transform Transform::scale(const Point& centre, double scaleX, double scaleY)
+{
+  return { scaleX, 0, 0, scaleY, centre.x - scaleX * centre.x, centre.y - scaleY * centre.y };
+}
+
+Transform Transform::rotation(const Point& centre, double angle)
+{
+  const double cosine = std::cos(angle);
+  const double sine = std::sin(angle);
+
+  return {
+    cosine, sine, -sine, cosine,
+    centre.x - cosine * centre.x + sine * centre.y,
+    centre.y - sine * centre.x - cosine * centre.y,
+  };
+}
+
+Point Transform::apply(const Point& point) const
+{
+  return { xx * point.x + xy * point.y + x0, yx * point.x + yy * point.y + y0 };
+}
+
+static_assert(sizeof(Point) == 2 * sizeof(double), "Points are transformed as packed pairs of doubles");
+
+void Transform::apply(Point* points, size_t count) const
+{
+  size_t i = 0;
+
+#if defined(__SSE2__)
+  // A point fills a register, and its image is the first column scaled by x, plus the second scaled by y, plus the
+  // translation. Two points are handled per iteration so that their multiplies can overlap.
+  const __m128d column0 = _mm_set_pd(yx, xx);
+  const __m128d column1 = _mm_set_pd(yy, xy);
+  const __m128d translation = _mm_set_pd(y0, x0);
+
+  double* data = reinterpret_cast<double*>(points);
+
+  for (; i + 2 <= count; i += 2) {
+    __m128d a = _mm_loadu_pd(data + 2 * i);
+    __m128d b = _mm_loadu_pd(data + 2 * i + 2);
+
+    __m128d resultA = _mm_add_pd(_mm_add_pd(_mm_mul_pd(column0, _mm_unpacklo_pd(a, a)),
+      _mm_mul_pd(column1, _mm_unpackhi_pd(a, a))), translation);
+    __m128d resultB = _mm_add_pd(_mm_add_pd(_mm_mul_pd(column0, _mm_unpacklo_pd(b, b)),
+      _mm_mul_pd(column1, _mm_unpackhi_pd(b, b))), translation);
+
+    _mm_storeu_pd(data + 2 * i, resultA);
+    _mm_storeu_pd(data + 2 * i + 2, resultB);
+  }
+#endif
+
+  for (; i < count; ++i) {
+    points[i] = apply(points[i]);
+  }
+}
+
+Transform Transform::operator*(const Transform& other) const
+{
+  return {
+    xx * other.xx + xy * other.yx,
+    yx * other.xx + yy * other.yx,
+    xx * other.xy + xy * other.yy,
+    yx * other.xy + yy * other.yy,
+    xx * other.x0 + xy * other.y0 + x0,
+    yx * other.x0 + yy * other.y0 + y0,
+  };
+}
+
+const Transform Transform::identity{1, 0, 0, 1, 0, 0};
+
 Rectangle Rectangle::normalised() const
 {
   return Rectangle {
@@ -120,6 +210,14 @@ bool Rectangle::intersectsLine(const Point& p1, const Point& p2) const
   return false;
 }
 
+double Rectangle::distance(const Point& point) const
+{
+  const double dx = std::max(std::max(left - point.x, point.x - right), 0.0);
+  const double dy = std::max(std::max(top - point.y, point.y - bottom), 0.0);
+
+  return std::sqrt(dx * dx + dy * dy);
+}
+
 void Rectangle::grow(const Rectangle& other)
 {
   left = std::min(left, other.left);
@@ -127,3 +225,373 @@ void Rectangle::grow(const Rectangle& other)
   right = std::max(right, other.right);
   bottom = std::max(bottom, other.bottom);
 }
+
+void Rectangle::grow(const Point& point)
+{
+  left = std::min(left, point.x);
+  top = std::min(top, point.y);
+  right = std::max(right, point.x);
+  bottom = std::max(bottom, point.y);
+}
+
+Rectangle Rectangle::inflated(double amount) const
+{
+  return { left - amount, top - amount, right + amount, bottom + amount };
+}
+
+Rectangle Rectangle::translated(const Vector& offset) const
+{
+  return { left + offset.x, top + offset.y, right + offset.x, bottom + offset.y };
+}
+
+static_assert(sizeof(CubicBezier) == 4 * sizeof(Point), "Curves are read as packed arrays of doubles");
+static_assert(sizeof(Vector) == sizeof(Point), "Derivatives are written as packed pairs of doubles");
+
+namespace
+{
+
+// The weights of a curve's points in its value at t
+void valueWeights(double t, double* weights)
+{
+  const double s = 1 - t;
+
+  weights[0] = s * s * s;
+  weights[1] = 3 * s * s * t;
+  weights[2] = 3 * s * t * t;
+  weights[3] = t * t * t;
+}
+
+// The weights of a curve's points in its derivative at t
+void derivativeWeights(double t, double* weights)
+{
+  const double s = 1 - t;
+
+  weights[0] = -3 * s * s;
+  weights[1] = 3 * s * s - 6 * s * t;
+  weights[2] = 6 * s * t - 3 * t * t;
+  weights[3] = 3 * t * t;
+}
+
+// Sums a curve's points with the given weights, which is how both values and derivatives are found
+void weightedSum(const CubicBezier& curve, const double* weights, double* result)
+{
+#if defined(__SSE2__)
+  const double* data = reinterpret_cast<const double*>(&curve);
+
+  __m128d sum = _mm_add_pd(
+    _mm_add_pd(_mm_mul_pd(_mm_set1_pd(weights[0]), _mm_loadu_pd(data)),
+      _mm_mul_pd(_mm_set1_pd(weights[1]), _mm_loadu_pd(data + 2))),
+    _mm_add_pd(_mm_mul_pd(_mm_set1_pd(weights[2]), _mm_loadu_pd(data + 4)),
+      _mm_mul_pd(_mm_set1_pd(weights[3]), _mm_loadu_pd(data + 6))));
+
+  _mm_storeu_pd(result, sum);
+#else
+  result[0] = weights[0] * curve.p0.x + weights[1] * curve.p1.x + weights[2] * curve.p2.x + weights[3] * curve.p3.x;
+  result[1] = weights[0] * curve.p0.y + weights[1] * curve.p1.y + weights[2] * curve.p2.y + weights[3] * curve.p3.y;
+#endif
+}
+
+// Finds the parameters in (0, 1) where one coordinate of the curve has a turning point, given that coordinate of
+// each of its points, and returns how many there are
+int turningPoints(double p0, double p1, double p2, double p3, double* ts)
+{
+  // A third of the derivative, as a quadratic a * t^2 + b * t + c
+  const double a = -p0 + 3 * p1 - 3 * p2 + p3;
+  const double b = 2 * (p0 - 2 * p1 + p2);
+  const double c = p1 - p0;
+
+  int count = 0;
+
+  auto add = [ts, &count](double t)
+  {
+    if (t > 0 && t < 1) {
+      ts[count++] = t;
+    }
+  };
+
+  if (std::abs(a) <= 1e-12 * (std::abs(b) + std::abs(c))) {
+    // The quadratic term is lost in rounding, so the derivative is as good as linear
+    if (b != 0) {
+      add(-c / b);
+    }
+  } else {
+    const double discriminant = b * b - 4 * a * c;
+
+    if (discriminant >= 0) {
+      const double root = std::sqrt(discriminant);
+      add((-b + root) / (2 * a));
+      add((-b - root) / (2 * a));
+    }
+  }
+
+  return count;
+}
+
+// Evaluates a curve at steps evenly spaced parameters after 0, using forward differences, so that each point costs
+// three additions
+void appendSteps(const CubicBezier& curve, int steps, std::vector<Point>* points)
+{
+  // The curve as a polynomial a * t^3 + b * t^2 + c * t + p0
+  const Vector a = (curve.p1 - curve.p2) * 3 + (curve.p3 - curve.p0);
+  const Vector b = ((curve.p0 - curve.p1) + (curve.p2 - curve.p1)) * 3;
+  const Vector c = (curve.p1 - curve.p0) * 3;
+
+  const double h = 1.0 / steps;
+  const Vector a3 = a * (h * h * h);
+  const Vector b2 = b * (h * h);
+
+  Point point = curve.p0;
+  Vector first = a3 + b2 + c * h;
+  Vector second = a3 * 6 + b2 * 2;
+  const Vector third = a3 * 6;
+
+  for (int i = 1; i < steps; ++i) {
+    point = point + first;
+    first = first + second;
+    second = second + third;
+
+    points->push_back(point);
+  }
+
+  // The end point is exact, rather than carrying the differences' rounding
+  points->push_back(curve.p3);
+}
+
+}
+
+Point CubicBezier::evaluate(double t) const
+{
+  Point point;
+  evaluate(&t, 1, &point);
+
+  return point;
+}
+
+Vector CubicBezier::derivative(double t) const
+{
+  Vector result;
+  derivatives(this, 1, t, &result);
+
+  return result;
+}
+
+void CubicBezier::split(double t, CubicBezier* first, CubicBezier* second) const
+{
+  // de Casteljau's construction, where the intermediate points are the new control points
+  auto lerp = [t](const Point& a, const Point& b) { return a + (b - a) * t; };
+
+  const Point p01 = lerp(p0, p1);
+  const Point p12 = lerp(p1, p2);
+  const Point p23 = lerp(p2, p3);
+  const Point p012 = lerp(p01, p12);
+  const Point p123 = lerp(p12, p23);
+  const Point p0123 = lerp(p012, p123);
+
+  *first = { p0, p01, p012, p0123 };
+  *second = { p0123, p123, p23, p3 };
+}
+
+double CubicBezier::closestParameter(const Point& point, double estimate) const
+{
+  const int MaxIterations = 8;
+
+  // The closest point is where the offset to the point is perpendicular to the curve, which is a root of
+  // f(t) = (B(t) - point) . B'(t), with f'(t) = B'(t) . B'(t) + (B(t) - point) . B''(t)
+  auto distanceSquared = [this, &point](double t)
+  {
+    const Vector offset = evaluate(t) - point;
+    return offset.dot(offset);
+  };
+
+  double t = estimate;
+  double best = distanceSquared(t);
+
+  for (int i = 0; i < MaxIterations; ++i) {
+    const double s = 1 - t;
+    const Vector offset = evaluate(t) - point;
+    const Vector first = derivative(t);
+    const Vector second = ((p0 - p1) + (p2 - p1)) * (6 * s) + ((p1 - p2) + (p3 - p2)) * (6 * t);
+
+    const double numerator = offset.dot(first);
+    const double denominator = first.dot(first) + offset.dot(second);
+
+    if (denominator <= 0) {
+      break;
+    }
+
+    const double next = std::max(0.0, std::min(1.0, t - numerator / denominator));
+    const double distance = distanceSquared(next);
+
+    // Newton's method can overshoot where the curve bends sharply, so a step is only taken if it gets closer
+    if (distance >= best) {
+      break;
+    }
+
+    const bool converged = std::abs(next - t) < 1e-9;
+
+    t = next;
+    best = distance;
+
+    if (converged) {
+      break;
+    }
+  }
+
+  return t;
+}
+
+Rectangle CubicBezier::bounds() const
+{
+  Rectangle result = { std::min(p0.x, p3.x), std::min(p0.y, p3.y), std::max(p0.x, p3.x), std::max(p0.y, p3.y) };
+
+  // The control points can only pull the curve outside its end points if they're outside themselves
+  if (result.contains(Rectangle{ p1.x, p1.y, p1.x, p1.y }) && result.contains(Rectangle{ p2.x, p2.y, p2.x, p2.y })) {
+    return result;
+  }
+
+  double ts[4];
+  int count = turningPoints(p0.x, p1.x, p2.x, p3.x, ts);
+  count += turningPoints(p0.y, p1.y, p2.y, p3.y, ts + count);
+
+  Point points[4];
+  evaluate(ts, count, points);
+
+  for (int i = 0; i < count; ++i) {
+    result.grow(points[i]);
+  }
+
+  return result;
+}
+
+int CubicBezier::flatteningSteps(double tolerance) const
+{
+  int steps;
+  flatteningSteps(this, 1, tolerance, &steps);
+
+  return steps;
+}
+
+void CubicBezier::flatten(double tolerance, std::vector<Point>* points) const
+{
+  appendSteps(*this, flatteningSteps(tolerance), points);
+}
+
+void CubicBezier::evaluate(const double* ts, size_t count, Point* points) const
+{
+  double weights[4];
+
+  for (size_t i = 0; i < count; ++i) {
+    valueWeights(ts[i], weights);
+    weightedSum(*this, weights, &points[i].x);
+  }
+}
+
+void CubicBezier::derivatives(const CubicBezier* curves, size_t count, double t, Vector* derivatives)
+{
+  double weights[4];
+  derivativeWeights(t, weights);
+
+  for (size_t i = 0; i < count; ++i) {
+    weightedSum(curves[i], weights, &derivatives[i].x);
+  }
+}
+
+void CubicBezier::bounds(const CubicBezier* curves, size_t count, Rectangle* bounds)
+{
+  for (size_t i = 0; i < count; ++i) {
+    bounds[i] = curves[i].bounds();
+  }
+}
+
+void CubicBezier::flatteningSteps(const CubicBezier* curves, size_t count, double tolerance, int* steps)
+{
+  // Wang's formula, which bounds the distance between the curve and its chords by the size of its second
+  // differences. The limit keeps degenerate tolerances from running away.
+  const int MaxSteps = 1024;
+
+  auto clamp = [MaxSteps](double steps)
+  {
+    steps = std::ceil(steps);
+    return steps < 1 ? 1 : (steps > MaxSteps ? MaxSteps : static_cast<int>(steps));
+  };
+
+  size_t i = 0;
+
+#if defined(__SSE2__)
+  // Curves are taken two at a time, with the x and y coordinates of their second differences gathered into separate
+  // registers, so that each lane works on one curve. The arithmetic is the same as below, so both give equal counts.
+  const __m128d two = _mm_set1_pd(2);
+  const __m128d factor = _mm_set1_pd(0.75);
+  const __m128d divisor = _mm_set1_pd(tolerance);
+
+  auto secondDifferences = [two](const CubicBezier& curve, __m128d* first, __m128d* second)
+  {
+    const double* data = reinterpret_cast<const double*>(&curve);
+    const __m128d p0 = _mm_loadu_pd(data);
+    const __m128d p1 = _mm_loadu_pd(data + 2);
+    const __m128d p2 = _mm_loadu_pd(data + 4);
+    const __m128d p3 = _mm_loadu_pd(data + 6);
+
+    *first = _mm_add_pd(_mm_sub_pd(p0, p1), _mm_sub_pd(p2, p1));
+    *second = _mm_add_pd(_mm_sub_pd(p1, p2), _mm_sub_pd(p3, p2));
+  };
+
+  auto lengthsSquared = [](__m128d a, __m128d b)
+  {
+    const __m128d x = _mm_unpacklo_pd(a, b);
+    const __m128d y = _mm_unpackhi_pd(a, b);
+
+    return _mm_add_pd(_mm_mul_pd(x, x), _mm_mul_pd(y, y));
+  };
+
+  for (; i + 1 < count; i += 2) {
+    __m128d firstA, secondA, firstB, secondB;
+    secondDifferences(curves[i], &firstA, &secondA);
+    secondDifferences(curves[i + 1], &firstB, &secondB);
+
+    const __m128d secondDifference = _mm_sqrt_pd(_mm_max_pd(lengthsSquared(firstA, firstB),
+      lengthsSquared(secondA, secondB)));
+
+    double values[2];
+    _mm_storeu_pd(values, _mm_sqrt_pd(_mm_div_pd(_mm_mul_pd(factor, secondDifference), divisor)));
+
+    steps[i] = clamp(values[0]);
+    steps[i + 1] = clamp(values[1]);
+  }
+#endif
+
+  for (; i < count; ++i) {
+    const CubicBezier& curve = curves[i];
+    const Vector first = (curve.p0 - curve.p1) + (curve.p2 - curve.p1);
+    const Vector second = (curve.p1 - curve.p2) + (curve.p3 - curve.p2);
+
+    const double secondDifference = std::sqrt(std::max(first.dot(first), second.dot(second)));
+
+    steps[i] = clamp(std::sqrt(0.75 * secondDifference / tolerance));
+  }
+}
+
+void CubicBezier::flatten(const CubicBezier* curves, size_t count, double tolerance, std::vector<Point>* points,
+  std::vector<size_t>* ends)
+{
+  // Curves are counted in blocks, so that the counts can be kept on the stack
+  const size_t BlockSize = 64;
+
+  if (count == 0) {
+    return;
+  }
+
+  points->push_back(curves[0].p0);
+
+  for (size_t block = 0; block < count; block += BlockSize) {
+    const size_t blockCount = std::min(BlockSize, count - block);
+
+    int steps[BlockSize];
+    flatteningSteps(curves + block, blockCount, tolerance, steps);
+
+    for (size_t i = 0; i < blockCount; ++i) {
+      appendSteps(curves[block + i], steps[i], points);
+      ends->push_back(points->size());
+    }
+  }
+}
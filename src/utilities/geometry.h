@@ -1,5 +1,8 @@
 #pragma once
 
+#include <cstddef>
+#include <vector>
+
 struct Vector
 {
   double length() const;
@@ -7,6 +10,8 @@ struct Vector
   double cross(const Vector& other) const;
   Vector normalised() const;
   Vector operator-() const;
+  Vector operator+(const Vector& other) const;
+  Vector operator-(const Vector& other) const;
   Vector operator*(double scale) const;
 
   static const Vector zero;
@@ -29,14 +34,43 @@ struct Point
   double y;
 };
 
+// An affine transform, which maps (x, y) to (xx * x + xy * y + x0, yx * x + yy * y + y0)
+struct Transform
+{
+  static Transform translation(const Vector& offset);
+  static Transform scale(const Point& centre, double scaleX, double scaleY);
+  static Transform rotation(const Point& centre, double angle);
+
+  Point apply(const Point& point) const;
+  // Transforms a batch of points in place, using SIMD instructions where they're available
+  void apply(Point* points, size_t count) const;
+
+  // The transform that applies other and then this one
+  Transform operator*(const Transform& other) const;
+
+  static const Transform identity;
+
+  double xx;
+  double yx;
+  double xy;
+  double yy;
+  double x0;
+  double y0;
+};
+
 struct Rectangle
 {
   Rectangle normalised() const;
   bool contains(const Rectangle& other) const;
   bool contains(const Point& point) const;
   bool intersectsLine(const Point& p1, const Point& p2) const;
+  // The distance from the point to the nearest point in the rectangle, which is zero inside it
+  double distance(const Point& point) const;
 
   void grow(const Rectangle& other);
+  void grow(const Point& point);
+  Rectangle inflated(double amount) const;
+  Rectangle translated(const Vector& offset) const;
 
   double width() const { return right - left; }
   double height() const { return bottom - top; }
@@ -46,3 +80,42 @@ struct Rectangle
   double right;
   double bottom;
 };
+
+// A cubic Bezier curve from p0 to p3, with control points p1 and p2. The batched functions work over arrays of
+// curves or parameters without allocating, and count flattening steps for two curves at a time where SSE2 is
+// available.
+struct CubicBezier
+{
+  Point evaluate(double t) const;
+  // The curve's tangent, which is zero where a control point coincides with its end point
+  Vector derivative(double t) const;
+  void split(double t, CubicBezier* first, CubicBezier* second) const;
+  // Refines an estimate of the parameter of the curve's closest point to the given one with Newton's method, which
+  // converges to the closest point near the estimate rather than searching the whole curve
+  double closestParameter(const Point& point, double estimate) const;
+
+  // The bounds of the curve itself, from the extremes where its derivative is zero, which are usually tighter than
+  // the bounds of its control points
+  Rectangle bounds() const;
+
+  // The number of straight lines needed to stay within tolerance of the curve
+  int flatteningSteps(double tolerance) const;
+  // Appends the points of a polyline within tolerance of the curve, not including p0
+  void flatten(double tolerance, std::vector<Point>* points) const;
+
+  void evaluate(const double* ts, size_t count, Point* points) const;
+  static void derivatives(const CubicBezier* curves, size_t count, double t, Vector* derivatives);
+  // The bounds of each curve
+  static void bounds(const CubicBezier* curves, size_t count, Rectangle* bounds);
+  static void flatteningSteps(const CubicBezier* curves, size_t count, double tolerance, int* steps);
+  // Flattens a chain of curves, each starting where the previous one ends, into a polyline that starts at the
+  // first curve's p0. The points are appended, so that a vector can be reused without allocating, and the end of
+  // each curve's points is appended to ends.
+  static void flatten(const CubicBezier* curves, size_t count, double tolerance, std::vector<Point>* points,
+    std::vector<size_t>* ends);
+
+  Point p0;
+  Point p1;
+  Point p2;
+  Point p3;
+};
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "utilities/geometry.h"
+
+#include <cstdint>
+#include <cstring>
+
+// Builds a 64-bit hash from a sequence of values, for telling content apart rather than for security. Each value is
+// mixed in with its position in the sequence, so the same values in a different order hash differently.
+class Hasher
+{
+public:
+  Hasher()
+    : mState(0x243F6A8885A308D3)
+  {}
+
+  Hasher& add(uint64_t value)
+  {
+    mState = mix(mState ^ (value + 0x9E3779B97F4A7C15 + (mState << 6) + (mState >> 2)));
+    return *this;
+  }
+
+  Hasher& add(double value)
+  {
+    // Both zeroes are the same coordinate
+    if (value == 0) {
+      value = 0;
+    }
+
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+
+    return add(bits);
+  }
+
+  Hasher& add(const Point& point)
+  {
+    return add(point.x).add(point.y);
+  }
+
+  uint64_t hash() const { return mix(mState); }
+
+private:
+  static uint64_t mix(uint64_t value)
+  {
+    value ^= value >> 30;
+    value *= 0xBF58476D1CE4E5B9;
+    value ^= value >> 27;
+    value *= 0x94D049BB133111EB;
+    value ^= value >> 31;
+    return value;
+  }
+
+  uint64_t mState;
+};
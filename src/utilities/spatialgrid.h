@@ -0,0 +1,158 @@
+#pragma once
+
+#include "utilities/geometry.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+// A uniform grid over the plane that holds values in the cells their bounds overlap, so that finding the values near a
+// point only looks at a few cells. Values whose bounds would cover too many cells are kept apart and looked at by
+// every query instead.
+template <class T>
+class SpatialGrid
+{
+public:
+  explicit SpatialGrid(double cellSize)
+    : mCellSize(cellSize)
+  {}
+
+  void insert(const T& value, const Rectangle& bounds)
+  {
+    const CellRange range = cells(bounds);
+
+    if (range.count() > MaxCells) {
+      mLarge.push_back({ value, bounds });
+      return;
+    }
+
+    for (int32_t y = range.top; y <= range.bottom; ++y) {
+      for (int32_t x = range.left; x <= range.right; ++x) {
+        mCells[key(x, y)].push_back({ value, bounds });
+      }
+    }
+  }
+
+  // Removes a value, given the bounds it was inserted with
+  void remove(const T& value, const Rectangle& bounds)
+  {
+    auto removeFrom = [&value](std::vector<Item>* items)
+    {
+      auto it = std::find_if(items->begin(), items->end(), [&value](const Item& item) { return item.mValue == value; });
+
+      if (it != items->end()) {
+        *it = items->back();
+        items->pop_back();
+      }
+    };
+
+    const CellRange range = cells(bounds);
+
+    if (range.count() > MaxCells) {
+      removeFrom(&mLarge);
+      return;
+    }
+
+    for (int32_t y = range.top; y <= range.bottom; ++y) {
+      for (int32_t x = range.left; x <= range.right; ++x) {
+        auto cell = mCells.find(key(x, y));
+
+        if (cell != mCells.end()) {
+          removeFrom(&cell->second);
+
+          if (cell->second.empty()) {
+            mCells.erase(cell);
+          }
+        }
+      }
+    }
+  }
+
+  void clear()
+  {
+    mCells.clear();
+    mLarge.clear();
+  }
+
+  // Calls back once with each value whose bounds overlap the area
+  template <class T_Callback>
+  void query(const Rectangle& area, T_Callback callback) const
+  {
+    auto overlaps = [&area](const Rectangle& bounds)
+    {
+      return bounds.left <= area.right && area.left <= bounds.right && bounds.top <= area.bottom
+        && area.top <= bounds.bottom;
+    };
+
+    for (const Item& item : mLarge) {
+      if (overlaps(item.mBounds)) {
+        callback(item.mValue);
+      }
+    }
+
+    const CellRange range = cells(area);
+
+    for (int32_t y = range.top; y <= range.bottom; ++y) {
+      for (int32_t x = range.left; x <= range.right; ++x) {
+        auto cell = mCells.find(key(x, y));
+
+        if (cell == mCells.end()) {
+          continue;
+        }
+
+        for (const Item& item : cell->second) {
+          if (!overlaps(item.mBounds)) {
+            continue;
+          }
+
+          // A value in several cells is only reported from the first of them that the area overlaps
+          const CellRange itemRange = cells(item.mBounds);
+
+          if (x == std::max(itemRange.left, range.left) && y == std::max(itemRange.top, range.top)) {
+            callback(item.mValue);
+          }
+        }
+      }
+    }
+  }
+
+private:
+  static const int MaxCells = 64;
+
+  struct Item
+  {
+    T mValue;
+    Rectangle mBounds;
+  };
+
+  struct CellRange
+  {
+    int64_t count() const { return int64_t(right - left + 1) * (bottom - top + 1); }
+
+    int32_t left;
+    int32_t top;
+    int32_t right;
+    int32_t bottom;
+  };
+
+  CellRange cells(const Rectangle& bounds) const
+  {
+    auto cell = [this](double coordinate)
+    {
+      return static_cast<int32_t>(std::max(-1e9, std::min(1e9, std::floor(coordinate / mCellSize))));
+    };
+
+    return { cell(bounds.left), cell(bounds.top), cell(bounds.right), cell(bounds.bottom) };
+  }
+
+  static uint64_t key(int32_t x, int32_t y)
+  {
+    return (uint64_t(uint32_t(x)) << 32) | uint32_t(y);
+  }
+
+  double mCellSize;
+  std::unordered_map<uint64_t, std::vector<Item>> mCells;
+  std::vector<Item> mLarge;
+};
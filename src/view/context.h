@@ -17,12 +17,25 @@ class Context
 public:
   sigc::signal<void()> addSignal() { return mAddSignal; }
   sigc::signal<void()> deleteSignal() { return mDeleteSignal; }
+  sigc::signal<void()> freehandSignal() { return mFreehandSignal; }
+  sigc::signal<void()> deleteSelectionSignal() { return mDeleteSelectionSignal; }
+  sigc::signal<void()> simplifySignal() { return mSimplifySignal; }
   sigc::signal<void()> groupSignal() { return mGroupSignal; }
+  sigc::signal<void()> ungroupSignal() { return mUngroupSignal; }
+  sigc::signal<void()> defineSignal() { return mDefineSignal; }
+  sigc::signal<void()> placeInstanceSignal() { return mPlaceInstanceSignal; }
   sigc::signal<void()> moveSignal() { return mMoveSignal; }
+  sigc::signal<void()> scaleSignal() { return mScaleSignal; }
+  sigc::signal<void()> rotateSignal() { return mRotateSignal; }
   sigc::signal<void()> cancelSignal() { return mCancelSignal; }
   sigc::signal<void()> viewSignal() { return mViewSignal; }
   sigc::signal<void()> bringForwardSignal() { return mBringForwardSignal; }
   sigc::signal<void()> sendBackwardSignal() { return mSendBackwardSignal; }
+  sigc::signal<void()> selectAllSignal() { return mSelectAllSignal; }
+  sigc::signal<void()> invertSelectionSignal() { return mInvertSelectionSignal; }
+  sigc::signal<void()> selectConnectedSignal() { return mSelectConnectedSignal; }
+  sigc::signal<void()> selectSameStrokeSignal() { return mSelectSameStrokeSignal; }
+  sigc::signal<void()> selectSameFillSignal() { return mSelectSameFillSignal; }
 
   sigc::signal<void(Model::Sketch*)> signalModelChanged() { return mModelChangedSignal; }
 
@@ -31,12 +44,25 @@ private:
 
   sigc::signal<void()> mAddSignal;
   sigc::signal<void()> mDeleteSignal;
+  sigc::signal<void()> mFreehandSignal;
+  sigc::signal<void()> mDeleteSelectionSignal;
+  sigc::signal<void()> mSimplifySignal;
   sigc::signal<void()> mGroupSignal;
+  sigc::signal<void()> mUngroupSignal;
+  sigc::signal<void()> mDefineSignal;
+  sigc::signal<void()> mPlaceInstanceSignal;
   sigc::signal<void()> mMoveSignal;
+  sigc::signal<void()> mScaleSignal;
+  sigc::signal<void()> mRotateSignal;
   sigc::signal<void()> mCancelSignal;
   sigc::signal<void()> mViewSignal;
   sigc::signal<void()> mBringForwardSignal;
   sigc::signal<void()> mSendBackwardSignal;
+  sigc::signal<void()> mSelectAllSignal;
+  sigc::signal<void()> mInvertSelectionSignal;
+  sigc::signal<void()> mSelectConnectedSignal;
+  sigc::signal<void()> mSelectSameStrokeSignal;
+  sigc::signal<void()> mSelectSameFillSignal;
   sigc::signal<void(Model::Sketch*)> mModelChangedSignal;
 };
 
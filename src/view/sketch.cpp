@@ -2,8 +2,14 @@
 
 #include "controller/undo.h"
 #include "model/controlpoint.h"
+#include "model/document.h"
+#include "model/instance.h"
+#include "utilities/curvefitting.h"
 #include "view/context.h"
 
+#include <algorithm>
+#include <cmath>
+#include <wx/config.h>
 #include <wx/rawbmp.h>
 
 namespace View
@@ -24,7 +30,7 @@ using Handle = Sketch::Handle;
 
 Handle findHandle(const Model::Sketch* sketch, double x, double y, Model::Type type,
   const Model::Node::ControlPointList& ignoreControlPoints);
-Handle findElement(Model::Sketch* sketch, double x, double y);
+Handle findElement(Controller::FlattenedPaths* flattenedPaths, Model::Sketch* sketch, double x, double y);
 
 HandleStyle handleStyle(NodeType nodeType, Model::Type handleType)
 {
@@ -185,6 +191,45 @@ void drawSketchDetails(cairo_t* context, const Model::Sketch* sketch, const Sket
   }
 }
 
+// Shows what a point has snapped to, with guides to the nodes it's in line with and a cross where it's snapped
+void drawSnap(cairo_t* context, const Controller::Snapping::Result& snap, const Model::Sketch* sketch)
+{
+  const double CrossSize = 4;
+
+  if (snap.mTarget == Controller::Snapping::Target::None) {
+    return;
+  }
+
+  const Vector offset = sketch->position() - Point{0, 0};
+
+  cairo_save(context);
+
+  for (const Controller::Snapping::Guide& guide : snap.mGuides) {
+    const Point from = guide.mFrom + offset;
+    const Point to = guide.mTo + offset;
+
+    cairo_move_to(context, from.x, from.y);
+    cairo_line_to(context, to.x, to.y);
+  }
+
+  cairo_set_source_rgb(context, 1, 0, 1);
+  cairo_set_line_width(context, 1);
+  cairo_set_dash(context, &DashLength, 1, 0);
+  cairo_stroke(context);
+
+  const Point position = snap.mPosition + offset;
+
+  cairo_move_to(context, position.x - CrossSize, position.y - CrossSize);
+  cairo_line_to(context, position.x + CrossSize, position.y + CrossSize);
+  cairo_move_to(context, position.x - CrossSize, position.y + CrossSize);
+  cairo_line_to(context, position.x + CrossSize, position.y - CrossSize);
+
+  cairo_set_dash(context, nullptr, 0, 0);
+  cairo_stroke(context);
+
+  cairo_restore(context);
+}
+
 class SketchModePlace : public Sketch::Mode
 {
 public:
@@ -208,8 +253,17 @@ public:
     mPreviousCursor = sketch.GetCursor();
     sketch.SetCursor(wxCURSOR_BLANK);
 
+    // The handle being dragged isn't snapped to, and nor is a dragged node's control points
+    mSnapExclusions.clear();
+
     if (mDragHandle.isValid()) {
       mInitialHandlePosition = sketch.handlePosition(mDragHandle);
+
+      if (mDragHandle.refersTo(Model::Type::Node)) {
+        mSnapExclusions.add(mDragHandle, sketch.mModel);
+      } else {
+        mSnapExclusions.insert(mDragHandle);
+      }
     }
 
     setDirectionConstraint(sketch);
@@ -218,6 +272,7 @@ public:
   void end(Sketch& sketch) override
   {
     sketch.SetCursor(mPreviousCursor);
+    sketch.clearSnap();
   }
 
   void draw(Sketch& sketch, cairo_t* context, int width, int height) override
@@ -236,6 +291,8 @@ public:
 
       cairo_stroke(context);
     }
+
+    drawSnap(context, sketch.mSnap, sketch.mModel);
   }
 
   void onPointerPressed(Sketch& sketch, double x, double y) override
@@ -250,6 +307,14 @@ public:
 
     if (mDragHandle.isValid()) {
       Point newPosition = mInitialHandlePosition + (Point{x, y} - mInitialMousePosition);
+
+      // A control point held to its direction follows the pointer along it instead
+      if (mConstrainDirection && mDragHandle.refersTo(Model::Type::ControlPoint)) {
+        sketch.clearSnap();
+      } else {
+        newPosition = sketch.snap(newPosition, mSnapExclusions);
+      }
+
       setHandlePosition(sketch, mDragHandle, newPosition.x, newPosition.y);
     }
 
@@ -342,6 +407,7 @@ private:
   Vector mDirectionConstraint;
   bool mConstrainDirection;
   Handle mDragHandle;
+  Controller::Selection mSnapExclusions;
 };
 
 SketchModePlace SketchModePlace::sInstance;
@@ -352,8 +418,9 @@ public:
   SketchModePlaceSelection()
   { }
 
-  void prepare(double mouseX, double mouseY)
+  void prepare(const Handle& grabHandle, double mouseX, double mouseY)
   {
+    mGrabHandle = grabHandle;
     mPreviousPosition = Point{mouseX, mouseY};
   }
 
@@ -361,11 +428,35 @@ public:
   {
     mPreviousCursor = sketch.GetCursor();
     sketch.SetCursor(wxCURSOR_BLANK);
+
+    // The node or control point that was grabbed is the one that snaps, and otherwise the point under the pointer
+    if (mGrabHandle.refersTo(Model::Type::Node) || mGrabHandle.refersTo(Model::Type::ControlPoint)) {
+      mSnapPosition = sketch.handlePosition(mGrabHandle);
+    } else {
+      mSnapPosition = mPreviousPosition;
+    }
+
+    mGrabOffset = mSnapPosition - mPreviousPosition;
+
+    // The selection isn't snapped to, as it moves along with the point. That includes the nodes and control points of
+    // selected sub-sketches, which aren't selected themselves as the sub-sketches share them with this sketch.
+    mSnapExclusions = sketch.mSelection;
+
+    sketch.mSelection.forEach(Model::Type::Sketch,
+      [this, &sketch](const Model::Reference& reference) {
+        excludeSubSketch(sketch.mModel->sketch(reference.id<Model::Sketch>()));
+      });
   }
 
   void end(Sketch& sketch) override
   {
     sketch.SetCursor(mPreviousCursor);
+    sketch.clearSnap();
+  }
+
+  void draw(Sketch& sketch, cairo_t* context, int width, int height) override
+  {
+    drawSnap(context, sketch.mSnap, sketch.mModel);
   }
 
   void onPointerPressed(Sketch& sketch, double x, double y) override
@@ -375,10 +466,10 @@ public:
 
   bool onPointerMotion(Sketch& sketch, double x, double y) override
   {
-    const Point position{x, y};
+    const Point position = sketch.snap(Point{x, y} + mGrabOffset, mSnapExclusions);
 
-    sketch.mController->moveSelection(sketch.mSelection, position - mPreviousPosition);
-    mPreviousPosition = position;
+    sketch.mController->moveSelection(sketch.mSelection, position - mSnapPosition);
+    mSnapPosition = position;
 
     sketch.Refresh();
     return true;
@@ -390,8 +481,27 @@ public:
   }
 
 private:
+  void excludeSubSketch(const Model::Sketch* subSketch)
+  {
+    for (auto [id, node] : subSketch->nodes()) {
+      mSnapExclusions.insert(id);
+    }
+
+    for (auto [id, controlPoint] : subSketch->controlPoints()) {
+      mSnapExclusions.insert(id);
+    }
+
+    for (auto [id, nested] : subSketch->sketches()) {
+      excludeSubSketch(nested);
+    }
+  }
+
   wxCursor mPreviousCursor;
+  Handle mGrabHandle;
   Point mPreviousPosition;
+  Point mSnapPosition;
+  Vector mGrabOffset;
+  Controller::Selection mSnapExclusions;
 };
 
 class SketchModeMove : public Sketch::Mode
@@ -419,7 +529,7 @@ public:
         mPlaceMode.prepare(sketch.mHoverHandle, Point{x, y});
         sketch.pushMode(&mPlaceMode);
       } else {
-        mPlaceSelectionMode.prepare(x, y);
+        mPlaceSelectionMode.prepare(sketch.mHoverHandle, x, y);
         sketch.pushMode(&mPlaceSelectionMode);
       }
     }
@@ -439,15 +549,116 @@ private:
 
 SketchModeMove SketchModeMove::sInstance;
 
+// Scales or rotates the selection about the centre of its bounds, following the pointer between two clicks
+class SketchModeTransform : public Sketch::Mode
+{
+public:
+  static SketchModeTransform sScale;
+  static SketchModeTransform sRotate;
+
+  enum Kind
+  {
+    Scale,
+    Rotate,
+  };
+
+  SketchModeTransform(Kind kind)
+    : mKind(kind)
+    , mActive(false)
+  { }
+
+  void begin(Sketch& sketch) override
+  {
+    const Rectangle bounds = sketch.mController->selectionBounds(sketch.mSelection);
+    mCentre = Point{(bounds.left + bounds.right) / 2, (bounds.top + bounds.bottom) / 2};
+    mActive = false;
+  }
+
+  void end(Sketch& sketch) override
+  {
+    if (mActive) {
+      sketch.mUndoManager->endGroup();
+      mActive = false;
+    }
+  }
+
+  void draw(Sketch& sketch, cairo_t* context, int width, int height) override
+  {
+    drawSketchDetails(context, sketch.mModel, sketch.mHoverHandle, sketch.mSelection);
+    drawHandle(context, HandleStyle::Add, mCentre, false);
+  }
+
+  void onPointerPressed(Sketch& sketch, double x, double y) override
+  {
+    if (mActive) {
+      sketch.popMode(this);
+    } else {
+      sketch.mUndoManager->beginGroup();
+      mPreviousPosition = Point{x, y};
+      mActive = true;
+    }
+  }
+
+  bool onPointerMotion(Sketch& sketch, double x, double y) override
+  {
+    if (!mActive) {
+      return false;
+    }
+
+    const Point position{x, y};
+    const Vector from = mPreviousPosition - mCentre;
+    const Vector to = position - mCentre;
+
+    // Too close to the centre to give a meaningful scale or angle
+    if (from.length() < 1 || to.length() < 1) {
+      return true;
+    }
+
+    if (mKind == Scale) {
+      const double factor = to.length() / from.length();
+      sketch.mController->scaleSelection(sketch.mSelection, mCentre, factor, factor);
+    } else {
+      sketch.mController->rotateSelection(sketch.mSelection, mCentre, std::atan2(from.cross(to), from.dot(to)));
+    }
+
+    mPreviousPosition = position;
+
+    sketch.Refresh();
+    return true;
+  }
+
+  void onCancel(Sketch& sketch) override
+  {
+    if (mActive) {
+      sketch.mUndoManager->cancelGroup();
+      mActive = false;
+    }
+  }
+
+private:
+  Kind mKind;
+  bool mActive;
+  Point mCentre;
+  Point mPreviousPosition;
+};
+
+SketchModeTransform SketchModeTransform::sScale(SketchModeTransform::Scale);
+SketchModeTransform SketchModeTransform::sRotate(SketchModeTransform::Rotate);
+
 class SketchModeAdd : public Sketch::Mode
 {
 public:
   static SketchModeAdd sInstance;
 
+  SketchModeAdd()
+    : mOnCurve(false)
+  {}
+
   void begin(Sketch& sketch) override
   {
     mPreviousCursor = sketch.GetCursor();
     sketch.SetCursor(wxCURSOR_CROSS);
+    mOnCurve = false;
   }
 
   void end(Sketch& sketch) override
@@ -459,6 +670,10 @@ public:
   {
     drawDetails(context, sketch.mModel, sketch.mHoverHandle);
 
+    if (mOnCurve && !sketch.mHoverHandle.isValid() && sketch.activeMode() == this) {
+      drawHandle(context, HandleStyle::Add, mCurvePoint.mPosition + sketch.mModel->position(), true);
+    }
+
     if (sketch.activeMode() == &mAdjustHandlesMode) {
       const Sketch::Handle& handle = mAdjustHandlesMode.dragHandle();
 
@@ -494,13 +709,32 @@ public:
     }
   }
 
+  bool onPointerMotion(Sketch& sketch, double x, double y) override
+  {
+    bool wasOnCurve = mOnCurve;
+    mOnCurve = findCurvePoint(sketch, x, y);
+
+    if (mOnCurve || wasOnCurve) {
+      sketch.Refresh();
+    }
+
+    return false;
+  }
+
   void onPointerPressed(Sketch& sketch, double x, double y) override
   {
     if (sketch.mHoverHandle.isValid()) {
       addNode(sketch, sketch.mHoverHandle, Point{x, y});
       sketch.mHoverHandle = Sketch::Handle();
+    } else if (findCurvePoint(sketch, x, y)) {
+      sketch.mController->controllerForPath(mCurvePoint.mPath).splitSegment(mCurvePoint.mSegment,
+        mCurvePoint.mParameter);
+
+      mOnCurve = false;
+      sketch.Refresh();
     } else {
-      Point position{x, y};
+      const Point position = sketch.snap(Point{x, y}, Controller::Selection());
+      sketch.clearSnap();
 
       sketch.mUndoManager->beginGroup();
 
@@ -587,6 +821,17 @@ public:
   }
 
 private:
+  // Finds where a node can be added to one of the sketch's paths under the pointer, away from its ends
+  bool findCurvePoint(Sketch& sketch, double x, double y)
+  {
+    const double CurveDistance = 4;
+
+    const Point point = { x - sketch.mModel->position().x, y - sketch.mModel->position().y };
+
+    return sketch.mFlattenedPaths.closestPoint(sketch.mModel, point, CurveDistance, &mCurvePoint)
+      && mCurvePoint.mParameter > 0 && mCurvePoint.mParameter < 1;
+  }
+
   std::tuple<int, ID<Model::Path>, Model::Path::Entry> findAddLocation(const Model::Sketch* sketch,
     const Handle& searchHandle)
   {
@@ -679,11 +924,121 @@ private:
   SketchModePlace mSetPositionMode;
   SketchModePlace mAdjustHandlesMode;
   ID<Model::Path> mCurrentPath;
+  Controller::FlattenedPaths::CurvePoint mCurvePoint;
+  bool mOnCurve;
   wxCursor mPreviousCursor;
 };
 
 SketchModeAdd SketchModeAdd::sInstance;
 
+// Draws a path along the pointer while the button is held, fitting curves to the stroke as it's drawn. The path is
+// only added when the button is released, as a single undo step.
+class SketchModeFreehand : public Sketch::Mode
+{
+public:
+  static SketchModeFreehand sInstance;
+
+  SketchModeFreehand()
+    : mDrawing(false)
+  {}
+
+  void begin(Sketch& sketch) override
+  {
+    mPreviousCursor = sketch.GetCursor();
+    sketch.SetCursor(wxCURSOR_PENCIL);
+    mDrawing = false;
+  }
+
+  void end(Sketch& sketch) override
+  {
+    sketch.SetCursor(mPreviousCursor);
+  }
+
+  void draw(Sketch& sketch, cairo_t* context, int width, int height) override
+  {
+    const std::vector<CubicBezier>& curves = mFitter.curves();
+
+    if (!mDrawing || curves.empty()) {
+      return;
+    }
+
+    cairo_move_to(context, curves.front().p0.x, curves.front().p0.y);
+
+    for (const CubicBezier& curve : curves) {
+      cairo_curve_to(context, curve.p1.x, curve.p1.y, curve.p2.x, curve.p2.y, curve.p3.x, curve.p3.y);
+    }
+
+    cairo_set_source_rgb(context, 0, 0, 0);
+    cairo_set_line_width(context, 1);
+    cairo_stroke(context);
+  }
+
+  void onPointerPressed(Sketch& sketch, double x, double y) override
+  {
+    const double StrokeTolerance = 1.5;
+
+    mFitter.begin(Point{x, y}, StrokeTolerance);
+    mDrawing = true;
+  }
+
+  void onPointerReleased(Sketch& sketch) override
+  {
+    if (!mDrawing) {
+      return;
+    }
+
+    mDrawing = false;
+
+    const std::vector<CubicBezier>& curves = mFitter.curves();
+
+    if (curves.empty()) {
+      return;
+    }
+
+    // Each curve ends at a node whose controls are the curve's and the next one's, and the ends of the stroke have
+    // their controls on them
+    const Vector offset = sketch.mModel->position() - Point{0, 0};
+    std::vector<Controller::Path::NodeData> nodes;
+    nodes.reserve(curves.size() + 1);
+
+    for (size_t i = 0; i <= curves.size(); ++i) {
+      const Point position = i < curves.size() ? curves[i].p0 : curves.back().p3;
+      const Point preControl = i > 0 ? curves[i - 1].p2 : position;
+      const Point postControl = i < curves.size() ? curves[i].p1 : position;
+
+      nodes.push_back({ position - offset, preControl - offset, postControl - offset, NodeType::Smooth });
+    }
+
+    sketch.mController->beginTransaction();
+
+    const ID<Model::Path> id = sketch.mController->addPath();
+    sketch.mController->controllerForPath(id).addNodes(0, nodes);
+
+    sketch.mController->commitTransaction();
+
+    sketch.Refresh();
+  }
+
+  bool onPointerMotion(Sketch& sketch, double x, double y) override
+  {
+    if (!mDrawing) {
+      return false;
+    }
+
+    mFitter.addPoint(Point{x, y});
+    sketch.Refresh();
+
+    return true;
+  }
+
+private:
+  StrokeFitter mFitter;
+  bool mDrawing;
+  wxCursor mPreviousCursor;
+};
+
+SketchModeFreehand SketchModeFreehand::sInstance;
+
 class SketchModeDelete : public Sketch::Mode
 {
 public:
@@ -728,6 +1083,8 @@ Sketch::Sketch(wxWindow* parent, Model::Sketch* model, Controller::UndoManager *
   , mModel(nullptr)
   , mController(nullptr)
   , mUndoManager(undoManager)
+  , mSnapping(&mFlattenedPaths)
+  , mSnap{ Point{0, 0}, Controller::Snapping::Target::None, Model::Reference(), {} }
   , mDragging(false)
   , mShowDetails(false)
 {
@@ -735,17 +1092,34 @@ Sketch::Sketch(wxWindow* parent, Model::Sketch* model, Controller::UndoManager *
 
   Bind(wxEVT_PAINT, &Sketch::onPaint, this);
 
+  // Snapping to a grid is off unless a spacing is configured
+  mSnapping.setGridSpacing(wxConfigBase::Get()->ReadDouble("SnapGridSpacing", 0));
+
   context.addSignal().connect(sigc::mem_fun(*this, &Sketch::activateAddMode));
   context.deleteSignal().connect(sigc::mem_fun(*this, &Sketch::activateDeleteMode));
+  context.freehandSignal().connect(sigc::mem_fun(*this, &Sketch::activateFreehandMode));
+  context.deleteSelectionSignal().connect(sigc::mem_fun(*this, &Sketch::deleteSelection));
+  context.simplifySignal().connect(sigc::mem_fun(*this, &Sketch::simplifySelection));
   context.groupSignal().connect(sigc::mem_fun(*this, &Sketch::groupSelection));
+  context.ungroupSignal().connect(sigc::mem_fun(*this, &Sketch::ungroupSelection));
+  context.defineSignal().connect(sigc::mem_fun(*this, &Sketch::defineSelection));
+  context.placeInstanceSignal().connect(sigc::mem_fun(*this, &Sketch::placeInstances));
   context.moveSignal().connect(sigc::mem_fun(*this, &Sketch::activateMoveMode));
+  context.scaleSignal().connect(sigc::mem_fun(*this, &Sketch::activateScaleMode));
+  context.rotateSignal().connect(sigc::mem_fun(*this, &Sketch::activateRotateMode));
   context.viewSignal().connect(sigc::mem_fun(*this, &Sketch::activateViewMode));
   context.cancelSignal().connect(sigc::mem_fun(*this, &Sketch::onCancel));
   context.bringForwardSignal().connect(sigc::mem_fun(*this, &Sketch::bringForward));
   context.sendBackwardSignal().connect(sigc::mem_fun(*this, &Sketch::sendBackward));
+  context.selectAllSignal().connect(sigc::mem_fun(*this, &Sketch::selectAll));
+  context.invertSelectionSignal().connect(sigc::mem_fun(*this, &Sketch::invertSelection));
+  context.selectConnectedSignal().connect(sigc::mem_fun(*this, &Sketch::selectConnected));
+  context.selectSameStrokeSignal().connect(sigc::mem_fun(*this, &Sketch::selectSameStroke));
+  context.selectSameFillSignal().connect(sigc::mem_fun(*this, &Sketch::selectSameFill));
   context.signalModelChanged().connect(sigc::mem_fun(*this, &Sketch::setModel));
 
   Bind(wxEVT_LEFT_DOWN, &Sketch::onPointerPressed, this);
+  Bind(wxEVT_LEFT_UP, &Sketch::onPointerReleased, this);
   Bind(wxEVT_RIGHT_DOWN, &Sketch::onSecondaryPointerPressed, this);
   Bind(wxEVT_MOTION, &Sketch::onPointerMotion, this);
   Bind(wxEVT_KEY_DOWN, &Sketch::onKeyPressed, this);
@@ -800,7 +1174,8 @@ void Sketch::onPaint(wxPaintEvent& event)
 
   std::vector<Rectangle> extents;
 
-  drawSketch(context, mModel, &extents, nullptr);
+  drawSketch(context, mModel);
+  selectedExtents(&extents);
 
   if (mShowDetails && mModeStack.empty()) {
     drawSketchDetails(context, mModel, Handle(), mSelection);
@@ -870,62 +1245,38 @@ void Sketch::onPaint(wxPaintEvent& event)
   dc.DrawBitmap(wxBitmap(image), 0, 0);
 }
 
-void Sketch::drawSketch(cairo_t* context, const Model::Sketch* sketch, std::vector<Rectangle>* selectedExtents,
-  Rectangle* extents) const
+void Sketch::drawSketch(cairo_t* context, const Model::Sketch* sketch) const
 {
-  bool first = true;
-
   for (const Handle& handle : sketch->drawOrder()) {
-    Rectangle currentExtents = { 0 };
-
-    bool getExtents = extents || (selectedExtents && mSelection.contains(handle));
-
     if (handle.type() == Model::Type::Path) {
-      drawPath(context, handle.id<Model::Path>(), sketch, getExtents ? &currentExtents : nullptr);
+      drawPath(context, handle.id<Model::Path>(), sketch);
     } else if (handle.type() == Model::Type::Sketch) {
       cairo_save(context);
 
       const Model::Sketch* subSketch = sketch->sketch(handle.id<Model::Sketch>());
       cairo_translate(context, subSketch->position().x, subSketch->position().y);
 
-      drawSketch(context, subSketch, nullptr, getExtents ? &currentExtents : nullptr);
-
-      if (getExtents) {
-        cairo_matrix_t matrix;
-        cairo_get_matrix(context, &matrix);
-        cairo_matrix_transform_point(&matrix, &currentExtents.left, &currentExtents.top);
-        cairo_matrix_transform_point(&matrix, &currentExtents.right, &currentExtents.bottom);
-      }
+      drawSketch(context, subSketch);
 
       cairo_restore(context);
-    }
+    } else if (handle.type() == Model::Type::Instance) {
+      cairo_save(context);
 
-    if (getExtents) {
-      if (extents) {
-        if (first) {
-          *extents = currentExtents;
-        } else {
-          extents->grow(currentExtents);
-        }
-      } else if (selectedExtents) {
-        selectedExtents->push_back(currentExtents);
-      }
-    }
+      const Model::Instance* instance = sketch->instance(handle.id<Model::Instance>());
+      cairo_translate(context, instance->position().x, instance->position().y);
 
-    first = false;
+      drawSketch(context, sketch->parent()->definition(instance->definition()));
+
+      cairo_restore(context);
+    }
   }
 }
 
-void Sketch::drawPath(cairo_t* context, const ID<Model::Path>& id, const Model::Sketch* sketch,
-  Rectangle* extents) const
+void Sketch::drawPath(cairo_t* context, const ID<Model::Path>& id, const Model::Sketch* sketch) const
 {
   const Model::Path* path = sketch->path(id);
 
   if (pathToCairo(context, path, sketch)) {
-    if (extents) {
-      cairo_path_extents(context, &extents->left, &extents->top, &extents->right, &extents->bottom);
-    }
-
     {
       const Colour& colour = path->strokeColour();
       cairo_set_source_rgb(context, colour.red(), colour.green(), colour.blue());
@@ -943,88 +1294,121 @@ void Sketch::drawPath(cairo_t* context, const ID<Model::Path>& id, const Model::
   }
 }
 
-cairo_t* createCollisionDetectionContext()
+// The bounds of each selected element of the top-level sketch, from the bounds that the flattened paths keep
+void Sketch::selectedExtents(std::vector<Rectangle>* extents)
 {
-  const cairo_format_t format = CAIRO_FORMAT_A8;
-  const int SurfaceSize = 11;
-  cairo_surface_t* surface = cairo_image_surface_create(format, SurfaceSize, SurfaceSize);
+  for (const Handle& handle : mModel->drawOrder()) {
+    if (!mSelection.contains(handle)) {
+      continue;
+    }
 
-  cairo_t* context = cairo_create(surface);
+    Rectangle bounds;
 
-  cairo_set_antialias(context, CAIRO_ANTIALIAS_NONE);
+    if (handle.type() == Model::Type::Path) {
+      if (mFlattenedPaths.bounds(mModel, handle.id<Model::Path>(), &bounds)) {
+        extents->push_back(bounds);
+      }
+    } else if (handle.type() == Model::Type::Sketch) {
+      const Model::Sketch* subSketch = mModel->sketch(handle.id<Model::Sketch>());
 
-  cairo_surface_destroy(surface);
+      if (mFlattenedPaths.sketchBounds(subSketch, &bounds)) {
+        extents->push_back(bounds.translated(subSketch->position() - Point{0, 0}));
+      }
+    } else if (handle.type() == Model::Type::Instance) {
+      const Model::Instance* instance = mModel->instance(handle.id<Model::Instance>());
 
-  return context;
+      if (mFlattenedPaths.sketchBounds(mModel->parent()->definition(instance->definition()), &bounds)) {
+        extents->push_back(bounds.translated(instance->position() - Point{0, 0}));
+      }
+    }
+  }
 }
 
-bool pointInPath(cairo_t* context, Model::Sketch* sketch, Model::Path* path, double x, double y)
-{
-  cairo_save(context);
-
-  cairo_surface_t* surface = cairo_get_target(context);
-
-  assert(cairo_surface_get_type(surface) == CAIRO_SURFACE_TYPE_IMAGE);
-
-  int width = cairo_image_surface_get_width(surface);
-  int height = cairo_image_surface_get_height(surface);
+// Paths are picked with polylines as fine as cairo draws their curves by default
+const double FlatteningTolerance = 0.1;
 
-  cairo_set_source_rgba(context, 0, 0, 0, 0);
-  cairo_set_operator(context, CAIRO_OPERATOR_SOURCE);
-  cairo_paint(context);
+double squaredDistanceToLine(const Point& point, const Point& p1, const Point& p2)
+{
+  const Vector delta = p2 - p1;
+  const Vector offset = point - p1;
+  const double lengthSquared = delta.dot(delta);
 
-  cairo_new_path(context);
+  double t = lengthSquared > 0 ? offset.dot(delta) / lengthSquared : 0;
+  t = std::max(0.0, std::min(1.0, t));
 
-  const int OffsetX = width / 2;
-  const int OffsetY = height / 2;
+  const Vector distance = offset - delta * t;
 
-  cairo_translate(context, -x + OffsetX, -y + OffsetY);
+  return distance.dot(distance);
+}
 
-  bool result = false;
+// Whether the point is within the given distance of the polyline, or inside it if it's filled. Filled polylines are
+// closed implicitly and filled by their winding number, as cairo does by default.
+bool pointInPolyline(const std::vector<Point>& points, const Point& point, double distance, bool filled)
+{
+  int winding = 0;
 
-  if (pathToCairo(context, path, sketch)) {
-    cairo_set_source_rgba(context, 1, 1, 1, 1);
-    cairo_set_operator(context, CAIRO_OPERATOR_OVER);
-    cairo_stroke_preserve(context);
+  for (size_t i = 0; i < points.size(); ++i) {
+    const Point& p1 = points[i];
+    const Point& p2 = points[i + 1 < points.size() ? i + 1 : 0];
 
-    if (path->isFilled()) {
-      cairo_fill(context);
+    if (i + 1 < points.size() && squaredDistanceToLine(point, p1, p2) <= distance * distance) {
+      return true;
     }
 
-    cairo_surface_flush(surface);
-
-    int stride = cairo_image_surface_get_stride(surface);
-    unsigned char* imageData = cairo_image_surface_get_data(surface);
-    unsigned char* pixel = imageData + (OffsetY * stride) + OffsetX;
+    if (filled) {
+      const double side = (p2 - p1).cross(point - p1);
 
-    result = *pixel != 0;
+      if (p1.y <= point.y && point.y < p2.y && side > 0) {
+        ++winding;
+      } else if (p2.y <= point.y && point.y < p1.y && side < 0) {
+        --winding;
+      }
+    }
   }
 
-  cairo_restore(context);
-
-  return result;
+  return winding != 0;
 }
 
-Handle findElement(Model::Sketch* sketch, double x, double y)
+Handle findElement(Controller::FlattenedPaths* flattenedPaths, Model::Sketch* sketch, double x, double y)
 {
-  cairo_t* context = createCollisionDetectionContext();
-
-  cairo_set_line_width(context, 4);
+  const double PickingDistance = 2;
 
   Handle handle;
 
   for (auto it = sketch->drawOrder().rbegin(); it != sketch->drawOrder().rend(); ++it) {
     if (it->type() == Model::Type::Path) {
-      Model::Path* path = sketch->path(it->id<Model::Path>());
+      const ID<Model::Path> id = it->id<Model::Path>();
+      const Point point = { x - sketch->position().x, y - sketch->position().y };
+
+      // The polyline lies within the bounds of the path's curves, so a path whose bounds are too far away can't be
+      // picked, whether it's filled or not
+      Rectangle bounds;
 
-      if (pointInPath(context, sketch, path, x - sketch->position().x, y - sketch->position().y)) {
+      if (!flattenedPaths->bounds(sketch, id, &bounds) || bounds.distance(point) > PickingDistance) {
+        continue;
+      }
+
+      const std::vector<Point>& points = flattenedPaths->flattened(sketch, id, FlatteningTolerance);
+
+      if (pointInPolyline(points, point, PickingDistance, sketch->path(id)->isFilled())) {
         handle = *it;
         break;
       }
     } else if (it->type() == Model::Type::Sketch) {
       Model::Sketch* subSketch = sketch->sketch(it->id<Model::Sketch>());
 
-      Handle subHandle = findElement(subSketch, x, y);
+      Handle subHandle = findElement(flattenedPaths, subSketch, x, y);
+
+      if (subHandle.isValid()) {
+        handle = *it;
+        break;
+      }
+    } else if (it->type() == Model::Type::Instance) {
+      Model::Instance* instance = sketch->instance(it->id<Model::Instance>());
+      Model::Sketch* definition = sketch->parent()->definition(instance->definition());
+
+      Handle subHandle = findElement(flattenedPaths, definition, x - instance->position().x,
+        y - instance->position().y);
 
       if (subHandle.isValid()) {
         handle = *it;
@@ -1033,95 +1417,104 @@ Handle findElement(Model::Sketch* sketch, double x, double y)
     }
   }
 
-  cairo_destroy(context);
-
   return handle;
 }
 
-bool rectangleIntersectsCairoPath(const Rectangle& rectangle, cairo_path_t* path, bool implicitlyClosed)
+bool rectangleIntersectsPolyline(const Rectangle& rectangle, const std::vector<Point>& points, bool implicitlyClosed)
 {
-  cairo_path_data_t* firstPoint = nullptr;
-  Point previousPoint = { 0, 0 };
+  for (size_t i = 1; i < points.size(); ++i) {
+    if (rectangle.intersectsLine(points[i - 1], points[i])) {
+      return true;
+    }
+  }
 
-  for (int i = 0; i < path->num_data; i += path->data[i].header.length) {
-    cairo_path_data_t* data = &path->data[i];
+  return implicitlyClosed && points.size() > 1 && rectangle.intersectsLine(points.back(), points.front());
+}
 
-    switch (data->header.type) {
-    case CAIRO_PATH_MOVE_TO:
-      previousPoint = Point{ data[1].point.x, data[1].point.y };
+bool pathInDragArea(Controller::FlattenedPaths* flattenedPaths, Model::Sketch* sketch, const ID<Model::Path>& id,
+  const Rectangle& rectangle, bool crossing)
+{
+  // Half the width that paths are stroked with
+  const double StrokeDistance = 1;
 
-      if (!firstPoint) {
-        firstPoint = &data[1];
-      }
+  Rectangle bounds;
 
-      break;
-    case CAIRO_PATH_LINE_TO:
-      {
-        Point currentPoint = { data[1].point.x, data[1].point.y };
+  if (!flattenedPaths->bounds(sketch, id, &bounds)) {
+    return false;
+  }
 
-        if (rectangle.intersectsLine(previousPoint, currentPoint)) {
-          return true;
-        }
+  const Rectangle strokeBounds = bounds.inflated(StrokeDistance);
 
-        previousPoint = currentPoint;
+  if (!crossing) {
+    return rectangle.contains(strokeBounds);
+  }
 
-        break;
-      }
-    }
+  // Nothing of a path can cross the area if its stroke's bounds don't
+  if (strokeBounds.left > rectangle.right || rectangle.left > strokeBounds.right || strokeBounds.top > rectangle.bottom
+    || rectangle.top > strokeBounds.bottom) {
+    return false;
   }
 
-  if (implicitlyClosed && firstPoint) {
-    Point currentPoint = { firstPoint->point.x, firstPoint->point.y };
+  const Model::Path* path = sketch->path(id);
+  const std::vector<Point>& points = flattenedPaths->flattened(sketch, id, FlatteningTolerance);
 
-    if (rectangle.intersectsLine(previousPoint, currentPoint)) {
-      return true;
-    }
+  if (path->isFilled() && pointInPolyline(points, { rectangle.left, rectangle.top }, StrokeDistance, true)) {
+    return true;
   }
 
-  return false;
+  return rectangleIntersectsPolyline(rectangle, points, path->isFilled() && !path->isClosed());
 }
 
-template<class T_Process>
-void forEachPathInDragArea(Model::Sketch* sketch, const Rectangle& area, T_Process process)
+// An instance is crossed if any of its definition's elements are, and enclosed if all of them are
+bool instanceInDragArea(Controller::FlattenedPaths* flattenedPaths, Model::Sketch* sketch, Model::Instance* instance,
+  const Rectangle& rectangle, bool crossing)
 {
-  cairo_t* context = createCollisionDetectionContext();
-
-  cairo_set_line_width(context, 2);
+  Model::Sketch* definition = sketch->parent()->definition(instance->definition());
 
-  bool crossing = area.right < area.left;
+  const Rectangle local = {
+    rectangle.left - instance->position().x, rectangle.top - instance->position().y,
+    rectangle.right - instance->position().x, rectangle.bottom - instance->position().y };
 
-  const Rectangle rectangle = area.normalised();
+  bool any = false;
 
-  for (auto [id, path] : sketch->paths()) {
-    cairo_new_path(context);
+  for (auto [id, path] : definition->paths()) {
+    if (pathInDragArea(flattenedPaths, definition, id, local, crossing) == crossing) {
+      return crossing;
+    }
 
-    bool inDragArea = false;
+    any = true;
+  }
 
-    if (crossing && path->isFilled()) {
-      inDragArea = pointInPath(context, sketch, path, rectangle.left, rectangle.top);
+  for (auto [id, subInstance] : definition->instances()) {
+    if (instanceInDragArea(flattenedPaths, definition, subInstance, local, crossing) == crossing) {
+      return crossing;
     }
 
-    if (!inDragArea && pathToCairo(context, path, sketch)) {
-      if (crossing) {
-        cairo_path_t* cairoPath = cairo_copy_path_flat(context);
+    any = true;
+  }
 
-        inDragArea = rectangleIntersectsCairoPath(rectangle, cairoPath, path->isFilled() && !path->isClosed());
+  return !crossing && any;
+}
 
-        cairo_path_destroy(cairoPath);
-      } else {
-        Rectangle extents;
-        cairo_stroke_extents(context, &extents.left, &extents.top, &extents.right, &extents.bottom);
+template<class T_Process>
+void forEachElementInDragArea(Controller::FlattenedPaths* flattenedPaths, Model::Sketch* sketch,
+  const Rectangle& area, T_Process process)
+{
+  bool crossing = area.right < area.left;
 
-        inDragArea = rectangle.contains(extents);
-      }
-    }
+  const Rectangle rectangle = area.normalised();
 
-    if (inDragArea) {
+  for (auto [id, path] : sketch->paths()) {
+    if (pathInDragArea(flattenedPaths, sketch, id, rectangle, crossing)) {
       process(id);
     }
   }
 
-  cairo_destroy(context);
+  for (auto [id, instance] : sketch->instances()) {
+    if (instanceInDragArea(flattenedPaths, sketch, instance, rectangle, crossing)) {
+      process(id);
+    }
+  }
 }
 
 void Sketch::onPointerPressed(wxMouseEvent& event)
@@ -1136,6 +1529,15 @@ void Sketch::onPointerPressed(wxMouseEvent& event)
   event.Skip();
 }
 
+void Sketch::onPointerReleased(wxMouseEvent& event)
+{
+  if (!mModeStack.empty()) {
+    mModeStack.front()->onPointerReleased(*this);
+  }
+
+  event.Skip();
+}
+
 void Sketch::onSecondaryPointerPressed(wxMouseEvent& event)
 {
   onCancel();
@@ -1197,6 +1599,49 @@ void Sketch::activateDeleteMode()
   pushMode(&SketchModeDelete::sInstance);
 }
 
+void Sketch::activateFreehandMode()
+{
+  cancelModeStack();
+  pushMode(&SketchModeFreehand::sInstance);
+}
+
+void Sketch::deleteSelection()
+{
+  if (mModeStack.empty() && !mSelection.isEmpty()) {
+    mController->removeSelection(mSelection);
+    mSelection.clear();
+    refreshHandles();
+  }
+}
+
+void Sketch::simplifySelection()
+{
+  if (mModeStack.empty() && mSelection.contains(Model::Type::Path)) {
+    const wxString text = wxGetTextFromUser("Greatest distance from the current shapes:", "Simplify", "0.5", this);
+    double tolerance;
+
+    if (text.empty() || !text.ToDouble(&tolerance) || tolerance < 0) {
+      return;
+    }
+
+    const Controller::Sketch::SimplifyResult result = mController->simplifySelection(mSelection, tolerance);
+
+    // Some of the selected nodes might be gone, so the paths are selected again with the nodes they have left
+    std::vector<ID<Model::Path>> paths;
+    mSelection.forEachPathID([&paths](const ID<Model::Path>& id) { paths.push_back(id); });
+    mSelection.clear();
+
+    for (const ID<Model::Path>& id : paths) {
+      mSelection.add(id, mModel);
+    }
+
+    refreshHandles();
+
+    wxLogStatus("Simplified %zu nodes to %zu, moving the paths by up to %.3g", result.mNodesBefore,
+      result.mNodesAfter, result.mError);
+  }
+}
+
 void Sketch::groupSelection()
 {
   if (mModeStack.empty() && !mSelection.isEmpty()) {
@@ -1207,12 +1652,101 @@ void Sketch::groupSelection()
   }
 }
 
+void Sketch::ungroupSelection()
+{
+  if (mModeStack.empty() && mSelection.contains(Model::Type::Sketch)) {
+    // The sub-sketches' contents are selected in their place
+    std::vector<ID<Model::Sketch>> ungrouped;
+    Model::Sketch::DrawOrder released;
+
+    mSelection.forEach(Model::Type::Sketch,
+      [this, &ungrouped, &released](const Model::Reference& reference)
+      {
+        ungrouped.push_back(reference.id<Model::Sketch>());
+
+        const Model::Sketch::DrawOrder& drawOrder = mModel->sketch(ungrouped.back())->drawOrder();
+        released.insert(released.end(), drawOrder.begin(), drawOrder.end());
+      });
+
+    mController->beginTransaction();
+
+    for (auto& id : ungrouped) {
+      mController->ungroupSubSketch(id);
+    }
+
+    mController->commitTransaction();
+
+    mSelection.clear();
+
+    for (auto& reference : released) {
+      mSelection.add(reference, mModel);
+    }
+
+    refreshHandles();
+  }
+}
+
+void Sketch::defineSelection()
+{
+  if (mModeStack.empty() && !mSelection.isEmpty()) {
+    ID<Model::Instance> id = mController->createDefinition(mSelection);
+
+    if (id.isValid()) {
+      mSelection.clear();
+      mSelection.add(id, mModel);
+    }
+
+    Refresh();
+  }
+}
+
+void Sketch::placeInstances()
+{
+  if (mModeStack.empty() && mSelection.contains(Model::Type::Instance)) {
+    const Point Offset = { 16, 16 };
+
+    std::vector<ID<Model::Instance>> placed;
+
+    mController->beginTransaction();
+
+    mSelection.forEachInstance(mModel, [this, &placed, Offset](const Model::Instance* instance) {
+      placed.push_back(mController->placeInstance(instance->definition(), instance->position() + Offset));
+    });
+
+    mController->commitTransaction();
+
+    mSelection.clear();
+
+    for (auto& id : placed) {
+      mSelection.add(id, mModel);
+    }
+
+    Refresh();
+  }
+}
+
 void Sketch::activateMoveMode()
 {
   cancelModeStack();
   pushMode(&SketchModeMove::sInstance);
 }
 
+void Sketch::activateScaleMode()
+{
+  if (!mSelection.isEmpty()) {
+    cancelModeStack();
+    pushMode(&SketchModeTransform::sScale);
+  }
+}
+
+void Sketch::activateRotateMode()
+{
+  if (!mSelection.isEmpty()) {
+    cancelModeStack();
+    pushMode(&SketchModeTransform::sRotate);
+  }
+}
+
 void Sketch::activateViewMode()
 {
   cancelModeStack();
@@ -1221,11 +1755,11 @@ void Sketch::activateViewMode()
 void Sketch::bringForward()
 {
   if (mSelection.contains(Model::Type::Path)) {
-    mUndoManager->beginGroup();
+    mController->beginTransaction();
 
     mSelection.forEachPathID([this](const ID<Model::Path>& id) { mController->bringPathForward(id); });
 
-    mUndoManager->endGroup();
+    mController->commitTransaction();
 
     Refresh();
   }
@@ -1234,11 +1768,82 @@ void Sketch::bringForward()
 void Sketch::sendBackward()
 {
   if (mSelection.contains(Model::Type::Path)) {
-    mUndoManager->beginGroup();
+    mController->beginTransaction();
 
     mSelection.forEachPathID([this](const ID<Model::Path>& id) { mController->sendPathBackward(id); });
 
-    mUndoManager->endGroup();
+    mController->commitTransaction();
+
+    Refresh();
+  }
+}
+
+void Sketch::selectAll()
+{
+  if (mModeStack.empty()) {
+    mSelection.selectAll(mModel);
+    Refresh();
+  }
+}
+
+void Sketch::invertSelection()
+{
+  if (mModeStack.empty()) {
+    mSelection.invert(mModel);
+    Refresh();
+  }
+}
+
+void Sketch::selectConnected()
+{
+  if (mModeStack.empty() && !mSelection.isEmpty()) {
+    mSelection.selectConnected(mModel);
+    Refresh();
+  }
+}
+
+void Sketch::selectSameStroke()
+{
+  if (mModeStack.empty() && mSelection.contains(Model::Type::Path)) {
+    // There are usually only a few colours among the selected paths, so each is matched in a separate pass
+    std::vector<Colour> colours;
+
+    mSelection.forEachPathID(
+      [this, &colours](const ID<Model::Path>& id)
+      {
+        const Colour& colour = mModel->path(id)->strokeColour();
+
+        if (std::find(colours.begin(), colours.end(), colour) == colours.end()) {
+          colours.push_back(colour);
+        }
+      });
+
+    for (const Colour& colour : colours) {
+      mSelection.selectByStrokeColour(mModel, colour);
+    }
+
+    Refresh();
+  }
+}
+
+void Sketch::selectSameFill()
+{
+  if (mModeStack.empty() && mSelection.contains(Model::Type::Path)) {
+    std::vector<Colour> colours;
+
+    mSelection.forEachPathID(
+      [this, &colours](const ID<Model::Path>& id)
+      {
+        const Model::Path* path = mModel->path(id);
+
+        if (path->isFilled() && std::find(colours.begin(), colours.end(), path->fillColour()) == colours.end()) {
+          colours.push_back(path->fillColour());
+        }
+      });
+
+    for (const Colour& colour : colours) {
+      mSelection.selectByFillColour(mModel, colour);
+    }
 
     Refresh();
   }
@@ -1258,7 +1863,7 @@ void Sketch::onCancel()
 void Sketch::setStrokeColour(const wxColour& colour)
 {
   if (mSelection.contains(Model::Type::Path)) {
-    mUndoManager->beginGroup();
+    mController->beginTransaction();
 
     mSelection.forEachPathID(
       [this, &colour](const ID<Model::Path>& id)
@@ -1266,7 +1871,7 @@ void Sketch::setStrokeColour(const wxColour& colour)
         mController->controllerForPath(id).setStrokeColour(Colour(colour.GetRGBA()));
       });
 
-    mUndoManager->endGroup();
+    mController->commitTransaction();
 
     Refresh();
   }
@@ -1275,7 +1880,7 @@ void Sketch::setStrokeColour(const wxColour& colour)
 void Sketch::setFillColour(const wxColour& colour)
 {
   if (mSelection.contains(Model::Type::Path)) {
-    mUndoManager->beginGroup();
+    mController->beginTransaction();
 
     mSelection.forEachPathID(
       [this, &colour](const ID<Model::Path>& id)
@@ -1283,7 +1888,7 @@ void Sketch::setFillColour(const wxColour& colour)
         mController->controllerForPath(id).setFillColour(Colour(colour.GetRGBA()));
       });
 
-    mUndoManager->endGroup();
+    mController->commitTransaction();
 
     Refresh();
   }
@@ -1292,10 +1897,15 @@ void Sketch::setFillColour(const wxColour& colour)
 void Sketch::setModel(Model::Sketch* model)
 {
   mModel = model;
+  mFlattenedPaths.setDocument(mModel->parent());
+  mSnapping.setDocument(mModel->parent());
 
   delete mController;
   mController = new Controller::Sketch(mUndoManager, mModel);
 
+  // The new document's IDs can refer to different elements
+  mSelection.clear();
+
   cancelModeStack();
   refreshHandles();
 }
@@ -1385,6 +1995,8 @@ void Sketch::setHandlePosition(const Handle& handle, const Point& position)
       mController->controllerForControlPoint(handle.id<Model::ControlPoint>()).setPosition(position);
       break;
     case Model::Type::Path:
+    case Model::Type::Sketch:
+    case Model::Type::Instance:
     case Model::Type::Null:
       break;
   }
@@ -1481,8 +2093,8 @@ void Sketch::MouseEventsManager::MouseDragEnd(int item, const wxPoint& position)
       }
     }
   } else {
-    forEachPathInDragArea(mSketch->mModel, mSketch->mDragArea,
-      [this, add, &selection](const ID<Model::Path>& id)
+    forEachElementInDragArea(&mSketch->mFlattenedPaths, mSketch->mModel, mSketch->mDragArea,
+      [this, add, &selection](const Handle& id)
       {
         if (add) {
           selection.add(id, mSketch->mModel);
@@ -1513,7 +2125,7 @@ int Sketch::MouseEventsManager::MouseHitTest(const wxPoint& position)
       }
     }
 
-    Handle handle = findElement(mSketch->mModel, position.x, position.y);
+    Handle handle = findElement(&mSketch->mFlattenedPaths, mSketch->mModel, position.x, position.y);
 
     mSketch->mDragArea.left = position.x;
     mSketch->mDragArea.top = position.y;
@@ -1556,6 +2168,27 @@ ID<Model::Node> Sketch::nodeIDForHandle(const Handle& handle)
   }
 }
 
+Point Sketch::snap(const Point& position, const Controller::Selection& exclude)
+{
+  // In the sketch's coordinates, which are the same as the window's until there's zooming
+  const double SnapDistance = 6;
+
+  if (wxGetKeyState(WXK_ALT)) {
+    clearSnap();
+    return position;
+  }
+
+  mSnapping.snap(mModel, position, SnapDistance, exclude, &mSnap);
+
+  return mSnap.mPosition;
+}
+
+void Sketch::clearSnap()
+{
+  mSnap.mTarget = Controller::Snapping::Target::None;
+  mSnap.mGuides.clear();
+}
+
 Sketch::Mode* Sketch::activeMode() const
 {
   if (!mModeStack.empty()) {
@@ -1,6 +1,8 @@
 #pragma once
 
+#include "controller/flattening.h"
 #include "controller/sketch.h"
+#include "controller/snapping.h"
 #include "model/reference.h"
 #include "model/sketch.h"
 #include "utilities/geometry.h"
@@ -33,27 +35,43 @@ public:
 
 private:
   friend class SketchModeMove;
+  friend class SketchModeTransform;
   friend class SketchModeAdd;
   friend class SketchModeDelete;
+  friend class SketchModeFreehand;
   friend class SketchModePlace;
   friend class SketchModePlaceSelection;
 
   void onPaint(wxPaintEvent& event);
-  void drawSketch(cairo_t* context, const Model::Sketch* sketch, std::vector<Rectangle>* selectedExtents,
-    Rectangle* extents) const;
-  void drawPath(cairo_t* context, const ID<Model::Path>& id, const Model::Sketch* sketch, Rectangle* extents) const;
+  void drawSketch(cairo_t* context, const Model::Sketch* sketch) const;
+  void drawPath(cairo_t* context, const ID<Model::Path>& id, const Model::Sketch* sketch) const;
+  void selectedExtents(std::vector<Rectangle>* extents);
   void onPointerPressed(wxMouseEvent& event);
+  void onPointerReleased(wxMouseEvent& event);
   void onSecondaryPointerPressed(wxMouseEvent& event);
   void onPointerMotion(wxMouseEvent& event);
   void onKeyPressed(wxKeyEvent& event);
   void refreshHandles();
   void activateAddMode();
   void activateDeleteMode();
+  void activateFreehandMode();
+  void deleteSelection();
+  void simplifySelection();
   void groupSelection();
+  void ungroupSelection();
+  void defineSelection();
+  void placeInstances();
   void activateMoveMode();
+  void activateScaleMode();
+  void activateRotateMode();
   void activateViewMode();
   void bringForward();
   void sendBackward();
+  void selectAll();
+  void invertSelection();
+  void selectConnected();
+  void selectSameStroke();
+  void selectSameFill();
   void onCancel();
   void setModel(Model::Sketch* model);
 
@@ -64,6 +82,10 @@ private:
 
   ID<Model::Node> nodeIDForHandle(const Handle& handle);
 
+  // Snaps a position in the sketch's coordinates, keeping the result to be drawn, unless Alt is held
+  Point snap(const Point& position, const Controller::Selection& exclude);
+  void clearSnap();
+
   class MouseEventsManager : public wxMouseEventsManager
   {
   public:
@@ -113,6 +135,9 @@ private:
 
   Handle mHoverHandle;
   Controller::Selection mSelection;
+  Controller::FlattenedPaths mFlattenedPaths;
+  Controller::Snapping mSnapping;
+  Controller::Snapping::Result mSnap;
 
   bool mDragging;
   bool mShowDetails;